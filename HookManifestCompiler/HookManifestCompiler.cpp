@@ -0,0 +1,508 @@
+/*!
+    @file HookManifestCompiler.cpp
+
+    @brief Compiles a hook manifest source file into the binary hook manifest
+        loaded by SimpleSvmHook.
+
+    @details This tool is portable C++17 and builds on Linux and Windows, for
+        example,
+
+            g++ -std=c++17 -O2 -o HookManifestCompiler HookManifestCompiler.cpp
+
+        Usage:
+
+            HookManifestCompiler [--reg] <source> <output>
+
+        The output is the raw manifest, or a .reg file setting it to the
+        HookManifest value under the service key with --reg. Each non-empty
+        line of the source describes one hook, and '#' starts a comment.
+
+            <mode> <function>[+<offset>] handler=<handler>
+                [args=<count>] [filter=<filter>[,<filter>...]] [sample=<interval>]
+
+        mode      function: hooks the entry of the function.
+                  point: hooks the instruction at the offset (0 by default).
+        handler   ZwQuerySystemInformation, ExAllocatePoolWithTag,
+                  ExFreePoolWithTag or ExFreePool for function; probe for point.
+        args      The number of arguments. Defaults to that of the function
+                  for function, and 4 for point.
+        filter    caller-outside-image: observes only calls from outside of any
+                  image. passive-level: observes only calls at PASSIVE_LEVEL.
+        sample    Observes one of every <interval> calls. 0 and 1 observe
+                  every call, which is the default.
+
+        See HookManifestFormat.hpp for the binary format.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "../SimpleSvmHook/HookManifestFormat.hpp"
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+//
+// The handler names and the number of arguments of the functions they are for,
+// indexed by HOOK_MANIFEST_HANDLER_ID.
+//
+static const struct
+{
+    const char* Name;
+    unsigned ArgumentCount;
+} k_Handlers[] =
+{
+    { "ZwQuerySystemInformation", 4, },
+    { "ExAllocatePoolWithTag", 3, },
+    { "ExFreePoolWithTag", 2, },
+    { "ExFreePool", 1, },
+    { "probe", 4, },
+};
+static_assert(sizeof(k_Handlers) / sizeof(k_Handlers[0]) == HookManifestHandlerMax,
+              "Size check");
+
+static const char k_ServiceKey[] =
+    "HKEY_LOCAL_MACHINE\\SYSTEM\\CurrentControlSet\\Services\\SimpleSvmHook";
+
+//
+// A hook parsed from the source.
+//
+struct ManifestEntry
+{
+    std::string FunctionName;
+    HOOK_MANIFEST_ENTRY Entry;
+};
+
+/*!
+    @brief Reports an error on the line of the source and exits.
+ */
+[[noreturn]]
+static
+void
+Fail (
+    const std::string& Path,
+    unsigned LineNumber,
+    const std::string& Message
+    )
+{
+    std::cerr << Path << ":" << LineNumber << ": error: " << Message << "\n";
+    std::exit(EXIT_FAILURE);
+}
+
+/*!
+    @brief Converts a decimal or 0x-prefixed hexadecimal number.
+
+    @return true on success; otherwise, false.
+ */
+static
+bool
+ParseNumber (
+    const std::string& Text,
+    std::uint32_t* Value
+    )
+{
+    char* end;
+    unsigned long long value;
+
+    if (Text.empty() || (Text[0] == '-'))
+    {
+        return false;
+    }
+    value = std::strtoull(Text.c_str(), &end, 0);
+    if ((*end != '\0') || (value > UINT32_MAX))
+    {
+        return false;
+    }
+    *Value = static_cast<std::uint32_t>(value);
+    return true;
+}
+
+/*!
+    @brief Tests whether the name can be an exported function name.
+ */
+static
+bool
+IsValidFunctionName (
+    const std::string& Name
+    )
+{
+    if (Name.empty() ||
+        (Name.size() * sizeof(UINT16) > k_HookManifestMaxNameLength))
+    {
+        return false;
+    }
+    for (auto c : Name)
+    {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && (c != '_'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+    @brief Parses one line of the source.
+
+    @return true if the line describes a hook; false if it is empty.
+ */
+static
+bool
+ParseLine (
+    const std::string& Path,
+    unsigned LineNumber,
+    std::string Line,
+    ManifestEntry* Result
+    )
+{
+    std::istringstream stream;
+    std::string mode, target, token;
+    bool hasHandler, hasArgs;
+    std::uint32_t value;
+    HOOK_MANIFEST_ENTRY entry = {};
+
+    Line = Line.substr(0, Line.find('#'));
+    stream.str(Line);
+    if (!(stream >> mode))
+    {
+        return false;
+    }
+
+    if (mode == "function")
+    {
+        entry.Mode = HookManifestModeFunction;
+    }
+    else if (mode == "point")
+    {
+        entry.Mode = HookManifestModeHookPoint;
+    }
+    else
+    {
+        Fail(Path, LineNumber, "unknown mode '" + mode + "'");
+    }
+
+    if (!(stream >> target))
+    {
+        Fail(Path, LineNumber, "missing function name");
+    }
+    auto plus = target.find('+');
+    Result->FunctionName = target.substr(0, plus);
+    if (!IsValidFunctionName(Result->FunctionName))
+    {
+        Fail(Path, LineNumber, "invalid function name '" + Result->FunctionName + "'");
+    }
+    if (plus != std::string::npos)
+    {
+        if (!ParseNumber(target.substr(plus + 1), &value))
+        {
+            Fail(Path, LineNumber, "invalid offset in '" + target + "'");
+        }
+        entry.Offset = value;
+    }
+
+    hasHandler = false;
+    hasArgs = false;
+    while (stream >> token)
+    {
+        auto equal = token.find('=');
+        auto key = token.substr(0, equal);
+        auto text = (equal == std::string::npos) ? std::string() : token.substr(equal + 1);
+
+        if (key == "handler")
+        {
+            unsigned id;
+
+            for (id = 0; id < HookManifestHandlerMax; ++id)
+            {
+                if (text == k_Handlers[id].Name)
+                {
+                    break;
+                }
+            }
+            if (id == HookManifestHandlerMax)
+            {
+                Fail(Path, LineNumber, "unknown handler '" + text + "'");
+            }
+            entry.Handler = static_cast<UINT16>(id);
+            hasHandler = true;
+        }
+        else if (key == "args")
+        {
+            if (!ParseNumber(text, &value) || (value > k_HookManifestMaxArgumentCount))
+            {
+                Fail(Path, LineNumber, "invalid argument count '" + text + "'");
+            }
+            entry.ArgumentCount = static_cast<UINT8>(value);
+            hasArgs = true;
+        }
+        else if (key == "filter")
+        {
+            std::istringstream filters(text);
+            std::string filter;
+
+            while (std::getline(filters, filter, ','))
+            {
+                if (filter == "caller-outside-image")
+                {
+                    entry.Filters |= k_HookManifestFilterCallerOutsideImage;
+                }
+                else if (filter == "passive-level")
+                {
+                    entry.Filters |= k_HookManifestFilterPassiveLevel;
+                }
+                else
+                {
+                    Fail(Path, LineNumber, "unknown filter '" + filter + "'");
+                }
+            }
+        }
+        else if (key == "sample")
+        {
+            if (!ParseNumber(text, &value))
+            {
+                Fail(Path, LineNumber, "invalid sampling interval '" + text + "'");
+            }
+            entry.SamplingInterval = value;
+        }
+        else
+        {
+            Fail(Path, LineNumber, "unknown attribute '" + token + "'");
+        }
+    }
+
+    if (!hasHandler)
+    {
+        Fail(Path, LineNumber, "missing handler");
+    }
+    if (!hasArgs)
+    {
+        entry.ArgumentCount = static_cast<UINT8>(k_Handlers[entry.Handler].ArgumentCount);
+    }
+
+    //
+    // The same rules as IsHookManifestEntryBindable in the driver.
+    //
+    if (entry.Mode == HookManifestModeFunction)
+    {
+        if (entry.Handler == HookManifestHandlerProbe)
+        {
+            Fail(Path, LineNumber, "probe can only be used for point");
+        }
+        if (entry.Offset != 0)
+        {
+            Fail(Path, LineNumber, "function cannot have an offset; use point");
+        }
+        if (Result->FunctionName != k_Handlers[entry.Handler].Name)
+        {
+            Fail(Path, LineNumber, std::string("handler ") +
+                                   k_Handlers[entry.Handler].Name +
+                                   " cannot hook " + Result->FunctionName);
+        }
+        if (entry.ArgumentCount != k_Handlers[entry.Handler].ArgumentCount)
+        {
+            Fail(Path, LineNumber, "argument count does not match with the handler");
+        }
+    }
+    else
+    {
+        if (entry.Handler != HookManifestHandlerProbe)
+        {
+            Fail(Path, LineNumber, "point can only use the probe handler");
+        }
+        if ((entry.Offset != 0) &&
+            ((entry.ArgumentCount > 4) ||
+             (entry.Filters & k_HookManifestFilterCallerOutsideImage)))
+        {
+            Fail(Path, LineNumber, "stack arguments and caller-outside-image are "
+                                   "only available at offset 0");
+        }
+    }
+
+    Result->Entry = entry;
+    return true;
+}
+
+/*!
+    @brief Serializes the entries into the binary manifest.
+ */
+static
+std::vector<UINT8>
+BuildManifest (
+    const std::vector<ManifestEntry>& Entries
+    )
+{
+    std::vector<UINT8> manifest(sizeof(HOOK_MANIFEST_HEADER));
+    HOOK_MANIFEST_HEADER header = {};
+
+    for (const auto& source : Entries)
+    {
+        HOOK_MANIFEST_ENTRY entry;
+        size_t position;
+
+        entry = source.Entry;
+        entry.NameLength = static_cast<UINT16>(source.FunctionName.size() * sizeof(UINT16));
+        entry.EntrySize = static_cast<UINT16>(
+            (sizeof(entry) + entry.NameLength + k_HookManifestEntryAlignment - 1) &
+            ~(k_HookManifestEntryAlignment - 1));
+
+        position = manifest.size();
+        manifest.resize(position + entry.EntrySize, 0);
+        std::memcpy(&manifest[position], &entry, sizeof(entry));
+        position += sizeof(entry);
+        for (auto c : source.FunctionName)
+        {
+            manifest[position++] = static_cast<UINT8>(c);
+            manifest[position++] = 0;
+        }
+    }
+
+    header.Signature = k_HookManifestSignature;
+    header.Version = k_HookManifestVersion;
+    header.EntryCount = static_cast<UINT16>(Entries.size());
+    header.TotalSize = static_cast<UINT32>(manifest.size());
+    header.Checksum = ComputeHookManifestChecksum(
+                            manifest.data() + sizeof(header),
+                            static_cast<UINT32>(manifest.size() - sizeof(header)));
+    std::memcpy(manifest.data(), &header, sizeof(header));
+    return manifest;
+}
+
+/*!
+    @brief Formats the manifest as a .reg file.
+ */
+static
+std::string
+FormatRegFile (
+    const std::vector<UINT8>& Manifest
+    )
+{
+    std::ostringstream reg;
+    std::string line;
+    char hex[4];
+
+    reg << "REGEDIT4\r\n\r\n[" << k_ServiceKey << "]\r\n";
+    line = "\"HookManifest\"=hex:";
+    for (size_t i = 0; i < Manifest.size(); ++i)
+    {
+        std::snprintf(hex, sizeof(hex), "%02x", Manifest[i]);
+        line += hex;
+        if (i + 1 == Manifest.size())
+        {
+            break;
+        }
+        line += ",";
+        if (line.size() > 76)
+        {
+            reg << line << "\\\r\n";
+            line = "  ";
+        }
+    }
+    reg << line << "\r\n";
+    return reg.str();
+}
+
+int
+main (
+    int Argc,
+    char* Argv[]
+    )
+{
+    bool regFile;
+    int argIndex;
+    std::vector<ManifestEntry> entries;
+    std::set<std::pair<std::string, std::uint32_t>> hookPoints;
+    std::set<unsigned> usedHandlers;
+    std::string line;
+    unsigned lineNumber;
+
+    regFile = false;
+    argIndex = 1;
+    if ((Argc > 1) && (std::strcmp(Argv[1], "--reg") == 0))
+    {
+        regFile = true;
+        argIndex++;
+    }
+    if (Argc - argIndex != 2)
+    {
+        std::cerr << "Usage: " << Argv[0] << " [--reg] <source> <output>\n";
+        return EXIT_FAILURE;
+    }
+
+    std::string sourcePath = Argv[argIndex];
+    std::ifstream source(sourcePath);
+    if (!source)
+    {
+        std::cerr << "Cannot open " << sourcePath << "\n";
+        return EXIT_FAILURE;
+    }
+
+    lineNumber = 0;
+    while (std::getline(source, line))
+    {
+        ManifestEntry entry;
+
+        lineNumber++;
+        if (!ParseLine(sourcePath, lineNumber, line, &entry))
+        {
+            continue;
+        }
+
+        //
+        // Duplicates are not detected by the driver.
+        //
+        if (!hookPoints.emplace(entry.FunctionName, entry.Entry.Offset).second)
+        {
+            Fail(sourcePath, lineNumber, "duplicate hook for " + entry.FunctionName);
+        }
+        if ((entry.Entry.Handler != HookManifestHandlerProbe) &&
+            !usedHandlers.insert(entry.Entry.Handler).second)
+        {
+            Fail(sourcePath, lineNumber, "handler is already used");
+        }
+        if (entries.size() == k_HookManifestMaxEntryCount)
+        {
+            Fail(sourcePath, lineNumber, "too many hooks");
+        }
+        entries.push_back(entry);
+    }
+    if (entries.empty())
+    {
+        std::cerr << sourcePath << ": error: no hook is described\n";
+        return EXIT_FAILURE;
+    }
+
+    auto manifest = BuildManifest(entries);
+    if (manifest.size() > k_HookManifestMaxSize)
+    {
+        std::cerr << sourcePath << ": error: manifest is too large\n";
+        return EXIT_FAILURE;
+    }
+
+    std::ofstream output(Argv[argIndex + 1], std::ios::binary);
+    if (regFile)
+    {
+        output << FormatRegFile(manifest);
+    }
+    else
+    {
+        output.write(reinterpret_cast<const char*>(manifest.data()),
+                     static_cast<std::streamsize>(manifest.size()));
+    }
+    if (!output)
+    {
+        std::cerr << "Cannot write " << Argv[argIndex + 1] << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Compiled " << entries.size() << " hook(s) into "
+              << manifest.size() << " bytes\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,5 @@
+//
+// See ntifs.h.
+//
+#pragma once
+#include "ntifs.h"
@@ -0,0 +1,145 @@
+/*!
+    @file ntifs.h
+
+    @brief The minimum subset of the WDK headers to build MemoryEmulator.cpp
+        and Disassembler.cpp in user mode with GCC or Clang.
+
+    @details fltKernel.h, intrin.h and basetsd.h include this file, and
+        pshpack1.h and poppack.h are substituted as well. Nothing else in the
+        driver is expected to build with this file.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdarg>
+
+//
+// Compiler extensions and SAL annotations.
+//
+#define __declspec(x)
+#define __pragma(x)
+#define FORCEINLINE inline __attribute__((always_inline))
+#define DECLSPEC_ALIGN(x) alignas(x)
+#define UNALIGNED
+#define EXTERN_C extern "C"
+#define EXTERN_C_START extern "C" {
+#define EXTERN_C_END }
+#define _Check_return_
+#define _In_
+#define _In_opt_
+#define _Inout_
+#define _Must_inspect_result_
+#define _Out_
+#define _Out_opt_
+#define _Post_maybenull_
+#define _Printf_format_string_
+#define _Use_decl_annotations_
+#define _IRQL_requires_max_(x)
+#define _Inout_updates_bytes_(x)
+#define _Out_writes_bytes_(x)
+#define _Post_writable_byte_size_(x)
+#define _Success_(x)
+
+//
+// Types.
+//
+typedef void VOID, *PVOID;
+typedef const void* PCVOID;
+typedef char CHAR, *PCHAR, *PSTR;
+typedef const char* PCSTR;
+typedef wchar_t WCHAR;
+typedef const WCHAR* PCWSTR;
+typedef uint8_t UCHAR, BOOLEAN, UINT8, *PUCHAR, *PBOOLEAN, *PUINT8;
+typedef const UCHAR* PCUCHAR;
+typedef int16_t SHORT;
+typedef uint16_t USHORT, UINT16, *PUSHORT;
+typedef int32_t LONG, INT32, NTSTATUS;
+typedef uint32_t ULONG, UINT32, *PULONG;
+typedef int64_t LONG64, LONGLONG, LONG_PTR;
+typedef uint64_t ULONG64, ULONGLONG, UINT64, ULONG_PTR, SIZE_T, *PULONG64;
+typedef UCHAR KIRQL;
+typedef PVOID HANDLE;
+typedef struct _DRIVER_OBJECT* PDRIVER_OBJECT;
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER, PHYSICAL_ADDRESS;
+typedef struct _UNICODE_STRING
+{
+    USHORT Length;
+    USHORT MaximumLength;
+    WCHAR* Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+typedef enum _MEMORY_CACHING_TYPE
+{
+    MmNonCached,
+    MmCached,
+} MEMORY_CACHING_TYPE;
+
+//
+// Constants and macros.
+//
+#define TRUE 1
+#define FALSE 0
+#define NOTHING
+#define ANSI_NULL ((CHAR)0)
+#define MAXUINT16 0xffff
+#define MAXUINT32 0xffffffffU
+#define MAXULONG 0xffffffffUL
+#define MAXULONG64 0xffffffffffffffffULL
+#define PAGE_SIZE 0x1000
+#define KERNEL_STACK_SIZE 0x6000
+#define PASSIVE_LEVEL 0
+#define DISPATCH_LEVEL 2
+#define HIGH_LEVEL 15
+#define MM_ANY_NODE_OK 0x80000000
+#define MANUALLY_INITIATED_CRASH 0xe2
+#define KD_DEBUGGER_NOT_PRESENT TRUE
+#define STATUS_SUCCESS ((NTSTATUS)0)
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#define NT_ASSERT(Expression) ((void)(Expression))
+#define UNREFERENCED_PARAMETER(Parameter) ((void)(Parameter))
+#define ARGUMENT_PRESENT(Argument) ((Argument) != nullptr)
+#define RTL_NUMBER_OF(Array) (sizeof(Array) / sizeof((Array)[0]))
+#define FIELD_OFFSET(Type, Field) offsetof(Type, Field)
+#define BooleanFlagOn(Flags, SingleFlag) ((BOOLEAN)(((Flags) & (SingleFlag)) != 0))
+#define SetFlag(Flags, SingleFlag) ((Flags) |= (SingleFlag))
+#define ClearFlag(Flags, SingleFlag) ((Flags) &= ~(SingleFlag))
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+
+//
+// Functions. The tester defines MmSystemRangeStart and MmIsAddressValid so
+// that the emulator accesses the user mode buffers it sets up.
+//
+#define __debugbreak() __builtin_trap()
+#define KeBugCheckEx(Code, P1, P2, P3, P4) __builtin_trap()
+#define _InterlockedExchange8(Target, Value) __sync_lock_test_and_set((Target), (Value))
+#define _InterlockedExchange16(Target, Value) __sync_lock_test_and_set((Target), (Value))
+#define InterlockedExchange(Target, Value) __sync_lock_test_and_set((Target), (Value))
+#define InterlockedExchange64(Target, Value) __sync_lock_test_and_set((Target), (Value))
+#define _InterlockedCompareExchange8(Destination, Exchange, Comperand) \
+    __sync_val_compare_and_swap((Destination), (Comperand), (Exchange))
+#define _InterlockedCompareExchange16(Destination, Exchange, Comperand) \
+    __sync_val_compare_and_swap((Destination), (Comperand), (Exchange))
+#define InterlockedCompareExchange(Destination, Exchange, Comperand) \
+    __sync_val_compare_and_swap((Destination), (Comperand), (Exchange))
+#define InterlockedCompareExchange64(Destination, Exchange, Comperand) \
+    __sync_val_compare_and_swap((Destination), (Comperand), (Exchange))
+extern PVOID MmSystemRangeStart;
+BOOLEAN MmIsAddressValid(PVOID VirtualAddress);
+PVOID MmAllocateContiguousMemorySpecifyCacheNode(SIZE_T, PHYSICAL_ADDRESS, PHYSICAL_ADDRESS, PHYSICAL_ADDRESS, MEMORY_CACHING_TYPE, ULONG);
+VOID MmFreeContiguousMemory(PVOID);
@@ -0,0 +1,949 @@
+/*!
+    @file MemoryEmulatorTester.cpp
+
+    @brief Tests the memory instruction emulator of SimpleSvmHook against
+        native execution.
+
+    @details This tool builds MemoryEmulator.cpp and Disassembler.cpp in user
+        mode with the substitutes of the WDK headers under Include, and runs
+        on x86-64 Linux, for example,
+
+            g++ -std=c++17 -O2 -IMemoryEmulatorTester/Include \
+                -o MemoryEmulatorTester \
+                MemoryEmulatorTester/MemoryEmulatorTester.cpp \
+                SimpleSvmHook/MemoryEmulator.cpp SimpleSvmHook/Disassembler.cpp
+
+        Usage:
+
+            MemoryEmulatorTester [<iterations> [<seed>]]
+
+        Each iteration encodes a random instruction supported by the emulator
+        with random prefixes, registers, addressing form and RFLAGS, such that
+        its memory operand falls on the data page. The instruction is executed
+        natively, and then, from the same initial state, emulated as if it
+        caused #VMEXIT due to NPF on the data page, with or without decode
+        assists. The resulting registers, the status flags and DF, RIP and the
+        pages must match. Mismatches are reported with the seed of the
+        iteration to reproduce it.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include <asm/prctl.h>
+#include <csetjmp>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <random>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//
+// Included after the standard headers since it defines min and max macros.
+//
+#include "../SimpleSvmHook/MemoryEmulator.hpp"
+#include "../SimpleSvmHook/x86_64.hpp"
+
+//
+// The emulator accesses the other operand of MOVS and fetches instructions
+// through these, which cover the whole user mode address space here.
+//
+PVOID MmSystemRangeStart = nullptr;
+
+BOOLEAN
+MmIsAddressValid (
+    PVOID VirtualAddress
+    )
+{
+    UNREFERENCED_PARAMETER(VirtualAddress);
+    return TRUE;
+}
+
+//
+// The register state exchanged with ExecuteNatively. Registers are in the
+// encoding order, and RSP is neither loaded nor stored.
+//
+struct NativeState
+{
+    ULONG64 Registers[16];
+    ULONG64 Rflags;
+};
+static_assert(offsetof(NativeState, Rflags) == 128, "Layout check");
+
+extern "C"
+{
+//
+// The code ExecuteNatively calls; the instruction under test followed by RET.
+//
+PVOID g_NativeCode;
+
+VOID
+ExecuteNatively (
+    NativeState* State
+    );
+}
+
+asm(R"(
+    .text
+    .globl  ExecuteNatively
+    .type   ExecuteNatively, @function
+ExecuteNatively:
+    push    %rbx
+    push    %rbp
+    push    %r12
+    push    %r13
+    push    %r14
+    push    %r15
+    push    %rdi
+    pushq   128(%rdi)
+    popfq
+    mov     0(%rdi), %rax
+    mov     8(%rdi), %rcx
+    mov     16(%rdi), %rdx
+    mov     24(%rdi), %rbx
+    mov     40(%rdi), %rbp
+    mov     48(%rdi), %rsi
+    mov     64(%rdi), %r8
+    mov     72(%rdi), %r9
+    mov     80(%rdi), %r10
+    mov     88(%rdi), %r11
+    mov     96(%rdi), %r12
+    mov     104(%rdi), %r13
+    mov     112(%rdi), %r14
+    mov     120(%rdi), %r15
+    mov     56(%rdi), %rdi
+    call    *g_NativeCode(%rip)
+    pushfq
+    push    %rdi
+    mov     16(%rsp), %rdi
+    mov     %rax, 0(%rdi)
+    mov     %rcx, 8(%rdi)
+    mov     %rdx, 16(%rdi)
+    mov     %rbx, 24(%rdi)
+    mov     %rbp, 40(%rdi)
+    mov     %rsi, 48(%rdi)
+    mov     %r8, 64(%rdi)
+    mov     %r9, 72(%rdi)
+    mov     %r10, 80(%rdi)
+    mov     %r11, 88(%rdi)
+    mov     %r12, 96(%rdi)
+    mov     %r13, 104(%rdi)
+    mov     %r14, 112(%rdi)
+    mov     %r15, 120(%rdi)
+    popq    56(%rdi)
+    popq    128(%rdi)
+    cld
+    pop     %rdi
+    pop     %r15
+    pop     %r14
+    pop     %r13
+    pop     %r12
+    pop     %rbp
+    pop     %rbx
+    ret
+    .size   ExecuteNatively, .-ExecuteNatively
+)");
+
+//
+// RFLAGS bits randomized and compared; the status flags and DF.
+//
+static constexpr ULONG64 k_ComparedRflags = 0x8d5 | 0x400;
+
+//
+// The fixed bit 1 and IF, which user mode cannot clear.
+//
+static constexpr ULONG64 k_FixedRflags = 0x202;
+
+static constexpr ULONG k_RegisterRax = 0;
+static constexpr ULONG k_RegisterRcx = 1;
+static constexpr ULONG k_RegisterRsp = 4;
+static constexpr ULONG k_RegisterRbp = 5;
+static constexpr ULONG k_RegisterRsi = 6;
+static constexpr ULONG k_RegisterRdi = 7;
+
+static const char* const k_RegisterNames[] =
+{
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+//
+// GUEST_REGISTERS fields in the encoding order.
+//
+static UINT64 GUEST_REGISTERS::* const k_GuestRegisterFields[] =
+{
+    &GUEST_REGISTERS::Rax, &GUEST_REGISTERS::Rcx, &GUEST_REGISTERS::Rdx,
+    &GUEST_REGISTERS::Rbx, &GUEST_REGISTERS::Rsp, &GUEST_REGISTERS::Rbp,
+    &GUEST_REGISTERS::Rsi, &GUEST_REGISTERS::Rdi, &GUEST_REGISTERS::R8,
+    &GUEST_REGISTERS::R9, &GUEST_REGISTERS::R10, &GUEST_REGISTERS::R11,
+    &GUEST_REGISTERS::R12, &GUEST_REGISTERS::R13, &GUEST_REGISTERS::R14,
+    &GUEST_REGISTERS::R15,
+};
+
+//
+// How the instruction references memory.
+//
+enum class OperandForm
+{
+    ModRmRegister,      // op r/m, r or op r, r/m
+    ModRmImmediate,     // op r/m, imm
+    MemoryOffset,       // op rAX, moffs or op moffs, rAX
+    String,             // STOS or MOVS
+};
+
+//
+// An instruction the emulator supports.
+//
+struct InstructionTemplate
+{
+    const char* Name;
+    bool Map0F;
+    UCHAR Opcode;
+    OperandForm Form;
+
+    //
+    // The size of the memory operand when fixed; otherwise, 0 for the operand
+    // size.
+    //
+    ULONG MemorySize;
+
+    //
+    // true when the register operand is a byte register.
+    //
+    bool ByteRegister;
+
+    //
+    // true for stores and read-modify-write instructions, which fault as
+    // writes.
+    //
+    bool Write;
+
+    //
+    // true when LOCK is allowed.
+    //
+    bool Lockable;
+};
+
+static const InstructionTemplate k_Templates[] =
+{
+    { "mov r/m8, r8",       false, 0x88, OperandForm::ModRmRegister,  1, true,  true,  false, },
+    { "mov r/m, r",         false, 0x89, OperandForm::ModRmRegister,  0, false, true,  false, },
+    { "mov r8, r/m8",       false, 0x8a, OperandForm::ModRmRegister,  1, true,  false, false, },
+    { "mov r, r/m",         false, 0x8b, OperandForm::ModRmRegister,  0, false, false, false, },
+    { "mov r/m8, imm8",     false, 0xc6, OperandForm::ModRmImmediate, 1, false, true,  false, },
+    { "mov r/m, imm",       false, 0xc7, OperandForm::ModRmImmediate, 0, false, true,  false, },
+    { "mov al, moffs8",     false, 0xa0, OperandForm::MemoryOffset,   1, false, false, false, },
+    { "mov rax, moffs",     false, 0xa1, OperandForm::MemoryOffset,   0, false, false, false, },
+    { "mov moffs8, al",     false, 0xa2, OperandForm::MemoryOffset,   1, false, true,  false, },
+    { "mov moffs, rax",     false, 0xa3, OperandForm::MemoryOffset,   0, false, true,  false, },
+    { "movsxd r, r/m32",    false, 0x63, OperandForm::ModRmRegister,  0, false, false, false, },
+    { "xchg r/m8, r8",      false, 0x86, OperandForm::ModRmRegister,  1, true,  true,  true,  },
+    { "xchg r/m, r",        false, 0x87, OperandForm::ModRmRegister,  0, false, true,  true,  },
+    { "stos m8",            false, 0xaa, OperandForm::String,         1, false, true,  false, },
+    { "stos m",             false, 0xab, OperandForm::String,         0, false, true,  false, },
+    { "movs m8, m8",        false, 0xa4, OperandForm::String,         1, false, true,  false, },
+    { "movs m, m",          false, 0xa5, OperandForm::String,         0, false, true,  false, },
+    { "movzx r, r/m8",      true,  0xb6, OperandForm::ModRmRegister,  1, false, false, false, },
+    { "movzx r, r/m16",     true,  0xb7, OperandForm::ModRmRegister,  2, false, false, false, },
+    { "movsx r, r/m8",      true,  0xbe, OperandForm::ModRmRegister,  1, false, false, false, },
+    { "movsx r, r/m16",     true,  0xbf, OperandForm::ModRmRegister,  2, false, false, false, },
+    { "cmpxchg r/m8, r8",   true,  0xb0, OperandForm::ModRmRegister,  1, true,  true,  true,  },
+    { "cmpxchg r/m, r",     true,  0xb1, OperandForm::ModRmRegister,  0, false, true,  true,  },
+};
+
+//
+// The pages the tests run on, allocated below 2GB so that 32-bit addressing
+// and RIP-relative addressing reach them.
+//
+struct TestPages
+{
+    PUCHAR Code;
+    PUCHAR Data;
+    PUCHAR Other;
+};
+
+//
+// A generated test.
+//
+struct TestCase
+{
+    const InstructionTemplate* Template;
+    UCHAR Bytes[k_MaxInsturctionLength];
+    ULONG Length;
+    NativeState State;
+
+    //
+    // The fault the instruction is emulated for.
+    //
+    bool Write;
+    ULONG Offset;
+    ULONG MemorySize;
+
+    //
+    // true to provide the instruction bytes as decode assists do.
+    //
+    bool DecodeAssists;
+};
+
+static ULONG64 g_FsBase;
+static ULONG64 g_GsBase;
+static sigjmp_buf g_FaultJump;
+
+/*!
+    @brief Returns to the test loop when native execution faults.
+ */
+static
+void
+HandleFault (
+    int Signal
+    )
+{
+    siglongjmp(g_FaultJump, Signal);
+}
+
+/*!
+    @brief Appends the value in little endian.
+ */
+static
+void
+Emit (
+    TestCase* Test,
+    ULONG64 Value,
+    ULONG Size
+    )
+{
+    for (ULONG i = 0; i < Size; ++i)
+    {
+        Test->Bytes[Test->Length++] = static_cast<UCHAR>(Value >> (i * 8));
+    }
+}
+
+/*!
+    @brief Generates a random test.
+
+    @return true on success; false if the random choices are inconsistent and
+        the generation has to be retried.
+ */
+static
+bool
+GenerateTestCase (
+    std::mt19937_64& Random,
+    const TestPages& Pages,
+    TestCase* Test
+    )
+{
+    const InstructionTemplate* instruction;
+    bool operandSizeOverride, addressSizeOverride, repeat, lock;
+    UCHAR segment;
+    ULONG64 segmentBase;
+    bool rexW, rexRequired, rexForbidden, rexPresent;
+    ULONG operandSize;
+    ULONG reg, base, index, scale, mod;
+    enum { BaseOnly, BaseIndex, IndexOnly, RipRelative } addressing;
+    LONG64 displacement;
+    ULONG displacementSize, displacementOffset;
+    ULONG immediateSize;
+    ULONG64 target, effectiveAddress;
+    UCHAR rex;
+
+    *Test = {};
+    instruction = &k_Templates[Random() % (sizeof(k_Templates) / sizeof(k_Templates[0]))];
+    Test->Template = instruction;
+    Test->DecodeAssists = ((Random() % 2) == 0);
+    for (auto& value : Test->State.Registers)
+    {
+        value = Random();
+    }
+    Test->State.Registers[k_RegisterRsp] = 0;
+    Test->State.Rflags = (Random() & k_ComparedRflags) | k_FixedRflags;
+
+    operandSizeOverride = ((Random() % 4) == 0);
+    addressSizeOverride = ((Random() % 6) == 0);
+    repeat = ((Random() % 2) == 0);
+    lock = (instruction->Lockable && ((Random() % 4) == 0));
+    segment = 0;
+    segmentBase = 0;
+    switch (Random() % 8)
+    {
+    case 0:
+        segment = 0x64;
+        segmentBase = g_FsBase;
+        break;
+    case 1:
+        segment = 0x65;
+        segmentBase = g_GsBase;
+        break;
+    default:
+        break;
+    }
+
+    //
+    // REX.W is meaningless for byte operations; leave it clear for them.
+    //
+    rexW = ((instruction->MemorySize != 1) && ((Random() % 2) == 0));
+    operandSize = rexW ? 8 : operandSizeOverride ? 2 : 4;
+    Test->MemorySize = (instruction->MemorySize != 0) ? instruction->MemorySize :
+                       operandSize;
+    if ((instruction->Opcode == 0x63) && !instruction->Map0F)
+    {
+        Test->MemorySize = (operandSize == 2) ? 2 : 4;
+    }
+
+    Test->Offset = static_cast<ULONG>(Random() % (PAGE_SIZE - Test->MemorySize + 1));
+    target = reinterpret_cast<ULONG64>(Pages.Data) + Test->Offset;
+    effectiveAddress = target - segmentBase;
+    Test->Write = instruction->Write;
+
+    //
+    // Prefixes. The emulator does not support 32-bit addressing for strings,
+    // and 32-bit addressing cannot reach the data page when the segment base
+    // is added.
+    //
+    if (addressSizeOverride &&
+        ((instruction->Form == OperandForm::String) || (segment != 0)))
+    {
+        return false;
+    }
+    if (lock)
+    {
+        Emit(Test, 0xf0, 1);
+    }
+    if (segment != 0)
+    {
+        Emit(Test, segment, 1);
+    }
+    if (operandSizeOverride)
+    {
+        Emit(Test, 0x66, 1);
+    }
+    if (addressSizeOverride)
+    {
+        Emit(Test, 0x67, 1);
+    }
+
+    if (instruction->Form == OperandForm::String)
+    {
+        if (repeat)
+        {
+            Emit(Test, 0xf3, 1);
+            Test->State.Registers[k_RegisterRcx] = 1;
+        }
+        if (rexW)
+        {
+            Emit(Test, 0x48, 1);
+        }
+        Emit(Test, instruction->Opcode, 1);
+
+        if (instruction->Opcode == 0xa4 || instruction->Opcode == 0xa5)
+        {
+            ULONG64 other;
+
+            //
+            // The segment override applies to the source, RSI. Either operand
+            // can be the one on the faulting page.
+            //
+            other = reinterpret_cast<ULONG64>(Pages.Other) +
+                    Random() % (PAGE_SIZE - Test->MemorySize + 1);
+            Test->Write = ((Random() % 2) == 0);
+            if (Test->Write)
+            {
+                Test->State.Registers[k_RegisterRdi] = target;
+                Test->State.Registers[k_RegisterRsi] = other - segmentBase;
+            }
+            else
+            {
+                Test->State.Registers[k_RegisterRsi] = target - segmentBase;
+                Test->State.Registers[k_RegisterRdi] = other;
+            }
+        }
+        else
+        {
+            Test->State.Registers[k_RegisterRdi] = target;
+        }
+        return true;
+    }
+
+    if (instruction->Form == OperandForm::MemoryOffset)
+    {
+        if (rexW)
+        {
+            Emit(Test, 0x48, 1);
+        }
+        Emit(Test, instruction->Opcode, 1);
+        Emit(Test, effectiveAddress, addressSizeOverride ? 4 : 8);
+        return true;
+    }
+
+    //
+    // ModRM forms. The register operand is never RSP, and is an opcode
+    // extension of zero for MOV r/m, imm. Byte registers 4 to 7 are AH to BH
+    // without REX, and SPL to DIL with REX.
+    //
+    rexRequired = rexW;
+    rexForbidden = false;
+    reg = 0;
+    if (instruction->Form == OperandForm::ModRmRegister)
+    {
+        reg = static_cast<ULONG>(Random() % 16);
+        if (instruction->ByteRegister && (reg >= 4) && (reg <= 7))
+        {
+            if ((Random() % 2) == 0)
+            {
+                rexForbidden = true;
+            }
+            else
+            {
+                rexRequired = true;
+            }
+        }
+        if ((reg == k_RegisterRsp) && !rexForbidden)
+        {
+            return false;
+        }
+    }
+
+    switch (Random() % 4)
+    {
+    case 0:
+        addressing = BaseOnly;
+        break;
+    case 1:
+        addressing = BaseIndex;
+        break;
+    case 2:
+        addressing = IndexOnly;
+        break;
+    default:
+        addressing = RipRelative;
+        break;
+    }
+
+    base = static_cast<ULONG>(Random() % 16);
+    index = static_cast<ULONG>(Random() % 16);
+    scale = static_cast<ULONG>(Random() % 4);
+    mod = static_cast<ULONG>(Random() % 3);
+    if ((base == k_RegisterRsp) ||
+        (index == k_RegisterRsp) ||
+        ((addressing == BaseIndex) && (base == index)))
+    {
+        return false;
+    }
+    if ((addressing == IndexOnly) || (addressing == RipRelative))
+    {
+        mod = 0;
+    }
+    else if ((mod == 0) && ((base & 7) == k_RegisterRbp))
+    {
+        //
+        // mod 00b with RBP or R13 as the base means no base or RIP.
+        //
+        mod = 1;
+    }
+
+    //
+    // The RIP-relative address cannot reach the data page when the segment
+    // base is added.
+    //
+    if ((addressing == RipRelative) && (segment != 0))
+    {
+        return false;
+    }
+
+    if ((reg >= 8) ||
+        (((addressing == BaseIndex) || (addressing == IndexOnly)) && (index >= 8)) ||
+        (((addressing == BaseOnly) || (addressing == BaseIndex)) && (base >= 8)))
+    {
+        rexRequired = true;
+    }
+    if (rexRequired && rexForbidden)
+    {
+        return false;
+    }
+    rexPresent = rexRequired || (!rexForbidden && ((Random() % 4) == 0));
+
+    rex = 0x40;
+    rex |= rexW ? 0x8 : 0;
+    rex |= (reg >= 8) ? 0x4 : 0;
+    rex |= (((addressing == BaseIndex) || (addressing == IndexOnly)) && (index >= 8)) ? 0x2 : 0;
+    rex |= (((addressing == BaseOnly) || (addressing == BaseIndex)) && (base >= 8)) ? 0x1 : 0;
+    if (rexPresent)
+    {
+        Emit(Test, rex, 1);
+    }
+    if (instruction->Map0F)
+    {
+        Emit(Test, 0x0f, 1);
+    }
+    Emit(Test, instruction->Opcode, 1);
+
+    displacementSize = (mod == 1) ? 1 :
+                       ((mod == 2) || (addressing == IndexOnly) ||
+                        (addressing == RipRelative)) ? 4 : 0;
+    displacement = 0;
+    if (displacementSize == 1)
+    {
+        displacement = static_cast<CHAR>(Random());
+    }
+    else if (displacementSize == 4)
+    {
+        displacement = static_cast<LONG>(Random()) >> 2;
+    }
+
+    if ((addressing == BaseOnly) && ((base & 7) != k_RegisterRsp))
+    {
+        Emit(Test, (mod << 6) | ((reg & 7) << 3) | (base & 7), 1);
+    }
+    else if (addressing == RipRelative)
+    {
+        Emit(Test, ((reg & 7) << 3) | 5, 1);
+    }
+    else
+    {
+        //
+        // SIB. Index 100b without REX.X means no index, and base 101b with
+        // mod 00b means no base.
+        //
+        Emit(Test, (mod << 6) | ((reg & 7) << 3) | 4, 1);
+        if (addressing == BaseOnly)
+        {
+            Emit(Test, (scale << 6) | (4 << 3) | (base & 7), 1);
+        }
+        else if (addressing == BaseIndex)
+        {
+            Emit(Test, (scale << 6) | ((index & 7) << 3) | (base & 7), 1);
+        }
+        else
+        {
+            Emit(Test, (scale << 6) | ((index & 7) << 3) | 5, 1);
+        }
+    }
+
+    //
+    // Make CMPXCHG succeed half of the time, unless RAX is used for
+    // addressing and overwritten below.
+    //
+    if (instruction->Map0F &&
+        ((instruction->Opcode == 0xb0) || (instruction->Opcode == 0xb1)) &&
+        ((Random() % 2) == 0))
+    {
+        ULONG64 mask;
+        ULONG64 value;
+
+        mask = (Test->MemorySize == 8) ? MAXULONG64 :
+               ((1ull << (Test->MemorySize * 8)) - 1);
+        value = 0;
+        std::memcpy(&value, Pages.Data + Test->Offset, Test->MemorySize);
+        Test->State.Registers[k_RegisterRax] =
+                    (Test->State.Registers[k_RegisterRax] & ~mask) | value;
+    }
+    //
+    // Make the effective address the target. The upper 32 bits of the base
+    // are ignored with 32-bit addressing, so randomize them.
+    //
+    switch (addressing)
+    {
+    case BaseOnly:
+        Test->State.Registers[base] = effectiveAddress - displacement;
+        break;
+    case BaseIndex:
+        Test->State.Registers[index] = Random() % 0x10000;
+        Test->State.Registers[base] = effectiveAddress - displacement -
+                                      (Test->State.Registers[index] << scale);
+        break;
+    case IndexOnly:
+        displacement += (effectiveAddress - displacement) & ((1ull << scale) - 1);
+        Test->State.Registers[index] = (effectiveAddress - displacement) >> scale;
+        break;
+    case RipRelative:
+        break;
+    }
+    if (addressSizeOverride && (addressing != IndexOnly) && (addressing != RipRelative))
+    {
+        Test->State.Registers[base] = (Random() << 32) |
+                                      (Test->State.Registers[base] & MAXUINT32);
+    }
+    displacementOffset = Test->Length;
+    Emit(Test, static_cast<ULONG64>(displacement), displacementSize);
+
+    immediateSize = 0;
+    if (instruction->Form == OperandForm::ModRmImmediate)
+    {
+        immediateSize = (instruction->MemorySize == 1) ? 1 :
+                        (operandSize == 2) ? 2 : 4;
+        Emit(Test, Random(), immediateSize);
+    }
+
+    if (addressing == RipRelative)
+    {
+        displacement = static_cast<LONG64>(target -
+                            (reinterpret_cast<ULONG64>(Pages.Code) + Test->Length));
+        for (ULONG i = 0; i < 4; ++i)
+        {
+            Test->Bytes[displacementOffset + i] = static_cast<UCHAR>(displacement >> (i * 8));
+        }
+    }
+
+    return true;
+}
+
+/*!
+    @brief Prints the test.
+ */
+static
+void
+PrintTestCase (
+    const TestCase& Test,
+    ULONG64 Seed
+    )
+{
+    std::printf("seed %llu: %s:",
+                static_cast<unsigned long long>(Seed),
+                Test.Template->Name);
+    for (ULONG i = 0; i < Test.Length; ++i)
+    {
+        std::printf(" %02x", Test.Bytes[i]);
+    }
+    std::printf(" (%s fault at +0x%03x, %s)\n",
+                Test.Write ? "write" : "read",
+                Test.Offset,
+                Test.DecodeAssists ? "decode assists" : "fetched");
+}
+
+/*!
+    @brief Runs the test natively and with the emulator, and compares the
+        results.
+
+    @return true if the results match; otherwise, false.
+ */
+static
+bool
+RunTestCase (
+    const TestCase& Test,
+    const TestPages& Pages,
+    ULONG64 Seed
+    )
+{
+    static UCHAR initialData[PAGE_SIZE], initialOther[PAGE_SIZE];
+    static UCHAR nativeData[PAGE_SIZE], nativeOther[PAGE_SIZE];
+    static VMCB vmcb;
+    NativeState native;
+    GUEST_REGISTERS guestRegisters;
+    NPF_EXITINFO1 exitInfo;
+    EMULATED_MEMORY_ACCESS access;
+    BOOLEAN emulated;
+    bool match;
+
+    std::memcpy(initialData, Pages.Data, PAGE_SIZE);
+    std::memcpy(initialOther, Pages.Other, PAGE_SIZE);
+
+    //
+    // Execute natively.
+    //
+    std::memset(Pages.Code, 0xcc, PAGE_SIZE);
+    std::memcpy(Pages.Code, Test.Bytes, Test.Length);
+    Pages.Code[Test.Length] = 0xc3;
+    g_NativeCode = Pages.Code;
+    native = Test.State;
+    if (sigsetjmp(g_FaultJump, 1) != 0)
+    {
+        asm volatile("cld");
+        PrintTestCase(Test, Seed);
+        std::printf("  native execution faulted\n");
+        std::memcpy(Pages.Data, initialData, PAGE_SIZE);
+        std::memcpy(Pages.Other, initialOther, PAGE_SIZE);
+        return false;
+    }
+    ExecuteNatively(&native);
+    std::memcpy(nativeData, Pages.Data, PAGE_SIZE);
+    std::memcpy(nativeOther, Pages.Other, PAGE_SIZE);
+    std::memcpy(Pages.Data, initialData, PAGE_SIZE);
+    std::memcpy(Pages.Other, initialOther, PAGE_SIZE);
+
+    //
+    // Emulate as if the access to the data page caused #VMEXIT.
+    //
+    std::memset(&vmcb, 0, sizeof(vmcb));
+    exitInfo.AsUInt64 = 0;
+    exitInfo.Fields.Valid = TRUE;
+    exitInfo.Fields.Write = Test.Write;
+    exitInfo.Fields.GuestPhysicalAddress = TRUE;
+    vmcb.ControlArea.ExitInfo1 = exitInfo.AsUInt64;
+    vmcb.ControlArea.ExitInfo2 = 0x12345000 + Test.Offset;
+    if (Test.DecodeAssists)
+    {
+        vmcb.ControlArea.NumOfBytesFetched = sizeof(vmcb.ControlArea.GuestInstructionBytes);
+        std::memcpy(vmcb.ControlArea.GuestInstructionBytes,
+                    Pages.Code,
+                    sizeof(vmcb.ControlArea.GuestInstructionBytes));
+    }
+    vmcb.StateSaveArea.CsAttrib = 0x29b;
+    vmcb.StateSaveArea.FsBase = g_FsBase;
+    vmcb.StateSaveArea.GsBase = g_GsBase;
+    vmcb.StateSaveArea.Rflags = Test.State.Rflags;
+    vmcb.StateSaveArea.Rip = reinterpret_cast<ULONG64>(Pages.Code);
+    for (ULONG i = 0; i < 16; ++i)
+    {
+        guestRegisters.*k_GuestRegisterFields[i] = Test.State.Registers[i];
+    }
+    guestRegisters.Rsp = 0;
+
+    emulated = EmulateMemoryAccess(&vmcb, &guestRegisters, Pages.Data, &access);
+
+    //
+    // Compare the results.
+    //
+    match = true;
+    if (emulated == FALSE)
+    {
+        PrintTestCase(Test, Seed);
+        std::printf("  not emulated\n");
+        match = false;
+        goto Exit;
+    }
+
+    if (vmcb.StateSaveArea.Rip != reinterpret_cast<ULONG64>(Pages.Code) + Test.Length)
+    {
+        PrintTestCase(Test, Seed);
+        std::printf("  rip: +%llx, expected +%x\n",
+                    static_cast<unsigned long long>(vmcb.StateSaveArea.Rip -
+                                        reinterpret_cast<ULONG64>(Pages.Code)),
+                    Test.Length);
+        match = false;
+    }
+    if ((access.Offset != Test.Offset) || (access.Size != Test.MemorySize))
+    {
+        if (match)
+        {
+            PrintTestCase(Test, Seed);
+        }
+        std::printf("  access: +0x%03x (%u bytes), expected +0x%03x (%u bytes)\n",
+                    access.Offset,
+                    access.Size,
+                    Test.Offset,
+                    Test.MemorySize);
+        match = false;
+    }
+    for (ULONG i = 0; i < 16; ++i)
+    {
+        if ((i == k_RegisterRsp) ||
+            (guestRegisters.*k_GuestRegisterFields[i] == native.Registers[i]))
+        {
+            continue;
+        }
+        if (match)
+        {
+            PrintTestCase(Test, Seed);
+        }
+        std::printf("  %s: %016llx, expected %016llx (initially %016llx)\n",
+                    k_RegisterNames[i],
+                    static_cast<unsigned long long>(guestRegisters.*k_GuestRegisterFields[i]),
+                    static_cast<unsigned long long>(native.Registers[i]),
+                    static_cast<unsigned long long>(Test.State.Registers[i]));
+        match = false;
+    }
+    if ((vmcb.StateSaveArea.Rflags & k_ComparedRflags) != (native.Rflags & k_ComparedRflags))
+    {
+        if (match)
+        {
+            PrintTestCase(Test, Seed);
+        }
+        std::printf("  rflags: %03llx, expected %03llx (initially %03llx)\n",
+                    static_cast<unsigned long long>(vmcb.StateSaveArea.Rflags & k_ComparedRflags),
+                    static_cast<unsigned long long>(native.Rflags & k_ComparedRflags),
+                    static_cast<unsigned long long>(Test.State.Rflags & k_ComparedRflags));
+        match = false;
+    }
+    for (ULONG i = 0; i < PAGE_SIZE; ++i)
+    {
+        if ((Pages.Data[i] == nativeData[i]) && (Pages.Other[i] == nativeOther[i]))
+        {
+            continue;
+        }
+        if (match)
+        {
+            PrintTestCase(Test, Seed);
+        }
+        std::printf("  memory differs at +0x%03x of the %s page\n",
+                    i,
+                    (Pages.Data[i] != nativeData[i]) ? "data" : "other");
+        match = false;
+        break;
+    }
+
+Exit:
+    std::memcpy(Pages.Data, initialData, PAGE_SIZE);
+    std::memcpy(Pages.Other, initialOther, PAGE_SIZE);
+    return match;
+}
+
+int
+main (
+    int Argc,
+    char* Argv[]
+    )
+{
+    unsigned long long iterations, seed;
+    PUCHAR region;
+    TestPages pages;
+    TestCase test;
+    unsigned long long failures;
+    struct sigaction action = {};
+
+    iterations = (Argc > 1) ? std::strtoull(Argv[1], nullptr, 0) : 100000;
+    seed = (Argc > 2) ? std::strtoull(Argv[2], nullptr, 0) :
+                        static_cast<unsigned long long>(std::time(nullptr));
+
+    region = static_cast<PUCHAR>(mmap(nullptr,
+                                      PAGE_SIZE * 3,
+                                      PROT_READ | PROT_WRITE | PROT_EXEC,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
+                                      -1,
+                                      0));
+    if (region == MAP_FAILED)
+    {
+        std::perror("mmap");
+        return EXIT_FAILURE;
+    }
+    pages.Code = region;
+    pages.Data = region + PAGE_SIZE;
+    pages.Other = region + PAGE_SIZE * 2;
+
+    if ((syscall(SYS_arch_prctl, ARCH_GET_FS, &g_FsBase) != 0) ||
+        (syscall(SYS_arch_prctl, ARCH_GET_GS, &g_GsBase) != 0))
+    {
+        std::perror("arch_prctl");
+        return EXIT_FAILURE;
+    }
+
+    action.sa_handler = HandleFault;
+    sigaction(SIGSEGV, &action, nullptr);
+    sigaction(SIGBUS, &action, nullptr);
+    sigaction(SIGILL, &action, nullptr);
+
+    std::printf("Running %llu iterations from seed %llu\n", iterations, seed);
+    failures = 0;
+    for (unsigned long long i = 0; i < iterations; ++i)
+    {
+        std::mt19937_64 random(seed + i);
+
+        for (ULONG j = 0; j < PAGE_SIZE; ++j)
+        {
+            pages.Data[j] = static_cast<UCHAR>(random());
+            pages.Other[j] = static_cast<UCHAR>(random());
+        }
+        while (!GenerateTestCase(random, pages, &test))
+        {
+            NOTHING;
+        }
+        if (!RunTestCase(test, pages, seed + i))
+        {
+            failures++;
+        }
+    }
+
+    std::printf("%llu of %llu iterations failed\n", failures, iterations);
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
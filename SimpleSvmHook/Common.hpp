@@ -28,7 +28,9 @@
 #define CPUID_SUBLEAF_UNLOAD_SIMPLE_SVM     0x41414141
 #define CPUID_SUBLEAF_ENABLE_HOOKS          0x41414142
 #define CPUID_SUBLEAF_DISABLE_HOOKS         0x41414143
-#define CPUID_HV_MAX                        CPUID_HV_INTERFACE
+#define CPUID_SUBLEAF_VERIFY_HOOKS          0x41414144
+#define CPUID_SUBLEAF_UPDATE_IO_INTERCEPTS  0x41414145
+#define CPUID_HV_MAX                        CPUID_HV_VMM_TIME
 
 //
 // The pool tag.
@@ -0,0 +1,188 @@
+/*!
+    @file Configuration.cpp
+
+    @brief Kernel mode code to read the driver configuration from the registry.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "Configuration.hpp"
+#include "HookCommon.hpp"
+
+DRIVER_CONFIGURATION g_Configuration;
+
+//
+// The description of a REG_DWORD setting.
+//
+typedef struct _CONFIGURATION_VALUE
+{
+    PCWSTR Name;
+    PULONG Setting;
+    ULONG DefaultValue;
+    ULONG MaximumValue;
+} CONFIGURATION_VALUE, *PCONFIGURATION_VALUE;
+
+static const CONFIGURATION_VALUE k_ConfigurationValues[] =
+{
+    { L"TrustedPages", &g_Configuration.TrustedPages, 0, k_TrustedPagesAll },
+    { L"IntegrityCheckInterval", &g_Configuration.IntegrityCheckInterval, 1000, 3600 * 1000 },
+    { L"IntegrityCheckBudget", &g_Configuration.IntegrityCheckBudget, 500, 1000 * 1000 },
+    { L"NptTransitionBackend", &g_Configuration.NptTransitionBackend, 0, NptTransitionBackendMax },
+    { L"SuspendOnCall", &g_Configuration.SuspendOnCall, 1, 1 },
+    { L"NptStateChecker", &g_Configuration.NptStateChecker, 0, 1 },
+    { L"SyscallTrace", &g_Configuration.SyscallTrace, 0, 1 },
+    { L"MmioPrewarm", &g_Configuration.MmioPrewarm, 1, 1 },
+    { L"QueryCacheClasses", &g_Configuration.QueryCacheClasses, k_QueryCacheProcessInformation, k_QueryCacheAll },
+    { L"QueryCacheTimeToLive", &g_Configuration.QueryCacheTimeToLive, 0, 60 * 1000 },
+    { L"PoolMagazine0Tag", &g_Configuration.PoolMagazines[0].Tag, 0, MAXULONG },
+    { L"PoolMagazine0Size", &g_Configuration.PoolMagazines[0].NumberOfBytes, 0, k_MaxPoolMagazineBlockSize },
+    { L"PoolMagazine0PoolType", &g_Configuration.PoolMagazines[0].PoolType, NonPagedPool, NonPagedPoolNx },
+    { L"PoolMagazine1Tag", &g_Configuration.PoolMagazines[1].Tag, 0, MAXULONG },
+    { L"PoolMagazine1Size", &g_Configuration.PoolMagazines[1].NumberOfBytes, 0, k_MaxPoolMagazineBlockSize },
+    { L"PoolMagazine1PoolType", &g_Configuration.PoolMagazines[1].PoolType, NonPagedPool, NonPagedPoolNx },
+    { L"PoolMagazine2Tag", &g_Configuration.PoolMagazines[2].Tag, 0, MAXULONG },
+    { L"PoolMagazine2Size", &g_Configuration.PoolMagazines[2].NumberOfBytes, 0, k_MaxPoolMagazineBlockSize },
+    { L"PoolMagazine2PoolType", &g_Configuration.PoolMagazines[2].PoolType, NonPagedPool, NonPagedPoolNx },
+    { L"PoolMagazine3Tag", &g_Configuration.PoolMagazines[3].Tag, 0, MAXULONG },
+    { L"PoolMagazine3Size", &g_Configuration.PoolMagazines[3].NumberOfBytes, 0, k_MaxPoolMagazineBlockSize },
+    { L"PoolMagazine3PoolType", &g_Configuration.PoolMagazines[3].PoolType, NonPagedPool, NonPagedPoolNx },
+    { L"MmioTrace0BasePage", &g_Configuration.MmioTraceRanges[0].BasePage, 0, MAXULONG },
+    { L"MmioTrace0PageCount", &g_Configuration.MmioTraceRanges[0].PageCount, 0, k_MaxMmioTracePages },
+    { L"MmioTrace1BasePage", &g_Configuration.MmioTraceRanges[1].BasePage, 0, MAXULONG },
+    { L"MmioTrace1PageCount", &g_Configuration.MmioTraceRanges[1].PageCount, 0, k_MaxMmioTracePages },
+    { L"MmioTrace2BasePage", &g_Configuration.MmioTraceRanges[2].BasePage, 0, MAXULONG },
+    { L"MmioTrace2PageCount", &g_Configuration.MmioTraceRanges[2].PageCount, 0, k_MaxMmioTracePages },
+    { L"MmioTrace3BasePage", &g_Configuration.MmioTraceRanges[3].BasePage, 0, MAXULONG },
+    { L"MmioTrace3PageCount", &g_Configuration.MmioTraceRanges[3].PageCount, 0, k_MaxMmioTracePages },
+};
+
+/*!
+    @brief Reads a REG_DWORD value.
+
+    @param[in] KeyHandle - The handle to the service key.
+
+    @param[in] Name - The name of the value to read.
+
+    @param[out] Value - The address to receive the value.
+
+    @details This function is also used to read settings that can be changed
+        after the driver entry. See IoPortTrace.cpp.
+
+    @return STATUS_SUCCESS on success; STATUS_OBJECT_NAME_NOT_FOUND when the
+        value does not exist; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+ReadConfigurationValue (
+    HANDLE KeyHandle,
+    PCWSTR Name,
+    PULONG Value
+    )
+{
+    NTSTATUS status;
+    UNICODE_STRING valueName;
+    UCHAR buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)];
+    PKEY_VALUE_PARTIAL_INFORMATION information;
+    ULONG resultLength;
+
+    PAGED_CODE();
+
+    *Value = 0;
+
+    information = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(buffer);
+    RtlInitUnicodeString(&valueName, Name);
+    status = ZwQueryValueKey(KeyHandle,
+                             &valueName,
+                             KeyValuePartialInformation,
+                             information,
+                             sizeof(buffer),
+                             &resultLength);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+    if ((information->Type != REG_DWORD) ||
+        (information->DataLength != sizeof(ULONG)))
+    {
+        status = STATUS_OBJECT_TYPE_MISMATCH;
+        goto Exit;
+    }
+
+    *Value = *reinterpret_cast<PULONG>(information->Data);
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Loads the driver configuration from the service key.
+
+    @details Settings that do not exist or are invalid are set to their
+        default values. This function fails only when the service key cannot
+        be opened.
+
+    @param[in] RegistryPath - The path to the service key.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_INIT
+_Use_decl_annotations_
+NTSTATUS
+LoadConfiguration (
+    PCUNICODE_STRING RegistryPath
+    )
+{
+    NTSTATUS status;
+    OBJECT_ATTRIBUTES objectAttributes;
+    HANDLE keyHandle;
+    ULONG value;
+
+    PAGED_CODE();
+
+    for (const auto& configurationValue : k_ConfigurationValues)
+    {
+        *configurationValue.Setting = configurationValue.DefaultValue;
+    }
+
+    InitializeObjectAttributes(&objectAttributes,
+                               const_cast<PUNICODE_STRING>(RegistryPath),
+                               OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                               nullptr,
+                               nullptr);
+    status = ZwOpenKey(&keyHandle, KEY_QUERY_VALUE, &objectAttributes);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ZwOpenKey failed : %08x", status);
+        goto Exit;
+    }
+
+    for (const auto& configurationValue : k_ConfigurationValues)
+    {
+        status = ReadConfigurationValue(keyHandle,
+                                        configurationValue.Name,
+                                        &value);
+        if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+        {
+            continue;
+        }
+        if (!NT_SUCCESS(status) || (value > configurationValue.MaximumValue))
+        {
+            LOGGING_LOG_WARN("Ignoring the invalid %ws value : %08x, %lu",
+                             configurationValue.Name,
+                             status,
+                             value);
+            continue;
+        }
+
+        LOGGING_LOG_INFO("%ws = %lu", configurationValue.Name, value);
+        *configurationValue.Setting = value;
+    }
+
+    NT_VERIFY(NT_SUCCESS(ZwClose(keyHandle)));
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
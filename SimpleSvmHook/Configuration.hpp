@@ -0,0 +1,165 @@
+/*!
+    @file Configuration.hpp
+
+    @brief Kernel mode code to read the driver configuration from the registry.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+
+//
+// The categories of pages kept executable in the state 2. See
+// HookKernelTrustedPages.cpp.
+//
+static constexpr ULONG k_TrustedPagesInterruptDispatch = 0x1;
+static constexpr ULONG k_TrustedPagesHookHandlers = 0x2;
+static constexpr ULONG k_TrustedPagesAll = 0x3;
+
+//
+// The information classes of ZwQuerySystemInformation served from snapshots.
+// See HookKernelQueryCache.cpp.
+//
+static constexpr ULONG k_QueryCacheProcessInformation = 0x1;
+static constexpr ULONG k_QueryCacheModuleInformation = 0x2;
+static constexpr ULONG k_QueryCacheHandleInformation = 0x4;
+static constexpr ULONG k_QueryCacheExtendedProcessInformation = 0x8;
+static constexpr ULONG k_QueryCacheAll = 0xf;
+
+//
+// The maximum number of the (tag, size, pool type) triples served from pool
+// magazines. See HookKernelPoolMagazines.cpp.
+//
+static constexpr ULONG k_MaxPoolMagazineClasses = 4;
+
+//
+// The maximum size of blocks served from pool magazines. Larger blocks do not
+// fit in the 8-bit BlockSize of the pool header in 16 byte units with the
+// header, and are big pool blocks without the header, which cannot be verified
+// on free.
+//
+static constexpr ULONG k_MaxPoolMagazineBlockSize = 255 * 16 - 16;
+
+//
+// A (tag, size, pool type) triple served from pool magazines. Tag is zero if
+// unused.
+//
+typedef struct _POOL_MAGAZINE_CONFIGURATION
+{
+    ULONG Tag;
+    ULONG NumberOfBytes;
+    ULONG PoolType;
+} POOL_MAGAZINE_CONFIGURATION, *PPOOL_MAGAZINE_CONFIGURATION;
+
+//
+// The maximum number of MMIO ranges traced, and the maximum number of pages of
+// each. See MmioTrace.cpp.
+//
+static constexpr ULONG k_MaxMmioTraceRanges = 4;
+static constexpr ULONG k_MaxMmioTracePages = 256;
+
+//
+// An MMIO range traced. PageCount is zero if unused.
+//
+typedef struct _MMIO_TRACE_CONFIGURATION
+{
+    ULONG BasePage;
+    ULONG PageCount;
+} MMIO_TRACE_CONFIGURATION, *PMMIO_TRACE_CONFIGURATION;
+
+//
+// The configurable settings of the driver. Each setting is a REG_DWORD value
+// of the same name under the service key, and the default value is used when
+// the value does not exist.
+//
+typedef struct _DRIVER_CONFIGURATION
+{
+    //
+    // k_TrustedPages* flags. Zero by default.
+    //
+    ULONG TrustedPages;
+
+    //
+    // The interval of the hook integrity verification in milliseconds, and
+    // the maximum time spent in each in microseconds. Zero interval disables
+    // the verification. See HookKernelIntegrity.cpp.
+    //
+    ULONG IntegrityCheckInterval;
+    ULONG IntegrityCheckBudget;
+
+    //
+    // NPT_TRANSITION_BACKEND + 1 to use, or zero to select the fastest one on
+    // load. Zero by default. See HookKernelTransitionBackend.cpp.
+    //
+    ULONG NptTransitionBackend;
+
+    //
+    // Non-zero to enter the suspended-visible state on calls out of the hooked
+    // page. Non-zero by default. See HookVmmCommon.cpp.
+    //
+    ULONG SuspendOnCall;
+
+    //
+    // Non-zero to validate the NPT state incrementally after each transition.
+    // Zero by default. See HookVmmCommon.cpp.
+    //
+    ULONG NptStateChecker;
+
+    //
+    // Non-zero to trace syscall entries by redirecting LSTAR. Zero by default.
+    // See SyscallTrace.cpp.
+    //
+    ULONG SyscallTrace;
+
+    //
+    // Non-zero to persist MMIO pages mapped on NPT fault and to map them when
+    // the NPT is built next time. One by default. See
+    // HookKernelMmioWorkingSet.cpp.
+    //
+    ULONG MmioPrewarm;
+
+    //
+    // k_QueryCache* flags, and the time to live of the snapshots in
+    // milliseconds. Zero time to live disables caching. See
+    // HookKernelQueryCache.cpp.
+    //
+    ULONG QueryCacheClasses;
+    ULONG QueryCacheTimeToLive;
+
+    //
+    // The triples served from pool magazines. None by default. See
+    // HookKernelPoolMagazines.cpp.
+    //
+    POOL_MAGAZINE_CONFIGURATION PoolMagazines[k_MaxPoolMagazineClasses];
+
+    //
+    // The MMIO ranges kept unmapped to trace access. None by default. See
+    // MmioTrace.cpp.
+    //
+    MMIO_TRACE_CONFIGURATION MmioTraceRanges[k_MaxMmioTraceRanges];
+} DRIVER_CONFIGURATION, *PDRIVER_CONFIGURATION;
+
+//
+// The configuration loaded at the driver entry. Read-only after that.
+//
+extern DRIVER_CONFIGURATION g_Configuration;
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+ReadConfigurationValue (
+    _In_ HANDLE KeyHandle,
+    _In_ PCWSTR Name,
+    _Out_ PULONG Value
+    );
+
+SIMPLESVMHOOK_INIT
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+LoadConfiguration (
+    _In_ PCUNICODE_STRING RegistryPath
+    );
@@ -0,0 +1,505 @@
+/*!
+    @file Disassembler.cpp
+
+    @brief x64 instruction length decoder.
+
+    @details This decoder determines the length and layout of an instruction
+        (prefixes, opcode, ModRM, SIB, displacement and immediate) without
+        determining its semantics. It covers the legacy one-byte and two-byte
+        opcode maps, the 0F 38 and 0F 3A maps, and VEX and EVEX encoded
+        instructions, which is sufficient to relocate kernel code. 3DNow!, XOP
+        and instructions invalid in 64-bit mode are rejected.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "Disassembler.hpp"
+
+//
+// The layout of operands followed by the opcode.
+//
+typedef enum _OPERAND_LAYOUT : UCHAR
+{
+    OperandLayoutInvalid,       // Invalid in 64-bit mode, or a prefix or escape byte
+    OperandLayoutNone,          // No operands encoded
+    OperandLayoutModRm,         // ModRM
+    OperandLayoutModRmImm8,     // ModRM and 8-bit immediate
+    OperandLayoutModRmImmZ,     // ModRM and 16 or 32-bit immediate
+    OperandLayoutImm8,          // 8-bit immediate
+    OperandLayoutImm16,         // 16-bit immediate
+    OperandLayoutImmZ,          // 16 or 32-bit immediate
+    OperandLayoutImmV,          // 16, 32 or 64-bit immediate (MOV r, imm)
+    OperandLayoutImm16Imm8,     // 16-bit and 8-bit immediate (ENTER)
+    OperandLayoutMemoryOffset,  // 32 or 64-bit absolute address (MOV moffs)
+    OperandLayoutRel8,          // 8-bit relative branch offset
+    OperandLayoutRelZ,          // 16 or 32-bit relative branch offset
+    OperandLayoutGroup3,        // ModRM, and an immediate for TEST (F6 and F7)
+} OPERAND_LAYOUT;
+
+#define I   OperandLayoutInvalid
+#define N   OperandLayoutNone
+#define M   OperandLayoutModRm
+#define MB  OperandLayoutModRmImm8
+#define MZ  OperandLayoutModRmImmZ
+#define B   OperandLayoutImm8
+#define W   OperandLayoutImm16
+#define Z   OperandLayoutImmZ
+#define V   OperandLayoutImmV
+#define E   OperandLayoutImm16Imm8
+#define O   OperandLayoutMemoryOffset
+#define R8  OperandLayoutRel8
+#define RZ  OperandLayoutRelZ
+#define G3  OperandLayoutGroup3
+
+//
+// The operand layouts of the one-byte opcode map. Prefixes (26, 2E, 36, 3E,
+// 40-4F, 64-67, F0, F2, F3) and escapes (0F, 62, C4, C5) are handled before
+// lookup and marked as invalid here.
+//
+static const OPERAND_LAYOUT k_PrimaryMap[256] =
+{
+//  x0  x1  x2  x3  x4  x5  x6  x7  x8  x9  xA  xB  xC  xD  xE  xF
+    M,  M,  M,  M,  B,  Z,  I,  I,  M,  M,  M,  M,  B,  Z,  I,  I,  // 0x
+    M,  M,  M,  M,  B,  Z,  I,  I,  M,  M,  M,  M,  B,  Z,  I,  I,  // 1x
+    M,  M,  M,  M,  B,  Z,  I,  I,  M,  M,  M,  M,  B,  Z,  I,  I,  // 2x
+    M,  M,  M,  M,  B,  Z,  I,  I,  M,  M,  M,  M,  B,  Z,  I,  I,  // 3x
+    I,  I,  I,  I,  I,  I,  I,  I,  I,  I,  I,  I,  I,  I,  I,  I,  // 4x
+    N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  // 5x
+    I,  I,  I,  M,  I,  I,  I,  I,  Z,  MZ, B,  MB, N,  N,  N,  N,  // 6x
+    R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, // 7x
+    MB, MZ, I,  MB, M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 8x
+    N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  I,  N,  N,  N,  N,  N,  // 9x
+    O,  O,  O,  O,  N,  N,  N,  N,  B,  Z,  N,  N,  N,  N,  N,  N,  // Ax
+    B,  B,  B,  B,  B,  B,  B,  B,  V,  V,  V,  V,  V,  V,  V,  V,  // Bx
+    MB, MB, W,  N,  I,  I,  MB, MZ, E,  N,  W,  N,  N,  B,  I,  N,  // Cx
+    M,  M,  M,  M,  I,  I,  I,  N,  M,  M,  M,  M,  M,  M,  M,  M,  // Dx
+    R8, R8, R8, R8, B,  B,  B,  B,  RZ, RZ, I,  R8, N,  N,  N,  N,  // Ex
+    I,  N,  I,  I,  N,  N,  G3, G3, N,  N,  N,  N,  N,  N,  M,  M,  // Fx
+};
+
+//
+// The operand layouts of the two-byte (0F xx) opcode map. 0F 38 and 0F 3A are
+// handled before lookup and marked as invalid here.
+//
+static const OPERAND_LAYOUT k_0FMap[256] =
+{
+//  x0  x1  x2  x3  x4  x5  x6  x7  x8  x9  xA  xB  xC  xD  xE  xF
+    M,  M,  M,  M,  I,  N,  N,  N,  N,  N,  I,  N,  I,  M,  N,  I,  // 0x
+    M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 1x
+    M,  M,  M,  M,  I,  I,  I,  I,  M,  M,  M,  M,  M,  M,  M,  M,  // 2x
+    N,  N,  N,  N,  N,  N,  I,  N,  I,  I,  I,  I,  I,  I,  I,  I,  // 3x
+    M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 4x
+    M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 5x
+    M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 6x
+    MB, MB, MB, MB, M,  M,  M,  N,  M,  M,  I,  I,  M,  M,  M,  M,  // 7x
+    RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, // 8x
+    M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 9x
+    N,  N,  N,  M,  MB, M,  I,  I,  N,  N,  N,  M,  MB, M,  M,  M,  // Ax
+    M,  M,  M,  M,  M,  M,  M,  M,  M,  I,  MB, M,  M,  M,  M,  M,  // Bx
+    M,  M,  MB, M,  MB, MB, MB, M,  N,  N,  N,  N,  N,  N,  N,  N,  // Cx
+    M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // Dx
+    M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // Ex
+    M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // Fx
+};
+
+#undef I
+#undef N
+#undef M
+#undef MB
+#undef MZ
+#undef B
+#undef W
+#undef Z
+#undef V
+#undef E
+#undef O
+#undef R8
+#undef RZ
+#undef G3
+
+/*!
+    @brief Returns the operand layout of a VEX or EVEX encoded instruction.
+
+    @param[in] Map - The opcode map the instruction belongs to.
+
+    @param[in] Opcode - The opcode byte.
+
+    @return The operand layout of the instruction.
+ */
+static
+_Check_return_
+OPERAND_LAYOUT
+GetVexOperandLayout (
+    _In_ OPCODE_MAP Map,
+    _In_ UCHAR Opcode
+    )
+{
+    OPERAND_LAYOUT layout;
+
+    switch (Map)
+    {
+    case OpcodeMap0F:
+        if (Opcode == 0x77)
+        {
+            //
+            // VZEROUPPER and VZEROALL.
+            //
+            layout = OperandLayoutNone;
+        }
+        else if (((Opcode >= 0x70) && (Opcode <= 0x73)) ||
+                 (Opcode == 0xc2) ||
+                 ((Opcode >= 0xc4) && (Opcode <= 0xc6)))
+        {
+            layout = OperandLayoutModRmImm8;
+        }
+        else
+        {
+            layout = OperandLayoutModRm;
+        }
+        break;
+
+    case OpcodeMap0F38:
+        layout = OperandLayoutModRm;
+        break;
+
+    case OpcodeMap0F3A:
+        layout = OperandLayoutModRmImm8;
+        break;
+
+    default:
+        layout = OperandLayoutInvalid;
+        break;
+    }
+    return layout;
+}
+
+/*!
+    @brief Decodes the length and layout of the instruction at the specified
+        address.
+
+    @param[in] Address - The address of the instruction to decode. Up to
+        k_MaxInsturctionLength bytes may be read.
+
+    @param[out] Instruction - The address to receive the decoded result.
+
+    @return TRUE when the instruction is decoded; otherwise, FALSE.
+ */
+_Use_decl_annotations_
+BOOLEAN
+DecodeInstruction (
+    PCVOID Address,
+    PINSTRUCTION_INFO Instruction
+    )
+{
+    BOOLEAN ok;
+    PCUCHAR bytes;
+    ULONG offset;
+    BOOLEAN operandSizeOverride;
+    BOOLEAN addressSizeOverride;
+    BOOLEAN rexW;
+    OPERAND_LAYOUT layout;
+    ULONG immediateSize;
+
+    RtlZeroMemory(Instruction, sizeof(*Instruction));
+
+    ok = FALSE;
+    bytes = static_cast<PCUCHAR>(Address);
+    offset = 0;
+    operandSizeOverride = FALSE;
+    addressSizeOverride = FALSE;
+    rexW = FALSE;
+
+    //
+    // Skip legacy prefixes. Those can appear in any order and may be repeated.
+    //
+    for (; offset < k_MaxInsturctionLength; ++offset)
+    {
+        if (bytes[offset] == 0x66)
+        {
+            operandSizeOverride = TRUE;
+        }
+        else if (bytes[offset] == 0x67)
+        {
+            addressSizeOverride = TRUE;
+        }
+        else if ((bytes[offset] != 0xf0) &&
+                 (bytes[offset] != 0xf2) &&
+                 (bytes[offset] != 0xf3) &&
+                 (bytes[offset] != 0x2e) &&
+                 (bytes[offset] != 0x36) &&
+                 (bytes[offset] != 0x3e) &&
+                 (bytes[offset] != 0x26) &&
+                 (bytes[offset] != 0x64) &&
+                 (bytes[offset] != 0x65))
+        {
+            break;
+        }
+    }
+    if (offset >= k_MaxInsturctionLength - 1)
+    {
+        goto Exit;
+    }
+
+    //
+    // REX prefix. It must immediately precede the opcode.
+    //
+    if ((bytes[offset] & 0xf0) == 0x40)
+    {
+        rexW = BooleanFlagOn(bytes[offset], 0x8);
+        offset++;
+    }
+
+    Instruction->Opcode = bytes[offset++];
+    if ((Instruction->Opcode == 0xc4) || (Instruction->Opcode == 0xc5))
+    {
+        //
+        // VEX. The 3-byte form has the map select and W, and the 2-byte
+        // form implies the 0F map.
+        //
+        if (Instruction->Opcode == 0xc4)
+        {
+            Instruction->OpcodeMap = static_cast<OPCODE_MAP>(bytes[offset] & 0x1f);
+            rexW = BooleanFlagOn(bytes[offset + 1], 0x80);
+            offset += 2;
+        }
+        else
+        {
+            Instruction->OpcodeMap = OpcodeMap0F;
+            offset += 1;
+        }
+        Instruction->Opcode = bytes[offset++];
+        layout = GetVexOperandLayout(Instruction->OpcodeMap,
+                                     Instruction->Opcode);
+    }
+    else if (Instruction->Opcode == 0x62)
+    {
+        //
+        // EVEX. BOUND is invalid in 64-bit mode, so 62 is always EVEX.
+        //
+        Instruction->OpcodeMap = static_cast<OPCODE_MAP>(bytes[offset] & 0x07);
+        offset += 3;
+        Instruction->Opcode = bytes[offset++];
+        layout = GetVexOperandLayout(Instruction->OpcodeMap,
+                                     Instruction->Opcode);
+        if (layout == OperandLayoutNone)
+        {
+            layout = OperandLayoutInvalid;
+        }
+    }
+    else if (Instruction->Opcode == 0x0f)
+    {
+        Instruction->Opcode = bytes[offset++];
+        if (Instruction->Opcode == 0x38)
+        {
+            Instruction->OpcodeMap = OpcodeMap0F38;
+            Instruction->Opcode = bytes[offset++];
+            layout = OperandLayoutModRm;
+        }
+        else if (Instruction->Opcode == 0x3a)
+        {
+            Instruction->OpcodeMap = OpcodeMap0F3A;
+            Instruction->Opcode = bytes[offset++];
+            layout = OperandLayoutModRmImm8;
+        }
+        else
+        {
+            Instruction->OpcodeMap = OpcodeMap0F;
+            layout = k_0FMap[Instruction->Opcode];
+        }
+    }
+    else
+    {
+        Instruction->OpcodeMap = OpcodeMapPrimary;
+        layout = k_PrimaryMap[Instruction->Opcode];
+
+        //
+        // 8F is POP only when ModRM.reg is 000b. Otherwise, it is XOP.
+        //
+        if ((Instruction->Opcode == 0x8f) && ((bytes[offset] & 0x38) != 0))
+        {
+            layout = OperandLayoutInvalid;
+        }
+    }
+
+    if (layout == OperandLayoutInvalid)
+    {
+        goto Exit;
+    }
+
+    //
+    // ModRM, SIB and displacement. 16-bit addressing does not exist in 64-bit
+    // mode, so the address size override does not change the layout.
+    //
+    if ((layout == OperandLayoutModRm) ||
+        (layout == OperandLayoutModRmImm8) ||
+        (layout == OperandLayoutModRmImmZ) ||
+        (layout == OperandLayoutGroup3))
+    {
+        UCHAR mod, rm;
+
+        Instruction->HasModRm = TRUE;
+        Instruction->ModRm = bytes[offset++];
+        mod = (Instruction->ModRm >> 6) & 0x3;
+        rm = Instruction->ModRm & 0x7;
+
+        if (mod != 3)
+        {
+            if (rm == 4)
+            {
+                //
+                // SIB. Base 101b with mod 00b means disp32 without base.
+                //
+                if ((mod == 0) && ((bytes[offset] & 0x7) == 5))
+                {
+                    Instruction->DisplacementSize = 4;
+                }
+                offset++;
+            }
+            else if ((mod == 0) && (rm == 5))
+            {
+                Instruction->DisplacementSize = 4;
+                Instruction->IsRipRelative = TRUE;
+            }
+
+            if (mod == 1)
+            {
+                Instruction->DisplacementSize = 1;
+            }
+            else if (mod == 2)
+            {
+                Instruction->DisplacementSize = 4;
+            }
+        }
+
+        Instruction->DisplacementOffset = static_cast<UCHAR>(offset);
+        offset += Instruction->DisplacementSize;
+    }
+
+    //
+    // Immediate. 66 also shortens near branch offsets on AMD processors. REX.W
+    // takes precedence over 66, and then, Iz remains 32 bits.
+    //
+    if (rexW != FALSE)
+    {
+        operandSizeOverride = FALSE;
+    }
+    switch (layout)
+    {
+    case OperandLayoutModRmImm8:
+    case OperandLayoutImm8:
+        immediateSize = 1;
+        break;
+    case OperandLayoutImm16:
+        immediateSize = 2;
+        break;
+    case OperandLayoutImm16Imm8:
+        immediateSize = 3;
+        break;
+    case OperandLayoutModRmImmZ:
+    case OperandLayoutImmZ:
+        immediateSize = (operandSizeOverride != FALSE) ? 2 : 4;
+        break;
+    case OperandLayoutImmV:
+        immediateSize = (rexW != FALSE) ? 8 :
+                        (operandSizeOverride != FALSE) ? 2 : 4;
+        break;
+    case OperandLayoutMemoryOffset:
+        immediateSize = (addressSizeOverride != FALSE) ? 4 : 8;
+        break;
+    case OperandLayoutRel8:
+        immediateSize = 1;
+        Instruction->IsRelativeBranch = TRUE;
+        break;
+    case OperandLayoutRelZ:
+        immediateSize = (operandSizeOverride != FALSE) ? 2 : 4;
+        Instruction->IsRelativeBranch = TRUE;
+        break;
+    case OperandLayoutGroup3:
+        //
+        // Only TEST (/0 and /1) has an immediate.
+        //
+        if (((Instruction->ModRm >> 3) & 0x7) > 1)
+        {
+            immediateSize = 0;
+        }
+        else if (Instruction->Opcode == 0xf6)
+        {
+            immediateSize = 1;
+        }
+        else
+        {
+            immediateSize = (operandSizeOverride != FALSE) ? 2 : 4;
+        }
+        break;
+    default:
+        immediateSize = 0;
+        break;
+    }
+
+    //
+    // XBEGIN (C7 F8) is a relative branch too.
+    //
+    if ((Instruction->OpcodeMap == OpcodeMapPrimary) &&
+        (Instruction->Opcode == 0xc7) &&
+        (Instruction->ModRm == 0xf8))
+    {
+        Instruction->IsRelativeBranch = TRUE;
+    }
+
+    Instruction->ImmediateOffset = static_cast<UCHAR>(offset);
+    Instruction->ImmediateSize = static_cast<UCHAR>(immediateSize);
+    offset += immediateSize;
+
+    if (offset > k_MaxInsturctionLength)
+    {
+        goto Exit;
+    }
+
+    Instruction->Length = offset;
+    ok = TRUE;
+
+Exit:
+    return ok;
+}
+
+/*!
+    @brief Returns the destination of the relative branch instruction.
+
+    @param[in] Address - The address of the instruction.
+
+    @param[in] Instruction - The decoded result of the instruction. Must be a
+        relative branch.
+
+    @return The destination address of the branch.
+ */
+_Use_decl_annotations_
+PVOID
+GetRelativeBranchTarget (
+    PCVOID Address,
+    const INSTRUCTION_INFO* Instruction
+    )
+{
+    PCUCHAR immediate;
+    LONG64 relative;
+
+    NT_ASSERT(Instruction->IsRelativeBranch != FALSE);
+
+    immediate = static_cast<PCUCHAR>(Address) + Instruction->ImmediateOffset;
+    switch (Instruction->ImmediateSize)
+    {
+    case 1:
+        relative = *reinterpret_cast<const CHAR*>(immediate);
+        break;
+    case 2:
+        relative = *reinterpret_cast<const SHORT UNALIGNED*>(immediate);
+        break;
+    default:
+        relative = *reinterpret_cast<const LONG UNALIGNED*>(immediate);
+        break;
+    }
+
+    return reinterpret_cast<PVOID>(reinterpret_cast<ULONG_PTR>(Address) +
+                                   Instruction->Length +
+                                   relative);
+}
@@ -0,0 +1,84 @@
+/*!
+    @file Disassembler.hpp
+
+    @brief x64 instruction length decoder.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include <fltKernel.h>
+#include "x86_64.hpp"
+
+//
+// The opcode maps an instruction belongs to.
+//
+typedef enum _OPCODE_MAP
+{
+    OpcodeMapPrimary,   // One-byte opcodes
+    OpcodeMap0F,        // 0F xx
+    OpcodeMap0F38,      // 0F 38 xx
+    OpcodeMap0F3A,      // 0F 3A xx
+} OPCODE_MAP, *POPCODE_MAP;
+
+//
+// The result of decoding a single instruction.
+//
+typedef struct _INSTRUCTION_INFO
+{
+    //
+    // The length of the instruction in bytes.
+    //
+    ULONG Length;
+
+    //
+    // The last byte of the opcode and the map it belongs to.
+    //
+    OPCODE_MAP OpcodeMap;
+    UCHAR Opcode;
+
+    //
+    // ModRM if HasModRm is TRUE.
+    //
+    BOOLEAN HasModRm;
+    UCHAR ModRm;
+
+    //
+    // The offset and size of the displacement and immediate fields in bytes.
+    // Sizes are zero if the instruction does not have the fields. For relative
+    // branches, the immediate is the relative offset.
+    //
+    UCHAR DisplacementOffset;
+    UCHAR DisplacementSize;
+    UCHAR ImmediateOffset;
+    UCHAR ImmediateSize;
+
+    //
+    // TRUE if the instruction references memory relative to RIP.
+    //
+    BOOLEAN IsRipRelative;
+
+    //
+    // TRUE if the instruction is a relative branch (Jcc, JMP, CALL, LOOPcc,
+    // JrCXZ and XBEGIN).
+    //
+    BOOLEAN IsRelativeBranch;
+} INSTRUCTION_INFO, *PINSTRUCTION_INFO;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Success_(return)
+_Check_return_
+BOOLEAN
+DecodeInstruction (
+    _In_ PCVOID Address,
+    _Out_ PINSTRUCTION_INFO Instruction
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+PVOID
+GetRelativeBranchTarget (
+    _In_ PCVOID Address,
+    _In_ const INSTRUCTION_INFO* Instruction
+    );
@@ -10,12 +10,15 @@
 #include "HookCommon.hpp"
 #include "Common.hpp"
 #include "HookKernelHandlers.hpp"
+#include "HookKernelHookPoint.hpp"
 
 //
 // The list of functions to hook and their handlers. Must be NT kernel exported
-// functions.
+// functions. An instruction inside those functions can be hooked with
+// HOOK_REGISTRATION_ENTRY_FOR_HOOK_POINT. Those are replaced with the entries
+// in the hook manifest when it is configured. See HookKernelManifest.cpp.
 //
-HOOK_REGISTRATION_ENTRY g_HookRegistrationEntries[] =
+HOOK_REGISTRATION_ENTRY g_HookRegistrationEntries[k_MaxHookRegistrationEntries] =
 {
 #if (SIMPLESVMHOOK_SINGLE_HOOK == 0)
     {
@@ -30,10 +33,7 @@ HOOK_REGISTRATION_ENTRY g_HookRegistrationEntries[] =
         RTL_CONSTANT_STRING(L"ExFreePoolWithTag"),
         HandleExFreePoolWithTag,
     },
-    {
-        RTL_CONSTANT_STRING(L"ExFreePool"),
-        HandleExFreePool,
-    },
+    HOOK_REGISTRATION_ENTRY_FROM_THUNK(ExFreePoolHook),
 #else
     //
     // Only one hook is installed when SIMPLESVMHOOK_SINGLE_HOOK is enabled.
@@ -46,6 +46,22 @@ HOOK_REGISTRATION_ENTRY g_HookRegistrationEntries[] =
 #endif
 };
 
+#if (SIMPLESVMHOOK_SINGLE_HOOK == 0)
+ULONG g_HookRegistrationEntryCount = 4;
+#else
+ULONG g_HookRegistrationEntryCount = 1;
+#endif
+
+//
+// The pages kept executable in the state 2. See HookKernelTrustedPages.cpp.
+//
+TRUSTED_PAGES g_TrustedPages;
+
+//
+// The statistics of the state 3. See HookVmmCommon.cpp.
+//
+SUSPENDED_VISIBLE_STATISTICS g_SuspendedVisibleStatistics;
+
 /*!
     @brief Returns an empty NPT entry to be used by the caller.
 
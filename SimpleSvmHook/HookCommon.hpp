@@ -11,6 +11,17 @@
 #include <fltKernel.h>
 #include "x86_64.hpp"
 
+//
+// The maximum number of NUMA nodes having their own copies of exec pages.
+//
+static constexpr ULONG k_MaxExecPageReplicas = 8;
+
+//
+// HOOK_DATA::ExecPageReplica of processors on the other nodes. Those use the
+// exec page shared by all nodes rather than a copy on another node.
+//
+static constexpr ULONG k_NoExecPageReplica = MAXULONG;
+
 //
 // The data structure represents a single hook.
 //
@@ -41,6 +52,28 @@ typedef struct _HOOK_ENTRY
     //
     ULONG64 PhyPageBaseForExecution;
 
+    //
+    // The page aligned virtual and physical memory addresses of the copies of
+    // PageBaseForExecution allocated on each of the first
+    // k_MaxExecPageReplicas NUMA nodes, indexed by the node number. Those are
+    // the same as PageBaseForExecution and PhyPageBaseForExecution when the
+    // system has a single node, or the copy could not be allocated on the
+    // node. The hypervisor backs the hooked page with the copy of the node of
+    // the processor in the state 2, or with PhyPageBaseForExecution on nodes
+    // without copies.
+    //
+    PVOID PageBasesForExecution[k_MaxExecPageReplicas];
+    ULONG64 PhyPageBasesForExecution[k_MaxExecPageReplicas];
+
+    //
+    // The page aligned physical memory address of the page following
+    // PhyPageBase when a hooked instruction on the page straddles the page
+    // boundary, or 0. The two pages form a group made executable together in
+    // the state 2, so that execution can continue into the next page without
+    // extra NPT state transitions. Shared with all hooks on the same page.
+    //
+    ULONG64 PhyLinkedPageBase;
+
     //
     // The address of code that does "jump to the next instruction of original
     // code". Must be freed when this structure is freed.
@@ -64,6 +97,37 @@ typedef struct _HOOK_REGISTRATION_ENTRY
     //
     PVOID Handler;
 
+    //
+    // The per hook data of the handler generated by the Hook template. NULL
+    // if Handler is hand-written. See HookKernelThunk.hpp.
+    //
+    struct _HOOK_THUNK_DATA* ThunkData;
+
+    //
+    // The immutable array of callbacks attached to this hook, or NULL. See
+    // HookKernelSubscribers.cpp.
+    //
+    struct _HOOK_SUBSCRIBER_ARRAY* volatile Subscribers;
+
+    //
+    // The offset from the start of the function to install the hook, and the
+    // HOOK_POINT_HANDLER to execute there, for a hook point. Handler is
+    // generated at runtime for a hook point. See HookKernelHookPoint.hpp.
+    //
+    ULONG Offset;
+    PVOID HookPointHandler;
+
+    //
+    // The number of arguments reported to subscribers by a hook point handler,
+    // and the filters and the sampling interval applied before subscribers are
+    // executed. Those are configured by the hook manifest. See
+    // HookKernelManifest.cpp.
+    //
+    ULONG ArgumentCount;
+    ULONG Filters;
+    ULONG SamplingInterval;
+    volatile LONG SampleCount;
+
     //
     // The data initialized at runtime.
     //
@@ -71,13 +135,100 @@ typedef struct _HOOK_REGISTRATION_ENTRY
 } HOOK_REGISTRATION_ENTRY, *PHOOK_REGISTRATION_ENTRY;
 
 //
-// The list of functions to be hooked.
+// The maximum number of hooks.
+//
+static constexpr ULONG k_MaxHookRegistrationEntries = 32;
+
+//
+// The list of functions to be hooked. Only the first
+// g_HookRegistrationEntryCount entries are used. Those are either the entries
+// compiled in, or the ones loaded from the hook manifest, and are read-only
+// once hooks are installed.
+//
+extern HOOK_REGISTRATION_ENTRY g_HookRegistrationEntries[k_MaxHookRegistrationEntries];
+extern ULONG g_HookRegistrationEntryCount;
+
+//
+// The range of registration entries in use, iterated with the range-based for
+// loop.
+//
+typedef struct _HOOK_REGISTRATION_RANGE
+{
+    PHOOK_REGISTRATION_ENTRY First;
+    PHOOK_REGISTRATION_ENTRY Last;
+
+    PHOOK_REGISTRATION_ENTRY
+    begin (
+        VOID
+        ) const
+    {
+        return First;
+    }
+
+    PHOOK_REGISTRATION_ENTRY
+    end (
+        VOID
+        ) const
+    {
+        return Last;
+    }
+} HOOK_REGISTRATION_RANGE, *PHOOK_REGISTRATION_RANGE;
+
+/*!
+    @brief Returns the range of registration entries in use.
+
+    @return The range of registration entries in use.
+ */
+inline
+_Check_return_
+HOOK_REGISTRATION_RANGE
+GetHookRegistrationEntries (
+    VOID
+    )
+{
+    return { &g_HookRegistrationEntries[0],
+             &g_HookRegistrationEntries[g_HookRegistrationEntryCount] };
+}
+
+//
+// The maximum number of trusted pages.
 //
-#if (SIMPLESVMHOOK_SINGLE_HOOK == 0)
-extern HOOK_REGISTRATION_ENTRY g_HookRegistrationEntries[4];
-#else
-extern HOOK_REGISTRATION_ENTRY g_HookRegistrationEntries[1];
-#endif
+static constexpr ULONG k_MaxTrustedPages = 64;
+
+//
+// The pages kept executable in the state 2 in addition to the pages of the
+// active hook. See HookKernelTrustedPages.cpp for details.
+//
+typedef struct _TRUSTED_PAGES
+{
+    //
+    // The sorted, page aligned physical memory addresses of the trusted
+    // pages. None of them is a hooked page. Read-only once hooks are installed.
+    //
+    ULONG Count;
+    ULONG64 PhyPageBases[k_MaxTrustedPages];
+
+    //
+    // The upper-bound estimate of the number of #VMEXITs avoided by keeping
+    // the trusted pages executable. Updated by the VMM.
+    //
+    volatile LONG64 AvoidedExitCount;
+} TRUSTED_PAGES, *PTRUSTED_PAGES;
+
+extern TRUSTED_PAGES g_TrustedPages;
+
+//
+// The number of times processors suspended the state 2 on calls out of the
+// hooked page, and resumed it on returns. See HookVmmCommon.cpp for details.
+// Updated by the VMM.
+//
+typedef struct _SUSPENDED_VISIBLE_STATISTICS
+{
+    volatile LONG64 SuspendCount;
+    volatile LONG64 ResumeCount;
+} SUSPENDED_VISIBLE_STATISTICS, *PSUSPENDED_VISIBLE_STATISTICS;
+
+extern SUSPENDED_VISIBLE_STATISTICS g_SuspendedVisibleStatistics;
 
 //
 // State of NPT. See HookVmmCommon.cpp for details.
@@ -87,8 +238,171 @@ typedef enum _NPT_STATE
     NptDefault,
     NptHookEnabledInvisible,
     NptHookEnabledVisible,
+    NptHookEnabledSuspended,
 } NPT_STATE, *PNPT_STATE;
 
+//
+// The incremental checker of the NPT state. See HookVmmCommon.cpp for details.
+//
+typedef struct _NPT_STATE_CHECKER
+{
+    //
+    // The XOR of the hashes of the old and new values of all changes made to
+    // the NX bits and the PFNs of NPT entries since the hook data was built.
+    // It equals to the XOR of the hashes of the original and current values
+    // of the changed fields.
+    //
+    ULONG64 Hash;
+
+    //
+    // The expected Hash in the state 1, and in the state 2 for each active
+    // hook indexed by the registration entry. The latter is valid when the
+    // corresponding bit of VisibleHashValidMask is set.
+    //
+    ULONG64 InvisibleHash;
+    ULONG64 VisibleHashes[k_MaxHookRegistrationEntries];
+    ULONG VisibleHashValidMask;
+
+    //
+    // The number of checks, and the number of mismatches found in total and
+    // since the last CPUID_SUBLEAF_VERIFY_HOOKS.
+    //
+    ULONG64 CheckCount;
+    ULONG64 MismatchCount;
+    ULONG UnreportedMismatchCount;
+} NPT_STATE_CHECKER, *PNPT_STATE_CHECKER;
+static_assert(k_MaxHookRegistrationEntries <= 32, "VisibleHashValidMask size check");
+
+//
+// The implementations of the transitions between the state 1 and 2. See
+// HookVmmCommon.cpp for details.
+//
+typedef enum _NPT_TRANSITION_BACKEND
+{
+    //
+    // Changes permissions of all pages of the single NPT on each transition.
+    //
+    NptTransitionBackendSweep,
+
+    //
+    // Switches NCr3 to the precomputed NPT of the state 2 for the hooked page.
+    //
+    NptTransitionBackendHookViews,
+
+    //
+    // Swaps the PDT of the hooked page with the one precomputed for the state
+    // 2, and changes permissions of the rest as the sweep backend.
+    //
+    NptTransitionBackendHookShadows,
+
+    NptTransitionBackendMax,
+} NPT_TRANSITION_BACKEND, *PNPT_TRANSITION_BACKEND;
+
+//
+// The maximum number of tables owned by a view; the PML4, the PDPT, and a PDT
+// and a PT for each of the hooked page, the linked page and the trusted pages.
+//
+static constexpr ULONG k_MaxHookViewTables = 2 + (2 + k_MaxTrustedPages) * 2;
+
+//
+// The NPT of the state 2 precomputed for a hooked page. Only the tables on the
+// paths to the executable pages are owned by the view, and the rest are shared
+// with the NPT of the state 1. See HookKernelViews.cpp.
+//
+typedef struct _HOOK_VIEW
+{
+    //
+    // The page aligned physical memory address of the hooked page the view is
+    // for. Hooks on the same page share the view.
+    //
+    ULONG64 PhyPageBase;
+
+    //
+    // The NPT PML4 of the view, and its physical address set to NCr3.
+    //
+    PPML4_ENTRY_4KB Pml4Table;
+    ULONG64 Pml4TablePa;
+
+    //
+    // The tables owned by the view, including Pml4Table.
+    //
+    ULONG TableCount;
+    PVOID Tables[k_MaxHookViewTables];
+} HOOK_VIEW, *PHOOK_VIEW;
+
+//
+// The views of a processor.
+//
+typedef struct _HOOK_VIEWS
+{
+    //
+    // The physical address of HOOK_DATA::Pml4Table, set to NCr3 in the state
+    // 0 and 1.
+    //
+    ULONG64 DefaultPml4TablePa;
+
+    ULONG Count;
+    HOOK_VIEW Views[ANYSIZE_ARRAY];
+} HOOK_VIEWS, *PHOOK_VIEWS;
+
+//
+// The maximum number of tables owned by a shadow; the PDT, and a PT for each of
+// the hooked page, the linked page and the trusted pages.
+//
+static constexpr ULONG k_MaxHookShadowTables = 1 + 2 + k_MaxTrustedPages;
+
+//
+// The maximum number of MMIO pages recorded per processor when their NPT
+// entries are built on NPT fault. See HookKernelMmioWorkingSet.cpp.
+//
+static constexpr ULONG k_MaxRecordedMmioPages = 256;
+
+//
+// The PDT of the state 2 precomputed for a hooked page, swapped into the PDPT
+// entry of the 1GB range of the hooked page in the state 2. Only the tables on
+// the paths to the executable pages within the range are owned by the shadow,
+// and the rest are shared with the NPT of the state 1. See
+// HookKernelShadows.cpp.
+//
+typedef struct _HOOK_SHADOW
+{
+    //
+    // The page aligned physical memory address of the hooked page the shadow
+    // is for. Hooks on the same page share the shadow.
+    //
+    ULONG64 PhyPageBase;
+
+    //
+    // The index of the PDPT entry to swap, and the PFNs of the PDT owned by
+    // the shadow and the PDT of the NPT of the state 1.
+    //
+    ULONG64 PpeIndex;
+    ULONG64 ShadowPdtPfn;
+    ULONG64 OriginalPdtPfn;
+
+    //
+    // The linked page and the trusted pages outside of the range, made
+    // executable in place as the sweep backend does. Zero for pages within the
+    // range.
+    //
+    ULONG64 OutOfRangePas[1 + k_MaxTrustedPages];
+
+    //
+    // The tables owned by the shadow, including the PDT.
+    //
+    ULONG TableCount;
+    PVOID Tables[k_MaxHookShadowTables];
+} HOOK_SHADOW, *PHOOK_SHADOW;
+
+//
+// The shadows of a processor.
+//
+typedef struct _HOOK_SHADOWS
+{
+    ULONG Count;
+    HOOK_SHADOW Shadows[ANYSIZE_ARRAY];
+} HOOK_SHADOWS, *PHOOK_SHADOWS;
+
 //
 // The per processor data structure for hooking.
 //
@@ -125,8 +439,97 @@ typedef struct _HOOK_DATA
     // The indicator of NTP state. See HookVmmCommon.cpp for details.
     //
     NPT_STATE NptState;
+
+    //
+    // The table of overhead of the processor, or NULL if the tables are not
+    // initialized. See HookOverhead.cpp.
+    //
+    struct _HOOK_OVERHEAD_TABLE* OverheadTable;
+
+    //
+    // The TSC ticks of the #VMEXIT and VMRUN round trip outside HandleVmExit,
+    // measured from the guest after the processor is virtualized. Charged to
+    // hooks in addition to the ticks spent in HandleVmExit.
+    //
+    ULONG64 VmExitRoundTripCycles;
+
+    //
+    // The index of HOOK_ENTRY::PhyPageBasesForExecution to use on the
+    // processor, that is, the NUMA node number of the processor, or
+    // k_NoExecPageReplica if the node has no copies of exec pages.
+    //
+    ULONG ExecPageReplica;
+
+    //
+    // The implementation of the transitions between the state 1 and 2 on the
+    // processor. Views and ActiveView are used only by
+    // NptTransitionBackendHookViews. ActiveView is the view NCr3 points to in
+    // the state 2, or NULL.
+    //
+    NPT_TRANSITION_BACKEND TransitionBackend;
+    PHOOK_VIEWS Views;
+    const HOOK_VIEW* ActiveView;
+
+    //
+    // Used only by NptTransitionBackendHookShadows. ActiveShadow is the shadow
+    // swapped into the NPT in the state 2, or NULL.
+    //
+    PHOOK_SHADOWS Shadows;
+    const HOOK_SHADOW* ActiveShadow;
+
+    //
+    // Whether the processor enters the state 3 on calls out of the hooked
+    // page, and the page aligned physical memory address of the called page
+    // in the state 3, or 0.
+    //
+    BOOLEAN SuspendOnCall;
+    ULONG64 SuspendedCalleePhyPageBase;
+
+    //
+    // The incremental checker of the NPT state, or NULL if it is disabled.
+    //
+    PNPT_STATE_CHECKER StateChecker;
+
+    //
+    // The page frame numbers of MMIO pages the processor built NPT entries for
+    // on NPT fault, and the number of those faults. Only the first
+    // k_MaxRecordedMmioPages pages are recorded.
+    //
+    ULONG64 MmioPageNumbers[k_MaxRecordedMmioPages];
+    ULONG MmioFaultCount;
+
+    //
+    // Whether the hook data is placed in the per processor data region
+    // instead of being allocated from the pool. See Virtualization.cpp.
+    //
+    BOOLEAN InProcessorDataRegion;
 } HOOK_DATA, *PHOOK_DATA;
 
+/*!
+    @brief Returns the physical address of the exec page local to the
+        processor.
+
+    @param[in] HookEntry - The hook to get the exec page.
+
+    @param[in] HookData - The processor associated hook data.
+
+    @return The page aligned physical memory address of the exec page.
+ */
+inline
+_Check_return_
+ULONG64
+GetPhyPageBaseForExecution (
+    _In_ const HOOK_ENTRY* HookEntry,
+    _In_ const HOOK_DATA* HookData
+    )
+{
+    if (HookData->ExecPageReplica == k_NoExecPageReplica)
+    {
+        return HookEntry->PhyPageBaseForExecution;
+    }
+    return HookEntry->PhyPageBasesForExecution[HookData->ExecPageReplica];
+}
+
 
 // Get the highest 25 bits
 static constexpr ULONGLONG k_PxiShift = 39;
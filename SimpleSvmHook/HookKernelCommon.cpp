@@ -12,6 +12,17 @@
 #include "HookCommon.hpp"
 #include "PhysicalMemoryDescriptor.hpp"
 #include "HookKernelRegistration.hpp"
+#include "HookKernelSubscribers.hpp"
+#include "HookKernelManifest.hpp"
+#include "HookKernelTrustedPages.hpp"
+#include "HookKernelSymbols.hpp"
+#include "HookOverhead.hpp"
+#include "Configuration.hpp"
+#include "HookKernelTransitionBackend.hpp"
+#include "HookKernelQueryCache.hpp"
+#include "HookKernelPoolMagazines.hpp"
+#include "HookKernelPlacement.hpp"
+#include "HookKernelMmioWorkingSet.hpp"
 
 //
 // Read only physical memory address ranges. Used to build NPT entries.
@@ -21,22 +32,69 @@ const PHYSICAL_MEMORY_DESCRIPTOR* g_PhysicalMemoryDescriptor;
 /*!
     @brief Initializes hook related general data structures.
 
+    @param[in] RegistryPath - The path to the service key of the driver, where
+        the hook manifest is read from.
+
     @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
  */
 SIMPLESVMHOOK_PAGED
 _Use_decl_annotations_
 NTSTATUS
 InitializeHook (
-    VOID
+    PCUNICODE_STRING RegistryPath
     )
 {
     NTSTATUS status;
+    BOOLEAN manifestLoaded;
+    BOOLEAN subscribersInited;
+    BOOLEAN symbolIndexInited;
     BOOLEAN registrationEntriesInited;
+    BOOLEAN trustedPagesInited;
+    BOOLEAN overheadInited;
+    BOOLEAN queryCacheInited;
+    BOOLEAN poolMagazinesInited;
     PPHYSICAL_MEMORY_DESCRIPTOR descriptor;
 
     PAGED_CODE();
 
+    manifestLoaded = FALSE;
+    subscribersInited = FALSE;
+    symbolIndexInited = FALSE;
     registrationEntriesInited = FALSE;
+    trustedPagesInited = FALSE;
+    overheadInited = FALSE;
+    queryCacheInited = FALSE;
+    poolMagazinesInited = FALSE;
+
+    //
+    // Replace the hooks compiled in if the hook manifest is configured.
+    //
+    status = LoadHookManifest(RegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("LoadHookManifest failed : %08x", status);
+        goto Exit;
+    }
+    manifestLoaded = TRUE;
+
+    status = InitializeHookSubscribers();
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("InitializeHookSubscribers failed : %08x", status);
+        goto Exit;
+    }
+    subscribersInited = TRUE;
+
+    //
+    // Index symbols of loaded modules to resolve addresses in logs.
+    //
+    status = InitializeSymbolIndex();
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("InitializeSymbolIndex failed : %08x", status);
+        goto Exit;
+    }
+    symbolIndexInited = TRUE;
 
     //
     // Installs hooks without activating them. Activation is done right after
@@ -51,6 +109,60 @@ InitializeHook (
     }
     registrationEntriesInited = TRUE;
 
+    //
+    // Collect pages kept executable in the state 2 now that hooked pages are
+    // known.
+    //
+    status = InitializeTrustedPages(g_Configuration.TrustedPages);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("InitializeTrustedPages failed : %08x", status);
+        goto Exit;
+    }
+    trustedPagesInited = TRUE;
+
+    //
+    // Report how hooked pages are placed and warn risky ones before they are
+    // activated.
+    //
+    AnalyzeHookPlacement();
+
+    //
+    // Allocate tables to attribute overhead to hooks and processes.
+    //
+    status = InitializeHookOverhead();
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("InitializeHookOverhead failed : %08x", status);
+        goto Exit;
+    }
+    overheadInited = TRUE;
+
+    //
+    // Enable caching results of ZwQuerySystemInformation if configured.
+    //
+    status = InitializeQueryCache(g_Configuration.QueryCacheClasses,
+                                  g_Configuration.QueryCacheTimeToLive);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("InitializeQueryCache failed : %08x", status);
+        goto Exit;
+    }
+    queryCacheInited = TRUE;
+
+    //
+    // Serve configured pool allocations from per processor magazines. This
+    // requires registration entries to see whether the pool functions are
+    // hooked.
+    //
+    status = InitializePoolMagazines(g_Configuration.PoolMagazines);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("InitializePoolMagazines failed : %08x", status);
+        goto Exit;
+    }
+    poolMagazinesInited = TRUE;
+
     //
     // Get physical memory address ranges.
     //
@@ -66,13 +178,53 @@ InitializeHook (
     status = STATUS_SUCCESS;
     g_PhysicalMemoryDescriptor = descriptor;
 
+    //
+    // Load the MMIO pages mapped on NPT fault on the last run, so that the NPT
+    // covers them from the beginning.
+    //
+    LoadMmioWorkingSet(RegistryPath, descriptor);
+
+    //
+    // Select how processors transition the NPT state now that the NPT can be
+    // built. This is done before any processor builds its hook data.
+    //
+    SelectNptTransitionBackend(g_Configuration.NptTransitionBackend);
+
 Exit:
     if (!NT_SUCCESS(status))
     {
+        if (poolMagazinesInited != FALSE)
+        {
+            CleanupPoolMagazines();
+        }
+        if (queryCacheInited != FALSE)
+        {
+            CleanupQueryCache();
+        }
+        if (overheadInited != FALSE)
+        {
+            CleanupHookOverhead();
+        }
+        if (trustedPagesInited != FALSE)
+        {
+            CleanupTrustedPages();
+        }
         if (registrationEntriesInited != FALSE)
         {
             CleanupHookRegistrationEntries();
         }
+        if (symbolIndexInited != FALSE)
+        {
+            CleanupSymbolIndex();
+        }
+        if (subscribersInited != FALSE)
+        {
+            CleanupHookSubscribers();
+        }
+        if (manifestLoaded != FALSE)
+        {
+            UnloadHookManifest();
+        }
     }
     return status;
 }
@@ -86,11 +238,19 @@ CleanupHook (
     VOID
     )
 {
+    UnloadMmioWorkingSet();
     FreePhysicalMemoryDescriptor(
         const_cast<PPHYSICAL_MEMORY_DESCRIPTOR>(g_PhysicalMemoryDescriptor));
 
+    CleanupHookSubscribers();
     CleanupHookRegistrationEntries();
     ReportHookActivities();
+    CleanupQueryCache();
+    CleanupPoolMagazines();
+    CleanupHookOverhead();
+    CleanupTrustedPages();
+    CleanupSymbolIndex();
+    UnloadHookManifest();
 }
 
 /*!
@@ -110,7 +270,7 @@ AreAllHooksInvisible (
     PAGED_CODE();
 
     invisible = TRUE;
-    for (const auto& registration : g_HookRegistrationEntries)
+    for (const auto& registration : GetHookRegistrationEntries())
     {
         NT_ASSERT(registration.HookEntry.HookAddress != nullptr);
 
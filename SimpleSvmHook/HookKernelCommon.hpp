@@ -17,10 +17,10 @@ _IRQL_requires_max_(PASSIVE_LEVEL)
 _Check_return_
 NTSTATUS
 InitializeHook (
-    VOID
+    _In_ PCUNICODE_STRING RegistryPath
     );
 
-_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_max_(PASSIVE_LEVEL)
 VOID
 CleanupHook (
     VOID
@@ -10,20 +10,13 @@
 #include "HookKernelHandlers.hpp"
 #include "Common.hpp"
 #include "HookCommon.hpp"
+#include "HookKernelSymbols.hpp"
+#include "HookKernelQueryCache.hpp"
+#include "HookKernelPoolMagazines.hpp"
 
 LONG64 g_ZwQuerySystemInformationCounter;
 LONG64 g_ExAllocatePoolWithTagCounter;
 LONG64 g_ExFreePoolWithTagCounter;
-LONG64 g_ExFreePoolCounter;
-
-EXTERN_C
-NTKERNELAPI
-PVOID
-NTAPI
-RtlPcToFileHeader (
-    _In_ PVOID PcValue,
-    _Out_ PVOID* BaseOfImage
-    );
 
 //
 // Handy union to convert a pool tag in ULONG to a string (char*).
@@ -39,35 +32,62 @@ typedef union _POOL_TAG_VALUE
 } TAG_VALUE, *PTAG_VALUE;
 
 /*!
-    @brief Finds the original call stub for the specified hook handler.
+    @brief Finds the registration entry for the specified hook handler.
 
-    @param[in] Handler - The address of the hook handler needing the original
-        call stub.
+    @param[in] Handler - The address of the hook handler.
 
-    @return The address of the original call stub.
+    @return The address of the registration entry.
  */
 template<typename HandlerType>
 static
 _Check_return_
-HandlerType
-GetOriginalCallStub (
+const HOOK_REGISTRATION_ENTRY*
+GetHookRegistrationEntry (
     _In_ HandlerType Handler
     )
 {
-    for (const auto& registration : g_HookRegistrationEntries)
+    for (const auto& registration : GetHookRegistrationEntries())
     {
         if (registration.Handler == Handler)
         {
             NT_ASSERT(registration.HookEntry.OriginalCallStub);
-            return static_cast<HandlerType>(registration.HookEntry.OriginalCallStub);
+            return &registration;
         }
     }
     NT_ASSERT(false);
     return nullptr;
 }
 
+/*!
+    @brief Returns the original call stub for the specified hook handler.
+
+    @param[in] Registration - The registration entry of the hook.
+
+    @param[in] Handler - The address of the hook handler needing the original
+        call stub.
+
+    @return The address of the original call stub.
+ */
+template<typename HandlerType>
+static
+_Check_return_
+HandlerType
+GetOriginalCallStub (
+    _In_ const HOOK_REGISTRATION_ENTRY* Registration,
+    _In_ HandlerType Handler
+    )
+{
+    UNREFERENCED_PARAMETER(Handler);
+
+    return static_cast<HandlerType>(Registration->HookEntry.OriginalCallStub);
+}
+
 /*!
     @brief Logs execution of ZwQuerySystemInformation.
+
+    @details The call is served from the snapshot instead of the original
+        function if the information class is cached. See
+        HookKernelQueryCache.cpp.
  */
 _Use_decl_annotations_
 NTSTATUS
@@ -80,17 +100,58 @@ HandleZwQuerySystemInformation (
     )
 {
     NTSTATUS status;
+    const HOOK_REGISTRATION_ENTRY* registration;
+    HOOK_CALL_INFO callInfo;
+    HOOK_SUBSCRIBER_SECTION section;
+    ULONG returnLength;
+    PULONG returnLengthPointer;
+
+    registration = GetHookRegistrationEntry(HandleZwQuerySystemInformation);
+    InitializeHookCallInfo(&callInfo,
+                           registration,
+                           _ReturnAddress(),
+                           SystemInformationClass,
+                           SystemInformation,
+                           SystemInformationLength,
+                           ReturnLength);
+    EnterHookSubscribers(registration, &callInfo, &section);
+
+    if (QueryCachedSystemInformation(SystemInformationClass,
+                                     SystemInformation,
+                                     SystemInformationLength,
+                                     ReturnLength,
+                                     &status) == FALSE)
+    {
+        //
+        // Receive the size of the information even if the caller does not, so
+        // that the result can be cached.
+        //
+        returnLength = 0;
+        returnLengthPointer = ARGUMENT_PRESENT(ReturnLength) ? ReturnLength :
+                                                               &returnLength;
+
+        auto zwQuerySystemInformation = GetOriginalCallStub(registration,
+                                                            HandleZwQuerySystemInformation);
+        status = zwQuerySystemInformation(SystemInformationClass,
+                                          SystemInformation,
+                                          SystemInformationLength,
+                                          returnLengthPointer);
+        if (NT_SUCCESS(status))
+        {
+            CacheSystemInformation(SystemInformationClass,
+                                   SystemInformation,
+                                   min(*returnLengthPointer,
+                                       SystemInformationLength));
+        }
+    }
 
-    auto zwQuerySystemInformation = GetOriginalCallStub(HandleZwQuerySystemInformation);
-    status = zwQuerySystemInformation(SystemInformationClass,
-                                      SystemInformation,
-                                      SystemInformationLength,
-                                      ReturnLength);
+    callInfo.Result = ToHookValue(status);
+    LeaveHookSubscribers(&callInfo, &section);
 
     InterlockedIncrement64(&g_ZwQuerySystemInformationCounter);
 
-    LOGGING_LOG_DEBUG("%p: ZwQuerySystemInformation(SystemInformationClass= %3d, ...) => %08x",
-                      _ReturnAddress(),
+    LOGGING_LOG_DEBUG("%s: ZwQuerySystemInformation(SystemInformationClass= %3d, ...) => %08x",
+                      AddressToSymbol(_ReturnAddress()).AsChars,
                       SystemInformationClass,
                       status);
 
@@ -142,9 +203,28 @@ HandleExAllocatePoolWithTag (
     PVOID pointer;
     PVOID returnAddress;
     PVOID imageBaseAddress;
-
-    auto exAllocatePoolWithTag = GetOriginalCallStub(HandleExAllocatePoolWithTag);
-    pointer = exAllocatePoolWithTag(PoolType, NumberOfBytes, Tag);
+    const HOOK_REGISTRATION_ENTRY* registration;
+    HOOK_CALL_INFO callInfo;
+    HOOK_SUBSCRIBER_SECTION section;
+
+    registration = GetHookRegistrationEntry(HandleExAllocatePoolWithTag);
+    InitializeHookCallInfo(&callInfo,
+                           registration,
+                           _ReturnAddress(),
+                           PoolType,
+                           NumberOfBytes,
+                           Tag);
+    EnterHookSubscribers(registration, &callInfo, &section);
+
+    auto exAllocatePoolWithTag = GetOriginalCallStub(registration,
+                                                     HandleExAllocatePoolWithTag);
+    pointer = AllocatePoolWithMagazine(PoolType,
+                                       NumberOfBytes,
+                                       Tag,
+                                       exAllocatePoolWithTag);
+
+    callInfo.Result = ToHookValue(pointer);
+    LeaveHookSubscribers(&callInfo, &section);
 
     InterlockedIncrement64(&g_ExAllocatePoolWithTagCounter);
 
@@ -181,9 +261,19 @@ HandleExFreePoolWithTag (
 {
     PVOID returnAddress;
     PVOID imageBaseAddress;
+    const HOOK_REGISTRATION_ENTRY* registration;
+    HOOK_CALL_INFO callInfo;
+    HOOK_SUBSCRIBER_SECTION section;
+
+    registration = GetHookRegistrationEntry(HandleExFreePoolWithTag);
+    InitializeHookCallInfo(&callInfo, registration, _ReturnAddress(), P, Tag);
+    EnterHookSubscribers(registration, &callInfo, &section);
 
-    auto exFreePoolWithTag = GetOriginalCallStub(HandleExFreePoolWithTag);
-    exFreePoolWithTag(P, Tag);
+    auto exFreePoolWithTag = GetOriginalCallStub(registration,
+                                                 HandleExFreePoolWithTag);
+    FreePoolWithMagazine(P, Tag, exFreePoolWithTag);
+
+    LeaveHookSubscribers(&callInfo, &section);
 
     InterlockedIncrement64(&g_ExFreePoolWithTagCounter);
 
@@ -206,33 +296,48 @@ Exit:
 }
 
 /*!
-    @brief Logs execution of ExFreePool.
+    @brief Reports execution of the hook point to subscribers.
+
+    @details The first four arguments are taken from the argument registers.
+        When the hook point is at the start of the function, the return
+        address and the rest of arguments are taken from the stack as well.
+        The values of argument registers are not meaningful after the function
+        modified them.
  */
+_Use_decl_annotations_
 VOID
-NTAPI
-HandleExFreePool (
-    PVOID P
+HandleProbeHookPoint (
+    PHOOK_REGISTER_CONTEXT Context,
+    const HOOK_REGISTRATION_ENTRY* Registration
     )
 {
-    PVOID returnAddress;
-    PVOID imageBaseAddress;
-
-    auto exFreePool = GetOriginalCallStub(HandleExFreePool);
-    exFreePool(P);
-
-    InterlockedIncrement64(&g_ExFreePoolCounter);
+    const ULONG64* stack;
+    HOOK_CALL_INFO callInfo;
+    HOOK_SUBSCRIBER_SECTION section;
 
     //
-    // Log only when it is called from outside of any image.
+    // At the start of the function, the stack holds the return address,
+    // followed by the home space of the four argument registers and the
+    // fifth and later arguments.
     //
-    returnAddress = _ReturnAddress();
-    if (RtlPcToFileHeader(returnAddress, &imageBaseAddress) != nullptr)
+    stack = reinterpret_cast<const ULONG64*>(Context->Rsp);
+
+    callInfo.FunctionName = &Registration->FunctionName;
+    callInfo.ReturnAddress = (Registration->Offset == 0) ?
+                                reinterpret_cast<PVOID>(stack[0]) : nullptr;
+    callInfo.ArgumentCount = Registration->ArgumentCount;
+    callInfo.Arguments[0] = Context->Rcx;
+    callInfo.Arguments[1] = Context->Rdx;
+    callInfo.Arguments[2] = Context->R8;
+    callInfo.Arguments[3] = Context->R9;
+    for (ULONG i = 4; i < k_HookMaxCallbackArguments; ++i)
     {
-        goto Exit;
+        callInfo.Arguments[i] = ((Registration->Offset == 0) &&
+                                 (i < Registration->ArgumentCount)) ?
+                                    stack[i + 1] : 0;
     }
+    callInfo.Result = 0;
 
-    LOGGING_LOG_INFO("%p: ExFreePool(P= %p)", returnAddress, P);
-
-Exit:
-    return;
+    EnterHookSubscribers(Registration, &callInfo, &section);
+    LeaveHookSubscribers(&callInfo, &section);
 }
@@ -9,11 +9,13 @@
  */
 #pragma once
 #include <fltKernel.h>
+#include "HookKernelThunk.hpp"
+#include "HookKernelHookPoint.hpp"
+#include "HookKernelPoolMagazines.hpp"
 
 extern LONG64 g_ZwQuerySystemInformationCounter;
 extern LONG64 g_ExAllocatePoolWithTagCounter;
 extern LONG64 g_ExFreePoolWithTagCounter;
-extern LONG64 g_ExFreePoolCounter;
 
 typedef enum _SYSTEM_INFORMATION_CLASS
 {
@@ -34,4 +36,21 @@ decltype(ExAllocatePoolWithTag) HandleExAllocatePoolWithTag;
 
 decltype(ExFreePoolWithTag) HandleExFreePoolWithTag;
 
-decltype(ExFreePool) HandleExFreePool;
+//
+// ExFreePool is hooked with a generated handler. It logs the call only when it
+// is called from outside of any image. The block is freed to the system even
+// if it was served from a pool magazine.
+//
+HOOK_DECLARE_TARGET(ExFreePool);
+using ExFreePoolHook = Hook<HookTargetExFreePool,
+                            PoolMagazineOwnershipPolicy,
+                            SubscribersPolicy,
+                            CountPolicy,
+                            CallerOutsideImageFilter,
+                            LogPolicy>;
+
+//
+// The generic hook point handler used by the hook manifest. It executes
+// subscribers with the argument registers at the hook point.
+//
+HOOK_POINT_HANDLER HandleProbeHookPoint;
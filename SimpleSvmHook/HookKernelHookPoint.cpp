@@ -0,0 +1,209 @@
+/*!
+    @file HookKernelHookPoint.cpp
+
+    @brief Kernel mode code to hook an arbitrary instruction in a function.
+
+    @details When a hook point is executed, the hypervisor transfers execution
+        to the entry stub generated for the hook point, as it does to a handler
+        of a function hook. The entry stub pushes the address of the
+        registration entry and jumps to SvHookPointDispatcher, which saves
+        registers to the stack as HOOK_POINT_FRAME and calls HandleHookPoint.
+        HandleHookPoint calls the handler and replaces the pushed address with
+        the address of the original call stub (the relocated hooked instruction
+        and a jump to the next instruction). SvHookPointDispatcher then restores
+        registers and returns to the original call stub.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelHookPoint.hpp"
+#include "Common.hpp"
+#include "Disassembler.hpp"
+
+//
+// A byte array that represents the below x64 code.
+//  ff3506000000     push    qword ptr cs:registration
+//  ff2508000000     jmp     qword ptr cs:dispatcher
+// registration:
+//  0000000000000000 dq 0
+// dispatcher:
+//  0000000000000000 dq 0
+//
+#include <pshpack1.h>
+typedef struct _HOOK_POINT_STUB
+{
+    UCHAR Push[6];
+    UCHAR Jmp[6];
+    PVOID Registration;
+    PVOID Dispatcher;
+} HOOK_POINT_STUB, *PHOOK_POINT_STUB;
+static_assert(sizeof(HOOK_POINT_STUB) == 28, "Size check");
+#include <poppack.h>
+
+//
+// The stack layout built by SvHookPointDispatcher.
+//
+typedef struct _HOOK_POINT_FRAME
+{
+    HOOK_REGISTER_CONTEXT Context;
+
+    //
+    // The address of HOOK_REGISTRATION_ENTRY on entry, and the address to
+    // continue execution on return.
+    //
+    PVOID RegistrationOrContinuation;
+} HOOK_POINT_FRAME, *PHOOK_POINT_FRAME;
+
+EXTERN_C
+VOID
+NTAPI
+SvHookPointDispatcher (
+    VOID
+    );
+
+/*!
+    @brief Tests whether the specified offset is an instruction boundary of the
+        function.
+
+    @details This function decodes instructions linearly from the start of the
+        function, assuming that no data is embedded in the code until the
+        offset.
+
+    @param[in] FunctionAddress - The start address of the function.
+
+    @param[in] Offset - The offset from FunctionAddress to test.
+
+    @return TRUE when the offset is an instruction boundary; otherwise, FALSE.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+BOOLEAN
+IsInstructionBoundary (
+    _In_ PVOID FunctionAddress,
+    _In_ ULONG Offset
+    )
+{
+    ULONG position;
+
+    for (position = 0; position < Offset; /**/)
+    {
+        INSTRUCTION_INFO instruction;
+
+        if (DecodeInstruction(Add2Ptr(FunctionAddress, position),
+                              &instruction) == FALSE)
+        {
+            LOGGING_LOG_ERROR("Undecodable instruction at %p",
+                              Add2Ptr(FunctionAddress, position));
+            break;
+        }
+        position += instruction.Length;
+    }
+    return (position == Offset);
+}
+
+/*!
+    @brief Creates the entry stub of the hook point for the registration entry.
+
+    @param[in] Registration - The registration entry of the hook point.
+
+    @param[in] FunctionAddress - The start address of the function to install
+        the hook point.
+
+    @param[out] HookAddress - The address to receive the address to install the
+        hook point.
+
+    @param[out] EntryStub - The address to receive the address of the entry
+        stub. Must be freed with ExFreePoolWithTag.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_Use_decl_annotations_
+NTSTATUS
+CreateHookPointStub (
+    PHOOK_REGISTRATION_ENTRY Registration,
+    PVOID FunctionAddress,
+    PVOID* HookAddress,
+    PVOID* EntryStub
+    )
+{
+    NTSTATUS status;
+    PHOOK_POINT_STUB stub;
+
+    NT_ASSERT(Registration->HookPointHandler != nullptr);
+
+    *HookAddress = nullptr;
+    *EntryStub = nullptr;
+
+    if (IsInstructionBoundary(FunctionAddress, Registration->Offset) == FALSE)
+    {
+        LOGGING_LOG_ERROR("Offset %lx is not an instruction boundary of %wZ",
+                          Registration->Offset,
+                          &Registration->FunctionName);
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+#pragma prefast(suppress : 30030, "Intentionally executable")
+    stub = static_cast<PHOOK_POINT_STUB>(ExAllocatePoolWithTag(
+                                                NonPagedPoolExecute,
+                                                sizeof(*stub),
+                                                k_PoolTag));
+    if (stub == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu", sizeof(*stub));
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    *stub = {
+        {
+            0xff, 0x35, 0x06, 0x00, 0x00, 0x00,
+        },
+        {
+            0xff, 0x25, 0x08, 0x00, 0x00, 0x00,
+        },
+        Registration,
+        reinterpret_cast<PVOID>(SvHookPointDispatcher),
+    };
+
+    status = STATUS_SUCCESS;
+    *HookAddress = Add2Ptr(FunctionAddress, Registration->Offset);
+    *EntryStub = stub;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Executes the handler of the hook point.
+
+    @details This function is called from SvHookPointDispatcher.
+
+    @param[in,out] Frame - The registers saved by SvHookPointDispatcher.
+ */
+EXTERN_C
+_IRQL_requires_same_
+VOID
+NTAPI
+HandleHookPoint (
+    _Inout_ PHOOK_POINT_FRAME Frame
+    )
+{
+    const HOOK_REGISTRATION_ENTRY* registration;
+    PHOOK_POINT_HANDLER handler;
+
+    registration = static_cast<const HOOK_REGISTRATION_ENTRY*>(
+                                        Frame->RegistrationOrContinuation);
+    handler = reinterpret_cast<PHOOK_POINT_HANDLER>(registration->HookPointHandler);
+
+    //
+    // The stack pointer at the hook point is right above the frame.
+    //
+    Frame->Context.Rsp = reinterpret_cast<ULONG64>(Frame + 1);
+
+    handler(&Frame->Context, registration);
+
+    Frame->RegistrationOrContinuation = registration->HookEntry.OriginalCallStub;
+}
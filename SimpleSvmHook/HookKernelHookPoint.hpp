@@ -0,0 +1,101 @@
+/*!
+    @file HookKernelHookPoint.hpp
+
+    @brief Kernel mode code to hook an arbitrary instruction in a function.
+
+    @details A hook point is a hook installed at an instruction boundary inside
+        an NT-kernel exported function instead of its entry. Its handler does
+        not take arguments of the function; instead, it receives the general
+        purpose registers and RFLAGS at the hook point, and may modify them.
+        Once the handler returns, the registers are restored from the context
+        and execution continues with a relocated copy of the hooked
+        instruction, followed by a jump to the next instruction.
+
+        A hook point is registered in g_HookRegistrationEntries with
+        HOOK_REGISTRATION_ENTRY_FOR_HOOK_POINT, or with the hook manifest and
+        HandleProbeHookPoint.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "HookCommon.hpp"
+
+//
+// The registers at the hook point. The layout of general purpose registers
+// matches with that of GUEST_REGISTERS.
+//
+typedef struct _HOOK_REGISTER_CONTEXT
+{
+    ULONG64 R15;
+    ULONG64 R14;
+    ULONG64 R13;
+    ULONG64 R12;
+    ULONG64 R11;
+    ULONG64 R10;
+    ULONG64 R9;
+    ULONG64 R8;
+    ULONG64 Rdi;
+    ULONG64 Rsi;
+    ULONG64 Rbp;
+
+    //
+    // The stack pointer at the hook point. This is read-only; changes made by
+    // the handler are ignored.
+    //
+    ULONG64 Rsp;
+    ULONG64 Rbx;
+    ULONG64 Rdx;
+    ULONG64 Rcx;
+    ULONG64 Rax;
+    ULONG64 Rflags;
+} HOOK_REGISTER_CONTEXT, *PHOOK_REGISTER_CONTEXT;
+
+//
+// A handler executed when the hook point is executed. It is executed at the
+// IRQL the hook point is executed, on the stack of the thread, and must not
+// change IF in Rflags. The address of the hook point is
+// Registration->HookEntry.HookAddress.
+//
+typedef
+_IRQL_requires_same_
+VOID
+HOOK_POINT_HANDLER (
+    _Inout_ PHOOK_REGISTER_CONTEXT Context,
+    _In_ const HOOK_REGISTRATION_ENTRY* Registration
+    );
+typedef HOOK_POINT_HANDLER *PHOOK_POINT_HANDLER;
+
+/*!
+    @brief Expands to the initializer of HOOK_REGISTRATION_ENTRY for a hook
+        point.
+
+    @param[in] FunctionName - The wide string literal of the NT-kernel exported
+        function to install the hook point.
+
+    @param[in] Offset - The offset in bytes from the start of the function to
+        install the hook point. Must be an instruction boundary.
+
+    @param[in] Handler - The HOOK_POINT_HANDLER to execute.
+ */
+#define HOOK_REGISTRATION_ENTRY_FOR_HOOK_POINT(FunctionName, Offset, Handler) \
+    { \
+        RTL_CONSTANT_STRING(FunctionName), \
+        nullptr, \
+        nullptr, \
+        nullptr, \
+        (Offset), \
+        (Handler), \
+    }
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+NTSTATUS
+CreateHookPointStub (
+    _In_ PHOOK_REGISTRATION_ENTRY Registration,
+    _In_ PVOID FunctionAddress,
+    _Outptr_result_nullonfailure_ PVOID* HookAddress,
+    _Outptr_result_nullonfailure_ PVOID* EntryStub
+    );
@@ -0,0 +1,486 @@
+/*!
+    @file HookKernelIntegrity.cpp
+
+    @brief Kernel mode code to verify integrity of hooks in background.
+
+    @details AreAllHooksInvisible only tests the first byte of each hook once
+        at load. The verifier is a low priority system thread that keeps
+        testing that 1) each exec page and its copies on NUMA nodes are
+        identical to the original page except for the break points at the
+        hook offsets, and 2) the NPT
+        entries of all hooked pages hold the expected page frame numbers and
+        NX bits on every processor.
+
+        The verification is split into work items; one for each hooked page,
+        followed by one for each processor. Every Interval milliseconds, the
+        thread processes work items until Budget microseconds elapse, and
+        resumes from the next item on the next wake up. Differences found in
+        a complete pass are reported in the log.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelIntegrity.hpp"
+#include "Common.hpp"
+#include "HookCommon.hpp"
+
+//
+// The state of the verifier.
+//
+typedef struct _HOOK_INTEGRITY_VERIFIER
+{
+    HANDLE ThreadHandle;
+    KEVENT StopEvent;
+    LARGE_INTEGER Interval;
+
+    //
+    // The maximum time spent for each verification in the performance counter
+    // ticks. The interrupt time is not used as its resolution (the clock tick,
+    // typically 15.6ms) is far coarser than the budget.
+    //
+    ULONG64 Budget;
+
+    //
+    // The index of the next work item to process.
+    //
+    ULONG NextItem;
+
+    //
+    // The numbers of unexpected bytes in exec pages and unexpected NPT entries
+    // found in the current pass.
+    //
+    ULONG PageDifferenceCount;
+    ULONG NptMismatchCount;
+
+    //
+    // The statistics reported when the verifier is stopped.
+    //
+    ULONG64 PassCount;
+    ULONG64 FailedPassCount;
+} HOOK_INTEGRITY_VERIFIER, *PHOOK_INTEGRITY_VERIFIER;
+
+static HOOK_INTEGRITY_VERIFIER g_HookIntegrityVerifier;
+
+static KSTART_ROUTINE HookIntegrityVerifierThreadRoutine;
+
+/*!
+    @brief Tests whether the difference between the original and exec pages
+        is the break point of a hook.
+
+    @param[in] PhyPageBase - The physical address of the hooked page.
+
+    @param[in] Offset - The offset of the byte differs.
+
+    @param[in] ExecPage - The address of the exec page.
+
+    @return TRUE when a hook is installed at the offset; otherwise, FALSE.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+BOOLEAN
+IsHookOffset (
+    _In_ ULONG64 PhyPageBase,
+    _In_ ULONG Offset,
+    _In_ PCUCHAR ExecPage
+    )
+{
+    PAGED_CODE();
+
+    if (ExecPage[Offset] != 0xcc)
+    {
+        return FALSE;
+    }
+
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        if ((registration.HookEntry.PhyPageBase == PhyPageBase) &&
+            (BYTE_OFFSET(registration.HookEntry.HookAddress) == Offset))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*!
+    @brief Compares the original page with an exec page.
+
+    @details The pages are compared 16 bytes at a time with SSE2, which is
+        usable in kernel-mode without saving the extended processor state, and
+        only blocks containing differences are inspected byte by byte.
+
+    @param[in] HookEntry - The hook on the page to verify.
+
+    @param[in] ExecPage - The exec page or its copy to compare.
+
+    @return The number of bytes differ other than at the hook offsets, plus
+        the number of hooks on the page whose break point is missing.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+ULONG
+CompareExecPage (
+    _In_ const HOOK_ENTRY* HookEntry,
+    _In_ PCVOID ExecPage
+    )
+{
+    ULONG differenceCount;
+    PCUCHAR originalPage, execPage;
+    __m128i originalBlock, execBlock;
+    ULONG equalMask;
+
+    PAGED_CODE();
+
+    differenceCount = 0;
+    originalPage = static_cast<PCUCHAR>(PAGE_ALIGN(HookEntry->HookAddress));
+    execPage = static_cast<PCUCHAR>(ExecPage);
+
+    for (ULONG offset = 0; offset < PAGE_SIZE; offset += sizeof(__m128i))
+    {
+        originalBlock = _mm_load_si128(
+                reinterpret_cast<const __m128i*>(originalPage + offset));
+        execBlock = _mm_load_si128(
+                reinterpret_cast<const __m128i*>(execPage + offset));
+        equalMask = static_cast<ULONG>(_mm_movemask_epi8(
+                                _mm_cmpeq_epi8(originalBlock, execBlock)));
+        if (equalMask == 0xffff)
+        {
+            continue;
+        }
+
+        for (ULONG i = 0; i < sizeof(__m128i); ++i)
+        {
+            if ((!BooleanFlagOn(equalMask, 1UL << i)) &&
+                (IsHookOffset(HookEntry->PhyPageBase,
+                              offset + i,
+                              execPage) == FALSE))
+            {
+                differenceCount++;
+            }
+        }
+    }
+
+    //
+    // Differences at the hook offsets are expected, but their absence is not
+    // detected above.
+    //
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        if ((registration.HookEntry.PhyPageBase == HookEntry->PhyPageBase) &&
+            (execPage[BYTE_OFFSET(registration.HookEntry.HookAddress)] != 0xcc))
+        {
+            differenceCount++;
+        }
+    }
+    return differenceCount;
+}
+
+/*!
+    @brief Compares the original page with the exec page and its copies.
+
+    @param[in] HookEntry - The hook on the page to verify.
+
+    @return The total number of differences found by CompareExecPage.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+ULONG
+CompareHookedPage (
+    _In_ const HOOK_ENTRY* HookEntry
+    )
+{
+    ULONG differenceCount;
+
+    PAGED_CODE();
+
+    differenceCount = CompareExecPage(HookEntry, HookEntry->PageBaseForExecution);
+    for (auto execPage : HookEntry->PageBasesForExecution)
+    {
+        if (execPage != HookEntry->PageBaseForExecution)
+        {
+            differenceCount += CompareExecPage(HookEntry, execPage);
+        }
+    }
+    return differenceCount;
+}
+
+/*!
+    @brief Asks the hypervisor on the processor to verify its NPT entries.
+
+    @param[in] ProcessorIndex - The index of the processor to verify.
+
+    @return The number of unexpected NPT entries. Zero when the processor is
+        not virtualized.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+ULONG
+VerifyProcessor (
+    _In_ ULONG ProcessorIndex
+    )
+{
+    NTSTATUS status;
+    PROCESSOR_NUMBER processorNumber;
+    GROUP_AFFINITY affinity, oldAffinity;
+    int registers[4];   // EAX, EBX, ECX, and EDX
+    ULONG mismatchCount;
+
+    PAGED_CODE();
+
+    mismatchCount = 0;
+
+    status = KeGetProcessorNumberFromIndex(ProcessorIndex, &processorNumber);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    affinity.Group = processorNumber.Group;
+    affinity.Mask = 1ULL << processorNumber.Number;
+    affinity.Reserved[0] = affinity.Reserved[1] = affinity.Reserved[2] = 0;
+    KeSetSystemGroupAffinityThread(&affinity, &oldAffinity);
+
+    //
+    // ECX is 'MVSS' when the hypervisor handled the request. Otherwise, the
+    // processor is not virtualized, for example, during resume from sleep.
+    //
+    __cpuidex(registers, CPUID_LEAF_SIMPLE_SVM_CALL, CPUID_SUBLEAF_VERIFY_HOOKS);
+    if (static_cast<ULONG>(registers[2]) == k_PoolTag)
+    {
+        mismatchCount = static_cast<ULONG>(registers[0]) +
+                        static_cast<ULONG>(registers[1]);
+    }
+
+    KeRevertToUserGroupAffinityThread(&oldAffinity);
+
+Exit:
+    return mismatchCount;
+}
+
+/*!
+    @brief Processes work items until the budget is exhausted or a pass
+        completes.
+
+    @param[in,out] Verifier - The state of the verifier.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+VerifyHookIntegrity (
+    _Inout_ PHOOK_INTEGRITY_VERIFIER Verifier
+    )
+{
+    ULONG64 startTime;
+    ULONG itemCount;
+    ULONG item;
+    BOOLEAN duplicated;
+
+    PAGED_CODE();
+
+    startTime = static_cast<ULONG64>(KeQueryPerformanceCounter(nullptr).QuadPart);
+    itemCount = g_HookRegistrationEntryCount +
+                KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    do
+    {
+        item = Verifier->NextItem;
+        if (item < g_HookRegistrationEntryCount)
+        {
+            //
+            // Verify each hooked page only once. Hooks on the same page share
+            // the exec page.
+            //
+            duplicated = FALSE;
+            for (ULONG i = 0; i < item; ++i)
+            {
+                if (g_HookRegistrationEntries[i].HookEntry.PhyPageBase ==
+                    g_HookRegistrationEntries[item].HookEntry.PhyPageBase)
+                {
+                    duplicated = TRUE;
+                    break;
+                }
+            }
+            if (duplicated == FALSE)
+            {
+                Verifier->PageDifferenceCount += CompareHookedPage(
+                                    &g_HookRegistrationEntries[item].HookEntry);
+            }
+        }
+        else
+        {
+            Verifier->NptMismatchCount += VerifyProcessor(
+                                        item - g_HookRegistrationEntryCount);
+        }
+
+        Verifier->NextItem++;
+        if (Verifier->NextItem < itemCount)
+        {
+            continue;
+        }
+
+        //
+        // A pass completed. Report the result and start over.
+        //
+        if ((Verifier->PageDifferenceCount != 0) ||
+            (Verifier->NptMismatchCount != 0))
+        {
+            LOGGING_LOG_WARN("Hook integrity violated : %lu bytes in exec pages, "
+                             "%lu NPT entries",
+                             Verifier->PageDifferenceCount,
+                             Verifier->NptMismatchCount);
+            Verifier->FailedPassCount++;
+        }
+        Verifier->PassCount++;
+        Verifier->NextItem = 0;
+        Verifier->PageDifferenceCount = 0;
+        Verifier->NptMismatchCount = 0;
+        break;
+    } while ((static_cast<ULONG64>(KeQueryPerformanceCounter(nullptr).QuadPart) -
+              startTime) < Verifier->Budget);
+}
+
+/*!
+    @brief The entry point of the verifier thread.
+
+    @param[in] StartContext - The state of the verifier.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_Use_decl_annotations_
+VOID
+HookIntegrityVerifierThreadRoutine (
+    PVOID StartContext
+    )
+{
+    NTSTATUS status;
+    PHOOK_INTEGRITY_VERIFIER verifier;
+
+    PAGED_CODE();
+
+    verifier = static_cast<PHOOK_INTEGRITY_VERIFIER>(StartContext);
+    (VOID)KeSetPriorityThread(KeGetCurrentThread(), LOW_PRIORITY + 1);
+
+    for (;;)
+    {
+        status = KeWaitForSingleObject(&verifier->StopEvent,
+                                       Executive,
+                                       KernelMode,
+                                       FALSE,
+                                       &verifier->Interval);
+        if (status != STATUS_TIMEOUT)
+        {
+            break;
+        }
+        VerifyHookIntegrity(verifier);
+    }
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/*!
+    @brief Starts the verifier thread.
+
+    @details This function must be called after all processors are
+        virtualized.
+
+    @param[in] Interval - The interval of verification in milliseconds. Zero
+        disables the verifier.
+
+    @param[in] Budget - The maximum time spent for each verification in
+        microseconds. At least one work item is processed regardless.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+StartHookIntegrityVerifier (
+    ULONG Interval,
+    ULONG Budget
+    )
+{
+    NTSTATUS status;
+    LARGE_INTEGER frequency;
+
+    PAGED_CODE();
+
+    NT_ASSERT(g_HookIntegrityVerifier.ThreadHandle == nullptr);
+
+    if (Interval == 0)
+    {
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+
+    RtlZeroMemory(&g_HookIntegrityVerifier, sizeof(g_HookIntegrityVerifier));
+    KeInitializeEvent(&g_HookIntegrityVerifier.StopEvent,
+                      NotificationEvent,
+                      FALSE);
+    g_HookIntegrityVerifier.Interval.QuadPart = -10000LL * Interval;
+    (VOID)KeQueryPerformanceCounter(&frequency);
+    g_HookIntegrityVerifier.Budget = static_cast<ULONG64>(Budget) *
+                                     static_cast<ULONG64>(frequency.QuadPart) /
+                                     1000000;
+
+    status = PsCreateSystemThread(&g_HookIntegrityVerifier.ThreadHandle,
+                                  THREAD_ALL_ACCESS,
+                                  nullptr,
+                                  nullptr,
+                                  nullptr,
+                                  HookIntegrityVerifierThreadRoutine,
+                                  &g_HookIntegrityVerifier);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("PsCreateSystemThread failed : %08x", status);
+        g_HookIntegrityVerifier.ThreadHandle = nullptr;
+    }
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Stops the verifier thread if started, and reports the statistics.
+
+    @details This function must be called before processors are
+        de-virtualized.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+StopHookIntegrityVerifier (
+    VOID
+    )
+{
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    if (g_HookIntegrityVerifier.ThreadHandle == nullptr)
+    {
+        goto Exit;
+    }
+
+    (VOID)KeSetEvent(&g_HookIntegrityVerifier.StopEvent, IO_NO_INCREMENT, FALSE);
+    status = ZwWaitForSingleObject(g_HookIntegrityVerifier.ThreadHandle,
+                                   FALSE,
+                                   nullptr);
+    NT_ASSERT(NT_SUCCESS(status));
+    NT_VERIFY(NT_SUCCESS(ZwClose(g_HookIntegrityVerifier.ThreadHandle)));
+    g_HookIntegrityVerifier.ThreadHandle = nullptr;
+
+    LOGGING_LOG_INFO("Hook integrity verification : %llu passes, %llu failed",
+                     g_HookIntegrityVerifier.PassCount,
+                     g_HookIntegrityVerifier.FailedPassCount);
+
+Exit:
+    return;
+}
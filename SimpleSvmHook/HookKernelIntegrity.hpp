@@ -0,0 +1,27 @@
+/*!
+    @file HookKernelIntegrity.hpp
+
+    @brief Kernel mode code to verify integrity of hooks in background.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+StartHookIntegrityVerifier (
+    _In_ ULONG Interval,
+    _In_ ULONG Budget
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+StopHookIntegrityVerifier (
+    VOID
+    );
@@ -0,0 +1,599 @@
+/*!
+    @file HookKernelManifest.cpp
+
+    @brief Kernel mode code to load hooks from the hook manifest.
+
+    @details When the HookManifest value exists under the service key, the
+        entries of g_HookRegistrationEntries are replaced with the hooks
+        described in it, so that a new set of hooks can be deployed without
+        rebuilding the driver. The manifest is a binary blob generated by
+        HookManifestCompiler (see HookManifestFormat.hpp), and is validated in
+        a single pass over the entries without parsing text. Names of
+        functions in g_HookRegistrationEntries point to the copy of the
+        manifest kept until the driver is unloaded.
+
+        The manifest can only bind hooks to handlers compiled into the driver.
+        Function handlers are typed for a specific function, and can only hook
+        that function. The probe handler can hook any instruction boundary of
+        any function, and reports the argument registers to subscribers.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelManifest.hpp"
+#include "Common.hpp"
+#include "HookCommon.hpp"
+#include "HookManifestFormat.hpp"
+#include "HookKernelHandlers.hpp"
+#include "HookKernelHookPoint.hpp"
+
+static_assert(k_HookManifestMaxEntryCount == k_MaxHookRegistrationEntries,
+              "Size check");
+
+//
+// The name of the registry value holding the manifest.
+//
+static constexpr WCHAR k_HookManifestValueName[] = L"HookManifest";
+
+//
+// The handler bound to HOOK_MANIFEST_HANDLER_ID.
+//
+typedef struct _HOOK_MANIFEST_HANDLER_BINDING
+{
+    //
+    // The name of the function the handler is written for, and the number of
+    // its arguments. FunctionName is NULL for the hook point handler.
+    //
+    PCWSTR FunctionName;
+    ULONG ArgumentCount;
+
+    //
+    // The values set to HOOK_REGISTRATION_ENTRY.
+    //
+    PVOID Handler;
+    PHOOK_THUNK_DATA ThunkData;
+    PVOID HookPointHandler;
+} HOOK_MANIFEST_HANDLER_BINDING, *PHOOK_MANIFEST_HANDLER_BINDING;
+
+//
+// The handlers indexed by HOOK_MANIFEST_HANDLER_ID.
+//
+static const HOOK_MANIFEST_HANDLER_BINDING k_HookManifestHandlers[] =
+{
+    {
+        L"ZwQuerySystemInformation",
+        4,
+        HandleZwQuerySystemInformation,
+        nullptr,
+        nullptr,
+    },
+    {
+        L"ExAllocatePoolWithTag",
+        3,
+        HandleExAllocatePoolWithTag,
+        nullptr,
+        nullptr,
+    },
+    {
+        L"ExFreePoolWithTag",
+        2,
+        HandleExFreePoolWithTag,
+        nullptr,
+        nullptr,
+    },
+    {
+        ExFreePoolHook::Target::Name,
+        1,
+        ExFreePoolHook::Handler,
+        &ExFreePoolHook::Data,
+        nullptr,
+    },
+    {
+        nullptr,
+        0,
+        nullptr,
+        nullptr,
+        HandleProbeHookPoint,
+    },
+};
+static_assert(RTL_NUMBER_OF(k_HookManifestHandlers) == HookManifestHandlerMax,
+              "Size check");
+
+//
+// The copy of the manifest referenced from g_HookRegistrationEntries, or NULL
+// when the manifest is not configured.
+//
+static PHOOK_MANIFEST_HEADER g_HookManifest;
+
+/*!
+    @brief Returns the name of the function of the manifest entry.
+
+    @param[in] Entry - The manifest entry.
+
+    @param[out] Name - The address to receive the name. Buffer points to the
+        inside of the manifest.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GetHookManifestEntryName (
+    _In_ const HOOK_MANIFEST_ENTRY* Entry,
+    _Out_ PUNICODE_STRING Name
+    )
+{
+    Name->Buffer = reinterpret_cast<PWCH>(const_cast<PHOOK_MANIFEST_ENTRY>(Entry + 1));
+    Name->Length = Entry->NameLength;
+    Name->MaximumLength = Entry->NameLength;
+}
+
+/*!
+    @brief Reads the manifest from the service key.
+
+    @param[in] RegistryPath - The path to the service key.
+
+    @param[out] Manifest - The address to receive the copy of the manifest
+        allocated from the non-paged pool. Must be freed with
+        ExFreePoolWithTag.
+
+    @param[out] ManifestSize - The address to receive the size of the manifest
+        in bytes.
+
+    @return STATUS_SUCCESS on success; STATUS_OBJECT_NAME_NOT_FOUND when the
+        manifest is not configured; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+ReadHookManifest (
+    _In_ PCUNICODE_STRING RegistryPath,
+    _Outptr_result_nullonfailure_ PHOOK_MANIFEST_HEADER* Manifest,
+    _Out_ PULONG ManifestSize
+    )
+{
+    NTSTATUS status;
+    OBJECT_ATTRIBUTES objectAttributes;
+    HANDLE keyHandle;
+    UNICODE_STRING valueName;
+    KEY_VALUE_PARTIAL_INFORMATION sizeInformation;
+    PKEY_VALUE_PARTIAL_INFORMATION information;
+    ULONG resultLength;
+    PHOOK_MANIFEST_HEADER manifest;
+
+    PAGED_CODE();
+
+    *Manifest = nullptr;
+    *ManifestSize = 0;
+
+    keyHandle = nullptr;
+    information = nullptr;
+
+    InitializeObjectAttributes(&objectAttributes,
+                               const_cast<PUNICODE_STRING>(RegistryPath),
+                               OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                               nullptr,
+                               nullptr);
+    status = ZwOpenKey(&keyHandle, KEY_QUERY_VALUE, &objectAttributes);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ZwOpenKey failed : %08x", status);
+        goto Exit;
+    }
+
+    //
+    // Get the size of the value first. Type and DataLength are returned even
+    // when the buffer is too small for the data.
+    //
+    RtlInitUnicodeString(&valueName, k_HookManifestValueName);
+    status = ZwQueryValueKey(keyHandle,
+                             &valueName,
+                             KeyValuePartialInformation,
+                             &sizeInformation,
+                             sizeof(sizeInformation),
+                             &resultLength);
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+    {
+        goto Exit;
+    }
+    if ((status != STATUS_BUFFER_OVERFLOW) && !NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ZwQueryValueKey failed : %08x", status);
+        goto Exit;
+    }
+    if ((sizeInformation.Type != REG_BINARY) ||
+        (sizeInformation.DataLength > k_HookManifestMaxSize))
+    {
+        LOGGING_LOG_ERROR("Unsupported manifest value : type %lu, %lu bytes",
+                          sizeInformation.Type,
+                          sizeInformation.DataLength);
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    information = static_cast<PKEY_VALUE_PARTIAL_INFORMATION>(
+                                        ExAllocatePoolWithTag(PagedPool,
+                                                              resultLength,
+                                                              k_PoolTag));
+    if (information == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %lu", resultLength);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    status = ZwQueryValueKey(keyHandle,
+                             &valueName,
+                             KeyValuePartialInformation,
+                             information,
+                             resultLength,
+                             &resultLength);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ZwQueryValueKey failed : %08x", status);
+        goto Exit;
+    }
+    if ((information->Type != REG_BINARY) ||
+        (information->DataLength > k_HookManifestMaxSize))
+    {
+        LOGGING_LOG_ERROR("Manifest value changed while being read");
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    //
+    // Copy the data into the non-paged pool. The copy is naturally aligned
+    // unlike Data, and referenced from hook handlers at any IRQL.
+    //
+    manifest = static_cast<PHOOK_MANIFEST_HEADER>(ExAllocatePoolWithTag(
+                                                    NonPagedPool,
+                                                    max(information->DataLength, 1),
+                                                    k_PoolTag));
+    if (manifest == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %lu",
+                          information->DataLength);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlCopyMemory(manifest, information->Data, information->DataLength);
+
+    status = STATUS_SUCCESS;
+    *Manifest = manifest;
+    *ManifestSize = information->DataLength;
+
+Exit:
+    if (information != nullptr)
+    {
+        ExFreePoolWithTag(information, k_PoolTag);
+    }
+    if (keyHandle != nullptr)
+    {
+        NT_VERIFY(NT_SUCCESS(ZwClose(keyHandle)));
+    }
+    return status;
+}
+
+/*!
+    @brief Validates a manifest entry against the handler it is bound to.
+
+    @param[in] Entry - The structurally valid manifest entry to validate.
+
+    @param[in,out] UsedHandlers - The bitmap of function handlers bound by
+        preceding entries. Updated when the entry binds a function handler.
+
+    @return TRUE when the entry can be installed; otherwise, FALSE.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+BOOLEAN
+IsHookManifestEntryBindable (
+    _In_ const HOOK_MANIFEST_ENTRY* Entry,
+    _Inout_ PULONG UsedHandlers
+    )
+{
+    BOOLEAN bindable;
+    const HOOK_MANIFEST_HANDLER_BINDING* binding;
+    UNICODE_STRING name;
+    UNICODE_STRING expectedName;
+
+    PAGED_CODE();
+
+    bindable = FALSE;
+    binding = &k_HookManifestHandlers[Entry->Handler];
+
+    if (Entry->Mode == HookManifestModeFunction)
+    {
+        //
+        // A function handler calls the original function with its own
+        // prototype. Binding it to any other function, or to the same function
+        // twice, would corrupt the call.
+        //
+        if ((binding->FunctionName == nullptr) ||
+            (Entry->Offset != 0) ||
+            (Entry->ArgumentCount != binding->ArgumentCount) ||
+            BooleanFlagOn(*UsedHandlers, 1UL << Entry->Handler))
+        {
+            goto Exit;
+        }
+
+        GetHookManifestEntryName(Entry, &name);
+        RtlInitUnicodeString(&expectedName, binding->FunctionName);
+        if (RtlEqualUnicodeString(&name, &expectedName, FALSE) == FALSE)
+        {
+            goto Exit;
+        }
+        SetFlag(*UsedHandlers, 1UL << Entry->Handler);
+    }
+    else
+    {
+        //
+        // The return address and arguments on the stack are only known at the
+        // start of the function.
+        //
+        if ((binding->HookPointHandler == nullptr) ||
+            ((Entry->Offset != 0) &&
+             ((Entry->ArgumentCount > 4) ||
+              BooleanFlagOn(Entry->Filters, k_HookManifestFilterCallerOutsideImage))))
+        {
+            goto Exit;
+        }
+    }
+
+    bindable = TRUE;
+
+Exit:
+    return bindable;
+}
+
+/*!
+    @brief Validates the manifest.
+
+    @details This function visits each entry once and does not dereference
+        outside of the manifest. Entries are not checked for duplicates; the
+        compiler rejects them.
+
+    @param[in] Manifest - The manifest to validate.
+
+    @param[in] ManifestSize - The size of the manifest in bytes.
+
+    @return STATUS_SUCCESS when the manifest is valid; otherwise, an
+        appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+ValidateHookManifest (
+    _In_ const HOOK_MANIFEST_HEADER* Manifest,
+    _In_ ULONG ManifestSize
+    )
+{
+    NTSTATUS status;
+    ULONG position;
+    ULONG usedHandlers;
+
+    PAGED_CODE();
+
+    status = STATUS_INVALID_PARAMETER;
+
+    if (ManifestSize < sizeof(*Manifest))
+    {
+        LOGGING_LOG_ERROR("Manifest is too small : %lu", ManifestSize);
+        goto Exit;
+    }
+
+    if ((Manifest->Signature != k_HookManifestSignature) ||
+        (Manifest->Version != k_HookManifestVersion))
+    {
+        LOGGING_LOG_ERROR("Unsupported manifest : %08x, version %u",
+                          Manifest->Signature,
+                          Manifest->Version);
+        goto Exit;
+    }
+
+    if ((Manifest->TotalSize != ManifestSize) ||
+        (Manifest->EntryCount == 0) ||
+        (Manifest->EntryCount > k_MaxHookRegistrationEntries))
+    {
+        LOGGING_LOG_ERROR("Malformed manifest : %lu bytes, %u entries",
+                          Manifest->TotalSize,
+                          Manifest->EntryCount);
+        goto Exit;
+    }
+
+    if (ComputeHookManifestChecksum(reinterpret_cast<const UINT8*>(Manifest + 1),
+                                    ManifestSize - sizeof(*Manifest)) !=
+        Manifest->Checksum)
+    {
+        LOGGING_LOG_ERROR("Manifest checksum mismatch");
+        goto Exit;
+    }
+
+    usedHandlers = 0;
+    position = sizeof(*Manifest);
+    for (ULONG i = 0; i < Manifest->EntryCount; ++i)
+    {
+        const HOOK_MANIFEST_ENTRY* entry;
+
+        if ((ManifestSize - position) < sizeof(*entry))
+        {
+            LOGGING_LOG_ERROR("Manifest entry %lu is truncated", i);
+            goto Exit;
+        }
+
+        entry = static_cast<const HOOK_MANIFEST_ENTRY*>(Add2Ptr(Manifest, position));
+        if ((entry->EntrySize > (ManifestSize - position)) ||
+            (entry->EntrySize < (sizeof(*entry) + entry->NameLength)) ||
+            ((entry->EntrySize % k_HookManifestEntryAlignment) != 0) ||
+            (entry->NameLength == 0) ||
+            (entry->NameLength > k_HookManifestMaxNameLength) ||
+            ((entry->NameLength % sizeof(WCHAR)) != 0))
+        {
+            LOGGING_LOG_ERROR("Manifest entry %lu is malformed", i);
+            goto Exit;
+        }
+
+        if ((entry->Handler >= HookManifestHandlerMax) ||
+            (entry->Mode >= HookManifestModeMax) ||
+            (entry->ArgumentCount > k_HookManifestMaxArgumentCount) ||
+            ((entry->Filters & ~k_HookManifestFilterAll) != 0) ||
+            (IsHookManifestEntryBindable(entry, &usedHandlers) == FALSE))
+        {
+            LOGGING_LOG_ERROR("Manifest entry %lu is invalid : handler %u, mode %u",
+                              i,
+                              entry->Handler,
+                              entry->Mode);
+            goto Exit;
+        }
+
+        position += entry->EntrySize;
+    }
+
+    if (position != ManifestSize)
+    {
+        LOGGING_LOG_ERROR("Manifest has %lu trailing bytes",
+                          ManifestSize - position);
+        goto Exit;
+    }
+
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Replaces g_HookRegistrationEntries with the entries of the manifest.
+
+    @param[in] Manifest - The validated manifest. Must outlive hooks.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+ApplyHookManifest (
+    _In_ const HOOK_MANIFEST_HEADER* Manifest
+    )
+{
+    ULONG position;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(g_HookRegistrationEntries, sizeof(g_HookRegistrationEntries));
+
+    position = sizeof(*Manifest);
+    for (ULONG i = 0; i < Manifest->EntryCount; ++i)
+    {
+        const HOOK_MANIFEST_ENTRY* entry;
+        const HOOK_MANIFEST_HANDLER_BINDING* binding;
+        PHOOK_REGISTRATION_ENTRY registration;
+
+        entry = static_cast<const HOOK_MANIFEST_ENTRY*>(Add2Ptr(Manifest, position));
+        binding = &k_HookManifestHandlers[entry->Handler];
+        registration = &g_HookRegistrationEntries[i];
+
+        GetHookManifestEntryName(entry, &registration->FunctionName);
+        registration->Handler = binding->Handler;
+        registration->ThunkData = binding->ThunkData;
+        registration->Offset = entry->Offset;
+        registration->HookPointHandler = binding->HookPointHandler;
+        registration->ArgumentCount = entry->ArgumentCount;
+        registration->Filters = entry->Filters;
+        registration->SamplingInterval = entry->SamplingInterval;
+
+        LOGGING_LOG_INFO("Manifest: %wZ+%lx, handler %u, filters %lx, sampling %lu",
+                         &registration->FunctionName,
+                         registration->Offset,
+                         entry->Handler,
+                         registration->Filters,
+                         registration->SamplingInterval);
+
+        position += entry->EntrySize;
+    }
+    g_HookRegistrationEntryCount = Manifest->EntryCount;
+}
+
+/*!
+    @brief Replaces the hooks compiled in with the ones in the hook manifest
+        if it is configured.
+
+    @details This function must be called before hooks are installed. An
+        invalid manifest is an error rather than being ignored, so that the
+        driver does not silently run with an unexpected set of hooks.
+
+    @param[in] RegistryPath - The path to the service key of the driver.
+
+    @return STATUS_SUCCESS when the manifest is loaded or not configured;
+        otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+LoadHookManifest (
+    PCUNICODE_STRING RegistryPath
+    )
+{
+    NTSTATUS status;
+    PHOOK_MANIFEST_HEADER manifest;
+    ULONG manifestSize;
+
+    PAGED_CODE();
+
+    NT_ASSERT(g_HookManifest == nullptr);
+
+    status = ReadHookManifest(RegistryPath, &manifest, &manifestSize);
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+    {
+        LOGGING_LOG_INFO("No hook manifest. Using the built-in hooks.");
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ReadHookManifest failed : %08x", status);
+        goto Exit;
+    }
+
+    status = ValidateHookManifest(manifest, manifestSize);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ValidateHookManifest failed : %08x", status);
+        ExFreePoolWithTag(manifest, k_PoolTag);
+        goto Exit;
+    }
+
+    ApplyHookManifest(manifest);
+    g_HookManifest = manifest;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Frees the hook manifest.
+
+    @details This function must be called after hooks are uninstalled.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+UnloadHookManifest (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    if (g_HookManifest == nullptr)
+    {
+        return;
+    }
+
+    g_HookRegistrationEntryCount = 0;
+    ExFreePoolWithTag(g_HookManifest, k_PoolTag);
+    g_HookManifest = nullptr;
+}
@@ -0,0 +1,26 @@
+/*!
+    @file HookKernelManifest.hpp
+
+    @brief Kernel mode code to load hooks from the hook manifest.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+LoadHookManifest (
+    _In_ PCUNICODE_STRING RegistryPath
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+UnloadHookManifest (
+    VOID
+    );
@@ -0,0 +1,560 @@
+/*!
+    @file HookKernelMmioWorkingSet.cpp
+
+    @brief Kernel mode code to persist MMIO pages mapped on NPT fault and to
+        map them when the NPT is built.
+
+    @details The NPT only covers physical memory ranges and the APIC page when
+        it is built, and each MMIO page gets its entry on the first NPT fault
+        on each processor. Each of those faults also consumes a pre-allocated
+        NPT entry when a sub table is needed. This repeats on every load and
+        resume, resulting in a burst of NPT faults on all processors.
+
+        To avoid this, each processor records MMIO pages it built entries for
+        (see HandleNestedPageFault), and those are merged into the MMIO working
+        set when the processor is de-virtualized. The set is saved under the
+        service key as the MmioWorkingSet value when all processors are
+        de-virtualized, that is, on unload and on entering a sleep state. On
+        the next load, the value is read and validated against the current
+        physical memory layout, and the BuildNestedPageTables function builds
+        entries for the pages in the set in addition to physical memory. The
+        set is also used as-is when processors are virtualized again on
+        resume.
+
+        The value is an array of MMIO_WORKING_SET_RUN. Runs are rejected when
+        they are beyond the physical address width or overlap physical memory,
+        which happens when the memory layout changed since saved. Pages in the
+        MMIO ranges traced are skipped as they must stay unmapped. See
+        MmioTrace.cpp.
+
+        The set is updated while processors are virtualized and de-virtualized
+        one by one, and read while the NPT is built. Those do not run
+        concurrently, and no lock is used.
+
+        This is disabled when the MmioPrewarm value is zero.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelMmioWorkingSet.hpp"
+#include "Common.hpp"
+#include "Configuration.hpp"
+#include "x86_64.hpp"
+
+//
+// The maximum number of pages in the working set.
+//
+static constexpr ULONG k_MaxMmioWorkingSetPages = 1024;
+
+static constexpr PCWSTR k_MmioWorkingSetValueName = L"MmioWorkingSet";
+
+//
+// The format of the MmioWorkingSet value.
+//
+typedef struct _MMIO_WORKING_SET_RUN
+{
+    ULONG64 BasePage;
+    ULONG64 PageCount;
+} MMIO_WORKING_SET_RUN, *PMMIO_WORKING_SET_RUN;
+
+typedef struct _MMIO_WORKING_SET
+{
+    //
+    // The service key opened to save the set, or NULL if disabled.
+    //
+    HANDLE KeyHandle;
+
+    //
+    // Whether pages were added since the set was loaded or saved.
+    //
+    BOOLEAN Modified;
+
+    //
+    // The page frame numbers of the pages, sorted.
+    //
+    ULONG PageCount;
+    ULONG64 PageNumbers[k_MaxMmioWorkingSetPages];
+} MMIO_WORKING_SET, *PMMIO_WORKING_SET;
+
+static MMIO_WORKING_SET g_MmioWorkingSet;
+
+/*!
+    @brief Adds the page to the working set.
+
+    @param[in] PageNumber - The page frame number to add.
+
+    @return TRUE if the page is added or already in the set; FALSE if the set
+        is full.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+BOOLEAN
+AddMmioWorkingSetPage (
+    _In_ ULONG64 PageNumber
+    )
+{
+    BOOLEAN added;
+    ULONG low, high;
+
+    //
+    // Find the index to insert the page with binary search.
+    //
+    low = 0;
+    high = g_MmioWorkingSet.PageCount;
+    while (low < high)
+    {
+        ULONG middle;
+
+        middle = low + (high - low) / 2;
+        if (g_MmioWorkingSet.PageNumbers[middle] < PageNumber)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    if ((low < g_MmioWorkingSet.PageCount) &&
+        (g_MmioWorkingSet.PageNumbers[low] == PageNumber))
+    {
+        added = TRUE;
+        goto Exit;
+    }
+    if (g_MmioWorkingSet.PageCount == RTL_NUMBER_OF(g_MmioWorkingSet.PageNumbers))
+    {
+        added = FALSE;
+        goto Exit;
+    }
+
+    RtlMoveMemory(&g_MmioWorkingSet.PageNumbers[low + 1],
+                  &g_MmioWorkingSet.PageNumbers[low],
+                  sizeof(ULONG64) * (g_MmioWorkingSet.PageCount - low));
+    g_MmioWorkingSet.PageNumbers[low] = PageNumber;
+    g_MmioWorkingSet.PageCount++;
+    added = TRUE;
+
+Exit:
+    return added;
+}
+
+/*!
+    @brief Tests whether the run overlaps physical memory.
+
+    @param[in] MemoryDescriptor - The physical memory address ranges.
+
+    @param[in] Run - The run to test.
+
+    @return TRUE if the run overlaps physical memory; otherwise, FALSE.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+BOOLEAN
+IsRunOverlappingMemory (
+    _In_ const PHYSICAL_MEMORY_DESCRIPTOR* MemoryDescriptor,
+    _In_ const MMIO_WORKING_SET_RUN* Run
+    )
+{
+    BOOLEAN overlapping;
+
+    PAGED_CODE();
+
+    overlapping = FALSE;
+    for (ULONG i = 0; i < MemoryDescriptor->NumberOfRuns; ++i)
+    {
+        const PHYSICAL_MEMORY_RUN* memoryRun;
+
+        memoryRun = &MemoryDescriptor->Run[i];
+        if ((Run->BasePage < memoryRun->BasePage + memoryRun->PageCount) &&
+            (memoryRun->BasePage < Run->BasePage + Run->PageCount))
+        {
+            overlapping = TRUE;
+            break;
+        }
+    }
+    return overlapping;
+}
+
+/*!
+    @brief Tests whether the page is in the MMIO ranges traced.
+
+    @param[in] PageNumber - The page frame number to test.
+
+    @return TRUE if the page is traced; otherwise, FALSE.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+BOOLEAN
+IsMmioTracePage (
+    _In_ ULONG64 PageNumber
+    )
+{
+    BOOLEAN traced;
+
+    traced = FALSE;
+    for (const auto& range : g_Configuration.MmioTraceRanges)
+    {
+        if ((PageNumber >= range.BasePage) &&
+            (PageNumber - range.BasePage < range.PageCount))
+        {
+            traced = TRUE;
+            break;
+        }
+    }
+    return traced;
+}
+
+/*!
+    @brief Loads the working set saved under the service key.
+
+    @details This function does not fail. The working set is left empty when
+        the value does not exist or is invalid, and is not saved when the
+        service key cannot be opened.
+
+    @param[in] RegistryPath - The path to the service key.
+
+    @param[in] MemoryDescriptor - The physical memory address ranges to
+        validate the working set against.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+LoadMmioWorkingSet (
+    PCUNICODE_STRING RegistryPath,
+    const PHYSICAL_MEMORY_DESCRIPTOR* MemoryDescriptor
+    )
+{
+    static constexpr ULONG maxValueSize = sizeof(MMIO_WORKING_SET_RUN) *
+                                          k_MaxMmioWorkingSetPages;
+    static constexpr ULONG bufferSize = sizeof(KEY_VALUE_PARTIAL_INFORMATION) +
+                                        maxValueSize;
+
+    NTSTATUS status;
+    OBJECT_ATTRIBUTES objectAttributes;
+    UNICODE_STRING valueName;
+    PKEY_VALUE_PARTIAL_INFORMATION information;
+    ULONG resultLength;
+    ULONG runCount;
+    ULONG rejectedCount;
+    ULONG tracedCount;
+    int registers[4];
+    ULONG64 maxPageNumber;
+
+    PAGED_CODE();
+
+    information = nullptr;
+    RtlZeroMemory(&g_MmioWorkingSet, sizeof(g_MmioWorkingSet));
+
+    if (g_Configuration.MmioPrewarm == FALSE)
+    {
+        goto Exit;
+    }
+
+    InitializeObjectAttributes(&objectAttributes,
+                               const_cast<PUNICODE_STRING>(RegistryPath),
+                               OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                               nullptr,
+                               nullptr);
+    status = ZwOpenKey(&g_MmioWorkingSet.KeyHandle,
+                       KEY_QUERY_VALUE | KEY_SET_VALUE,
+                       &objectAttributes);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ZwOpenKey failed : %08x", status);
+        g_MmioWorkingSet.KeyHandle = nullptr;
+        goto Exit;
+    }
+
+    information = static_cast<PKEY_VALUE_PARTIAL_INFORMATION>(
+                                        ExAllocatePoolWithTag(PagedPool,
+                                                              bufferSize,
+                                                              k_PoolTag));
+    if (information == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %lu", bufferSize);
+        goto Exit;
+    }
+
+    RtlInitUnicodeString(&valueName, k_MmioWorkingSetValueName);
+    status = ZwQueryValueKey(g_MmioWorkingSet.KeyHandle,
+                             &valueName,
+                             KeyValuePartialInformation,
+                             information,
+                             bufferSize,
+                             &resultLength);
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+    {
+        goto Exit;
+    }
+
+    //
+    // Overwrite the value on save if it is too large or invalid, so that it
+    // is not ignored on every load.
+    //
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_WARN("Ignoring the %ws value : %08x",
+                         k_MmioWorkingSetValueName,
+                         status);
+        g_MmioWorkingSet.Modified = TRUE;
+        goto Exit;
+    }
+    if ((information->Type != REG_BINARY) ||
+        ((information->DataLength % sizeof(MMIO_WORKING_SET_RUN)) != 0))
+    {
+        LOGGING_LOG_WARN("Ignoring the %ws value : type %lu, %lu bytes",
+                         k_MmioWorkingSetValueName,
+                         information->Type,
+                         information->DataLength);
+        g_MmioWorkingSet.Modified = TRUE;
+        goto Exit;
+    }
+
+    //
+    // Get the highest page frame number + 1 the processor can address.
+    //
+    __cpuid(registers, CPUID_ADDRESS_SIZE_IDENTIFIERS);
+    maxPageNumber = 1ull << ((registers[0] & 0xff) - PAGE_SHIFT);
+
+    runCount = information->DataLength / sizeof(MMIO_WORKING_SET_RUN);
+    rejectedCount = 0;
+    tracedCount = 0;
+    for (ULONG i = 0; i < runCount; ++i)
+    {
+        MMIO_WORKING_SET_RUN run;
+
+        //
+        // Data is not naturally aligned.
+        //
+        RtlCopyMemory(&run,
+                      &information->Data[sizeof(run) * i],
+                      sizeof(run));
+        if ((run.PageCount == 0) ||
+            (run.BasePage >= maxPageNumber) ||
+            (run.PageCount > maxPageNumber - run.BasePage) ||
+            (run.PageCount > k_MaxMmioWorkingSetPages) ||
+            (IsRunOverlappingMemory(MemoryDescriptor, &run) != FALSE))
+        {
+            rejectedCount++;
+            continue;
+        }
+
+        for (ULONG64 j = 0; j < run.PageCount; ++j)
+        {
+            if (IsMmioTracePage(run.BasePage + j) != FALSE)
+            {
+                tracedCount++;
+                continue;
+            }
+            if (AddMmioWorkingSetPage(run.BasePage + j) == FALSE)
+            {
+                break;
+            }
+        }
+    }
+
+    LOGGING_LOG_INFO("MMIO working set : %lu pages, %lu runs rejected",
+                     g_MmioWorkingSet.PageCount,
+                     rejectedCount);
+
+    //
+    // Save the set when rejected or traced pages are dropped, so that it does
+    // not have to be validated again.
+    //
+    g_MmioWorkingSet.Modified = ((rejectedCount != 0) || (tracedCount != 0));
+
+Exit:
+    if (information != nullptr)
+    {
+        ExFreePoolWithTag(information, k_PoolTag);
+    }
+}
+
+/*!
+    @brief Frees resources of the working set.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+UnloadMmioWorkingSet (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    if (g_MmioWorkingSet.KeyHandle != nullptr)
+    {
+        NT_VERIFY(NT_SUCCESS(ZwClose(g_MmioWorkingSet.KeyHandle)));
+    }
+    RtlZeroMemory(&g_MmioWorkingSet, sizeof(g_MmioWorkingSet));
+}
+
+/*!
+    @brief Saves the working set under the service key if it is modified.
+
+    @details This function must be called after all processors are
+        de-virtualized.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+SaveMmioWorkingSet (
+    VOID
+    )
+{
+    NTSTATUS status;
+    PMMIO_WORKING_SET_RUN runs;
+    ULONG runCount;
+    ULONG runsSize;
+    UNICODE_STRING valueName;
+
+    PAGED_CODE();
+
+    runs = nullptr;
+
+    if ((g_MmioWorkingSet.KeyHandle == nullptr) ||
+        (g_MmioWorkingSet.Modified == FALSE))
+    {
+        goto Exit;
+    }
+
+    runsSize = sizeof(MMIO_WORKING_SET_RUN) * max(g_MmioWorkingSet.PageCount, 1);
+    runs = static_cast<PMMIO_WORKING_SET_RUN>(ExAllocatePoolWithTag(PagedPool,
+                                                                    runsSize,
+                                                                    k_PoolTag));
+    if (runs == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %lu", runsSize);
+        goto Exit;
+    }
+
+    //
+    // Coalesce contiguous pages into runs.
+    //
+    runCount = 0;
+    for (ULONG i = 0; i < g_MmioWorkingSet.PageCount; ++i)
+    {
+        ULONG64 pageNumber;
+
+        pageNumber = g_MmioWorkingSet.PageNumbers[i];
+        if ((runCount != 0) &&
+            (runs[runCount - 1].BasePage + runs[runCount - 1].PageCount == pageNumber))
+        {
+            runs[runCount - 1].PageCount++;
+            continue;
+        }
+        runs[runCount].BasePage = pageNumber;
+        runs[runCount].PageCount = 1;
+        runCount++;
+    }
+
+    RtlInitUnicodeString(&valueName, k_MmioWorkingSetValueName);
+    status = ZwSetValueKey(g_MmioWorkingSet.KeyHandle,
+                           &valueName,
+                           0,
+                           REG_BINARY,
+                           runs,
+                           sizeof(MMIO_WORKING_SET_RUN) * runCount);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ZwSetValueKey failed : %08x", status);
+        goto Exit;
+    }
+
+    LOGGING_LOG_INFO("Saved MMIO working set : %lu pages in %lu runs",
+                     g_MmioWorkingSet.PageCount,
+                     runCount);
+    g_MmioWorkingSet.Modified = FALSE;
+
+Exit:
+    if (runs != nullptr)
+    {
+        ExFreePoolWithTag(runs, k_PoolTag);
+    }
+}
+
+/*!
+    @brief Builds NPT entries for the pages in the working set.
+
+    @param[in,out] Pml4Table - The NPT PML4 being built.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_Use_decl_annotations_
+NTSTATUS
+PrewarmMmioWorkingSet (
+    PPML4_ENTRY_4KB Pml4Table
+    )
+{
+    NTSTATUS status;
+
+    for (ULONG i = 0; i < g_MmioWorkingSet.PageCount; ++i)
+    {
+        if (BuildSubTables(Pml4Table,
+                           g_MmioWorkingSet.PageNumbers[i] * PAGE_SIZE,
+                           nullptr) == nullptr)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Adds the MMIO pages recorded by the processor to the working set.
+
+    @param[in] HookData - The hook data of the processor being de-virtualized.
+ */
+_Use_decl_annotations_
+VOID
+MergeMmioWorkingSet (
+    const HOOK_DATA* HookData
+    )
+{
+    ULONG recordedCount;
+    ULONG previousCount;
+
+    LOGGING_LOG_INFO("MMIO pages mapped on NPT fault: %lu", HookData->MmioFaultCount);
+
+    if (g_MmioWorkingSet.KeyHandle == nullptr)
+    {
+        goto Exit;
+    }
+
+    recordedCount = min(HookData->MmioFaultCount,
+                        static_cast<ULONG>(RTL_NUMBER_OF(HookData->MmioPageNumbers)));
+    previousCount = g_MmioWorkingSet.PageCount;
+    for (ULONG i = 0; i < recordedCount; ++i)
+    {
+        //
+        // Traced pages are mapped when their access cannot be emulated. They
+        // must stay unmapped on the next load.
+        //
+        if (IsMmioTracePage(HookData->MmioPageNumbers[i]) != FALSE)
+        {
+            continue;
+        }
+        if (AddMmioWorkingSetPage(HookData->MmioPageNumbers[i]) == FALSE)
+        {
+            break;
+        }
+    }
+    if (g_MmioWorkingSet.PageCount != previousCount)
+    {
+        g_MmioWorkingSet.Modified = TRUE;
+    }
+
+Exit:
+    return;
+}
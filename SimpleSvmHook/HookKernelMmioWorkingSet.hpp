@@ -0,0 +1,48 @@
+/*!
+    @file HookKernelMmioWorkingSet.hpp
+
+    @brief Kernel mode code to persist MMIO pages mapped on NPT fault and to
+        map them when the NPT is built.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "HookCommon.hpp"
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+LoadMmioWorkingSet (
+    _In_ PCUNICODE_STRING RegistryPath,
+    _In_ const PHYSICAL_MEMORY_DESCRIPTOR* MemoryDescriptor
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+UnloadMmioWorkingSet (
+    VOID
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+SaveMmioWorkingSet (
+    VOID
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+NTSTATUS
+PrewarmMmioWorkingSet (
+    _Inout_ PPML4_ENTRY_4KB Pml4Table
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+MergeMmioWorkingSet (
+    _In_ const HOOK_DATA* HookData
+    );
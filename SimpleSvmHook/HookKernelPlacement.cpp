@@ -0,0 +1,467 @@
+/*!
+    @file HookKernelPlacement.cpp
+
+    @brief Kernel mode code to analyze how hooked pages are placed and call
+        each other.
+
+    @details How many NPT state transitions a call to a hooked function costs
+        depends on where execution goes while the processor is on the hooked
+        page (see HookVmmCommon.cpp). Hooks on the same page share the state 2
+        and execute without transitions between them. A call from a hooked
+        page to another hooked page transitions the state 2 to 2 (through 1)
+        on the call and again on the return. A call to any other page leaves
+        the state 2 and comes back, unless the page is trusted.
+
+        This module reports, before hooks are activated, the hooked pages and
+        the hooks on each, the rel32 calls and jumps from the hooked functions
+        to other hooked pages, and the estimated transitions per call to each
+        hooked function. The estimate assumes each call site is executed once
+        and no interrupt arrives; it is meant to compare configurations and
+        not to predict the actual count. Configurations estimated to be
+        expensive are logged as warnings.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelPlacement.hpp"
+#include "Common.hpp"
+#include "HookCommon.hpp"
+#include "HookKernelSymbols.hpp"
+#include "Disassembler.hpp"
+
+//
+// The number of bytes scanned from the hook address when the range of the
+// function is unknown.
+//
+static constexpr ULONG k_MaxPlacementScanLength = 0x1000;
+
+//
+// The estimated transitions per call above which the hook is warned.
+//
+static constexpr ULONG k_RiskyTransitionsPerCall = 8;
+
+//
+// The result of scanning a hooked function.
+//
+typedef struct _HOOK_PLACEMENT
+{
+    //
+    // The number of calls to pages that are neither hooked nor trusted.
+    //
+    ULONG OutsideCallCount;
+
+    //
+    // The number of calls and tail jumps to other hooked pages.
+    //
+    ULONG HookedPageCallCount;
+    ULONG HookedPageJumpCount;
+
+    //
+    // The number of pages the function spans other than the hooked page and
+    // the linked page.
+    //
+    ULONG SpilledPageCount;
+
+    //
+    // The estimated NPT state transitions per call, and how many of them are
+    // on calls out of the hooked page.
+    //
+    ULONG Transitions;
+    ULONG CallOutTransitions;
+} HOOK_PLACEMENT, *PHOOK_PLACEMENT;
+
+/*!
+    @brief Returns the virtual address of the linked page of the hook.
+
+    @param[in] HookEntry - The hook to get the linked page.
+
+    @return The page aligned virtual address of the linked page, or NULL if
+        the hook does not have it.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+PVOID
+GetLinkedPageBase (
+    _In_ const HOOK_ENTRY* HookEntry
+    )
+{
+    PAGED_CODE();
+
+    return (HookEntry->PhyLinkedPageBase != 0) ?
+                Add2Ptr(PAGE_ALIGN(HookEntry->HookAddress), PAGE_SIZE) :
+                nullptr;
+}
+
+/*!
+    @brief Finds the registration whose hooked page or linked page contains
+        the address.
+
+    @param[in] VirtualAddress - The address to find.
+
+    @return The first registration found, or NULL.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+const HOOK_REGISTRATION_ENTRY*
+FindRegistrationByPage (
+    _In_ PVOID VirtualAddress
+    )
+{
+    const HOOK_REGISTRATION_ENTRY* found;
+    PVOID page;
+
+    PAGED_CODE();
+
+    found = nullptr;
+    page = PAGE_ALIGN(VirtualAddress);
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        if ((page == PAGE_ALIGN(registration.HookEntry.HookAddress)) ||
+            (page == GetLinkedPageBase(&registration.HookEntry)))
+        {
+            found = &registration;
+            break;
+        }
+    }
+    return found;
+}
+
+/*!
+    @brief Tests whether the page containing the address is trusted.
+
+    @param[in] VirtualAddress - The address to test.
+
+    @return TRUE if the page is trusted; otherwise, FALSE.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+BOOLEAN
+IsTrustedAddress (
+    _In_ PVOID VirtualAddress
+    )
+{
+    BOOLEAN trusted;
+    ULONG64 pa;
+
+    PAGED_CODE();
+
+    trusted = FALSE;
+    if (MmIsAddressValid(VirtualAddress) == FALSE)
+    {
+        goto Exit;
+    }
+
+    pa = reinterpret_cast<ULONG64>(PAGE_ALIGN(
+                            MmGetPhysicalAddress(VirtualAddress).QuadPart));
+    for (ULONG i = 0; i < g_TrustedPages.Count; ++i)
+    {
+        if (g_TrustedPages.PhyPageBases[i] == pa)
+        {
+            trusted = TRUE;
+            break;
+        }
+    }
+
+Exit:
+    return trusted;
+}
+
+/*!
+    @brief Tests whether execution at the address stays on the hooked page of
+        the registration.
+
+    @param[in] Registration - The registration of the hooked function.
+
+    @param[in] VirtualAddress - The address to test.
+
+    @return TRUE if the address is on the hooked page or the linked page;
+        otherwise, FALSE.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+BOOLEAN
+IsOnHookedPage (
+    _In_ const HOOK_REGISTRATION_ENTRY* Registration,
+    _In_ PVOID VirtualAddress
+    )
+{
+    PAGED_CODE();
+
+    return ((PAGE_ALIGN(VirtualAddress) ==
+                PAGE_ALIGN(Registration->HookEntry.HookAddress)) ||
+            (PAGE_ALIGN(VirtualAddress) ==
+                GetLinkedPageBase(&Registration->HookEntry)));
+}
+
+/*!
+    @brief Scans the hooked function for rel32 calls and jumps leaving the
+        hooked page, and estimates transitions per call to it.
+
+    @param[in] Registration - The registration of the hooked function.
+
+    @param[out] Placement - The result of the scan.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+ScanHookedFunction (
+    _In_ const HOOK_REGISTRATION_ENTRY* Registration,
+    _Out_ PHOOK_PLACEMENT Placement
+    )
+{
+    PRUNTIME_FUNCTION functionEntry;
+    ULONG64 imageBase;
+    PUCHAR begin;
+    PUCHAR end;
+    PUCHAR current;
+    INSTRUCTION_INFO instruction;
+    PVOID target;
+    const HOOK_REGISTRATION_ENTRY* targetRegistration;
+    BOOLEAN isCall;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(Placement, sizeof(*Placement));
+
+    //
+    // Scan the whole function containing the hook when its range is known
+    // from the exception directory. Otherwise, scan from the hook address up
+    // to the first RET.
+    //
+    functionEntry = RtlLookupFunctionEntry(
+                    reinterpret_cast<ULONG64>(Registration->HookEntry.HookAddress),
+                    &imageBase,
+                    nullptr);
+    if (functionEntry != nullptr)
+    {
+        begin = reinterpret_cast<PUCHAR>(imageBase + functionEntry->BeginAddress);
+        end = reinterpret_cast<PUCHAR>(imageBase + functionEntry->EndAddress);
+    }
+    else
+    {
+        begin = static_cast<PUCHAR>(Registration->HookEntry.HookAddress);
+        end = begin + k_MaxPlacementScanLength;
+    }
+
+    for (current = begin; current < end; current += instruction.Length)
+    {
+        if (DecodeInstruction(current, &instruction) == FALSE)
+        {
+            LOGGING_LOG_WARN("Unable to decode %wZ at %p. Results are partial.",
+                             &Registration->FunctionName,
+                             current);
+            break;
+        }
+
+        if ((functionEntry == nullptr) &&
+            (instruction.OpcodeMap == OpcodeMapPrimary) &&
+            ((instruction.Opcode == 0xc3) || (instruction.Opcode == 0xc2)))
+        {
+            end = current + instruction.Length;
+            break;
+        }
+
+        //
+        // Only CALL rel32 and JMP rel32 are considered. Short branches and
+        // Jcc are assumed to stay within the function.
+        //
+        if ((instruction.IsRelativeBranch == FALSE) ||
+            (instruction.OpcodeMap != OpcodeMapPrimary) ||
+            ((instruction.Opcode != 0xe8) && (instruction.Opcode != 0xe9)))
+        {
+            continue;
+        }
+
+        isCall = (instruction.Opcode == 0xe8);
+        target = GetRelativeBranchTarget(current, &instruction);
+        if ((isCall == FALSE) &&
+            (target >= begin) && (target < end))
+        {
+            continue;
+        }
+        if ((IsOnHookedPage(Registration, target) != FALSE) ||
+            (IsTrustedAddress(target) != FALSE))
+        {
+            continue;
+        }
+
+        targetRegistration = FindRegistrationByPage(target);
+        if (targetRegistration != nullptr)
+        {
+            LOGGING_LOG_INFO("  %s edge %wZ -> %wZ (%s)",
+                             (isCall != FALSE) ? "Call" : "Jump",
+                             &Registration->FunctionName,
+                             &targetRegistration->FunctionName,
+                             AddressToSymbol(target).AsChars);
+            if (isCall != FALSE)
+            {
+                Placement->HookedPageCallCount++;
+            }
+            else
+            {
+                Placement->HookedPageJumpCount++;
+            }
+        }
+        else if (isCall != FALSE)
+        {
+            Placement->OutsideCallCount++;
+        }
+    }
+
+    //
+    // Count pages of the function outside the hooked page and the linked
+    // page. Execution flowing into them leaves the state 2.
+    //
+    for (current = static_cast<PUCHAR>(PAGE_ALIGN(begin));
+         current < end;
+         current += PAGE_SIZE)
+    {
+        if (IsOnHookedPage(Registration, current) == FALSE)
+        {
+            Placement->SpilledPageCount++;
+        }
+    }
+
+    //
+    // Entering the hooked page and leaving it on the return cost two
+    // transitions. Unless the handler is trusted, #BP redirecting to the
+    // handler and the original call stub jumping back to the page cost two
+    // more. A call to another hooked page transitions the state 2 to 2 on
+    // the call and the return, each through the state 1. A call to other
+    // page and execution flowing into other page leave the state 2 and come
+    // back. With the sweep backend, the former only flips a few entries in
+    // the suspended-visible state. A tail jump to another hooked page adds
+    // the transition to its page.
+    //
+    Placement->Transitions = 2;
+    if (IsTrustedAddress(Registration->Handler) == FALSE)
+    {
+        Placement->Transitions += 2;
+    }
+    Placement->Transitions += Placement->HookedPageCallCount * 4;
+    Placement->Transitions += Placement->HookedPageJumpCount * 2;
+    Placement->Transitions += Placement->SpilledPageCount * 2;
+    Placement->CallOutTransitions = Placement->OutsideCallCount * 2;
+    Placement->Transitions += Placement->CallOutTransitions;
+}
+
+/*!
+    @brief Reports the hooked pages, the call edges between them and the
+        estimated transitions per call to each hooked function.
+
+    @details This function must be called after hooks are installed and the
+        trusted pages are collected, and before processors are virtualized.
+        Risky configurations are logged as warnings and do not fail.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+AnalyzeHookPlacement (
+    VOID
+    )
+{
+    HOOK_PLACEMENT placement;
+    const HOOK_REGISTRATION_ENTRY* first;
+    ULONG hookCount;
+    ULONG pageCount;
+    ULONG riskyCount;
+
+    PAGED_CODE();
+
+    //
+    // Report hooks grouped by the hooked page. Each page is reported with the
+    // first registration on it.
+    //
+    pageCount = 0;
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        first = nullptr;
+        hookCount = 0;
+        for (const auto& member : GetHookRegistrationEntries())
+        {
+            if (member.HookEntry.PhyPageBase != registration.HookEntry.PhyPageBase)
+            {
+                continue;
+            }
+            if (first == nullptr)
+            {
+                first = &member;
+            }
+            hookCount++;
+        }
+        if (first != &registration)
+        {
+            continue;
+        }
+
+        pageCount++;
+        LOGGING_LOG_INFO("Hooked page %016llx (linked page %016llx) has %lu hooks",
+                         registration.HookEntry.PhyPageBase,
+                         registration.HookEntry.PhyLinkedPageBase,
+                         hookCount);
+        for (const auto& member : GetHookRegistrationEntries())
+        {
+            if (member.HookEntry.PhyPageBase == registration.HookEntry.PhyPageBase)
+            {
+                LOGGING_LOG_INFO("  %wZ at %p",
+                                 &member.FunctionName,
+                                 member.HookEntry.HookAddress);
+            }
+        }
+    }
+
+    //
+    // Report call edges and estimated transitions of each hooked function.
+    //
+    riskyCount = 0;
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        ScanHookedFunction(&registration, &placement);
+        LOGGING_LOG_INFO("%wZ: %lu calls out, %lu calls and %lu jumps to hooked "
+                         "pages, %lu other pages, about %lu transitions per "
+                         "call (%lu on calls out)",
+                         &registration.FunctionName,
+                         placement.OutsideCallCount,
+                         placement.HookedPageCallCount,
+                         placement.HookedPageJumpCount,
+                         placement.SpilledPageCount,
+                         placement.Transitions,
+                         placement.CallOutTransitions);
+
+        if ((placement.HookedPageCallCount != 0) ||
+            (placement.HookedPageJumpCount != 0))
+        {
+            LOGGING_LOG_WARN("%wZ reaches other hooked pages, each switching "
+                             "the visible page through the invisible state",
+                             &registration.FunctionName);
+        }
+        if (placement.SpilledPageCount != 0)
+        {
+            LOGGING_LOG_WARN("%wZ spans %lu pages outside the hooked page",
+                             &registration.FunctionName,
+                             placement.SpilledPageCount);
+        }
+        if (placement.Transitions > k_RiskyTransitionsPerCall)
+        {
+            LOGGING_LOG_WARN("%wZ may cause about %lu transitions per call",
+                             &registration.FunctionName,
+                             placement.Transitions);
+            riskyCount++;
+        }
+    }
+
+    LOGGING_LOG_INFO("%lu hooks on %lu pages, %lu of them risky",
+                     g_HookRegistrationEntryCount,
+                     pageCount,
+                     riskyCount);
+}
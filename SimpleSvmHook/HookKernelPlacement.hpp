@@ -0,0 +1,19 @@
+/*!
+    @file HookKernelPlacement.hpp
+
+    @brief Kernel mode code to analyze how hooked pages are placed and call
+        each other.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+AnalyzeHookPlacement (
+    VOID
+    );
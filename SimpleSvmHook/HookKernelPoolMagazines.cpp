@@ -0,0 +1,797 @@
+/*!
+    @file HookKernelPoolMagazines.cpp
+
+    @brief Kernel mode code to serve hot pool allocations from per processor
+        caches.
+
+    @details For each configured (tag, size, pool type) triple, each processor
+        has a magazine, a small stack of blocks freed with the triple. The
+        ExAllocatePoolWithTag hook pops a block from the magazine of the current
+        processor instead of calling the original function, and the
+        ExFreePoolWithTag hook pushes the block back. The original functions
+        are used when the magazine is empty or full. Blocks are, therefore,
+        always genuine pool blocks allocated with the triple.
+
+        Only blocks handed out by this module are put back into magazines.
+        Those blocks are tracked in a lock-free open addressing set keyed by
+        the address, and a block is removed from the set when it is freed with
+        either ExFreePoolWithTag or ExFreePool. A block not found in the set
+        is freed with the original function, as is a block that could not be
+        tracked because the set was full. A block freed through a function
+        not hooked, for example ExFreePool2, remains in the set; it is removed
+        when the same address is returned by the ExAllocatePoolWithTag hook
+        for any triple. Since the address may instead be returned by a
+        function not hooked, the pool header of a block found in the set is
+        also verified to match the class before the block is cached. Big pool
+        blocks, which are page aligned and have no pool header, are never
+        cached.
+
+        Magazines are enabled only when all of ExAllocatePoolWithTag,
+        ExFreePoolWithTag and ExFreePool are hooked with the handlers aware of
+        them. On initialization, the cycles spent for an allocation and a free
+        with and without magazines are measured and logged for each triple.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelPoolMagazines.hpp"
+#include "Common.hpp"
+#include "HookCommon.hpp"
+#include "HookKernelHandlers.hpp"
+
+//
+// The number of blocks each magazine can hold.
+//
+static constexpr ULONG k_PoolMagazineCapacity = 32;
+
+//
+// The number of entries of the set of blocks handed out, the maximum number of
+// entries probed, and the value of a removed entry.
+//
+static constexpr ULONG k_PoolMagazineBlockSetSize = 8192;
+static constexpr ULONG k_PoolMagazineMaxProbes = 32;
+static constexpr ULONG_PTR k_PoolMagazineRemovedBlock = 1;
+
+//
+// The pool header preceding a pool block that is not page aligned. Only the
+// fields used to verify the block are named. The pool type field holds the
+// base pool type plus one and flags such as the quota bit.
+//
+typedef struct _POOL_BLOCK_HEADER
+{
+    union
+    {
+        struct
+        {
+            ULONG PreviousSize : 8;
+            ULONG PoolIndex : 8;
+            ULONG BlockSize : 8;
+            ULONG PoolType : 8;
+        };
+        ULONG Ulong1;
+    };
+    ULONG PoolTag;
+    ULONG64 Reserved;
+} POOL_BLOCK_HEADER, *PPOOL_BLOCK_HEADER;
+static_assert(sizeof(POOL_BLOCK_HEADER) == 16, "Size check");
+
+//
+// The granularity of BlockSize, and the bit of the pool type distinguishing
+// paged pool from non-paged pool.
+//
+static constexpr ULONG k_PoolBlockGranularity = sizeof(POOL_BLOCK_HEADER);
+static constexpr ULONG k_BasePoolTypeMask = 1;
+
+//
+// The number of allocations and frees measured on initialization.
+//
+static constexpr ULONG k_PoolMagazineBenchmarkIterations = 1000;
+
+//
+// The blocks cached by a processor for a triple. Padded to a cache line so
+// that magazines of different processors do not share it.
+//
+typedef struct DECLSPEC_CACHEALIGN _POOL_MAGAZINE
+{
+    ULONG Count;
+    PVOID Blocks[k_PoolMagazineCapacity];
+} POOL_MAGAZINE, *PPOOL_MAGAZINE;
+
+//
+// A cached triple, its magazines and statistics.
+//
+typedef struct _POOL_MAGAZINE_CLASS
+{
+    ULONG Tag;
+    SIZE_T NumberOfBytes;
+    POOL_TYPE PoolType;
+
+    //
+    // The magazines indexed by the processor index, or NULL if the class is
+    // unused.
+    //
+    PPOOL_MAGAZINE Magazines;
+
+    //
+    // The number of allocations served from and not served from magazines,
+    // and the number of frees cached in and not cached in magazines.
+    //
+    volatile LONG64 HitCount;
+    volatile LONG64 MissCount;
+    volatile LONG64 CachedFreeCount;
+    volatile LONG64 OverflowCount;
+} POOL_MAGAZINE_CLASS, *PPOOL_MAGAZINE_CLASS;
+
+static POOL_MAGAZINE_CLASS g_PoolMagazineClasses[k_MaxPoolMagazineClasses];
+static ULONG g_PoolMagazineProcessorCount;
+
+//
+// The set of blocks handed out, or NULL if magazines are disabled. Each entry
+// holds the address of a block ORed with the index of its class, since pool
+// blocks are at least 16 byte aligned.
+//
+static volatile ULONG_PTR* g_PoolMagazineBlocks;
+static_assert(k_MaxPoolMagazineClasses <= 16, "Class index must fit in 4 bits");
+
+/*!
+    @brief Returns the first entry to probe for the block in the set.
+
+    @param[in] P - The address of the block.
+
+    @return The index of the first entry to probe.
+ */
+static
+_Check_return_
+ULONG
+GetPoolMagazineBlockSlot (
+    _In_ PVOID P
+    )
+{
+    //
+    // Fibonacci hashing of the address without the alignment bits.
+    //
+    return static_cast<ULONG>(((reinterpret_cast<ULONG64>(P) >> 4) *
+                               0x9e3779b97f4a7c15ull) >> 51) %
+           k_PoolMagazineBlockSetSize;
+}
+
+/*!
+    @brief Removes the block from the set of blocks handed out.
+
+    @param[in] P - The address of the block to remove.
+
+    @return The class of the block if it was in the set; otherwise, NULL.
+ */
+static
+_Check_return_
+PPOOL_MAGAZINE_CLASS
+UntrackPoolMagazineBlock (
+    _In_ PVOID P
+    )
+{
+    PPOOL_MAGAZINE_CLASS poolClass;
+    ULONG slot;
+    ULONG_PTR entry;
+
+    poolClass = nullptr;
+    if ((g_PoolMagazineBlocks == nullptr) || (P == nullptr))
+    {
+        goto Exit;
+    }
+
+    slot = GetPoolMagazineBlockSlot(P);
+    for (ULONG i = 0; i < k_PoolMagazineMaxProbes; ++i)
+    {
+        entry = g_PoolMagazineBlocks[(slot + i) % k_PoolMagazineBlockSetSize];
+        if (entry == 0)
+        {
+            break;
+        }
+        if ((entry & ~static_cast<ULONG_PTR>(0xf)) != reinterpret_cast<ULONG_PTR>(P))
+        {
+            continue;
+        }
+
+        //
+        // Only one of concurrent frees of the same block, which is a bug of the
+        // caller, can remove the entry.
+        //
+        if (static_cast<ULONG_PTR>(InterlockedCompareExchange64(
+                reinterpret_cast<volatile LONG64*>(
+                    &g_PoolMagazineBlocks[(slot + i) % k_PoolMagazineBlockSetSize]),
+                k_PoolMagazineRemovedBlock,
+                entry)) == entry)
+        {
+            poolClass = &g_PoolMagazineClasses[entry & 0xf];
+        }
+        break;
+    }
+
+Exit:
+    return poolClass;
+}
+
+/*!
+    @brief Adds the block to the set of blocks handed out.
+
+    @details The block is left untracked if the set is full around the block.
+        Such a block is freed with the original function.
+
+    @param[in] P - The address of the block to add.
+
+    @param[in] PoolClass - The class of the block.
+ */
+static
+VOID
+TrackPoolMagazineBlock (
+    _In_ PVOID P,
+    _In_ const POOL_MAGAZINE_CLASS* PoolClass
+    )
+{
+    ULONG slot;
+    ULONG_PTR entry;
+    ULONG_PTR newEntry;
+
+    NT_ASSERT((reinterpret_cast<ULONG_PTR>(P) & 0xf) == 0);
+
+    newEntry = reinterpret_cast<ULONG_PTR>(P) |
+               static_cast<ULONG_PTR>(PoolClass - g_PoolMagazineClasses);
+
+    slot = GetPoolMagazineBlockSlot(P);
+    for (ULONG i = 0; i < k_PoolMagazineMaxProbes; ++i)
+    {
+        entry = g_PoolMagazineBlocks[(slot + i) % k_PoolMagazineBlockSetSize];
+        if ((entry != 0) && (entry != k_PoolMagazineRemovedBlock))
+        {
+            continue;
+        }
+        if (static_cast<ULONG_PTR>(InterlockedCompareExchange64(
+                reinterpret_cast<volatile LONG64*>(
+                    &g_PoolMagazineBlocks[(slot + i) % k_PoolMagazineBlockSetSize]),
+                static_cast<LONG64>(newEntry),
+                entry)) == entry)
+        {
+            break;
+        }
+    }
+}
+
+/*!
+    @brief Finds the class of the triple.
+
+    @param[in] PoolType - The pool type.
+
+    @param[in] NumberOfBytes - The size of the block.
+
+    @param[in] Tag - The pool tag.
+
+    @return The class of the triple, or NULL if it is not cached.
+ */
+static
+_Check_return_
+PPOOL_MAGAZINE_CLASS
+FindPoolMagazineClass (
+    _In_ POOL_TYPE PoolType,
+    _In_ SIZE_T NumberOfBytes,
+    _In_ ULONG Tag
+    )
+{
+    PPOOL_MAGAZINE_CLASS found;
+
+    found = nullptr;
+    if (g_PoolMagazineBlocks == nullptr)
+    {
+        goto Exit;
+    }
+
+    for (auto& poolClass : g_PoolMagazineClasses)
+    {
+        if ((poolClass.Magazines != nullptr) &&
+            (poolClass.Tag == Tag) &&
+            (poolClass.NumberOfBytes == NumberOfBytes) &&
+            (poolClass.PoolType == PoolType))
+        {
+            found = &poolClass;
+            break;
+        }
+    }
+
+Exit:
+    return found;
+}
+
+/*!
+    @brief Tests whether the pool header of the block matches the class.
+
+    @details This rejects a block whose address remains in the set of blocks
+        handed out after it was freed and allocated again through functions
+        not hooked, possibly with a different size or pool type.
+
+    @param[in] P - The address of the block.
+
+    @param[in] PoolClass - The class the block is recorded with.
+
+    @return TRUE if the block can be cached in a magazine of the class;
+        otherwise, FALSE.
+ */
+static
+_Check_return_
+BOOLEAN
+IsPoolBlockOfClass (
+    _In_ PVOID P,
+    _In_ const POOL_MAGAZINE_CLASS* PoolClass
+    )
+{
+    const POOL_BLOCK_HEADER* header;
+    SIZE_T blockSize;
+
+    if (BYTE_OFFSET(P) == 0)
+    {
+        return FALSE;
+    }
+
+    header = static_cast<const POOL_BLOCK_HEADER*>(P) - 1;
+    blockSize = ROUND_TO_SIZE(PoolClass->NumberOfBytes + sizeof(*header),
+                              k_PoolBlockGranularity) / k_PoolBlockGranularity;
+    return (header->PoolTag == PoolClass->Tag) &&
+           (header->BlockSize == blockSize) &&
+           (header->PoolType != 0) &&
+           (((header->PoolType - 1) & k_BasePoolTypeMask) ==
+                (static_cast<ULONG>(PoolClass->PoolType) & k_BasePoolTypeMask));
+}
+
+/*!
+    @brief Allocates a block from the magazine of the current processor, or
+        with the original function.
+
+    @param[in] PoolType - The pool type requested.
+
+    @param[in] NumberOfBytes - The size requested.
+
+    @param[in] Tag - The pool tag requested.
+
+    @param[in] Allocate - The original ExAllocatePoolWithTag.
+
+    @return The address of the block, or NULL.
+ */
+_Use_decl_annotations_
+PVOID
+AllocatePoolWithMagazine (
+    POOL_TYPE PoolType,
+    SIZE_T NumberOfBytes,
+    ULONG Tag,
+    decltype(ExAllocatePoolWithTag)* Allocate
+    )
+{
+    PVOID pointer;
+    PPOOL_MAGAZINE_CLASS poolClass;
+    PPOOL_MAGAZINE magazine;
+    KIRQL oldIrql;
+    ULONG processorIndex;
+
+    pointer = nullptr;
+
+    poolClass = FindPoolMagazineClass(PoolType, NumberOfBytes, Tag);
+    if (poolClass == nullptr)
+    {
+        //
+        // The address may remain in the set if the previous block at the
+        // address was freed through a function not hooked. Remove it so that
+        // this block is not mistaken for a block of the class.
+        //
+        pointer = Allocate(PoolType, NumberOfBytes, Tag);
+        if (pointer != nullptr)
+        {
+            (VOID)UntrackPoolMagazineBlock(pointer);
+        }
+        goto Exit;
+    }
+
+    //
+    // Stay on the processor while the magazine is used.
+    //
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+    if (processorIndex < g_PoolMagazineProcessorCount)
+    {
+        magazine = &poolClass->Magazines[processorIndex];
+        if (magazine->Count != 0)
+        {
+            pointer = magazine->Blocks[--magazine->Count];
+        }
+    }
+    KeLowerIrql(oldIrql);
+
+    if (pointer != nullptr)
+    {
+        InterlockedIncrement64(&poolClass->HitCount);
+    }
+    else
+    {
+        InterlockedIncrement64(&poolClass->MissCount);
+        pointer = Allocate(PoolType, NumberOfBytes, Tag);
+        if (pointer == nullptr)
+        {
+            goto Exit;
+        }
+
+        //
+        // The address may remain in the set if the previous block at the
+        // address was freed through a function not hooked.
+        //
+        (VOID)UntrackPoolMagazineBlock(pointer);
+    }
+    TrackPoolMagazineBlock(pointer, poolClass);
+
+Exit:
+    return pointer;
+}
+
+/*!
+    @brief Frees the block into the magazine of the current processor if it
+        was handed out by AllocatePoolWithMagazine, or with the original
+        function.
+
+    @param[in] P - The address of the block to free.
+
+    @param[in] Tag - The pool tag specified.
+
+    @param[in] Free - The original ExFreePoolWithTag.
+ */
+_Use_decl_annotations_
+VOID
+FreePoolWithMagazine (
+    PVOID P,
+    ULONG Tag,
+    decltype(ExFreePoolWithTag)* Free
+    )
+{
+    PPOOL_MAGAZINE_CLASS poolClass;
+    PPOOL_MAGAZINE magazine;
+    KIRQL oldIrql;
+    ULONG processorIndex;
+    BOOLEAN cached;
+
+    poolClass = UntrackPoolMagazineBlock(P);
+    if ((poolClass == nullptr) ||
+        (poolClass->Tag != Tag) ||
+        (IsPoolBlockOfClass(P, poolClass) == FALSE))
+    {
+        Free(P, Tag);
+        goto Exit;
+    }
+
+    cached = FALSE;
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+    if (processorIndex < g_PoolMagazineProcessorCount)
+    {
+        magazine = &poolClass->Magazines[processorIndex];
+        if (magazine->Count < RTL_NUMBER_OF(magazine->Blocks))
+        {
+            magazine->Blocks[magazine->Count++] = P;
+            cached = TRUE;
+        }
+    }
+    KeLowerIrql(oldIrql);
+
+    if (cached != FALSE)
+    {
+        InterlockedIncrement64(&poolClass->CachedFreeCount);
+    }
+    else
+    {
+        InterlockedIncrement64(&poolClass->OverflowCount);
+        Free(P, Tag);
+    }
+
+Exit:
+    return;
+}
+
+/*!
+    @brief Removes the block freed without magazines from the set of blocks
+        handed out.
+
+    @param[in] P - The address of the block being freed.
+ */
+_Use_decl_annotations_
+VOID
+ReleasePoolMagazineBlock (
+    PVOID P
+    )
+{
+    (VOID)UntrackPoolMagazineBlock(P);
+}
+
+/*!
+    @brief Tests whether the allocation and free functions are hooked with the
+        handlers aware of magazines.
+
+    @return TRUE if all of them are hooked; otherwise, FALSE.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+BOOLEAN
+ArePoolFunctionsHooked (
+    VOID
+    )
+{
+    BOOLEAN allocateHooked;
+    BOOLEAN freeWithTagHooked;
+    BOOLEAN freeHooked;
+
+    PAGED_CODE();
+
+    allocateHooked = freeWithTagHooked = freeHooked = FALSE;
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        if (registration.Handler == HandleExAllocatePoolWithTag)
+        {
+            allocateHooked = TRUE;
+        }
+        else if (registration.Handler == HandleExFreePoolWithTag)
+        {
+            freeWithTagHooked = TRUE;
+        }
+        else if (registration.Handler == ExFreePoolHook::Handler)
+        {
+            freeHooked = TRUE;
+        }
+    }
+    return (allocateHooked != FALSE) &&
+           (freeWithTagHooked != FALSE) &&
+           (freeHooked != FALSE);
+}
+
+/*!
+    @brief Measures and logs cycles of an allocation and a free with and
+        without the magazine of the class.
+
+    @details This is executed before hooks are enabled, hence the pool
+        functions called here are the original functions.
+
+    @param[in] PoolClass - The class to measure.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+BenchmarkPoolMagazine (
+    _In_ const POOL_MAGAZINE_CLASS* PoolClass
+    )
+{
+    ULONG64 startCycles;
+    ULONG64 originalCycles;
+    ULONG64 magazineCycles;
+    PVOID pointer;
+
+    PAGED_CODE();
+
+    startCycles = __rdtsc();
+    for (ULONG i = 0; i < k_PoolMagazineBenchmarkIterations; ++i)
+    {
+        pointer = ExAllocatePoolWithTag(PoolClass->PoolType,
+                                        PoolClass->NumberOfBytes,
+                                        PoolClass->Tag);
+        if (pointer != nullptr)
+        {
+            ExFreePoolWithTag(pointer, PoolClass->Tag);
+        }
+    }
+    originalCycles = __rdtsc() - startCycles;
+
+    startCycles = __rdtsc();
+    for (ULONG i = 0; i < k_PoolMagazineBenchmarkIterations; ++i)
+    {
+        pointer = AllocatePoolWithMagazine(PoolClass->PoolType,
+                                           PoolClass->NumberOfBytes,
+                                           PoolClass->Tag,
+                                           ExAllocatePoolWithTag);
+        if (pointer != nullptr)
+        {
+            FreePoolWithMagazine(pointer, PoolClass->Tag, ExFreePoolWithTag);
+        }
+    }
+    magazineCycles = __rdtsc() - startCycles;
+
+    LOGGING_LOG_INFO("Pool magazine %08x/%Iu/%lu: %llu cycles without, %llu "
+                     "cycles with magazines per allocation and free",
+                     PoolClass->Tag,
+                     PoolClass->NumberOfBytes,
+                     PoolClass->PoolType,
+                     originalCycles / k_PoolMagazineBenchmarkIterations,
+                     magazineCycles / k_PoolMagazineBenchmarkIterations);
+}
+
+/*!
+    @brief Enables magazines for the configured triples.
+
+    @details Triples with unsupported pool types are ignored. Magazines are
+        not enabled when no triple is configured, or the pool functions are not
+        hooked with the handlers aware of magazines.
+
+    @param[in] Configurations - The triples to cache.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+InitializePoolMagazines (
+    const POOL_MAGAZINE_CONFIGURATION* Configurations
+    )
+{
+    NTSTATUS status;
+    ULONG classCount;
+    ULONG numOfProcessors;
+    PPOOL_MAGAZINE_CLASS poolClass;
+    volatile ULONG_PTR* blocks;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(g_PoolMagazineClasses, sizeof(g_PoolMagazineClasses));
+    blocks = nullptr;
+
+    classCount = 0;
+    for (ULONG i = 0; i < k_MaxPoolMagazineClasses; ++i)
+    {
+        if (Configurations[i].Tag == 0)
+        {
+            continue;
+        }
+        if ((Configurations[i].NumberOfBytes == 0) ||
+            ((Configurations[i].PoolType != NonPagedPool) &&
+             (Configurations[i].PoolType != NonPagedPoolNx) &&
+             (Configurations[i].PoolType != PagedPool)))
+        {
+            LOGGING_LOG_WARN("Ignoring the unsupported pool magazine %08x/%lu/%lu",
+                             Configurations[i].Tag,
+                             Configurations[i].NumberOfBytes,
+                             Configurations[i].PoolType);
+            continue;
+        }
+        classCount++;
+    }
+    if (classCount == 0)
+    {
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+
+    if (ArePoolFunctionsHooked() == FALSE)
+    {
+        LOGGING_LOG_WARN("Pool magazines are disabled as pool functions are not hooked");
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+
+    blocks = static_cast<volatile ULONG_PTR*>(ExAllocatePoolWithTag(
+                                NonPagedPool,
+                                sizeof(ULONG_PTR) * k_PoolMagazineBlockSetSize,
+                                k_PoolTag));
+    if (blocks == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(const_cast<PULONG_PTR>(blocks),
+                  sizeof(ULONG_PTR) * k_PoolMagazineBlockSetSize);
+
+    numOfProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    for (ULONG i = 0; i < k_MaxPoolMagazineClasses; ++i)
+    {
+        if ((Configurations[i].Tag == 0) ||
+            (Configurations[i].NumberOfBytes == 0) ||
+            ((Configurations[i].PoolType != NonPagedPool) &&
+             (Configurations[i].PoolType != NonPagedPoolNx) &&
+             (Configurations[i].PoolType != PagedPool)))
+        {
+            continue;
+        }
+
+        poolClass = &g_PoolMagazineClasses[i];
+        poolClass->Magazines = static_cast<PPOOL_MAGAZINE>(ExAllocatePoolWithTag(
+                                        NonPagedPool,
+                                        sizeof(POOL_MAGAZINE) * numOfProcessors,
+                                        k_PoolTag));
+        if (poolClass->Magazines == nullptr)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        RtlZeroMemory(poolClass->Magazines, sizeof(POOL_MAGAZINE) * numOfProcessors);
+        poolClass->Tag = Configurations[i].Tag;
+        poolClass->NumberOfBytes = Configurations[i].NumberOfBytes;
+        poolClass->PoolType = static_cast<POOL_TYPE>(Configurations[i].PoolType);
+    }
+
+    g_PoolMagazineProcessorCount = numOfProcessors;
+    g_PoolMagazineBlocks = blocks;
+
+    for (const auto& configured : g_PoolMagazineClasses)
+    {
+        if (configured.Magazines != nullptr)
+        {
+            BenchmarkPoolMagazine(&configured);
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+Exit:
+    if (!NT_SUCCESS(status))
+    {
+        for (auto& configured : g_PoolMagazineClasses)
+        {
+            if (configured.Magazines != nullptr)
+            {
+                ExFreePoolWithTag(configured.Magazines, k_PoolTag);
+                configured.Magazines = nullptr;
+            }
+        }
+        if (blocks != nullptr)
+        {
+            ExFreePoolWithTag(const_cast<PULONG_PTR>(blocks), k_PoolTag);
+        }
+    }
+    return status;
+}
+
+/*!
+    @brief Frees all cached blocks and reports statistics.
+
+    @details This must be called after hooks are uninstalled. Blocks handed out
+        and not freed yet are freed by their owners without magazines.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+CleanupPoolMagazines (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    if (g_PoolMagazineBlocks == nullptr)
+    {
+        goto Exit;
+    }
+
+    for (auto& poolClass : g_PoolMagazineClasses)
+    {
+        if (poolClass.Magazines == nullptr)
+        {
+            continue;
+        }
+
+        LOGGING_LOG_INFO("Pool magazine %08x/%Iu/%lu: %llu hits, %llu misses, "
+                         "%llu cached frees, %llu overflows",
+                         poolClass.Tag,
+                         poolClass.NumberOfBytes,
+                         poolClass.PoolType,
+                         static_cast<ULONG64>(poolClass.HitCount),
+                         static_cast<ULONG64>(poolClass.MissCount),
+                         static_cast<ULONG64>(poolClass.CachedFreeCount),
+                         static_cast<ULONG64>(poolClass.OverflowCount));
+
+        for (ULONG i = 0; i < g_PoolMagazineProcessorCount; ++i)
+        {
+            for (ULONG j = 0; j < poolClass.Magazines[i].Count; ++j)
+            {
+                ExFreePoolWithTag(poolClass.Magazines[i].Blocks[j], poolClass.Tag);
+            }
+        }
+        ExFreePoolWithTag(poolClass.Magazines, k_PoolTag);
+        poolClass.Magazines = nullptr;
+    }
+
+    ExFreePoolWithTag(const_cast<PULONG_PTR>(g_PoolMagazineBlocks), k_PoolTag);
+    g_PoolMagazineBlocks = nullptr;
+
+Exit:
+    return;
+}
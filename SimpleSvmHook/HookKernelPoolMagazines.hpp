@@ -0,0 +1,88 @@
+/*!
+    @file HookKernelPoolMagazines.hpp
+
+    @brief Kernel mode code to serve hot pool allocations from per processor
+        caches.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "HookKernelThunk.hpp"
+#include "Configuration.hpp"
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+InitializePoolMagazines (
+    _In_reads_(k_MaxPoolMagazineClasses)
+        const POOL_MAGAZINE_CONFIGURATION* Configurations
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CleanupPoolMagazines (
+    VOID
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+PVOID
+AllocatePoolWithMagazine (
+    _In_ POOL_TYPE PoolType,
+    _In_ SIZE_T NumberOfBytes,
+    _In_ ULONG Tag,
+    _In_ decltype(ExAllocatePoolWithTag)* Allocate
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+FreePoolWithMagazine (
+    _In_ PVOID P,
+    _In_ ULONG Tag,
+    _In_ decltype(ExFreePoolWithTag)* Free
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+ReleasePoolMagazineBlock (
+    _In_ PVOID P
+    );
+
+//
+// Releases the ownership of the block freed with ExFreePool, so that the block
+// is freed to the system and its address is not mistaken as a cached block
+// once reused. This must be the first policy of the ExFreePool hook.
+//
+struct PoolMagazineOwnershipPolicy
+{
+    static
+    FORCEINLINE
+    BOOLEAN
+    Pre (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ PVOID P
+        )
+    {
+        UNREFERENCED_PARAMETER(Context);
+
+        ReleasePoolMagazineBlock(P);
+        return TRUE;
+    }
+
+    static
+    FORCEINLINE
+    VOID
+    Post (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ PVOID P
+        )
+    {
+        UNREFERENCED_PARAMETER(Context);
+        UNREFERENCED_PARAMETER(P);
+    }
+};
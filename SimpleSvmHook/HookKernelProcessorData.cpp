@@ -11,6 +11,12 @@
 #include "Common.hpp"
 #include "HookCommon.hpp"
 #include "HookKernelCommon.hpp"
+#include "HookOverhead.hpp"
+#include "HookKernelViews.hpp"
+#include "HookKernelShadows.hpp"
+#include "HookKernelTransitionBackend.hpp"
+#include "Configuration.hpp"
+#include "HookKernelMmioWorkingSet.hpp"
 
 /*!
     @brief Frees the specified NPT and all sub tables.
@@ -92,8 +98,9 @@ DestructNestedPageTables (
     @details This function builds 1:1 pass-through NPT entries for the physical
         memory address ranges. This function also creates an entry for the
         APIC base address to avoid system hang. MMIO regions are not covered
-        by this function and are later covered on NPT fault on demand. See the
-        HandleNestedPageFault function for this.
+        by this function and are later covered on NPT fault on demand, except
+        the pages in the MMIO working set. See the HandleNestedPageFault
+        function and HookKernelMmioWorkingSet.cpp for this.
 
     @param[in] MemoryDescriptor - The physical memory address ranges to build
         NTP entries.
@@ -170,6 +177,16 @@ BuildNestedPageTables (
         goto Exit;
     }
 
+    //
+    // Create entries for the MMIO pages mapped on NPT fault previously, so
+    // that access to them does not cause NPT faults again.
+    //
+    status = PrewarmMmioWorkingSet(pml4Table);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
     //
     // Compute the max PDPT index based on the last descriptor entry that
     // describes the address of the highest physical page. The index is rounded
@@ -281,12 +298,16 @@ Exit:
 
     @param[out] HookData - The address of hook data to initialize.
 
+    @param[out] Storage - The memory to place the hook data in, or NULL to
+        allocate it from the pool.
+
     @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
  */
 _Use_decl_annotations_
 NTSTATUS
 InitializeHookData (
-    PHOOK_DATA* HookData
+    PHOOK_DATA* HookData,
+    PVOID Storage
     )
 {
     NTSTATUS status;
@@ -295,18 +316,26 @@ InitializeHookData (
     *HookData = nullptr;
 
     //
-    // Allocate hook data.
+    // Allocate hook data unless the storage is given.
     //
-#pragma prefast(suppress : 28118, "DISPATCH_LEVEL is ok as this always allocates NonPagedPool")
-    hookData = static_cast<PHOOK_DATA>(ExAllocatePoolWithTag(NonPagedPool,
-                                                             sizeof(*hookData),
-                                                             k_PoolTag));
-    if (hookData == nullptr)
+    if (Storage != nullptr)
     {
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        goto Exit;
+        hookData = static_cast<PHOOK_DATA>(Storage);
+    }
+    else
+    {
+#pragma prefast(suppress : 28118, "DISPATCH_LEVEL is ok as this always allocates NonPagedPool")
+        hookData = static_cast<PHOOK_DATA>(ExAllocatePoolWithTag(NonPagedPool,
+                                                                 sizeof(*hookData),
+                                                                 k_PoolTag));
+        if (hookData == nullptr)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
     }
     RtlZeroMemory(hookData, sizeof(*hookData));
+    hookData->InProcessorDataRegion = (Storage != nullptr);
 
     //
     // Initialize Pml4Table and MaxNptPdpEntriesUsed.
@@ -330,6 +359,63 @@ InitializeHookData (
         goto Exit;
     }
 
+    //
+    // This function is executed on the processor the hook data is for.
+    //
+    hookData->OverheadTable = GetCurrentHookOverheadTable();
+    hookData->ExecPageReplica = KeGetCurrentNodeNumber();
+    if (hookData->ExecPageReplica >= k_MaxExecPageReplicas)
+    {
+        hookData->ExecPageReplica = k_NoExecPageReplica;
+    }
+
+    //
+    // Precompute the NPTs or PDTs of the state 2 if the backend uses them.
+    // This must be done after the exec page replica is determined.
+    //
+    hookData->TransitionBackend = g_NptTransitionBackend;
+    if (hookData->TransitionBackend == NptTransitionBackendHookViews)
+    {
+        status = BuildHookViews(hookData);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+    }
+    else if (hookData->TransitionBackend == NptTransitionBackendHookShadows)
+    {
+        status = BuildHookShadows(hookData);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+    }
+
+    //
+    // The state 3 is only for the backends editing the NPT in place. See
+    // HookVmmCommon.cpp.
+    //
+    hookData->SuspendOnCall = ((hookData->TransitionBackend !=
+                                                NptTransitionBackendHookViews) &&
+                               (g_Configuration.SuspendOnCall != FALSE));
+
+    //
+    // Allocate the NPT state checker if configured. See HookVmmCommon.cpp.
+    //
+    if (g_Configuration.NptStateChecker != FALSE)
+    {
+        hookData->StateChecker = static_cast<PNPT_STATE_CHECKER>(
+                ExAllocatePoolWithTag(NonPagedPool,
+                                      sizeof(*hookData->StateChecker),
+                                      k_PoolTag));
+        if (hookData->StateChecker == nullptr)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        RtlZeroMemory(hookData->StateChecker, sizeof(*hookData->StateChecker));
+    }
+
     *HookData = hookData;
 
 Exit:
@@ -337,11 +423,24 @@ Exit:
     {
         if (hookData != nullptr)
         {
+            if (hookData->StateChecker != nullptr)
+            {
+                ExFreePoolWithTag(hookData->StateChecker, k_PoolTag);
+            }
+            DestroyHookViews(hookData);
+            DestroyHookShadows(hookData);
+            CleanupPreAllocateEntries(
+                            hookData->PreAllocatedNptEntries,
+                            RTL_NUMBER_OF(hookData->PreAllocatedNptEntries),
+                            0);
             if (hookData->Pml4Table != nullptr)
             {
                 DestructNestedPageTables(hookData->Pml4Table);
             }
-            ExFreePoolWithTag(hookData, k_PoolTag);
+            if (hookData->InProcessorDataRegion == FALSE)
+            {
+                ExFreePoolWithTag(hookData, k_PoolTag);
+            }
         }
     }
     return status;
@@ -361,12 +460,26 @@ CleanupHookData (
     LOGGING_LOG_INFO("Pre-allocated entry usage: %ld / %Iu",
                      HookData->UsedPreAllocatedEntriesCount,
                      RTL_NUMBER_OF(HookData->PreAllocatedNptEntries));
+    MergeMmioWorkingSet(HookData);
+
+    if (HookData->StateChecker != nullptr)
+    {
+        LOGGING_LOG_INFO("NPT state checks: %llu, mismatches: %llu",
+                         HookData->StateChecker->CheckCount,
+                         HookData->StateChecker->MismatchCount);
+        ExFreePoolWithTag(HookData->StateChecker, k_PoolTag);
+    }
 
     CleanupPreAllocateEntries(HookData->PreAllocatedNptEntries,
                               RTL_NUMBER_OF(HookData->PreAllocatedNptEntries),
                               HookData->UsedPreAllocatedEntriesCount);
+    DestroyHookViews(HookData);
+    DestroyHookShadows(HookData);
     DestructNestedPageTables(HookData->Pml4Table);
-    ExFreePoolWithTag(HookData, k_PoolTag);
+    if (HookData->InProcessorDataRegion == FALSE)
+    {
+        ExFreePoolWithTag(HookData, k_PoolTag);
+    }
 }
 
 /*!
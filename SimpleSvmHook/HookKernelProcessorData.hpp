@@ -15,7 +15,8 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 _Check_return_
 NTSTATUS
 InitializeHookData (
-    _Outptr_result_nullonfailure_ PHOOK_DATA* HookData
+    _Outptr_result_nullonfailure_ PHOOK_DATA* HookData,
+    _Out_writes_bytes_opt_(sizeof(HOOK_DATA)) PVOID Storage
     );
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
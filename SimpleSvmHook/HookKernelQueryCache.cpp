@@ -0,0 +1,439 @@
+/*!
+    @file HookKernelQueryCache.cpp
+
+    @brief Kernel mode code to serve ZwQuerySystemInformation from snapshots.
+
+    @details For the configured information classes, the result of a
+        successful ZwQuerySystemInformation call is kept as a snapshot, and
+        subsequent calls are served by copying the snapshot into the caller's
+        buffer until the snapshot becomes older than the configured time to
+        live. The call that finds the snapshot stale is passed to the original
+        function, and its result replaces the snapshot. A call with a buffer
+        too small for the snapshot fails with STATUS_INFO_LENGTH_MISMATCH and
+        the size of the snapshot as ReturnLength, as the original function
+        does.
+
+        Only the classes whose layout is known are supported, since results of
+        some classes contain pointers into the buffer they are returned in.
+        Such pointers are relocated for the caller's buffer. Calls with
+        buffers outside the system address range are never cached.
+
+        The number of hits and misses and the age of the snapshots served are
+        reported on unload.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelQueryCache.hpp"
+#include "Common.hpp"
+#include "Configuration.hpp"
+
+//
+// The leading part of SYSTEM_PROCESS_INFORMATION. ImageName.Buffer points into
+// the buffer the information is returned in.
+//
+typedef struct _SYSTEM_PROCESS_INFORMATION_HEADER
+{
+    ULONG NextEntryOffset;
+    ULONG NumberOfThreads;
+    UCHAR Reserved1[48];
+    UNICODE_STRING ImageName;
+} SYSTEM_PROCESS_INFORMATION_HEADER, *PSYSTEM_PROCESS_INFORMATION_HEADER;
+static_assert(FIELD_OFFSET(SYSTEM_PROCESS_INFORMATION_HEADER, ImageName) == 0x38,
+              "Layout check");
+
+//
+// The snapshot and statistics of a cached information class.
+//
+typedef struct _QUERY_CACHE_ENTRY
+{
+    //
+    // The information class, and the k_QueryCache* flag to enable caching it.
+    //
+    ULONG InformationClass;
+    ULONG Flag;
+    PCSTR Name;
+
+    //
+    // TRUE if the result is a list of SYSTEM_PROCESS_INFORMATION.
+    //
+    BOOLEAN IsProcessList;
+
+    //
+    // TRUE if caching is enabled for the class.
+    //
+    BOOLEAN Enabled;
+
+    //
+    // Protects the snapshot. The statistics are updated without the lock.
+    //
+    ERESOURCE Resource;
+
+    //
+    // The copy of the result, its size, the address of the buffer it was
+    // returned in, and the interrupt time when it was returned. Snapshot is
+    // NULL if no result is cached.
+    //
+    PVOID Snapshot;
+    ULONG SnapshotLength;
+    ULONG_PTR SnapshotOrigin;
+    ULONG64 SnapshotTime;
+
+    //
+    // The number of calls served from and not served from the snapshot, and
+    // the sum and the maximum of the age of the snapshots served, in 100
+    // nanoseconds.
+    //
+    volatile LONG64 HitCount;
+    volatile LONG64 MissCount;
+    volatile LONG64 TotalHitAge;
+    volatile LONG64 MaxHitAge;
+} QUERY_CACHE_ENTRY, *PQUERY_CACHE_ENTRY;
+
+static QUERY_CACHE_ENTRY g_QueryCacheEntries[] =
+{
+    { 5, k_QueryCacheProcessInformation, "SystemProcessInformation", TRUE },
+    { 11, k_QueryCacheModuleInformation, "SystemModuleInformation", FALSE },
+    { 16, k_QueryCacheHandleInformation, "SystemHandleInformation", FALSE },
+    { 57, k_QueryCacheExtendedProcessInformation, "SystemExtendedProcessInformation", TRUE },
+};
+
+//
+// The time to live of snapshots in 100 nanoseconds. Zero if caching is
+// disabled.
+//
+static ULONG64 g_QueryCacheTimeToLive;
+
+/*!
+    @brief Finds the entry for the information class if caching is enabled.
+
+    @param[in] SystemInformationClass - The information class to find.
+
+    @return The address of the entry, or NULL.
+ */
+static
+_Check_return_
+PQUERY_CACHE_ENTRY
+FindQueryCacheEntry (
+    _In_ ULONG SystemInformationClass
+    )
+{
+    PQUERY_CACHE_ENTRY found;
+
+    found = nullptr;
+    if (g_QueryCacheTimeToLive == 0)
+    {
+        goto Exit;
+    }
+
+    for (auto& entry : g_QueryCacheEntries)
+    {
+        if ((entry.InformationClass == SystemInformationClass) &&
+            (entry.Enabled != FALSE))
+        {
+            found = &entry;
+            break;
+        }
+    }
+
+Exit:
+    return found;
+}
+
+/*!
+    @brief Relocates image name pointers of the list of
+        SYSTEM_PROCESS_INFORMATION copied from the snapshot.
+
+    @param[in,out] Buffer - The buffer the list was copied into.
+
+    @param[in] Length - The size of the list in bytes.
+
+    @param[in] Origin - The address of the buffer the list was returned in.
+ */
+static
+VOID
+RelocateProcessList (
+    _Inout_updates_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length,
+    _In_ ULONG_PTR Origin
+    )
+{
+    ULONG offset;
+    PSYSTEM_PROCESS_INFORMATION_HEADER entry;
+    ULONG_PTR nameAddress;
+
+    offset = 0;
+    while ((offset + sizeof(*entry)) <= Length)
+    {
+        entry = reinterpret_cast<PSYSTEM_PROCESS_INFORMATION_HEADER>(
+                                    static_cast<PUCHAR>(Buffer) + offset);
+        nameAddress = reinterpret_cast<ULONG_PTR>(entry->ImageName.Buffer);
+        if ((nameAddress >= Origin) && (nameAddress < (Origin + Length)))
+        {
+            entry->ImageName.Buffer = reinterpret_cast<PWCH>(
+                        reinterpret_cast<ULONG_PTR>(Buffer) + (nameAddress - Origin));
+        }
+
+        if (entry->NextEntryOffset == 0)
+        {
+            break;
+        }
+        offset += entry->NextEntryOffset;
+    }
+}
+
+/*!
+    @brief Enables caching of the information classes.
+
+    @param[in] Classes - k_QueryCache* flags to cache.
+
+    @param[in] TimeToLive - The time to live of snapshots in milliseconds. Zero
+        disables caching.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+InitializeQueryCache (
+    ULONG Classes,
+    ULONG TimeToLive
+    )
+{
+    NTSTATUS status;
+    ULONG initializedCount;
+
+    PAGED_CODE();
+
+    initializedCount = 0;
+    for (auto& entry : g_QueryCacheEntries)
+    {
+        status = ExInitializeResourceLite(&entry.Resource);
+        if (!NT_SUCCESS(status))
+        {
+            LOGGING_LOG_ERROR("ExInitializeResourceLite failed : %08x", status);
+            goto Exit;
+        }
+        initializedCount++;
+
+        entry.Enabled = BooleanFlagOn(Classes, entry.Flag);
+        entry.Snapshot = nullptr;
+        entry.SnapshotLength = 0;
+        entry.HitCount = entry.MissCount = 0;
+        entry.TotalHitAge = entry.MaxHitAge = 0;
+    }
+
+    g_QueryCacheTimeToLive = static_cast<ULONG64>(TimeToLive) * 10 * 1000;
+
+Exit:
+    if (!NT_SUCCESS(status))
+    {
+        for (ULONG i = 0; i < initializedCount; ++i)
+        {
+            NT_VERIFY(NT_SUCCESS(ExDeleteResourceLite(
+                                        &g_QueryCacheEntries[i].Resource)));
+        }
+    }
+    return status;
+}
+
+/*!
+    @brief Reports statistics and frees the snapshots.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+CleanupQueryCache (
+    VOID
+    )
+{
+    ULONG64 total;
+
+    PAGED_CODE();
+
+    for (auto& entry : g_QueryCacheEntries)
+    {
+        total = static_cast<ULONG64>(entry.HitCount) + entry.MissCount;
+        if (total != 0)
+        {
+            LOGGING_LOG_INFO("%s cache: %llu hits / %llu calls (%llu%%), "
+                             "age %llu us on average and %llu us at most",
+                             entry.Name,
+                             static_cast<ULONG64>(entry.HitCount),
+                             total,
+                             static_cast<ULONG64>(entry.HitCount) * 100 / total,
+                             (entry.HitCount != 0) ?
+                                static_cast<ULONG64>(entry.TotalHitAge) /
+                                    entry.HitCount / 10 : 0,
+                             static_cast<ULONG64>(entry.MaxHitAge) / 10);
+        }
+
+        if (entry.Snapshot != nullptr)
+        {
+            ExFreePoolWithTag(entry.Snapshot, k_PoolTag);
+            entry.Snapshot = nullptr;
+        }
+        NT_VERIFY(NT_SUCCESS(ExDeleteResourceLite(&entry.Resource)));
+    }
+    g_QueryCacheTimeToLive = 0;
+}
+
+/*!
+    @brief Serves ZwQuerySystemInformation from the snapshot if it is fresh.
+
+    @param[in] SystemInformationClass - The information class requested.
+
+    @param[out] SystemInformation - The caller's buffer.
+
+    @param[in] SystemInformationLength - The size of SystemInformation.
+
+    @param[out] ReturnLength - The caller's address to receive the size of the
+        information.
+
+    @param[out] Status - The address to receive the status to return to the
+        caller when this function returns TRUE.
+
+    @return TRUE if the call was served from the snapshot; otherwise, FALSE,
+        and the call must be passed to the original function.
+ */
+_Use_decl_annotations_
+BOOLEAN
+QueryCachedSystemInformation (
+    ULONG SystemInformationClass,
+    PVOID SystemInformation,
+    ULONG SystemInformationLength,
+    PULONG ReturnLength,
+    NTSTATUS* Status
+    )
+{
+    BOOLEAN served;
+    PQUERY_CACHE_ENTRY entry;
+    ULONG64 age;
+    LONG64 maxAge;
+
+    served = FALSE;
+    *Status = STATUS_UNSUCCESSFUL;
+
+    entry = FindQueryCacheEntry(SystemInformationClass);
+    if (entry == nullptr)
+    {
+        goto Exit;
+    }
+
+    //
+    // Only serve buffers in the system address range. Those are not changed
+    // by user-mode while being copied.
+    //
+    if ((SystemInformation < MmSystemRangeStart) ||
+        (ARGUMENT_PRESENT(ReturnLength) &&
+         (static_cast<PVOID>(ReturnLength) < MmSystemRangeStart)))
+    {
+        goto Exit;
+    }
+
+    ExEnterCriticalRegionAndAcquireResourceShared(&entry->Resource);
+    age = KeQueryInterruptTime() - entry->SnapshotTime;
+    if ((entry->Snapshot != nullptr) && (age < g_QueryCacheTimeToLive))
+    {
+        if (SystemInformationLength < entry->SnapshotLength)
+        {
+            *Status = STATUS_INFO_LENGTH_MISMATCH;
+        }
+        else
+        {
+            RtlCopyMemory(SystemInformation,
+                          entry->Snapshot,
+                          entry->SnapshotLength);
+            if (entry->IsProcessList != FALSE)
+            {
+                RelocateProcessList(SystemInformation,
+                                    entry->SnapshotLength,
+                                    entry->SnapshotOrigin);
+            }
+            *Status = STATUS_SUCCESS;
+        }
+        if (ARGUMENT_PRESENT(ReturnLength))
+        {
+            *ReturnLength = entry->SnapshotLength;
+        }
+        served = TRUE;
+    }
+    ExReleaseResourceAndLeaveCriticalRegion(&entry->Resource);
+
+    if (served == FALSE)
+    {
+        InterlockedIncrement64(&entry->MissCount);
+        goto Exit;
+    }
+
+    InterlockedIncrement64(&entry->HitCount);
+    InterlockedAdd64(&entry->TotalHitAge, static_cast<LONG64>(age));
+    do
+    {
+        maxAge = entry->MaxHitAge;
+        if (static_cast<LONG64>(age) <= maxAge)
+        {
+            break;
+        }
+    } while (InterlockedCompareExchange64(&entry->MaxHitAge,
+                                          static_cast<LONG64>(age),
+                                          maxAge) != maxAge);
+
+Exit:
+    return served;
+}
+
+/*!
+    @brief Replaces the snapshot with the result of the original function.
+
+    @param[in] SystemInformationClass - The information class returned.
+
+    @param[in] SystemInformation - The buffer the original function returned the
+        information in.
+
+    @param[in] Length - The size of the information returned.
+ */
+_Use_decl_annotations_
+VOID
+CacheSystemInformation (
+    ULONG SystemInformationClass,
+    const VOID* SystemInformation,
+    ULONG Length
+    )
+{
+    PQUERY_CACHE_ENTRY entry;
+    PVOID snapshot;
+    PVOID oldSnapshot;
+
+    entry = FindQueryCacheEntry(SystemInformationClass);
+    if ((entry == nullptr) ||
+        (Length == 0) ||
+        (SystemInformation < MmSystemRangeStart))
+    {
+        goto Exit;
+    }
+
+    snapshot = ExAllocatePoolWithTag(PagedPool, Length, k_PoolTag);
+    if (snapshot == nullptr)
+    {
+        goto Exit;
+    }
+    RtlCopyMemory(snapshot, SystemInformation, Length);
+
+    ExEnterCriticalRegionAndAcquireResourceExclusive(&entry->Resource);
+    oldSnapshot = entry->Snapshot;
+    entry->Snapshot = snapshot;
+    entry->SnapshotLength = Length;
+    entry->SnapshotOrigin = reinterpret_cast<ULONG_PTR>(SystemInformation);
+    entry->SnapshotTime = KeQueryInterruptTime();
+    ExReleaseResourceAndLeaveCriticalRegion(&entry->Resource);
+
+    if (oldSnapshot != nullptr)
+    {
+        ExFreePoolWithTag(oldSnapshot, k_PoolTag);
+    }
+
+Exit:
+    return;
+}
@@ -0,0 +1,46 @@
+/*!
+    @file HookKernelQueryCache.hpp
+
+    @brief Kernel mode code to serve ZwQuerySystemInformation from snapshots.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+InitializeQueryCache (
+    _In_ ULONG Classes,
+    _In_ ULONG TimeToLive
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CleanupQueryCache (
+    VOID
+    );
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+BOOLEAN
+QueryCachedSystemInformation (
+    _In_ ULONG SystemInformationClass,
+    _Out_writes_bytes_opt_(SystemInformationLength) PVOID SystemInformation,
+    _In_ ULONG SystemInformationLength,
+    _Out_opt_ PULONG ReturnLength,
+    _Out_ NTSTATUS* Status
+    );
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CacheSystemInformation (
+    _In_ ULONG SystemInformationClass,
+    _In_reads_bytes_(Length) const VOID* SystemInformation,
+    _In_ ULONG Length
+    );
@@ -11,6 +11,8 @@
 #include "Common.hpp"
 #include "HookCommon.hpp"
 #include "HookKernelHandlers.hpp"
+#include "HookKernelHookPoint.hpp"
+#include "Disassembler.hpp"
 
 //
 // A byte array that represents the below x64 code.
@@ -29,6 +31,13 @@ typedef struct _JMP_CODE
 static_assert(sizeof(JMP_CODE) == 15, "Size check");
 #include <poppack.h>
 
+//
+// The size of the original call stub. The largest one is made for a
+// conditional branch, which is the instruction followed by two JMP_CODE-s.
+//
+static constexpr ULONG k_OriginalCallStubSize = k_MaxInsturctionLength +
+                                                sizeof(JMP_CODE) * 2;
+
 //
 // Memory related resources allocated for a hook. This data structure is defined
 // separately from HOOK_ENTRY because identical set of those data is shared with
@@ -46,10 +55,22 @@ typedef struct _SHARED_MEMORY_ENTRY
     //
     PVOID ExecPage;
 
+    //
+    // The copies of ExecPage allocated on each NUMA node, indexed by the node
+    // number, or NULL. Allocated only when the system has more than one node.
+    //
+    PVOID ExecPageReplicas[k_MaxExecPageReplicas];
+
     //
     // The MDL for HookAddressBase.
     //
     PMDL HookAddressMdl;
+
+    //
+    // The MDL for the page following HookAddressBase, or NULL. Created when
+    // any of hooks on HookAddressBase straddles the page boundary.
+    //
+    PMDL LinkedPageMdl;
 } SHARED_MEMORY_ENTRY, *PSHARED_MEMORY_ENTRY;
 
 //
@@ -60,6 +81,82 @@ typedef struct _SHARED_MEMORY_ENTRY
 static SHARED_MEMORY_ENTRY g_HookSharedMemoryEntries[
     RTL_NUMBER_OF(g_HookRegistrationEntries)];
 
+/*!
+    @brief Allocates the copies of the page on each NUMA node.
+
+    @details Failure to allocate a copy is not fatal. Processors on the node
+        use ExecPage instead.
+
+    @param[in,out] SharedMemoryEntry - The SHARED_MEMORY_ENTRY to allocate
+        ExecPageReplicas for.
+
+    @param[in] PageBase - The page aligned address of the contents to copy.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+AllocateExecPageReplicas (
+    _Inout_ PSHARED_MEMORY_ENTRY SharedMemoryEntry,
+    _In_ PCVOID PageBase
+    )
+{
+    ULONG nodeCount;
+    PHYSICAL_ADDRESS lowest, highest, boundary;
+    PVOID replica;
+
+    nodeCount = static_cast<ULONG>(KeQueryHighestNodeNumber()) + 1;
+    if (nodeCount == 1)
+    {
+        goto Exit;
+    }
+
+    lowest.QuadPart = 0;
+    highest.QuadPart = MAXULONG64;
+    boundary.QuadPart = 0;
+    for (ULONG node = 0; node < min(nodeCount, k_MaxExecPageReplicas); ++node)
+    {
+        replica = MmAllocateContiguousNodeMemory(PAGE_SIZE,
+                                                 lowest,
+                                                 highest,
+                                                 boundary,
+                                                 PAGE_READWRITE,
+                                                 node);
+        if (replica == nullptr)
+        {
+            LOGGING_LOG_WARN("MmAllocateContiguousNodeMemory failed : %lu", node);
+            continue;
+        }
+        RtlCopyMemory(replica, PageBase, PAGE_SIZE);
+        SharedMemoryEntry->ExecPageReplicas[node] = replica;
+    }
+
+Exit:
+    return;
+}
+
+/*!
+    @brief Frees the copies of the page allocated on each NUMA node.
+
+    @param[in,out] SharedMemoryEntry - The SHARED_MEMORY_ENTRY to free
+        ExecPageReplicas.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+FreeExecPageReplicas (
+    _Inout_ PSHARED_MEMORY_ENTRY SharedMemoryEntry
+    )
+{
+    for (auto& replica : SharedMemoryEntry->ExecPageReplicas)
+    {
+        if (replica != nullptr)
+        {
+            MmFreeContiguousMemory(replica);
+            replica = nullptr;
+        }
+    }
+}
+
 /*!
     @brief Gets the SHARED_MEMORY_ENTRY entry to use for the specified address.
 
@@ -165,6 +262,11 @@ GetSharedMemoryEntry (
         goto Exit;
     }
 
+    //
+    // Let processors fetch hooked code from the exec page on the local node.
+    //
+    AllocateExecPageReplicas(memoryEntry, hookAddressBase);
+
     status = STATUS_SUCCESS;
     memoryEntry->HookAddressBase = hookAddressBase;
     memoryEntry->ExecPage = execPage;
@@ -182,6 +284,65 @@ Exit:
     return status;
 }
 
+/*!
+    @brief Locks the page following the page managed by the SHARED_MEMORY_ENTRY.
+
+    @param[in,out] SharedMemoryEntry - The SHARED_MEMORY_ENTRY to lock the next
+        page of.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+NTSTATUS
+LockLinkedPage (
+    _Inout_ PSHARED_MEMORY_ENTRY SharedMemoryEntry
+    )
+{
+    NTSTATUS status;
+    PVOID linkedPage;
+    PMDL mdl;
+
+    if (SharedMemoryEntry->LinkedPageMdl != nullptr)
+    {
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+
+    //
+    // Lock the next page for the same reason as the hook page. See the
+    // GetSharedMemoryEntry function.
+    //
+    linkedPage = Add2Ptr(SharedMemoryEntry->HookAddressBase, PAGE_SIZE);
+    mdl = IoAllocateMdl(linkedPage, PAGE_SIZE, FALSE, FALSE, nullptr);
+    if (mdl == nullptr)
+    {
+        LOGGING_LOG_ERROR("IoAllocateMdl failed : %p", linkedPage);
+        status = STATUS_UNSUCCESSFUL;
+        goto Exit;
+    }
+
+    __try
+    {
+        MmProbeAndLockPages(mdl, KernelMode, IoReadAccess);
+    }
+#pragma prefast(suppress : __WARNING_EXCEPTIONEXECUTEHANDLER, "Always want to handle exception")
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        status = GetExceptionCode();
+        LOGGING_LOG_ERROR("MmProbeAndLockPages failed : %08x", status);
+        IoFreeMdl(mdl);
+        goto Exit;
+    }
+
+    status = STATUS_SUCCESS;
+    SharedMemoryEntry->LinkedPageMdl = mdl;
+
+Exit:
+    return status;
+}
+
 /*!
     @brief Creates a code byte array for an absolute jump instruction.
 
@@ -212,20 +373,15 @@ CreateJumpCode (
 }
 
 /*!
-    @brief Returns the length of the first instruction at the specified address.
-
-    @details This is a simplistic length disassembler, that is, it takes an
-        address, determines the first x86 instruction there, and returns the
-        length of the instruction. It, however, only handles known byte patterns
-        for simplicity instead of actually disassembling bytes. One can replace
-        this implementation with better disassemble code as needed.
+    @brief Decodes the first instruction at the specified address and tests
+        whether it can be relocated to the original call stub.
 
     @param[in] HookAddress - The address to install a hook.
 
-    @param[out] InstructionLength - The address to receive the length of the
-        instruction.
+    @param[out] Instruction - The address to receive the decoded instruction.
 
-    @return TRUE when the first instruction is determined; otherwise, FALSE.
+    @return TRUE when the first instruction is decoded and can be relocated;
+        otherwise, FALSE.
  */
 static
 _Success_(return)
@@ -233,89 +389,303 @@ _Check_return_
 BOOLEAN
 FindFirstInstruction (
     _In_ PVOID HookAddress,
-    _Out_ PULONG InstructionLength
+    _Out_ PINSTRUCTION_INFO Instruction
     )
 {
     BOOLEAN ok;
 
-    typedef struct _BYTE_PATTERN
+    ok = FALSE;
+
+    if (DecodeInstruction(HookAddress, Instruction) == FALSE)
+    {
+        goto Exit;
+    }
+
+    //
+    // Do not hook where someone else already installed a break point.
+    //
+    if ((Instruction->OpcodeMap == OpcodeMapPrimary) &&
+        (Instruction->Opcode == 0xcc))
+    {
+        goto Exit;
+    }
+
+    //
+    // RIP-relative operands cannot be relocated since the original call stub
+    // may be more than 2GB away from the hook address. Neither can XBEGIN.
+    //
+    if (Instruction->IsRipRelative != FALSE)
+    {
+        goto Exit;
+    }
+    if ((Instruction->IsRelativeBranch != FALSE) &&
+        (Instruction->OpcodeMap == OpcodeMapPrimary) &&
+        (Instruction->Opcode == 0xc7))
+    {
+        goto Exit;
+    }
+
+    ok = TRUE;
+
+Exit:
+    return ok;
+}
+
+/*!
+    @brief Builds the code to execute the instruction at the hook address and
+        to jump to the next instruction of it.
+
+    @details Relative branches are rewritten to jump to the same destinations
+        with absolute jumps.
+
+    @param[in] HookAddress - The address to install a hook.
+
+    @param[in] Instruction - The decoded instruction at HookAddress.
+
+    @param[out] OriginalCallStub - The address of the buffer to build the code.
+ */
+static
+VOID
+BuildOriginalCallStub (
+    _In_ PVOID HookAddress,
+    _In_ const INSTRUCTION_INFO* Instruction,
+    _Out_writes_bytes_(k_OriginalCallStubSize) PUCHAR OriginalCallStub
+    )
+{
+    ULONG length;
+    JMP_CODE jmpCode;
+    PVOID branchTarget;
+    PVOID nextAddress;
+
+    length = 0;
+    branchTarget = nullptr;
+    nextAddress = Add2Ptr(HookAddress, Instruction->Length);
+
+    if (Instruction->IsRelativeBranch == FALSE)
     {
         //
-        // An actual instruction length in bytes.
+        // Copy the instruction as-is.
         //
-        ULONG InsructionLength;
-
+        RtlCopyMemory(OriginalCallStub, HookAddress, Instruction->Length);
+        length = Instruction->Length;
+    }
+    else if ((Instruction->OpcodeMap == OpcodeMapPrimary) &&
+             ((Instruction->Opcode == 0xe9) || (Instruction->Opcode == 0xeb)))
+    {
         //
-        // A length of Bytes to use for match. This can be different from
-        // InsructionLength when the last few bytes are variable and unnecessary
-        // for determination of the instruction.
+        // JMP. Just jump to the destination instead of the next instruction.
         //
-        ULONG MatchLength;
-        UCHAR Bytes[k_MaxInsturctionLength];
-    } BYTE_PATTERN, *PBYTE_PATTERN;
+        nextAddress = GetRelativeBranchTarget(HookAddress, Instruction);
+    }
+    else if ((Instruction->OpcodeMap == OpcodeMapPrimary) &&
+             (Instruction->Opcode == 0xe8))
+    {
+        //
+        // CALL. Call the destination indirectly, and jump to the next
+        // instruction on return.
+        //  ff1502000000     call    qword ptr cs:call_addr
+        //  eb08             jmp     next
+        // call_addr:
+        //  0000000000000000 dq 0
+        // next:
+        //
+        static const UCHAR callCode[] =
+        {
+            0xff, 0x15, 0x02, 0x00, 0x00, 0x00, 0xeb, 0x08,
+        };
+
+        RtlCopyMemory(OriginalCallStub, callCode, sizeof(callCode));
+        length = sizeof(callCode);
+        branchTarget = GetRelativeBranchTarget(HookAddress, Instruction);
+        RtlCopyMemory(OriginalCallStub + length,
+                      &branchTarget,
+                      sizeof(branchTarget));
+        length += sizeof(branchTarget);
+        branchTarget = nullptr;
+    }
+    else
+    {
+        //
+        // Jcc, LOOPcc or JrCXZ. Rewrite the instruction to its rel8 form to
+        // skip the jump to the next instruction when the condition is met.
+        //  jcc     taken
+        //  <jump to the next instruction>
+        // taken:
+        //  <jump to the destination>
+        //
+        if (Instruction->OpcodeMap == OpcodeMap0F)
+        {
+            OriginalCallStub[length++] = 0x70 | (Instruction->Opcode & 0xf);
+        }
+        else
+        {
+            //
+            // Preserve prefixes as the address size override changes the
+            // counter register of LOOPcc and JrCXZ.
+            //
+            RtlCopyMemory(OriginalCallStub,
+                          HookAddress,
+                          Instruction->ImmediateOffset);
+            length = Instruction->ImmediateOffset;
+        }
+        OriginalCallStub[length++] = sizeof(jmpCode);
+        branchTarget = GetRelativeBranchTarget(HookAddress, Instruction);
+    }
+
+    //
+    // Append the code of "jmp to the next instruction of hooked address", and
+    // "jmp to the destination of the branch" if needed.
+    //
+    jmpCode = CreateJumpCode(nextAddress);
+    RtlCopyMemory(OriginalCallStub + length, &jmpCode, sizeof(jmpCode));
+    length += sizeof(jmpCode);
 
-    static const BYTE_PATTERN knownPatterns[] =
+    if (branchTarget != nullptr)
     {
-        {   // push    rbx
-            2, 2, { 0x40, 0x53, },
-        },
-        {   // push    rbp
-            2, 2, { 0x40, 0x55, },
-        },
-        {   // push    rdi
-            2, 2, { 0x40, 0x57, },
-        },
-        {   // sub     rsp, Imm
-            4, 3, { 0x48, 0x83, 0xEC, /*Imm*/ },
-        },
-        {   // mov     [rsp - 8 + arg_8], rdx
-            5, 5, { 0x48, 0x89, 0x54, 0x24, 0x10, },
-        },
-        {   // mov     [rsp + Offset], rbx
-            5, 4, { 0x48, 0x89, 0x5c, 0x24, /*Offset*/ },
-        },
-        {   // mov     rax, rsp
-            3, 3, { 0x48, 0x8B, 0xC4, },
-        },
-        {   // xor     edx, edx
-            2, 2, { 0x33, 0xD2, },
-        },
-    };
+        jmpCode = CreateJumpCode(branchTarget);
+        RtlCopyMemory(OriginalCallStub + length, &jmpCode, sizeof(jmpCode));
+    }
+}
 
-    *InstructionLength = 0;
+/*!
+    @brief Decodes the hooked instruction from the copy of the page.
 
-    ok = FALSE;
-    for (auto& pattern : knownPatterns)
+    @details The copy is a single page. When the instruction straddles the
+        page boundary, the bytes in the page are taken from the copy and the
+        rest from the next page at the hook address, as those are what the
+        processor executes when the linked page is executable. Bytes beyond the
+        expected length are not read from the next page, which may not be
+        mapped, and are zero.
+
+    @param[in] HookAddress - The address to install a hook.
+
+    @param[in] Page - The exec page or its copy.
+
+    @param[in] Length - The expected length of the instruction.
+
+    @param[out] Instruction - The address to receive the decoded instruction.
+
+    @return TRUE when the instruction is decoded; otherwise, FALSE.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Success_(return)
+_Check_return_
+BOOLEAN
+DecodeInstructionInPage (
+    _In_ PVOID HookAddress,
+    _In_ PCVOID Page,
+    _In_ ULONG Length,
+    _Out_ PINSTRUCTION_INFO Instruction
+    )
+{
+    UCHAR bytes[k_MaxInsturctionLength];
+    ULONG bytesInPage;
+
+    NT_ASSERT(Length <= sizeof(bytes));
+
+    RtlZeroMemory(bytes, sizeof(bytes));
+    bytesInPage = min(PAGE_SIZE - BYTE_OFFSET(HookAddress),
+                      static_cast<ULONG>(sizeof(bytes)));
+    RtlCopyMemory(bytes,
+                  Add2Ptr(Page, BYTE_OFFSET(HookAddress)),
+                  bytesInPage);
+    if (Length > bytesInPage)
+    {
+        RtlCopyMemory(&bytes[bytesInPage],
+                      Add2Ptr(HookAddress, bytesInPage),
+                      Length - bytesInPage);
+    }
+    return DecodeInstruction(bytes, Instruction);
+}
+
+/*!
+    @brief Cross-checks the length of the hooked instruction against the code
+        the break point is installed into and the original call stub.
+
+    @details The instruction is decoded again from the exec page and its
+        copies, and from the original call stub when it is copied as-is. All
+        must decode to the same length as the instruction at the hook address.
+        Otherwise, the break point would not replace exactly the instruction
+        the stub executes, for example, because another hook is already
+        installed at the address.
+
+    @param[in] HookAddress - The address to install a hook.
+
+    @param[in] Instruction - The decoded instruction at HookAddress.
+
+    @param[in] SharedMemoryEntry - The SHARED_MEMORY_ENTRY of the page
+        referenced on execution.
+
+    @param[in] OriginalCallStub - The original call stub built for the hook.
+
+    @return TRUE when all lengths match; otherwise, FALSE.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+BOOLEAN
+VerifyHookedInstructionLength (
+    _In_ PVOID HookAddress,
+    _In_ const INSTRUCTION_INFO* Instruction,
+    _In_ const SHARED_MEMORY_ENTRY* SharedMemoryEntry,
+    _In_ PCUCHAR OriginalCallStub
+    )
+{
+    BOOLEAN matched;
+    INSTRUCTION_INFO decoded;
+
+    matched = FALSE;
+
+    if ((DecodeInstructionInPage(HookAddress,
+                                 SharedMemoryEntry->ExecPage,
+                                 Instruction->Length,
+                                 &decoded) == FALSE) ||
+        (decoded.Length != Instruction->Length))
+    {
+        goto Exit;
+    }
+    for (auto replica : SharedMemoryEntry->ExecPageReplicas)
     {
-        if (RtlEqualMemory(HookAddress, pattern.Bytes, pattern.MatchLength) != FALSE)
+        if ((replica != nullptr) &&
+            ((DecodeInstructionInPage(HookAddress,
+                                      replica,
+                                      Instruction->Length,
+                                      &decoded) == FALSE) ||
+             (decoded.Length != Instruction->Length)))
         {
-            *InstructionLength = pattern.InsructionLength;
-            ok = TRUE;
             goto Exit;
         }
     }
 
+    if ((Instruction->IsRelativeBranch == FALSE) &&
+        ((DecodeInstruction(OriginalCallStub, &decoded) == FALSE) ||
+         (decoded.Length != Instruction->Length)))
+    {
+        goto Exit;
+    }
+
+    matched = TRUE;
+
 Exit:
-    return ok;
+    return matched;
 }
 
 /*!
     @brief Installs a hook on the exec page and builds the stub to call the
         original function.
 
-    @details This is a simplistic disassembler function, that is, takes an
-        address, determines the first x86 instruction there, and return
-        information about it. It, however, only handles known byte patterns
-        instead of actually disassembling bytes for simplicity. One can replace
-        this implementation with better disassemble code as needed.
-
     @param[in] HookAddress - The address to install a hook.
 
-    @param[in] ExecPage - The address of the page referenced on execution.
+    @param[in,out] SharedMemoryEntry - The SHARED_MEMORY_ENTRY of the page
+        referenced on execution. The hook is installed on all its copies.
 
     @param[out] OriginalCallStub - The address to receive an address of code
         stub to call the original function.
 
+    @param[out] InstructionLength - The address to receive the length of the
+        hooked instruction.
+
     @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
  */
 static
@@ -324,29 +694,30 @@ _Check_return_
 NTSTATUS
 InstallHookOnExecPage (
     _In_ PVOID HookAddress,
-    _In_ PVOID ExecPage,
-    _Outptr_result_nullonfailure_ PVOID* OriginalCallStub
+    _Inout_ PSHARED_MEMORY_ENTRY SharedMemoryEntry,
+    _Outptr_result_nullonfailure_ PVOID* OriginalCallStub,
+    _Out_ PULONG InstructionLength
     )
 {
     NTSTATUS status;
-    JMP_CODE jmpCode;
-    PVOID originalCallStub;
-    ULONG instrLength;
+    PUCHAR originalCallStub;
+    INSTRUCTION_INFO instruction;
     PUCHAR hookAddrInExecPage;
 
     *OriginalCallStub = nullptr;
+    *InstructionLength = 0;
 
     //
     // Determine the first instruction at the hook address, so that we can
     // safely replace it with a break point.
     //
-    if (FindFirstInstruction(HookAddress, &instrLength) == FALSE)
+    if (FindFirstInstruction(HookAddress, &instruction) == FALSE)
     {
         PCUCHAR bytes;
 
         bytes = static_cast<PCUCHAR>(HookAddress);
-        LOGGING_LOG_ERROR("No supported byte pattern found at %p", HookAddress);
-        LOGGING_LOG_ERROR("Pattern: "
+        LOGGING_LOG_ERROR("Unsupported instruction found at %p", HookAddress);
+        LOGGING_LOG_ERROR("Bytes: "
                           "%02x %02x %02x %02x %02x "
                           "%02x %02x %02x %02x %02x "
                           "%02x %02x %02x %02x %02x",
@@ -357,17 +728,6 @@ InstallHookOnExecPage (
         goto Exit;
     }
 
-    //
-    // Bail out if the instruction belongs to two pages. FIXME as needed.
-    //
-    if (PAGE_ALIGN(Add2Ptr(HookAddress, instrLength - 1)) != PAGE_ALIGN(HookAddress))
-    {
-        LOGGING_LOG_ERROR("The target instruction at %p belongs to two pages",
-                          HookAddress);
-        status = STATUS_UNSUCCESSFUL;
-        goto Exit;
-    }
-
     //
     // Allocate executable memory that is going to contain copy of the first
     // instruction and a jmp instruction to the next instruction of hooked
@@ -375,42 +735,58 @@ InstallHookOnExecPage (
     // after hook is installed.
     //
 #pragma prefast(suppress : 30030, "Intentionally executable")
-    originalCallStub = ExAllocatePoolWithTag(NonPagedPoolExecute,
-                                             instrLength + sizeof(jmpCode),
-                                             k_PoolTag);
+    originalCallStub = static_cast<PUCHAR>(ExAllocatePoolWithTag(
+                                                NonPagedPoolExecute,
+                                                k_OriginalCallStubSize,
+                                                k_PoolTag));
     if (originalCallStub == nullptr)
     {
-        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu",
-                          instrLength + sizeof(jmpCode));
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %lu",
+                          k_OriginalCallStubSize);
         status = STATUS_INSUFFICIENT_RESOURCES;
         goto Exit;
     }
 
-    //
-    // Create a byte array that represents "jmp to the next instruction of
-    // hooked address".
-    //
-    jmpCode = CreateJumpCode(Add2Ptr(HookAddress, instrLength));
+    BuildOriginalCallStub(HookAddress, &instruction, originalCallStub);
 
     //
-    // Copy the first instruction and the jmp code to the stub code memory.
+    // Do not install the break point unless it replaces exactly the
+    // instruction the stub executes.
     //
-    RtlCopyMemory(originalCallStub, HookAddress, instrLength);
-    RtlCopyMemory(Add2Ptr(originalCallStub, instrLength),
-                  &jmpCode,
-                  sizeof(jmpCode));
+    if (VerifyHookedInstructionLength(HookAddress,
+                                      &instruction,
+                                      SharedMemoryEntry,
+                                      originalCallStub) == FALSE)
+    {
+        LOGGING_LOG_ERROR("Instruction length mismatch at %p : %lu bytes",
+                          HookAddress,
+                          instruction.Length);
+        ExFreePoolWithTag(originalCallStub, k_PoolTag);
+        status = STATUS_UNSUCCESSFUL;
+        goto Exit;
+    }
 
     //
-    // Install a breakpoint to the exec page so that the hypervisor can tell
-    // when it is being executed.
+    // Install a breakpoint to the exec page and its copies so that the
+    // hypervisor can tell when it is being executed.
     //
-    hookAddrInExecPage = static_cast<PUCHAR>(Add2Ptr(ExecPage,
+    hookAddrInExecPage = static_cast<PUCHAR>(Add2Ptr(SharedMemoryEntry->ExecPage,
                                                      BYTE_OFFSET(HookAddress)));
     *hookAddrInExecPage = 0xcc;
+    for (auto replica : SharedMemoryEntry->ExecPageReplicas)
+    {
+        if (replica != nullptr)
+        {
+            hookAddrInExecPage = static_cast<PUCHAR>(Add2Ptr(replica,
+                                                     BYTE_OFFSET(HookAddress)));
+            *hookAddrInExecPage = 0xcc;
+        }
+    }
     (VOID)KeInvalidateAllCaches();
 
     status = STATUS_SUCCESS;
     *OriginalCallStub = originalCallStub;
+    *InstructionLength = instruction.Length;
 
 Exit:
     return status;
@@ -443,6 +819,7 @@ InitializeHookEntry (
     PSHARED_MEMORY_ENTRY sharedMemoryEntry;
     PVOID execPage;
     PVOID originalCallStub;
+    ULONG instrLength;
 
     RtlZeroMemory(HookEntry, sizeof(*HookEntry));
     execPage = nullptr;
@@ -471,19 +848,47 @@ InitializeHookEntry (
     // code.
     //
     status = InstallHookOnExecPage(HookAddress,
-                                   sharedMemoryEntry->ExecPage,
-                                   &originalCallStub);
+                                   sharedMemoryEntry,
+                                   &originalCallStub,
+                                   &instrLength);
     if (!NT_SUCCESS(status))
     {
         LOGGING_LOG_ERROR("InstallHookOnExecPage failed : %08x", status);
         goto Exit;
     }
 
+    //
+    // If the hooked instruction straddles the page boundary, link the next
+    // page to the hook page so that the hypervisor makes both executable
+    // together.
+    //
+    if (PAGE_ALIGN(Add2Ptr(HookAddress, instrLength - 1)) != PAGE_ALIGN(HookAddress))
+    {
+        status = LockLinkedPage(sharedMemoryEntry);
+        if (!NT_SUCCESS(status))
+        {
+            LOGGING_LOG_ERROR("LockLinkedPage failed : %08x", status);
+            goto Exit;
+        }
+        HookEntry->PhyLinkedPageBase = GetPaFromVa(
+                        Add2Ptr(sharedMemoryEntry->HookAddressBase, PAGE_SIZE));
+    }
+
     HookEntry->Handler = Handler;
     HookEntry->HookAddress = HookAddress;
     HookEntry->PageBaseForExecution = sharedMemoryEntry->ExecPage;
     HookEntry->PhyPageBase = GetPaFromVa(PAGE_ALIGN(HookAddress));
     HookEntry->PhyPageBaseForExecution = GetPaFromVa(HookEntry->PageBaseForExecution);
+    for (ULONG node = 0; node < k_MaxExecPageReplicas; ++node)
+    {
+        execPage = sharedMemoryEntry->ExecPageReplicas[node];
+        if (execPage == nullptr)
+        {
+            execPage = HookEntry->PageBaseForExecution;
+        }
+        HookEntry->PageBasesForExecution[node] = execPage;
+        HookEntry->PhyPageBasesForExecution[node] = GetPaFromVa(execPage);
+    }
     HookEntry->OriginalCallStub = originalCallStub;
 
 Exit:
@@ -518,9 +923,11 @@ InitializeHookRegistrationEntries (
     //
     // Build HOOK_ENTRY for each hook registration entry.
     //
-    for (auto& registration : g_HookRegistrationEntries)
+    for (auto& registration : GetHookRegistrationEntries())
     {
         PVOID functionAddr;
+        PVOID hookAddr;
+        PVOID handler;
 
         NT_ASSERT(registration.FunctionName.Buffer != nullptr);
 
@@ -533,19 +940,77 @@ InitializeHookRegistrationEntries (
             goto Exit;
         }
 
+        //
+        // For a hook point, the hypervisor transfers execution to the
+        // generated entry stub instead of the handler.
+        //
+        if (registration.HookPointHandler != nullptr)
+        {
+            status = CreateHookPointStub(&registration,
+                                         functionAddr,
+                                         &hookAddr,
+                                         &handler);
+            if (!NT_SUCCESS(status))
+            {
+                LOGGING_LOG_ERROR("CreateHookPointStub failed : %08x", status);
+                goto Exit;
+            }
+        }
+        else
+        {
+            hookAddr = functionAddr;
+            handler = registration.Handler;
+        }
+
         status = InitializeHookEntry(&registration.HookEntry,
-                                     registration.Handler,
-                                     functionAddr);
+                                     handler,
+                                     hookAddr);
         if (!NT_SUCCESS(status))
         {
             LOGGING_LOG_ERROR("InitializeHookEntry failed : %08x", status);
+            if (registration.HookPointHandler != nullptr)
+            {
+                ExFreePoolWithTag(handler, k_PoolTag);
+            }
             goto Exit;
         }
 
-        LOGGING_LOG_INFO("Hook installed at %p (ExecPage at %p) for %wZ",
-                         functionAddr,
+        //
+        // Let the generated handler know the original call stub.
+        //
+        if (registration.ThunkData != nullptr)
+        {
+            registration.ThunkData->OriginalCallStub = registration.HookEntry.OriginalCallStub;
+            registration.ThunkData->FunctionName = &registration.FunctionName;
+            registration.ThunkData->Registration = &registration;
+        }
+
+        LOGGING_LOG_INFO("Hook installed at %p (ExecPage at %p) for %wZ+%lx",
+                         hookAddr,
                          registration.HookEntry.PageBaseForExecution,
-                         &registration.FunctionName);
+                         &registration.FunctionName,
+                         registration.Offset);
+    }
+
+    //
+    // Let all hooks on the same page share the linked page, as the hypervisor
+    // looks up only the first HOOK_ENTRY for the page.
+    //
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        if (registration.HookEntry.PhyLinkedPageBase == 0)
+        {
+            continue;
+        }
+
+        for (auto& other : GetHookRegistrationEntries())
+        {
+            if (other.HookEntry.PhyPageBase == registration.HookEntry.PhyPageBase)
+            {
+                other.HookEntry.PhyLinkedPageBase =
+                                    registration.HookEntry.PhyLinkedPageBase;
+            }
+        }
     }
 
 Exit:
@@ -556,12 +1021,16 @@ Exit:
         // g_HookSharedMemoryEntries failed in the middle. Clean up any already
         // initialized entries.
         //
-        for (auto& registration : g_HookRegistrationEntries)
+        for (auto& registration : GetHookRegistrationEntries())
         {
             if (registration.HookEntry.OriginalCallStub != nullptr)
             {
                 ExFreePoolWithTag(registration.HookEntry.OriginalCallStub,
                                   k_PoolTag);
+                if (registration.HookPointHandler != nullptr)
+                {
+                    ExFreePoolWithTag(registration.HookEntry.Handler, k_PoolTag);
+                }
             }
         }
         for (auto& sharedMemoryEntry : g_HookSharedMemoryEntries)
@@ -571,6 +1040,12 @@ Exit:
                 MmUnlockPages(sharedMemoryEntry.HookAddressMdl);
                 IoFreeMdl(sharedMemoryEntry.HookAddressMdl);
                 ExFreePoolWithTag(sharedMemoryEntry.ExecPage, k_PoolTag);
+                FreeExecPageReplicas(&sharedMemoryEntry);
+            }
+            if (sharedMemoryEntry.LinkedPageMdl != nullptr)
+            {
+                MmUnlockPages(sharedMemoryEntry.LinkedPageMdl);
+                IoFreeMdl(sharedMemoryEntry.LinkedPageMdl);
             }
         }
     }
@@ -587,10 +1062,18 @@ CleanupHookRegistrationEntries (
     VOID
     )
 {
-    for (auto& registration : g_HookRegistrationEntries)
+    for (auto& registration : GetHookRegistrationEntries())
     {
+        if (registration.ThunkData != nullptr)
+        {
+            registration.ThunkData->OriginalCallStub = nullptr;
+        }
         ExFreePoolWithTag(registration.HookEntry.OriginalCallStub,
                           k_PoolTag);
+        if (registration.HookPointHandler != nullptr)
+        {
+            ExFreePoolWithTag(registration.HookEntry.Handler, k_PoolTag);
+        }
     }
     for (auto& sharedMemoryEntry : g_HookSharedMemoryEntries)
     {
@@ -599,6 +1082,12 @@ CleanupHookRegistrationEntries (
             MmUnlockPages(sharedMemoryEntry.HookAddressMdl);
             IoFreeMdl(sharedMemoryEntry.HookAddressMdl);
             ExFreePoolWithTag(sharedMemoryEntry.ExecPage, k_PoolTag);
+            FreeExecPageReplicas(&sharedMemoryEntry);
+        }
+        if (sharedMemoryEntry.LinkedPageMdl != nullptr)
+        {
+            MmUnlockPages(sharedMemoryEntry.LinkedPageMdl);
+            IoFreeMdl(sharedMemoryEntry.LinkedPageMdl);
         }
     }
 }
@@ -618,6 +1107,42 @@ ReportHookActivities (
                      static_cast<ULONG64>(g_ExAllocatePoolWithTagCounter));
     LOGGING_LOG_INFO("ExFreePoolWithTag called %llu times",
                      static_cast<ULONG64>(g_ExFreePoolWithTagCounter));
-    LOGGING_LOG_INFO("ExFreePool called %llu times",
-                     static_cast<ULONG64>(g_ExFreePoolCounter));
+    LOGGING_LOG_INFO("Suspended-visible state entered %llu times, resumed "
+                     "%llu times",
+                     static_cast<ULONG64>(g_SuspendedVisibleStatistics.SuspendCount),
+                     static_cast<ULONG64>(g_SuspendedVisibleStatistics.ResumeCount));
+
+    //
+    // Report statistics collected by generated handlers.
+    //
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        const HOOK_THUNK_DATA* data;
+
+        data = registration.ThunkData;
+        if (data == nullptr)
+        {
+            continue;
+        }
+
+        LOGGING_LOG_INFO("%wZ called %llu times (%llu cycles)",
+                         &registration.FunctionName,
+                         static_cast<ULONG64>(data->CallCount),
+                         static_cast<ULONG64>(data->ElapsedCycles));
+
+        for (ULONG i = 0; i < min(static_cast<ULONG>(data->NextRecordIndex),
+                                  k_HookArgumentRecordCount); ++i)
+        {
+            const HOOK_ARGUMENT_RECORD* record;
+
+            record = &data->Records[i];
+            LOGGING_LOG_INFO("  %p: (%llx, %llx, %llx, %llx) => %llx",
+                             record->ReturnAddress,
+                             record->Arguments[0],
+                             record->Arguments[1],
+                             record->Arguments[2],
+                             record->Arguments[3],
+                             record->Result);
+        }
+    }
 }
\ No newline at end of file
@@ -0,0 +1,429 @@
+/*!
+    @file HookKernelShadows.cpp
+
+    @brief Kernel mode code to precompute PDTs of the state 2 for each hooked
+        page.
+
+    @details A shadow is the PDT of the state 2 for the 1GB range of a hooked
+        page, used by NptTransitionBackendHookShadows. It is built from the
+        PDT of the state 0 by copying it and making all entries
+        non-executable, then, copying the PT on the path to each page
+        executable in the state 2 within the range and making only that path
+        executable. The hooked page is backed by the exec page in the shadow,
+        and so is the linked page if it has hooks too. The rest of PTs and all
+        leaf pages are shared with the NPT of the state 1.
+
+        In the state 2, the sweep backend makes the PDPT entry of the hooked
+        page executable and then rewrites all 512 PDT entries and all 512 PT
+        entries to re-isolate the hooked page, and rewrites them back on the
+        transition to the state 1. The shadow replaces those loops with a swap
+        of the PFN of the PDPT entry. Executable pages outside of the range are
+        rare, and are still handled in place as the sweep backend does.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelShadows.hpp"
+#include "Common.hpp"
+#include "HookCommon.hpp"
+
+/*!
+    @brief Allocates a table owned by the shadow as a non-executable copy of
+        the table.
+
+    @param[in,out] Shadow - The shadow to own the table.
+
+    @param[in] SourceTable - The table to copy.
+
+    @return The address of the copy on success, or NULL.
+ */
+template<typename TableType>
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+TableType*
+CopyTableForShadow (
+    _Inout_ PHOOK_SHADOW Shadow,
+    _In_reads_(512) const TableType* SourceTable
+    )
+{
+    TableType* table;
+
+    table = nullptr;
+
+    if (Shadow->TableCount >= RTL_NUMBER_OF(Shadow->Tables))
+    {
+        NT_ASSERT(FALSE);
+        goto Exit;
+    }
+
+    table = static_cast<TableType*>(AllocateNptEntry(nullptr));
+    if (table == nullptr)
+    {
+        goto Exit;
+    }
+    Shadow->Tables[Shadow->TableCount++] = table;
+
+    RtlCopyMemory(table, SourceTable, PAGE_SIZE);
+    for (ULONG i = 0; i < 512; ++i)
+    {
+        table[i].Fields.NoExecute = TRUE;
+    }
+
+Exit:
+    return table;
+}
+
+/*!
+    @brief Makes the page executable in the shadow.
+
+    @param[in,out] Shadow - The shadow to make the page executable.
+
+    @param[in] PhysicalAddress - The physical address of the page to make
+        executable. Must be within the range of the shadow.
+
+    @param[in] BackingPhysicalAddress - The physical address of the page to
+        back PhysicalAddress in the shadow.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+NTSTATUS
+MakePageExecutableInShadow (
+    _Inout_ PHOOK_SHADOW Shadow,
+    _In_ ULONG64 PhysicalAddress,
+    _In_ ULONG64 BackingPhysicalAddress
+    )
+{
+    NTSTATUS status;
+    PPD_ENTRY_4KB shadowPdt, sharedPdt;
+    PPT_ENTRY_4KB shadowPt, sharedPt;
+    ULONG64 pdeIndex, pteIndex;
+
+    NT_ASSERT(GetPpeIndex(PhysicalAddress) == Shadow->PpeIndex);
+
+    shadowPdt = static_cast<PPD_ENTRY_4KB>(GetVaFromPfn(Shadow->ShadowPdtPfn));
+    sharedPdt = static_cast<PPD_ENTRY_4KB>(GetVaFromPfn(Shadow->OriginalPdtPfn));
+
+    //
+    // PDT (2 MB). The entry refers to the PT owned by the shadow if its PFN
+    // differs from the one of the NPT of the state 1.
+    //
+    pdeIndex = GetPdeIndex(PhysicalAddress);
+    if (shadowPdt[pdeIndex].Fields.Valid == FALSE)
+    {
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+    if (shadowPdt[pdeIndex].Fields.PageFrameNumber ==
+        sharedPdt[pdeIndex].Fields.PageFrameNumber)
+    {
+        shadowPt = CopyTableForShadow(Shadow,
+                                      static_cast<PPT_ENTRY_4KB>(GetVaFromPfn(
+                                        sharedPdt[pdeIndex].Fields.PageFrameNumber)));
+        if (shadowPt == nullptr)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        shadowPdt[pdeIndex].Fields.PageFrameNumber = GetPfnFromVa(shadowPt);
+    }
+    shadowPdt[pdeIndex].Fields.NoExecute = FALSE;
+    shadowPt = static_cast<PPT_ENTRY_4KB>(GetVaFromPfn(
+                            shadowPdt[pdeIndex].Fields.PageFrameNumber));
+    sharedPt = static_cast<PPT_ENTRY_4KB>(GetVaFromPfn(
+                            sharedPdt[pdeIndex].Fields.PageFrameNumber));
+
+    //
+    // PT (4 KB)
+    //
+    pteIndex = GetPteIndex(PhysicalAddress);
+    if (sharedPt[pteIndex].Fields.Valid == FALSE)
+    {
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+    shadowPt[pteIndex].Fields.NoExecute = FALSE;
+    shadowPt[pteIndex].Fields.PageFrameNumber = GetPfnFromPa(BackingPhysicalAddress);
+
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Frees all tables owned by the shadow.
+
+    @param[in,out] Shadow - The shadow to free.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+CleanupHookShadow (
+    _Inout_ PHOOK_SHADOW Shadow
+    )
+{
+    for (ULONG i = 0; i < Shadow->TableCount; ++i)
+    {
+        FreeContiguousMemory(Shadow->Tables[i]);
+    }
+    Shadow->TableCount = 0;
+}
+
+/*!
+    @brief Builds the shadow for the hooked page.
+
+    @param[in] HookData - The processor associated hook data. The NPT must be
+        in the state 0.
+
+    @param[out] Shadow - The shadow to build.
+
+    @param[in] HookEntry - The hook on the page to build the shadow for.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+NTSTATUS
+BuildHookShadow (
+    _In_ const HOOK_DATA* HookData,
+    _Out_ PHOOK_SHADOW Shadow,
+    _In_ const HOOK_ENTRY* HookEntry
+    )
+{
+    NTSTATUS status;
+    PPDP_ENTRY_4KB pdpt;
+    PPD_ENTRY_4KB pdt;
+    ULONG64 linkedBackingPa;
+    ULONG64 pa;
+
+    RtlZeroMemory(Shadow, sizeof(*Shadow));
+    Shadow->PhyPageBase = HookEntry->PhyPageBase;
+    Shadow->PpeIndex = GetPpeIndex(HookEntry->PhyPageBase);
+
+    //
+    // Only the first PML4 entry is managed, as in the state 2 of the sweep
+    // backend. All physical memory ranges are within it.
+    //
+    if (GetPxeIndex(HookEntry->PhyPageBase) != 0)
+    {
+        status = STATUS_NOT_SUPPORTED;
+        goto Exit;
+    }
+
+    pdpt = static_cast<PPDP_ENTRY_4KB>(GetVaFromPfn(
+                            HookData->Pml4Table[0].Fields.PageFrameNumber));
+    if (pdpt[Shadow->PpeIndex].Fields.Valid == FALSE)
+    {
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+
+    //
+    // Copy the PDT and make everything non-executable.
+    //
+    Shadow->OriginalPdtPfn = pdpt[Shadow->PpeIndex].Fields.PageFrameNumber;
+    pdt = CopyTableForShadow(Shadow,
+                             static_cast<PPD_ENTRY_4KB>(GetVaFromPfn(
+                                                    Shadow->OriginalPdtPfn)));
+    if (pdt == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    Shadow->ShadowPdtPfn = GetPfnFromVa(pdt);
+
+    //
+    // Make the hooked page executable and backed by the exec page.
+    //
+    status = MakePageExecutableInShadow(Shadow,
+                                        HookEntry->PhyPageBase,
+                                        GetPhyPageBaseForExecution(HookEntry,
+                                                                   HookData));
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Do the same for the linked page if it is within the range. It is backed
+    // by the exec page only when it has hooks too.
+    //
+    if (HookEntry->PhyLinkedPageBase != 0)
+    {
+        if ((GetPxeIndex(HookEntry->PhyLinkedPageBase) != 0) ||
+            (GetPpeIndex(HookEntry->PhyLinkedPageBase) != Shadow->PpeIndex))
+        {
+            Shadow->OutOfRangePas[0] = HookEntry->PhyLinkedPageBase;
+        }
+        else
+        {
+            linkedBackingPa = HookEntry->PhyLinkedPageBase;
+            for (const auto& registration : GetHookRegistrationEntries())
+            {
+                if (registration.HookEntry.PhyPageBase == HookEntry->PhyLinkedPageBase)
+                {
+                    linkedBackingPa = GetPhyPageBaseForExecution(
+                                                    &registration.HookEntry,
+                                                    HookData);
+                    break;
+                }
+            }
+
+            status = MakePageExecutableInShadow(Shadow,
+                                                HookEntry->PhyLinkedPageBase,
+                                                linkedBackingPa);
+            if (!NT_SUCCESS(status))
+            {
+                goto Exit;
+            }
+        }
+    }
+
+    //
+    // Keep the trusted pages executable.
+    //
+    for (ULONG i = 0; i < g_TrustedPages.Count; ++i)
+    {
+        pa = g_TrustedPages.PhyPageBases[i];
+        if ((GetPxeIndex(pa) != 0) ||
+            (GetPpeIndex(pa) != Shadow->PpeIndex))
+        {
+            Shadow->OutOfRangePas[1 + i] = pa;
+            continue;
+        }
+
+        status = MakePageExecutableInShadow(Shadow, pa, pa);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+    }
+
+Exit:
+    if (!NT_SUCCESS(status))
+    {
+        CleanupHookShadow(Shadow);
+    }
+    return status;
+}
+
+/*!
+    @brief Builds the shadows for all hooked pages.
+
+    @param[in,out] HookData - The processor associated hook data to build the
+        shadows for. The NPT must be in the state 0.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_Use_decl_annotations_
+NTSTATUS
+BuildHookShadows (
+    PHOOK_DATA HookData
+    )
+{
+    NTSTATUS status;
+    PHOOK_SHADOWS shadows;
+    SIZE_T shadowsSize;
+    BOOLEAN built;
+
+    NT_ASSERT(HookData->NptState == NptDefault);
+    NT_ASSERT(HookData->Shadows == nullptr);
+
+    //
+    // Allocate the shadows for up to as many hooked pages as hooks.
+    //
+    shadowsSize = FIELD_OFFSET(HOOK_SHADOWS, Shadows) +
+                  sizeof(HOOK_SHADOW) * g_HookRegistrationEntryCount;
+#pragma prefast(suppress : 28118, "DISPATCH_LEVEL is ok as this always allocates NonPagedPool")
+    shadows = static_cast<PHOOK_SHADOWS>(ExAllocatePoolWithTag(NonPagedPool,
+                                                               shadowsSize,
+                                                               k_PoolTag));
+    if (shadows == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(shadows, shadowsSize);
+
+    //
+    // Build a shadow for each hooked page.
+    //
+    status = STATUS_SUCCESS;
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        built = FALSE;
+        for (ULONG i = 0; i < shadows->Count; ++i)
+        {
+            if (shadows->Shadows[i].PhyPageBase == registration.HookEntry.PhyPageBase)
+            {
+                built = TRUE;
+                break;
+            }
+        }
+        if (built != FALSE)
+        {
+            continue;
+        }
+
+        status = BuildHookShadow(HookData,
+                                 &shadows->Shadows[shadows->Count],
+                                 &registration.HookEntry);
+        if (!NT_SUCCESS(status))
+        {
+            LOGGING_LOG_ERROR("BuildHookShadow failed : %08x", status);
+            goto Exit;
+        }
+        shadows->Count++;
+    }
+
+    HookData->Shadows = shadows;
+
+Exit:
+    if (!NT_SUCCESS(status))
+    {
+        if (shadows != nullptr)
+        {
+            for (ULONG i = 0; i < shadows->Count; ++i)
+            {
+                CleanupHookShadow(&shadows->Shadows[i]);
+            }
+            ExFreePoolWithTag(shadows, k_PoolTag);
+        }
+    }
+    return status;
+}
+
+/*!
+    @brief Frees the shadows built by the BuildHookShadows function, if any.
+
+    @param[in,out] HookData - The processor associated hook data.
+ */
+_Use_decl_annotations_
+VOID
+DestroyHookShadows (
+    PHOOK_DATA HookData
+    )
+{
+    NT_ASSERT(HookData->ActiveShadow == nullptr);
+
+    if (HookData->Shadows == nullptr)
+    {
+        goto Exit;
+    }
+
+    for (ULONG i = 0; i < HookData->Shadows->Count; ++i)
+    {
+        CleanupHookShadow(&HookData->Shadows->Shadows[i]);
+    }
+    ExFreePoolWithTag(HookData->Shadows, k_PoolTag);
+    HookData->Shadows = nullptr;
+
+Exit:
+    return;
+}
@@ -0,0 +1,26 @@
+/*!
+    @file HookKernelShadows.hpp
+
+    @brief Kernel mode code to precompute PDTs of the state 2 for each hooked
+        page.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "HookCommon.hpp"
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+NTSTATUS
+BuildHookShadows (
+    _Inout_ PHOOK_DATA HookData
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+DestroyHookShadows (
+    _Inout_ PHOOK_DATA HookData
+    );
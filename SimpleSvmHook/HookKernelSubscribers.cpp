@@ -0,0 +1,600 @@
+/*!
+    @file HookKernelSubscribers.cpp
+
+    @brief Kernel mode code to let more than one component observe a hook.
+
+    @details Each hook has an immutable array of subscribers published through
+        HOOK_REGISTRATION_ENTRY::Subscribers. Hook handlers read the array
+        without taking a lock; they only increment a per processor reader
+        count for the current epoch while they use the array.
+
+        Subscription and unsubscription are serialized with a fast mutex. They
+        build a new array, publish it, and then wait for a grace period before
+        freeing the old array. The grace period flips the epoch and waits for
+        the reader counts of the previous epoch to drain, twice, so that any
+        reader that could have seen the old array has left. Unlike classic
+        RCU, readers may block since hooked functions can be called at
+        PASSIVE_LEVEL.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelSubscribers.hpp"
+#include "Common.hpp"
+#include "HookCommon.hpp"
+#include "HookManifestFormat.hpp"
+#include "HookKernelThunk.hpp"
+#include "HookOverhead.hpp"
+
+//
+// The reader counts of a processor for the two epochs. Padded to a cache line
+// so that readers on different processors do not contend.
+//
+typedef struct DECLSPEC_CACHEALIGN _HOOK_SUBSCRIBER_READERS
+{
+    volatile LONG64 Count[2];
+} HOOK_SUBSCRIBER_READERS, *PHOOK_SUBSCRIBER_READERS;
+static_assert(sizeof(HOOK_SUBSCRIBER_READERS) == SYSTEM_CACHE_ALIGNMENT_SIZE,
+              "Size check");
+
+static PHOOK_SUBSCRIBER_READERS g_HookSubscriberReaders;
+static ULONG g_HookSubscriberReaderCount;
+static volatile LONG g_HookSubscriberEpoch;
+static FAST_MUTEX g_HookSubscriberMutex;
+
+/*!
+    @brief Initializes the data structures for subscribers.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+InitializeHookSubscribers (
+    VOID
+    )
+{
+    NTSTATUS status;
+    ULONG numOfProcessors;
+    PHOOK_SUBSCRIBER_READERS readers;
+
+    PAGED_CODE();
+
+    numOfProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    readers = static_cast<PHOOK_SUBSCRIBER_READERS>(ExAllocatePoolWithTag(
+                                        NonPagedPool,
+                                        sizeof(*readers) * numOfProcessors,
+                                        k_PoolTag));
+    if (readers == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu",
+                          sizeof(*readers) * numOfProcessors);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(readers, sizeof(*readers) * numOfProcessors);
+
+    ExInitializeFastMutex(&g_HookSubscriberMutex);
+    g_HookSubscriberEpoch = 0;
+    g_HookSubscriberReaderCount = numOfProcessors;
+    g_HookSubscriberReaders = readers;
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Waits until all readers that could see a previously published
+        subscriber array complete.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(APC_LEVEL)
+VOID
+SynchronizeHookSubscribers (
+    VOID
+    )
+{
+    static constexpr LONGLONG oneMillisecond = -(10000);
+    LARGE_INTEGER interval;
+
+    PAGED_CODE();
+
+    interval.QuadPart = oneMillisecond;
+
+    for (ULONG round = 0; round < 2; ++round)
+    {
+        LONG previousEpoch;
+        LONG64 activeReaders;
+
+        previousEpoch = InterlockedIncrement(&g_HookSubscriberEpoch) - 1;
+
+        for (;;)
+        {
+            activeReaders = 0;
+            for (ULONG i = 0; i < g_HookSubscriberReaderCount; ++i)
+            {
+                activeReaders += g_HookSubscriberReaders[i].Count[previousEpoch & 1];
+            }
+            if (activeReaders == 0)
+            {
+                break;
+            }
+            (VOID)KeDelayExecutionThread(KernelMode, FALSE, &interval);
+        }
+    }
+}
+
+/*!
+    @brief Frees the data structures for subscribers.
+
+    @details This function must be called after hooks are disabled.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+CleanupHookSubscribers (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    if (g_HookSubscriberReaders == nullptr)
+    {
+        return;
+    }
+
+    ExAcquireFastMutex(&g_HookSubscriberMutex);
+    for (auto& registration : GetHookRegistrationEntries())
+    {
+        PVOID array;
+
+        array = InterlockedExchangePointer(
+                    reinterpret_cast<PVOID volatile*>(&registration.Subscribers),
+                    nullptr);
+        if (array != nullptr)
+        {
+            SynchronizeHookSubscribers();
+            ExFreePoolWithTag(array, k_PoolTag);
+        }
+    }
+    ExReleaseFastMutex(&g_HookSubscriberMutex);
+
+    ExFreePoolWithTag(g_HookSubscriberReaders, k_PoolTag);
+    g_HookSubscriberReaders = nullptr;
+}
+
+/*!
+    @brief Finds the registration entry of the specified function.
+
+    @param[in] FunctionName - The name of the hooked function.
+
+    @return The registration entry, or NULL if not found.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(APC_LEVEL)
+_Check_return_
+PHOOK_REGISTRATION_ENTRY
+FindHookRegistrationEntry (
+    _In_ PCUNICODE_STRING FunctionName
+    )
+{
+    PAGED_CODE();
+
+    for (auto& registration : GetHookRegistrationEntries())
+    {
+        if (RtlEqualUnicodeString(&registration.FunctionName,
+                                  FunctionName,
+                                  FALSE) != FALSE)
+        {
+            return &registration;
+        }
+    }
+    return nullptr;
+}
+
+/*!
+    @brief Publishes a new subscriber array and frees the old one after a grace
+        period.
+
+    @param[in,out] Registration - The registration entry to update.
+
+    @param[in] NewArray - The array to publish. Can be NULL.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(APC_LEVEL)
+_Requires_lock_held_(g_HookSubscriberMutex)
+VOID
+PublishHookSubscribers (
+    _Inout_ PHOOK_REGISTRATION_ENTRY Registration,
+    _In_opt_ PHOOK_SUBSCRIBER_ARRAY NewArray
+    )
+{
+    PVOID oldArray;
+
+    PAGED_CODE();
+
+    oldArray = InterlockedExchangePointer(
+                    reinterpret_cast<PVOID volatile*>(&Registration->Subscribers),
+                    NewArray);
+    if (oldArray != nullptr)
+    {
+        SynchronizeHookSubscribers();
+        ExFreePoolWithTag(oldArray, k_PoolTag);
+    }
+}
+
+/*!
+    @brief Attaches callbacks to the hook of the specified function.
+
+    @param[in] FunctionName - The name of the hooked function.
+
+    @param[in] PreCallback - The callback executed before the original function.
+
+    @param[in] PostCallback - The callback executed after the original function.
+
+    @param[in] Context - An arbitrary value passed to the callbacks.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+SubscribeHook (
+    PCUNICODE_STRING FunctionName,
+    PHOOK_CALLBACK PreCallback,
+    PHOOK_CALLBACK PostCallback,
+    PVOID Context
+    )
+{
+    NTSTATUS status;
+    PHOOK_REGISTRATION_ENTRY registration;
+    const HOOK_SUBSCRIBER_ARRAY* oldArray;
+    PHOOK_SUBSCRIBER_ARRAY newArray;
+    ULONG oldCount;
+    SIZE_T newArraySize;
+
+    PAGED_CODE();
+
+    NT_ASSERT(g_HookSubscriberReaders != nullptr);
+
+    registration = FindHookRegistrationEntry(FunctionName);
+    if (registration == nullptr)
+    {
+        LOGGING_LOG_ERROR("No hook for %wZ", FunctionName);
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+
+    ExAcquireFastMutex(&g_HookSubscriberMutex);
+
+    oldArray = registration->Subscribers;
+    oldCount = (oldArray != nullptr) ? oldArray->Count : 0;
+    newArraySize = FIELD_OFFSET(HOOK_SUBSCRIBER_ARRAY, Subscribers) +
+                   sizeof(HOOK_SUBSCRIBER) * (oldCount + 1);
+    newArray = static_cast<PHOOK_SUBSCRIBER_ARRAY>(ExAllocatePoolWithTag(
+                                                        NonPagedPool,
+                                                        newArraySize,
+                                                        k_PoolTag));
+    if (newArray == nullptr)
+    {
+        ExReleaseFastMutex(&g_HookSubscriberMutex);
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu", newArraySize);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    if (oldArray != nullptr)
+    {
+        RtlCopyMemory(newArray->Subscribers,
+                      oldArray->Subscribers,
+                      sizeof(HOOK_SUBSCRIBER) * oldCount);
+    }
+    newArray->Subscribers[oldCount].PreCallback = PreCallback;
+    newArray->Subscribers[oldCount].PostCallback = PostCallback;
+    newArray->Subscribers[oldCount].Context = Context;
+    newArray->Count = oldCount + 1;
+
+    PublishHookSubscribers(registration, newArray);
+    ExReleaseFastMutex(&g_HookSubscriberMutex);
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Detaches callbacks attached with SubscribeHook.
+
+    @details When this function returns, the callbacks are no longer executed.
+
+    @param[in] FunctionName - The name of the hooked function.
+
+    @param[in] PreCallback - The pre-callback specified for SubscribeHook.
+
+    @param[in] PostCallback - The post-callback specified for SubscribeHook.
+
+    @param[in] Context - The context specified for SubscribeHook.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+UnsubscribeHook (
+    PCUNICODE_STRING FunctionName,
+    PHOOK_CALLBACK PreCallback,
+    PHOOK_CALLBACK PostCallback,
+    PVOID Context
+    )
+{
+    NTSTATUS status;
+    PHOOK_REGISTRATION_ENTRY registration;
+    const HOOK_SUBSCRIBER_ARRAY* oldArray;
+    PHOOK_SUBSCRIBER_ARRAY newArray;
+    ULONG index;
+    SIZE_T newArraySize;
+
+    PAGED_CODE();
+
+    NT_ASSERT(g_HookSubscriberReaders != nullptr);
+
+    registration = FindHookRegistrationEntry(FunctionName);
+    if (registration == nullptr)
+    {
+        LOGGING_LOG_ERROR("No hook for %wZ", FunctionName);
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+
+    ExAcquireFastMutex(&g_HookSubscriberMutex);
+
+    //
+    // Find the subscriber to remove.
+    //
+    oldArray = registration->Subscribers;
+    for (index = 0; (oldArray != nullptr) && (index < oldArray->Count); ++index)
+    {
+        if ((oldArray->Subscribers[index].PreCallback == PreCallback) &&
+            (oldArray->Subscribers[index].PostCallback == PostCallback) &&
+            (oldArray->Subscribers[index].Context == Context))
+        {
+            break;
+        }
+    }
+    if ((oldArray == nullptr) || (index == oldArray->Count))
+    {
+        ExReleaseFastMutex(&g_HookSubscriberMutex);
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+
+    //
+    // Build a new array without the subscriber, or publish NULL if it was the
+    // last subscriber so that hook handlers skip the read-side section.
+    //
+    newArray = nullptr;
+    if (oldArray->Count > 1)
+    {
+        newArraySize = FIELD_OFFSET(HOOK_SUBSCRIBER_ARRAY, Subscribers) +
+                       sizeof(HOOK_SUBSCRIBER) * (oldArray->Count - 1);
+        newArray = static_cast<PHOOK_SUBSCRIBER_ARRAY>(ExAllocatePoolWithTag(
+                                                            NonPagedPool,
+                                                            newArraySize,
+                                                            k_PoolTag));
+        if (newArray == nullptr)
+        {
+            ExReleaseFastMutex(&g_HookSubscriberMutex);
+            LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu", newArraySize);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+
+        RtlCopyMemory(newArray->Subscribers,
+                      oldArray->Subscribers,
+                      sizeof(HOOK_SUBSCRIBER) * index);
+        RtlCopyMemory(&newArray->Subscribers[index],
+                      &oldArray->Subscribers[index + 1],
+                      sizeof(HOOK_SUBSCRIBER) * (oldArray->Count - index - 1));
+        newArray->Count = oldArray->Count - 1;
+    }
+
+    PublishHookSubscribers(registration, newArray);
+    ExReleaseFastMutex(&g_HookSubscriberMutex);
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Tests whether the call should be observed by subscribers according
+        to the filters and the sampling interval of the hook.
+
+    @param[in] Registration - The registration entry of the hook.
+
+    @param[in] CallInfo - The information of the call.
+
+    @return TRUE when subscribers should be executed; otherwise, FALSE.
+ */
+static
+FORCEINLINE
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+BOOLEAN
+IsHookCallObserved (
+    _In_ const HOOK_REGISTRATION_ENTRY* Registration,
+    _In_ const HOOK_CALL_INFO* CallInfo
+    )
+{
+    BOOLEAN observed;
+    PVOID imageBaseAddress;
+    LONG sampleCount;
+
+    observed = FALSE;
+
+    if (BooleanFlagOn(Registration->Filters, k_HookManifestFilterPassiveLevel) &&
+        (KeGetCurrentIrql() != PASSIVE_LEVEL))
+    {
+        goto Exit;
+    }
+
+    if (BooleanFlagOn(Registration->Filters, k_HookManifestFilterCallerOutsideImage) &&
+        (RtlPcToFileHeader(CallInfo->ReturnAddress, &imageBaseAddress) != nullptr))
+    {
+        goto Exit;
+    }
+
+    //
+    // Count only calls that passed the filters, so that the interval applies
+    // to calls of interest.
+    //
+    if (Registration->SamplingInterval > 1)
+    {
+        sampleCount = InterlockedIncrement(
+                    const_cast<volatile LONG*>(&Registration->SampleCount));
+        if ((static_cast<ULONG>(sampleCount) % Registration->SamplingInterval) != 0)
+        {
+            goto Exit;
+        }
+    }
+
+    observed = TRUE;
+
+Exit:
+    return observed;
+}
+
+/*!
+    @brief Enters the read-side section of the subscriber array and executes
+        pre-callbacks.
+
+    @details This function executes no callback when no subscriber is
+        attached, or the call is excluded by the filters or the sampling
+        interval. The caller must call LeaveHookSubscribers with the same Section after
+        calling the original function.
+
+    @param[in] Registration - The registration entry of the hook.
+
+    @param[in] CallInfo - The information of the call.
+
+    @param[out] Section - The address to receive the read-side section.
+ */
+_Use_decl_annotations_
+VOID
+EnterHookSubscribers (
+    const HOOK_REGISTRATION_ENTRY* Registration,
+    const HOOK_CALL_INFO* CallInfo,
+    PHOOK_SUBSCRIBER_SECTION Section
+    )
+{
+    const HOOK_SUBSCRIBER_ARRAY* array;
+    volatile LONG64* readerCount;
+    ULONG processorIndex;
+    ULONG64 startCycles;
+
+    startCycles = __rdtsc();
+    Section->Array = nullptr;
+    Section->ReaderCount = nullptr;
+    Section->Registration = Registration;
+    Section->EnterCycles = 0;
+
+    //
+    // Skip the read-side section entirely when nothing is subscribed. This
+    // is safe because the array is not dereferenced here.
+    //
+    if (Registration->Subscribers == nullptr)
+    {
+        goto Exit;
+    }
+
+    if (IsHookCallObserved(Registration, CallInfo) == FALSE)
+    {
+        goto Exit;
+    }
+
+    processorIndex = KeGetCurrentProcessorNumberEx(nullptr) %
+                     g_HookSubscriberReaderCount;
+    readerCount = &g_HookSubscriberReaders[processorIndex].Count[g_HookSubscriberEpoch & 1];
+    InterlockedIncrement64(readerCount);
+
+    //
+    // Read the array after the reader count is incremented. Interlocked
+    // increment is a full barrier.
+    //
+    array = Registration->Subscribers;
+    if (array == nullptr)
+    {
+        InterlockedDecrement64(readerCount);
+        goto Exit;
+    }
+
+    for (ULONG i = 0; i < array->Count; ++i)
+    {
+        if (array->Subscribers[i].PreCallback != nullptr)
+        {
+            array->Subscribers[i].PreCallback(CallInfo,
+                                              array->Subscribers[i].Context);
+        }
+    }
+
+    Section->Array = array;
+    Section->ReaderCount = readerCount;
+
+Exit:
+    Section->EnterCycles = __rdtsc() - startCycles;
+}
+
+/*!
+    @brief Executes post-callbacks and leaves the read-side section of the
+        subscriber array.
+
+    @param[in] CallInfo - The information of the call including the result.
+
+    @param[in] Section - The read-side section returned by EnterHookSubscribers.
+ */
+_Use_decl_annotations_
+VOID
+LeaveHookSubscribers (
+    const HOOK_CALL_INFO* CallInfo,
+    PHOOK_SUBSCRIBER_SECTION Section
+    )
+{
+    const HOOK_SUBSCRIBER_ARRAY* array;
+    ULONG64 startCycles;
+
+    //
+    // Charge the handler even when no callback was executed, so that the
+    // cost of the checks on hooks without subscribers, or on calls excluded
+    // by the filters, is accounted for too.
+    //
+    startCycles = __rdtsc();
+    array = Section->Array;
+    if (array == nullptr)
+    {
+        goto Exit;
+    }
+
+    for (ULONG i = 0; i < array->Count; ++i)
+    {
+        if (array->Subscribers[i].PostCallback != nullptr)
+        {
+            array->Subscribers[i].PostCallback(CallInfo,
+                                               array->Subscribers[i].Context);
+        }
+    }
+
+    InterlockedDecrement64(Section->ReaderCount);
+    Section->Array = nullptr;
+
+Exit:
+    ChargeHookOverhead(GetCurrentHookOverheadTable(),
+                       Section->Registration,
+                       __readcr3(),
+                       HookOverheadHandler,
+                       Section->EnterCycles + (__rdtsc() - startCycles));
+}
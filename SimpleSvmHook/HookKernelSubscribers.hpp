@@ -0,0 +1,135 @@
+/*!
+    @file HookKernelSubscribers.hpp
+
+    @brief Kernel mode code to let more than one component observe a hook.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "HookCommon.hpp"
+
+//
+// The maximum number of arguments passed to callbacks.
+//
+static constexpr ULONG k_HookMaxCallbackArguments = 8;
+
+//
+// Information of a hooked call passed to callbacks.
+//
+typedef struct _HOOK_CALL_INFO
+{
+    PCUNICODE_STRING FunctionName;
+    PVOID ReturnAddress;
+    ULONG ArgumentCount;
+    ULONG64 Arguments[k_HookMaxCallbackArguments];
+
+    //
+    // The return value of the original function. Valid only for post-callbacks.
+    //
+    ULONG64 Result;
+} HOOK_CALL_INFO, *PHOOK_CALL_INFO;
+
+//
+// A callback executed before or after the original function is called. It is
+// executed at the IRQL the hooked function is called, and must not subscribe
+// or unsubscribe callbacks.
+//
+typedef
+_IRQL_requires_same_
+VOID
+HOOK_CALLBACK (
+    _In_ const HOOK_CALL_INFO* CallInfo,
+    _In_opt_ PVOID Context
+    );
+typedef HOOK_CALLBACK *PHOOK_CALLBACK;
+
+typedef struct _HOOK_SUBSCRIBER
+{
+    PHOOK_CALLBACK PreCallback;
+    PHOOK_CALLBACK PostCallback;
+    PVOID Context;
+} HOOK_SUBSCRIBER, *PHOOK_SUBSCRIBER;
+
+//
+// The immutable array of subscribers published to
+// HOOK_REGISTRATION_ENTRY::Subscribers. Subscription and unsubscription
+// publish a new array and free the old one after all readers that could see
+// it completed.
+//
+typedef struct _HOOK_SUBSCRIBER_ARRAY
+{
+    ULONG Count;
+    HOOK_SUBSCRIBER Subscribers[ANYSIZE_ARRAY];
+} HOOK_SUBSCRIBER_ARRAY, *PHOOK_SUBSCRIBER_ARRAY;
+
+//
+// The read-side section of the subscriber array entered by a hook handler.
+//
+typedef struct _HOOK_SUBSCRIBER_SECTION
+{
+    const HOOK_SUBSCRIBER_ARRAY* Array;
+    volatile LONG64* ReaderCount;
+
+    //
+    // The hook, and the cycles spent in EnterHookSubscribers, charged as the
+    // overhead of the handler when the section is left, whether or not any
+    // callback was executed.
+    //
+    const HOOK_REGISTRATION_ENTRY* Registration;
+    ULONG64 EnterCycles;
+} HOOK_SUBSCRIBER_SECTION, *PHOOK_SUBSCRIBER_SECTION;
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+InitializeHookSubscribers (
+    VOID
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CleanupHookSubscribers (
+    VOID
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+SubscribeHook (
+    _In_ PCUNICODE_STRING FunctionName,
+    _In_opt_ PHOOK_CALLBACK PreCallback,
+    _In_opt_ PHOOK_CALLBACK PostCallback,
+    _In_opt_ PVOID Context
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+UnsubscribeHook (
+    _In_ PCUNICODE_STRING FunctionName,
+    _In_opt_ PHOOK_CALLBACK PreCallback,
+    _In_opt_ PHOOK_CALLBACK PostCallback,
+    _In_opt_ PVOID Context
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+EnterHookSubscribers (
+    _In_ const HOOK_REGISTRATION_ENTRY* Registration,
+    _In_ const HOOK_CALL_INFO* CallInfo,
+    _Out_ PHOOK_SUBSCRIBER_SECTION Section
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+LeaveHookSubscribers (
+    _In_ const HOOK_CALL_INFO* CallInfo,
+    _In_ PHOOK_SUBSCRIBER_SECTION Section
+    );
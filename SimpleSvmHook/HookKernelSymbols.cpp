@@ -0,0 +1,751 @@
+/*!
+    @file HookKernelSymbols.cpp
+
+    @brief Kernel mode code to resolve addresses into module!symbol+offset.
+
+    @details The symbol index is built once before hooks are installed, from
+        the export directory and the exception directory (.pdata) of each
+        module loaded at that time. Each module has a sorted array of RVAs of
+        exported functions and starts of functions, and an address is resolved
+        with two binary searches; one for the module and one for the nearest
+        preceding RVA. Functions without exported names are shown as sub_<RVA>.
+
+        The index is read-only after built, so that lookups need no locks and
+        can be done at any IRQL. Modules loaded later are not indexed, and
+        addresses in them are shown as is.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelSymbols.hpp"
+#include <aux_klib.h>
+#include <ntstrsafe.h>
+#include "Common.hpp"
+
+//
+// The value of SYMBOL_ENTRY::NameOffset for functions without names.
+//
+static constexpr ULONG k_NoSymbolName = MAXULONG;
+
+//
+// The RVA of an exported function or a start of a function.
+//
+typedef struct _SYMBOL_ENTRY
+{
+    ULONG Rva;
+
+    //
+    // The offset of the name in SYMBOL_MODULE::Names, or k_NoSymbolName.
+    //
+    ULONG NameOffset;
+} SYMBOL_ENTRY, *PSYMBOL_ENTRY;
+
+//
+// The indexed module.
+//
+typedef struct _SYMBOL_MODULE
+{
+    ULONG_PTR ImageBase;
+    ULONG ImageSize;
+
+    //
+    // The file name without the extension.
+    //
+    CHAR Name[32];
+
+    //
+    // The symbols sorted by RVA, and null-terminated names of them.
+    //
+    PSYMBOL_ENTRY Entries;
+    ULONG EntryCount;
+    PCHAR Names;
+} SYMBOL_MODULE, *PSYMBOL_MODULE;
+
+//
+// The modules sorted by the image base.
+//
+typedef struct _SYMBOL_INDEX
+{
+    PSYMBOL_MODULE Modules;
+    ULONG ModuleCount;
+} SYMBOL_INDEX, *PSYMBOL_INDEX;
+
+static SYMBOL_INDEX g_SymbolIndex;
+
+/*!
+    @brief Returns the data directory of the image if it is readable.
+
+    @param[in] ImageBase - The base address of the image.
+
+    @param[in] ImageSize - The size of the image.
+
+    @param[in] Index - The index of the data directory to return.
+
+    @param[out] Size - The address to receive the size of the directory.
+
+    @return The address of the directory, or NULL if it does not exist or is
+        not resident.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+PVOID
+GetImageDirectory (
+    _In_ PUCHAR ImageBase,
+    _In_ ULONG ImageSize,
+    _In_ ULONG Index,
+    _Out_ PULONG Size
+    )
+{
+    PIMAGE_DOS_HEADER dosHeader;
+    PIMAGE_NT_HEADERS ntHeaders;
+    PIMAGE_DATA_DIRECTORY directory;
+    PVOID directoryBase;
+
+    PAGED_CODE();
+
+    *Size = 0;
+    directoryBase = nullptr;
+
+    dosHeader = reinterpret_cast<PIMAGE_DOS_HEADER>(ImageBase);
+    if ((MmIsAddressValid(ImageBase) == FALSE) ||
+        (dosHeader->e_magic != IMAGE_DOS_SIGNATURE) ||
+        (static_cast<ULONG>(dosHeader->e_lfanew) >
+            PAGE_SIZE - sizeof(IMAGE_NT_HEADERS)))
+    {
+        goto Exit;
+    }
+
+    ntHeaders = reinterpret_cast<PIMAGE_NT_HEADERS>(ImageBase +
+                                                    dosHeader->e_lfanew);
+    if ((ntHeaders->Signature != IMAGE_NT_SIGNATURE) ||
+        (ntHeaders->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR64_MAGIC) ||
+        (ntHeaders->OptionalHeader.NumberOfRvaAndSizes <= Index))
+    {
+        goto Exit;
+    }
+
+    //
+    // Directories in discarded or paged out sections are not indexed.
+    //
+    directory = &ntHeaders->OptionalHeader.DataDirectory[Index];
+    if ((directory->VirtualAddress == 0) ||
+        (directory->Size == 0) ||
+        (directory->VirtualAddress >= ImageSize) ||
+        (directory->Size > ImageSize - directory->VirtualAddress) ||
+        (MmIsAddressValid(ImageBase + directory->VirtualAddress) == FALSE) ||
+        (MmIsAddressValid(ImageBase + directory->VirtualAddress +
+                                      directory->Size - 1) == FALSE))
+    {
+        goto Exit;
+    }
+
+    directoryBase = ImageBase + directory->VirtualAddress;
+    *Size = directory->Size;
+
+Exit:
+    return directoryBase;
+}
+
+/*!
+    @brief Compares two symbol entries by RVA for qsort.
+ */
+static
+int
+__cdecl
+CompareSymbolEntries (
+    _In_ const void* Entry1,
+    _In_ const void* Entry2
+    )
+{
+    ULONG rva1, rva2;
+
+    rva1 = static_cast<const SYMBOL_ENTRY*>(Entry1)->Rva;
+    rva2 = static_cast<const SYMBOL_ENTRY*>(Entry2)->Rva;
+    return (rva1 < rva2) ? -1 : (rva1 > rva2) ? 1 : 0;
+}
+
+/*!
+    @brief Builds the symbol entries of the module.
+
+    @details Exported functions are collected and sorted first, then, merged
+        with the function table, which is sorted by the specification. An
+        exported function and a function start with the same RVA are merged
+        into a single named entry.
+
+    @param[in,out] Module - The module to build symbol entries. ImageBase and
+        ImageSize must be initialized.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+BuildModuleSymbols (
+    _Inout_ PSYMBOL_MODULE Module
+    )
+{
+    NTSTATUS status;
+    PUCHAR imageBase;
+    PIMAGE_EXPORT_DIRECTORY exportDirectory;
+    PIMAGE_RUNTIME_FUNCTION_ENTRY functionTable;
+    ULONG exportDirectorySize, functionTableSize, functionCount;
+    PULONG functions, names;
+    PUSHORT nameOrdinals;
+    PSYMBOL_ENTRY exports, entries;
+    ULONG exportCount, entryCount, namesSize, nameOffset;
+    PCSTR name;
+    SIZE_T nameLength;
+    ULONG i, j;
+
+    PAGED_CODE();
+
+    imageBase = reinterpret_cast<PUCHAR>(Module->ImageBase);
+    exports = nullptr;
+    entries = nullptr;
+    exportCount = 0;
+    namesSize = 0;
+
+    exportDirectory = static_cast<PIMAGE_EXPORT_DIRECTORY>(GetImageDirectory(
+                                                imageBase,
+                                                Module->ImageSize,
+                                                IMAGE_DIRECTORY_ENTRY_EXPORT,
+                                                &exportDirectorySize));
+    functionTable = static_cast<PIMAGE_RUNTIME_FUNCTION_ENTRY>(GetImageDirectory(
+                                                imageBase,
+                                                Module->ImageSize,
+                                                IMAGE_DIRECTORY_ENTRY_EXCEPTION,
+                                                &functionTableSize));
+    functionCount = functionTableSize / sizeof(*functionTable);
+
+    //
+    // Collect named exports. Forwarders are ignored as their RVAs point to
+    // the strings in the export directory.
+    //
+    if (exportDirectory != nullptr)
+    {
+        functions = reinterpret_cast<PULONG>(imageBase +
+                                        exportDirectory->AddressOfFunctions);
+        names = reinterpret_cast<PULONG>(imageBase +
+                                        exportDirectory->AddressOfNames);
+        nameOrdinals = reinterpret_cast<PUSHORT>(imageBase +
+                                        exportDirectory->AddressOfNameOrdinals);
+
+        exports = static_cast<PSYMBOL_ENTRY>(ExAllocatePoolWithTag(
+                            PagedPool,
+                            max(exportDirectory->NumberOfNames, 1) * sizeof(*exports),
+                            k_PoolTag));
+        if (exports == nullptr)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+
+        for (i = 0; i < exportDirectory->NumberOfNames; ++i)
+        {
+            if ((nameOrdinals[i] >= exportDirectory->NumberOfFunctions) ||
+                (names[i] >= Module->ImageSize))
+            {
+                continue;
+            }
+
+            exports[exportCount].Rva = functions[nameOrdinals[i]];
+            if ((exports[exportCount].Rva >= Module->ImageSize) ||
+                ((exports[exportCount].Rva >=
+                  static_cast<ULONG>(reinterpret_cast<PUCHAR>(exportDirectory) - imageBase)) &&
+                 (exports[exportCount].Rva <
+                  static_cast<ULONG>(reinterpret_cast<PUCHAR>(exportDirectory) - imageBase) +
+                                                        exportDirectorySize)))
+            {
+                continue;
+            }
+
+            name = reinterpret_cast<PCSTR>(imageBase + names[i]);
+            status = RtlStringCchLengthA(name,
+                                         k_MaxSymbolNameLength,
+                                         &nameLength);
+            if (!NT_SUCCESS(status))
+            {
+                continue;
+            }
+
+            //
+            // Hold the RVA of the name until it is copied into the name pool.
+            //
+            exports[exportCount].NameOffset = names[i];
+            namesSize += static_cast<ULONG>(nameLength) + 1;
+            exportCount++;
+        }
+        qsort(exports, exportCount, sizeof(*exports), CompareSymbolEntries);
+    }
+
+    if ((exportCount + functionCount) == 0)
+    {
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+
+    entries = static_cast<PSYMBOL_ENTRY>(ExAllocatePoolWithTag(
+                            NonPagedPool,
+                            (exportCount + functionCount) * sizeof(*entries),
+                            k_PoolTag));
+    Module->Names = static_cast<PCHAR>(ExAllocatePoolWithTag(NonPagedPool,
+                                                             max(namesSize, 1),
+                                                             k_PoolTag));
+    if ((entries == nullptr) || (Module->Names == nullptr))
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    //
+    // Merge the two sorted arrays, copying names of exports into the name
+    // pool of the module.
+    //
+    entryCount = 0;
+    nameOffset = 0;
+    i = j = 0;
+    while ((i < exportCount) || (j < functionCount))
+    {
+        if ((j == functionCount) ||
+            ((i < exportCount) &&
+             (exports[i].Rva <= functionTable[j].BeginAddress)))
+        {
+            if ((j < functionCount) &&
+                (exports[i].Rva == functionTable[j].BeginAddress))
+            {
+                j++;
+            }
+
+            name = reinterpret_cast<PCSTR>(imageBase + exports[i].NameOffset);
+            NT_VERIFY(NT_SUCCESS(RtlStringCchCopyA(&Module->Names[nameOffset],
+                                                   namesSize - nameOffset,
+                                                   name)));
+            entries[entryCount].Rva = exports[i].Rva;
+            entries[entryCount].NameOffset = nameOffset;
+            nameOffset += static_cast<ULONG>(strlen(name)) + 1;
+            i++;
+        }
+        else
+        {
+            entries[entryCount].Rva = functionTable[j].BeginAddress;
+            entries[entryCount].NameOffset = k_NoSymbolName;
+            j++;
+        }
+
+        //
+        // Keep the first of entries with the same RVA, preferring named ones.
+        //
+        if ((entryCount != 0) &&
+            (entries[entryCount].Rva == entries[entryCount - 1].Rva))
+        {
+            continue;
+        }
+        entryCount++;
+    }
+
+    status = STATUS_SUCCESS;
+    Module->Entries = entries;
+    Module->EntryCount = entryCount;
+    entries = nullptr;
+
+Exit:
+    if (entries != nullptr)
+    {
+        ExFreePoolWithTag(entries, k_PoolTag);
+    }
+    if ((!NT_SUCCESS(status)) && (Module->Names != nullptr))
+    {
+        ExFreePoolWithTag(Module->Names, k_PoolTag);
+        Module->Names = nullptr;
+    }
+    if (exports != nullptr)
+    {
+        ExFreePoolWithTag(exports, k_PoolTag);
+    }
+    return status;
+}
+
+/*!
+    @brief Builds the symbol index of all loaded modules.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+InitializeSymbolIndex (
+    VOID
+    )
+{
+    NTSTATUS status;
+    ULONG bufferSize, moduleCount;
+    PAUX_MODULE_EXTENDED_INFO moduleInfo;
+    PSYMBOL_MODULE modules, module;
+    PCSTR fileName;
+    ULONG symbolCount;
+
+    PAGED_CODE();
+
+    NT_ASSERT(g_SymbolIndex.Modules == nullptr);
+
+    moduleInfo = nullptr;
+    modules = nullptr;
+    moduleCount = 0;
+
+    status = AuxKlibInitialize();
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("AuxKlibInitialize failed : %08x", status);
+        goto Exit;
+    }
+
+    bufferSize = 0;
+    status = AuxKlibQueryModuleInformation(&bufferSize,
+                                           sizeof(*moduleInfo),
+                                           nullptr);
+    if (!NT_SUCCESS(status) || (bufferSize == 0))
+    {
+        LOGGING_LOG_ERROR("AuxKlibQueryModuleInformation failed : %08x", status);
+        status = NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+        goto Exit;
+    }
+
+    moduleInfo = static_cast<PAUX_MODULE_EXTENDED_INFO>(ExAllocatePoolWithTag(
+                                                                PagedPool,
+                                                                bufferSize,
+                                                                k_PoolTag));
+    if (moduleInfo == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %lu", bufferSize);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    status = AuxKlibQueryModuleInformation(&bufferSize,
+                                           sizeof(*moduleInfo),
+                                           moduleInfo);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("AuxKlibQueryModuleInformation failed : %08x", status);
+        goto Exit;
+    }
+    moduleCount = bufferSize / sizeof(*moduleInfo);
+
+    modules = static_cast<PSYMBOL_MODULE>(ExAllocatePoolWithTag(
+                                            NonPagedPool,
+                                            moduleCount * sizeof(*modules),
+                                            k_PoolTag));
+    if (modules == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu",
+                          moduleCount * sizeof(*modules));
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(modules, moduleCount * sizeof(*modules));
+
+    symbolCount = 0;
+    for (ULONG i = 0; i < moduleCount; ++i)
+    {
+        module = &modules[i];
+        module->ImageBase = reinterpret_cast<ULONG_PTR>(
+                                        moduleInfo[i].BasicInfo.ImageBase);
+        module->ImageSize = moduleInfo[i].ImageSize;
+
+        //
+        // Take the file name up to the extension as the module name.
+        //
+        fileName = reinterpret_cast<PCSTR>(
+                &moduleInfo[i].FullPathName[moduleInfo[i].FileNameOffset]);
+        for (ULONG j = 0; j < RTL_NUMBER_OF(module->Name) - 1; ++j)
+        {
+            if ((fileName[j] == ANSI_NULL) || (fileName[j] == '.'))
+            {
+                break;
+            }
+            module->Name[j] = fileName[j];
+        }
+
+        status = BuildModuleSymbols(module);
+        if (!NT_SUCCESS(status))
+        {
+            LOGGING_LOG_ERROR("BuildModuleSymbols failed : %08x", status);
+            goto Exit;
+        }
+        symbolCount += module->EntryCount;
+    }
+
+    //
+    // Sort modules by the image base for the binary search. The entries of
+    // modules are referenced by pointers and can be moved.
+    //
+    for (ULONG i = 1; i < moduleCount; ++i)
+    {
+        SYMBOL_MODULE temp = modules[i];
+        ULONG j = i;
+
+        while ((j > 0) && (modules[j - 1].ImageBase > temp.ImageBase))
+        {
+            modules[j] = modules[j - 1];
+            j--;
+        }
+        modules[j] = temp;
+    }
+
+    LOGGING_LOG_INFO("Indexed %lu symbols in %lu modules",
+                     symbolCount,
+                     moduleCount);
+    g_SymbolIndex.Modules = modules;
+    g_SymbolIndex.ModuleCount = moduleCount;
+    modules = nullptr;
+    status = STATUS_SUCCESS;
+
+Exit:
+    if (modules != nullptr)
+    {
+        for (ULONG i = 0; i < moduleCount; ++i)
+        {
+            if (modules[i].Entries != nullptr)
+            {
+                ExFreePoolWithTag(modules[i].Entries, k_PoolTag);
+            }
+            if (modules[i].Names != nullptr)
+            {
+                ExFreePoolWithTag(modules[i].Names, k_PoolTag);
+            }
+        }
+        ExFreePoolWithTag(modules, k_PoolTag);
+    }
+    if (moduleInfo != nullptr)
+    {
+        ExFreePoolWithTag(moduleInfo, k_PoolTag);
+    }
+    return status;
+}
+
+/*!
+    @brief Frees the symbol index.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+CleanupSymbolIndex (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    if (g_SymbolIndex.Modules == nullptr)
+    {
+        goto Exit;
+    }
+
+    for (ULONG i = 0; i < g_SymbolIndex.ModuleCount; ++i)
+    {
+        if (g_SymbolIndex.Modules[i].Entries != nullptr)
+        {
+            ExFreePoolWithTag(g_SymbolIndex.Modules[i].Entries, k_PoolTag);
+        }
+        if (g_SymbolIndex.Modules[i].Names != nullptr)
+        {
+            ExFreePoolWithTag(g_SymbolIndex.Modules[i].Names, k_PoolTag);
+        }
+    }
+    ExFreePoolWithTag(g_SymbolIndex.Modules, k_PoolTag);
+    RtlZeroMemory(&g_SymbolIndex, sizeof(g_SymbolIndex));
+
+Exit:
+    return;
+}
+
+//
+// The digits used to format RVAs and offsets.
+//
+static const CHAR k_UpperHexDigits[] = "0123456789ABCDEF";
+static const CHAR k_LowerHexDigits[] = "0123456789abcdef";
+
+/*!
+    @brief Appends the string to the resolved symbol, truncating it if
+        needed.
+
+    @details This and AppendHexToSymbol are used instead of
+        RtlStringCchPrintfA, which is not callable above DISPATCH_LEVEL.
+
+    @param[in,out] Symbol - The resolved symbol to append to.
+
+    @param[in,out] Length - The current length of the resolved symbol.
+
+    @param[in] String - The null-terminated string to append.
+ */
+static
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+AppendStringToSymbol (
+    _Inout_ PSYMBOL_NAME Symbol,
+    _Inout_ PULONG Length,
+    _In_z_ PCSTR String
+    )
+{
+    for (ULONG i = 0; String[i] != ANSI_NULL; ++i)
+    {
+        if (*Length >= RTL_NUMBER_OF(Symbol->AsChars) - 1)
+        {
+            break;
+        }
+        Symbol->AsChars[(*Length)++] = String[i];
+    }
+    Symbol->AsChars[*Length] = ANSI_NULL;
+}
+
+/*!
+    @brief Appends the value in hexadecimal to the resolved symbol.
+
+    @param[in,out] Symbol - The resolved symbol to append to.
+
+    @param[in,out] Length - The current length of the resolved symbol.
+
+    @param[in] Value - The value to append.
+
+    @param[in] MinimumDigits - The minimum number of digits, padded with
+        zeros. Zero for no padding.
+
+    @param[in] Digits - k_UpperHexDigits or k_LowerHexDigits.
+ */
+static
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+AppendHexToSymbol (
+    _Inout_ PSYMBOL_NAME Symbol,
+    _Inout_ PULONG Length,
+    _In_ ULONG64 Value,
+    _In_ ULONG MinimumDigits,
+    _In_ PCSTR Digits
+    )
+{
+    CHAR buffer[17];
+    ULONG position;
+
+    position = RTL_NUMBER_OF(buffer) - 1;
+    buffer[position] = ANSI_NULL;
+    do
+    {
+        buffer[--position] = Digits[Value & 0xf];
+        Value >>= 4;
+    } while ((Value != 0) ||
+             ((RTL_NUMBER_OF(buffer) - 1 - position) < MinimumDigits));
+
+    AppendStringToSymbol(Symbol, Length, &buffer[position]);
+}
+
+/*!
+    @brief Resolves the address into module!symbol+offset.
+
+    @param[in] Address - The address to resolve.
+
+    @return The resolved symbol; module!name+offset for an exported function,
+        module!sub_<RVA>+offset for other functions, module+offset when no
+        function precedes the address, and the address itself when no indexed
+        module contains it.
+ */
+_Use_decl_annotations_
+SYMBOL_NAME
+AddressToSymbol (
+    PVOID Address
+    )
+{
+    SYMBOL_NAME symbol;
+    ULONG length;
+    ULONG_PTR address;
+    const SYMBOL_MODULE* module;
+    const SYMBOL_ENTRY* entry;
+    ULONG rva, low, high, middle;
+
+    symbol.AsChars[0] = ANSI_NULL;
+    length = 0;
+    address = reinterpret_cast<ULONG_PTR>(Address);
+    module = nullptr;
+    entry = nullptr;
+
+    //
+    // Find the last module whose image base is less than or equal to the
+    // address.
+    //
+    low = 0;
+    high = g_SymbolIndex.ModuleCount;
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (g_SymbolIndex.Modules[middle].ImageBase <= address)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if ((low != 0) &&
+        (address - g_SymbolIndex.Modules[low - 1].ImageBase <
+            g_SymbolIndex.Modules[low - 1].ImageSize))
+    {
+        module = &g_SymbolIndex.Modules[low - 1];
+    }
+
+    if (module == nullptr)
+    {
+        AppendHexToSymbol(&symbol, &length, address, 16, k_UpperHexDigits);
+        goto Exit;
+    }
+
+    //
+    // Do the same for the symbol.
+    //
+    rva = static_cast<ULONG>(address - module->ImageBase);
+    low = 0;
+    high = module->EntryCount;
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (module->Entries[middle].Rva <= rva)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low != 0)
+    {
+        entry = &module->Entries[low - 1];
+    }
+
+    AppendStringToSymbol(&symbol, &length, module->Name);
+    if (entry == nullptr)
+    {
+        AppendStringToSymbol(&symbol, &length, "+0x");
+        AppendHexToSymbol(&symbol, &length, rva, 0, k_LowerHexDigits);
+        goto Exit;
+    }
+
+    AppendStringToSymbol(&symbol, &length, "!");
+    if (entry->NameOffset == k_NoSymbolName)
+    {
+        AppendStringToSymbol(&symbol, &length, "sub_");
+        AppendHexToSymbol(&symbol, &length, entry->Rva, 0, k_UpperHexDigits);
+    }
+    else
+    {
+        AppendStringToSymbol(&symbol, &length, &module->Names[entry->NameOffset]);
+    }
+    AppendStringToSymbol(&symbol, &length, "+0x");
+    AppendHexToSymbol(&symbol, &length, rva - entry->Rva, 0, k_LowerHexDigits);
+
+Exit:
+    return symbol;
+}
@@ -0,0 +1,47 @@
+/*!
+    @file HookKernelSymbols.hpp
+
+    @brief Kernel mode code to resolve addresses into module!symbol+offset.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+
+//
+// The maximum length of a resolved symbol including the terminating null.
+//
+static constexpr ULONG k_MaxSymbolNameLength = 128;
+
+//
+// The resolved symbol, returned by value so that it can be used as an
+// argument of logging functions.
+//
+typedef struct _SYMBOL_NAME
+{
+    CHAR AsChars[k_MaxSymbolNameLength];
+} SYMBOL_NAME, *PSYMBOL_NAME;
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+InitializeSymbolIndex (
+    VOID
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CleanupSymbolIndex (
+    VOID
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+SYMBOL_NAME
+AddressToSymbol (
+    _In_ PVOID Address
+    );
@@ -0,0 +1,584 @@
+/*!
+    @file HookKernelThunk.hpp
+
+    @brief Kernel mode code to generate hook handlers from a declarative
+        description of a hook.
+
+    @details A hook handler generated by this file is declared as a type
+        alias, and only describes the hooked function and what to do when it
+        is called. For example,
+
+            HOOK_DECLARE_TARGET(ExFreePool);
+            using ExFreePoolHook = Hook<HookTargetExFreePool,
+                                        CountPolicy,
+                                        CallerOutsideImageFilter,
+                                        LogPolicy>;
+
+        generates ExFreePoolHook::Handler, which calls the original ExFreePool
+        through the original call stub, counts the call, and logs it only when
+        it is called from outside of any image. The type is registered into
+        g_HookRegistrationEntries with HOOK_REGISTRATION_ENTRY_FROM_THUNK.
+
+        Policies are applied in the specified order like layers: the first
+        policy is the outermost one. When Pre of a policy returns FALSE, the
+        rest of the policies are skipped for the call (the original function
+        is still called), which lets a filter policy gate policies after it.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "HookCommon.hpp"
+#include "HookKernelSubscribers.hpp"
+#include "HookKernelSymbols.hpp"
+
+EXTERN_C
+NTKERNELAPI
+PVOID
+NTAPI
+RtlPcToFileHeader (
+    _In_ PVOID PcValue,
+    _Out_ PVOID* BaseOfImage
+    );
+
+//
+// The number of recent calls recorded per hook by RecordArgumentsPolicy, and
+// the number of arguments recorded per call.
+//
+static constexpr ULONG k_HookArgumentRecordCount = 16;
+static constexpr ULONG k_HookMaxRecordedArguments = 4;
+
+//
+// A single call recorded by RecordArgumentsPolicy.
+//
+typedef struct _HOOK_ARGUMENT_RECORD
+{
+    PVOID ReturnAddress;
+    ULONG64 Arguments[k_HookMaxRecordedArguments];
+    ULONG64 Result;
+} HOOK_ARGUMENT_RECORD, *PHOOK_ARGUMENT_RECORD;
+
+//
+// The per hook data used by a generated handler. One instance exists for each
+// Hook type, and is referenced from HOOK_REGISTRATION_ENTRY.
+//
+typedef struct _HOOK_THUNK_DATA
+{
+    //
+    // The original call stub, the name of the hooked function and the
+    // registration entry. Those are set by InitializeHookRegistrationEntries.
+    // The generated handler reads the stub from here instead of searching
+    // g_HookRegistrationEntries.
+    //
+    PVOID OriginalCallStub;
+    PCUNICODE_STRING FunctionName;
+    const HOOK_REGISTRATION_ENTRY* Registration;
+
+    //
+    // Statistics updated by CountPolicy and TimePolicy.
+    //
+    volatile LONG64 CallCount;
+    volatile LONG64 ElapsedCycles;
+
+    //
+    // The ring buffer of recent calls updated by RecordArgumentsPolicy. Records
+    // are not updated atomically, and a record can be torn when more than
+    // k_HookArgumentRecordCount calls are made concurrently.
+    //
+    volatile LONG NextRecordIndex;
+    HOOK_ARGUMENT_RECORD Records[k_HookArgumentRecordCount];
+} HOOK_THUNK_DATA, *PHOOK_THUNK_DATA;
+
+//
+// The per call context passed to each policy.
+//
+typedef struct _HOOK_THUNK_CONTEXT
+{
+    PHOOK_THUNK_DATA Data;
+    PVOID ReturnAddress;
+    ULONG64 StartTime;
+
+    //
+    // The return value of the original function converted to ULONG64. Valid
+    // only in Post, and zero if the function returns VOID.
+    //
+    ULONG64 Result;
+
+    //
+    // The call information and the read-side section used by SubscribersPolicy.
+    //
+    HOOK_CALL_INFO CallInfo;
+    HOOK_SUBSCRIBER_SECTION SubscriberSection;
+} HOOK_THUNK_CONTEXT, *PHOOK_THUNK_CONTEXT;
+
+/*!
+    @brief Declares a type describing the NT-kernel exported function to hook.
+
+    @param[in] FunctionName - The name of the function to hook. The function
+        must be declared by the WDK.
+ */
+#define HOOK_DECLARE_TARGET(FunctionName) \
+    HOOK_DECLARE_TARGET_WITH_TYPE(FunctionName, decltype(FunctionName))
+
+/*!
+    @brief Declares a type describing the NT-kernel exported function to hook
+        with an explicit function type.
+
+    @details This is for functions not declared by the WDK, such as
+        ZwQuerySystemInformation.
+
+    @param[in] FunctionName - The name of the function to hook.
+
+    @param[in] FunctionType - The type of the function, for example,
+        NTSTATUS NTAPI (ULONG, PVOID).
+ */
+#define HOOK_DECLARE_TARGET_WITH_TYPE(FunctionName, FunctionType) \
+    struct HookTarget##FunctionName \
+    { \
+        using Type = FunctionType; \
+        static constexpr WCHAR Name[] = HOOK_WIDE_STRING(FunctionName); \
+    }
+
+#define HOOK_WIDE_STRING_(String) L##String
+#define HOOK_WIDE_STRING(Name) HOOK_WIDE_STRING_(#Name)
+
+/*!
+    @brief Expands to the initializer of HOOK_REGISTRATION_ENTRY for the Hook
+        type.
+
+    @param[in] HookType - The Hook type to register.
+ */
+#define HOOK_REGISTRATION_ENTRY_FROM_THUNK(HookType) \
+    { \
+        RTL_CONSTANT_STRING(HookType::Target::Name), \
+        HookType::Handler, \
+        &HookType::Data, \
+    }
+
+/*!
+    @brief Converts an argument or a return value to ULONG64 for recording.
+ */
+template<typename ValueType>
+FORCEINLINE
+ULONG64
+ToHookValue (
+    _In_ ValueType* Value
+    )
+{
+    return reinterpret_cast<ULONG64>(Value);
+}
+
+template<typename ValueType>
+FORCEINLINE
+ULONG64
+ToHookValue (
+    _In_ ValueType Value
+    )
+{
+    return static_cast<ULONG64>(Value);
+}
+
+/*!
+    @brief Initializes HOOK_CALL_INFO passed to subscribers.
+
+    @param[out] CallInfo - The address of HOOK_CALL_INFO to initialize.
+
+    @param[in] Registration - The registration entry of the hook.
+
+    @param[in] ReturnAddress - The return address of the hooked call.
+
+    @param[in] Arguments - The arguments of the hooked call.
+ */
+template<typename... ArgTypes>
+FORCEINLINE
+VOID
+InitializeHookCallInfo (
+    _Out_ PHOOK_CALL_INFO CallInfo,
+    _In_ const HOOK_REGISTRATION_ENTRY* Registration,
+    _In_ PVOID ReturnAddress,
+    _In_ ArgTypes... Arguments
+    )
+{
+    const ULONG64 arguments[] = { ToHookValue(Arguments)..., 0, };
+
+    static_assert(sizeof...(Arguments) <= k_HookMaxCallbackArguments,
+                  "Too many arguments");
+
+    CallInfo->FunctionName = &Registration->FunctionName;
+    CallInfo->ReturnAddress = ReturnAddress;
+    CallInfo->ArgumentCount = sizeof...(Arguments);
+    for (ULONG i = 0; i < sizeof...(Arguments); ++i)
+    {
+        CallInfo->Arguments[i] = arguments[i];
+    }
+    CallInfo->Result = 0;
+}
+
+//
+// Counts the number of calls.
+//
+struct CountPolicy
+{
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    BOOLEAN
+    Pre (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes...
+        )
+    {
+        UNREFERENCED_PARAMETER(Context);
+        return TRUE;
+    }
+
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    VOID
+    Post (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes...
+        )
+    {
+        InterlockedIncrement64(&Context->Data->CallCount);
+    }
+};
+
+//
+// Accumulates the time spent for the call, including the policies after this
+// policy, in TSC.
+//
+struct TimePolicy
+{
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    BOOLEAN
+    Pre (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes...
+        )
+    {
+        Context->StartTime = __rdtsc();
+        return TRUE;
+    }
+
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    VOID
+    Post (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes...
+        )
+    {
+        InterlockedAdd64(&Context->Data->ElapsedCycles,
+                         static_cast<LONG64>(__rdtsc() - Context->StartTime));
+    }
+};
+
+//
+// Records the return address, the first k_HookMaxRecordedArguments arguments
+// and the return value of recent calls.
+//
+struct RecordArgumentsPolicy
+{
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    BOOLEAN
+    Pre (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes...
+        )
+    {
+        UNREFERENCED_PARAMETER(Context);
+        return TRUE;
+    }
+
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    VOID
+    Post (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes... Arguments
+        )
+    {
+        ULONG index;
+        PHOOK_ARGUMENT_RECORD record;
+        const ULONG64 arguments[] = { ToHookValue(Arguments)..., 0, };
+
+        index = static_cast<ULONG>(InterlockedIncrement(&Context->Data->NextRecordIndex) - 1);
+        record = &Context->Data->Records[index % k_HookArgumentRecordCount];
+        record->ReturnAddress = Context->ReturnAddress;
+        for (ULONG i = 0; i < k_HookMaxRecordedArguments; ++i)
+        {
+            record->Arguments[i] = (i < sizeof...(Arguments)) ? arguments[i] : 0;
+        }
+        record->Result = Context->Result;
+    }
+};
+
+//
+// Skips the rest of policies unless the hooked function is called from outside
+// of any image.
+//
+struct CallerOutsideImageFilter
+{
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    BOOLEAN
+    Pre (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes...
+        )
+    {
+        PVOID imageBaseAddress;
+
+        return (RtlPcToFileHeader(Context->ReturnAddress, &imageBaseAddress) == nullptr);
+    }
+
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    VOID
+    Post (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes...
+        )
+    {
+        UNREFERENCED_PARAMETER(Context);
+    }
+};
+
+//
+// Executes callbacks attached to the hook with SubscribeHook.
+//
+struct SubscribersPolicy
+{
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    BOOLEAN
+    Pre (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes... Arguments
+        )
+    {
+        InitializeHookCallInfo(&Context->CallInfo,
+                               Context->Data->Registration,
+                               Context->ReturnAddress,
+                               Arguments...);
+        EnterHookSubscribers(Context->Data->Registration,
+                             &Context->CallInfo,
+                             &Context->SubscriberSection);
+        return TRUE;
+    }
+
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    VOID
+    Post (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes...
+        )
+    {
+        Context->CallInfo.Result = Context->Result;
+        LeaveHookSubscribers(&Context->CallInfo, &Context->SubscriberSection);
+    }
+};
+
+//
+// Logs the call with up to the first four arguments and the return value.
+//
+struct LogPolicy
+{
+    template<typename... ArgTypes>
+    static
+    FORCEINLINE
+    BOOLEAN
+    Pre (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes...
+        )
+    {
+        UNREFERENCED_PARAMETER(Context);
+        return TRUE;
+    }
+
+    template<typename... ArgTypes>
+    static
+    VOID
+    Post (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes... Arguments
+        )
+    {
+        const ULONG64 arguments[] = { ToHookValue(Arguments)..., 0, 0, 0, 0, };
+
+        switch (sizeof...(Arguments))
+        {
+        case 0:
+            LOGGING_LOG_INFO("%s: %wZ() => %llx",
+                             AddressToSymbol(Context->ReturnAddress).AsChars,
+                             Context->Data->FunctionName,
+                             Context->Result);
+            break;
+        case 1:
+            LOGGING_LOG_INFO("%s: %wZ(%llx) => %llx",
+                             AddressToSymbol(Context->ReturnAddress).AsChars,
+                             Context->Data->FunctionName,
+                             arguments[0],
+                             Context->Result);
+            break;
+        case 2:
+            LOGGING_LOG_INFO("%s: %wZ(%llx, %llx) => %llx",
+                             AddressToSymbol(Context->ReturnAddress).AsChars,
+                             Context->Data->FunctionName,
+                             arguments[0],
+                             arguments[1],
+                             Context->Result);
+            break;
+        case 3:
+            LOGGING_LOG_INFO("%s: %wZ(%llx, %llx, %llx) => %llx",
+                             AddressToSymbol(Context->ReturnAddress).AsChars,
+                             Context->Data->FunctionName,
+                             arguments[0],
+                             arguments[1],
+                             arguments[2],
+                             Context->Result);
+            break;
+        default:
+            LOGGING_LOG_INFO("%s: %wZ(%llx, %llx, %llx, %llx, ...) => %llx",
+                             AddressToSymbol(Context->ReturnAddress).AsChars,
+                             Context->Data->FunctionName,
+                             arguments[0],
+                             arguments[1],
+                             arguments[2],
+                             arguments[3],
+                             Context->Result);
+            break;
+        }
+    }
+};
+
+template<typename Type>
+struct HookIsVoid
+{
+    static constexpr bool Value = false;
+};
+
+template<>
+struct HookIsVoid<VOID>
+{
+    static constexpr bool Value = true;
+};
+
+template<typename TargetType, typename FunctionType, typename... Policies>
+class HookThunk;
+
+//
+// The implementation of Hook, specialized with the return and argument types
+// of the hooked function.
+//
+template<typename TargetType, typename ReturnType, typename... ArgTypes, typename... Policies>
+class HookThunk<TargetType, ReturnType NTAPI (ArgTypes...), Policies...>
+{
+public:
+    using Target = TargetType;
+    using FunctionType = ReturnType NTAPI (ArgTypes...);
+
+    static inline HOOK_THUNK_DATA Data;
+
+    /*!
+        @brief The hook handler executed instead of the hooked function.
+     */
+    static
+    ReturnType
+    NTAPI
+    Handler (
+        ArgTypes... Arguments
+        )
+    {
+        HOOK_THUNK_CONTEXT context;
+
+        context.Data = &Data;
+        context.ReturnAddress = _ReturnAddress();
+        context.StartTime = 0;
+        context.Result = 0;
+        return Invoke<Policies...>(&context, Arguments...);
+    }
+
+private:
+    /*!
+        @brief Applies the specified policies, or calls the original function
+            if no policy is specified.
+     */
+    template<typename... Chain>
+    static
+    FORCEINLINE
+    ReturnType
+    Invoke (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes... Arguments
+        )
+    {
+        if constexpr (sizeof...(Chain) == 0)
+        {
+            UNREFERENCED_PARAMETER(Context);
+            NT_ASSERT(Data.OriginalCallStub != nullptr);
+            return reinterpret_cast<FunctionType*>(Data.OriginalCallStub)(Arguments...);
+        }
+        else
+        {
+            return InvokePolicy<Chain...>(Context, Arguments...);
+        }
+    }
+
+    /*!
+        @brief Applies Policy around the rest of policies.
+     */
+    template<typename Policy, typename... Rest>
+    static
+    FORCEINLINE
+    ReturnType
+    InvokePolicy (
+        _Inout_ PHOOK_THUNK_CONTEXT Context,
+        _In_ ArgTypes... Arguments
+        )
+    {
+        if (Policy::Pre(Context, Arguments...) == FALSE)
+        {
+            return Invoke<>(Context, Arguments...);
+        }
+
+        if constexpr (IsVoidReturnType)
+        {
+            Invoke<Rest...>(Context, Arguments...);
+            Policy::Post(Context, Arguments...);
+        }
+        else
+        {
+            ReturnType result;
+
+            result = Invoke<Rest...>(Context, Arguments...);
+            Context->Result = ToHookValue(result);
+            Policy::Post(Context, Arguments...);
+            return result;
+        }
+    }
+
+    static constexpr bool IsVoidReturnType = HookIsVoid<ReturnType>::Value;
+};
+
+//
+// A hook handler generated from the hooked function and policies.
+//
+template<typename TargetType, typename... Policies>
+using Hook = HookThunk<TargetType, typename TargetType::Type, Policies...>;
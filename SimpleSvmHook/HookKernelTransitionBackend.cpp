@@ -0,0 +1,371 @@
+/*!
+    @file HookKernelTransitionBackend.cpp
+
+    @brief Kernel mode code to select the implementation of the NPT state
+        transitions.
+
+    @details Which backend is faster depends on the system; the sweep backend
+        scales with the size of physical memory and the number of executable
+        pages in the state 2, while the views backend costs a constant NCr3
+        switch and a TLB flush, at the expense of memory for the views. The
+        shadows backend still scales with the size of physical memory, but
+        only with the executable pages outside of the 1GB range of the hooked
+        page. The backend is, therefore, selected by timing the transitions of
+        each backend against the NPT built for the system in the same way as
+        that for processors, before any processor is virtualized. The
+        selection can be overridden with the NptTransitionBackend
+        configuration.
+
+        Each transition is timed as made on the NPT fault, followed by an
+        access to the page through the NPT walked in software in place of the
+        walk on the TLB miss. The timing does not include the cost of #VMEXIT
+        and VMRUN, which is the same for all backends, nor the full TLB flush,
+        which cannot be measured without virtualization. The flush is instead
+        modelled for the backends requesting it on transitions, the views
+        backend, as the guest refilling k_TlbRefillPageCount translations.
+        The cost of a refill is measured as a TLB miss of the host after
+        INVLPG, scaled by k_NestedWalkFactor for the two dimensional walk of
+        nested paging, and is added to the measured cycles. Transitions are
+        measured in short chunks at DISPATCH_LEVEL, and the IRQL is lowered
+        between chunks, so that the calibration does not hold the processor
+        for long.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelTransitionBackend.hpp"
+#include "Common.hpp"
+#include "HookCommon.hpp"
+#include "HookKernelProcessorData.hpp"
+#include "HookKernelViews.hpp"
+#include "HookKernelShadows.hpp"
+#include "HookVmmCommon.hpp"
+
+//
+// The number of times to transition for each hook in a round, and the number
+// of rounds to measure. The fastest round is taken. Each time of a round is
+// measured as a separate chunk.
+//
+static constexpr ULONG k_CalibrationIterations = 100;
+static constexpr ULONG k_CalibrationRounds = 5;
+
+//
+// The number of translations the guest is assumed to refill after a full TLB
+// flush, and the ratio of memory references of a nested page walk to those of
+// a native walk with 4-level paging on both dimensions, (4 + 1) * (4 + 1) - 1
+// to 4.
+//
+static constexpr ULONG k_TlbRefillPageCount = 64;
+static constexpr ULONG k_NestedWalkFactor = 6;
+
+//
+// The number of full TLB flushes for a pair of the transitions to the state 2
+// and back to 1, indexed by NPT_TRANSITION_BACKEND. Only the views backend
+// switches NCr3, which requires the flush.
+//
+static const ULONG k_TlbFlushesPerTransitionPair[] =
+{
+    0,
+    2,
+    0,
+};
+static_assert(RTL_NUMBER_OF(k_TlbFlushesPerTransitionPair) == NptTransitionBackendMax,
+              "Size check");
+
+//
+// The names of backends for logging, indexed by NPT_TRANSITION_BACKEND.
+//
+static const PCSTR k_NptTransitionBackendNames[] =
+{
+    "sweep",
+    "views",
+    "shadows",
+};
+static_assert(RTL_NUMBER_OF(k_NptTransitionBackendNames) == NptTransitionBackendMax,
+              "Size check");
+
+NPT_TRANSITION_BACKEND g_NptTransitionBackend;
+
+/*!
+    @brief Estimates cycles the guest spends refilling TLB after a full
+        flush.
+
+    @param[out] Cycles - The address to receive the estimated cycles.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+MeasureTlbFlushPenalty (
+    _Out_ PULONG64 Cycles
+    )
+{
+    NTSTATUS status;
+    PMDL mdl;
+    PUCHAR pages;
+    PHYSICAL_ADDRESS lowest, highest, skip;
+    KIRQL oldIrql;
+    ULONG64 startCycles;
+    ULONG64 cycles;
+
+    *Cycles = MAXULONG64;
+
+    pages = nullptr;
+
+    //
+    // Map the pages with system PTEs so that each page has its own
+    // translation. Pool may be mapped with large pages.
+    //
+    lowest.QuadPart = 0;
+    highest.QuadPart = MAXLONGLONG;
+    skip.QuadPart = 0;
+    mdl = MmAllocatePagesForMdlEx(lowest,
+                                  highest,
+                                  skip,
+                                  k_TlbRefillPageCount * PAGE_SIZE,
+                                  MmCached,
+                                  MM_ALLOCATE_FULLY_REQUIRED);
+    if (mdl == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    pages = static_cast<PUCHAR>(MmMapLockedPagesSpecifyCache(mdl,
+                                                             KernelMode,
+                                                             MmCached,
+                                                             nullptr,
+                                                             FALSE,
+                                                             NormalPagePriority));
+    if (pages == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    //
+    // Time an access to each page after invalidating its translation, once
+    // for each round as a chunk, and take the fastest round.
+    //
+    for (ULONG i = 0; i < k_CalibrationRounds; ++i)
+    {
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+        for (ULONG j = 0; j < k_TlbRefillPageCount; ++j)
+        {
+            __invlpg(&pages[j * PAGE_SIZE]);
+        }
+        startCycles = __rdtsc();
+        for (ULONG j = 0; j < k_TlbRefillPageCount; ++j)
+        {
+            (VOID)*static_cast<volatile UCHAR*>(&pages[j * PAGE_SIZE]);
+        }
+        cycles = __rdtsc() - startCycles;
+        KeLowerIrql(oldIrql);
+        *Cycles = min(*Cycles, cycles);
+    }
+
+    *Cycles *= k_NestedWalkFactor;
+    status = STATUS_SUCCESS;
+
+Exit:
+    if (pages != nullptr)
+    {
+        MmUnmapLockedPages(pages, mdl);
+    }
+    if (mdl != nullptr)
+    {
+        MmFreePagesFromMdl(mdl);
+        ExFreePool(mdl);
+    }
+    return status;
+}
+
+/*!
+    @brief Measures cycles of the transitions between the state 1 and 2 with
+        the backend.
+
+    @param[in] Backend - The backend to measure.
+
+    @param[out] Cycles - The address to receive the cycles spent for a pair
+        of the transitions to the state 2 and back to 1.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+MeasureNptTransitionBackend (
+    _In_ NPT_TRANSITION_BACKEND Backend,
+    _Out_ PULONG64 Cycles
+    )
+{
+    NTSTATUS status;
+    PHOOK_DATA hookData;
+    PVMCB vmcb;
+    KIRQL oldIrql;
+    ULONG64 cycles;
+
+    *Cycles = MAXULONG64;
+
+    hookData = nullptr;
+    vmcb = static_cast<PVMCB>(ExAllocatePoolWithTag(NonPagedPool,
+                                                    sizeof(*vmcb),
+                                                    k_PoolTag));
+    if (vmcb == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(vmcb, sizeof(*vmcb));
+
+    //
+    // Build the hook data the same as that for processors, but for the
+    // backend to measure.
+    //
+    status = InitializeHookData(&hookData, nullptr);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("InitializeHookData failed : %08x", status);
+        goto Exit;
+    }
+    hookData->TransitionBackend = Backend;
+    hookData->SuspendOnCall = FALSE;
+    if ((Backend == NptTransitionBackendHookViews) &&
+        (hookData->Views == nullptr))
+    {
+        status = BuildHookViews(hookData);
+        if (!NT_SUCCESS(status))
+        {
+            LOGGING_LOG_ERROR("BuildHookViews failed : %08x", status);
+            goto Exit;
+        }
+    }
+    if ((Backend == NptTransitionBackendHookShadows) &&
+        (hookData->Shadows == nullptr))
+    {
+        status = BuildHookShadows(hookData);
+        if (!NT_SUCCESS(status))
+        {
+            LOGGING_LOG_ERROR("BuildHookShadows failed : %08x", status);
+            goto Exit;
+        }
+    }
+
+    //
+    // Measure each chunk at DISPATCH_LEVEL so that it is not interrupted by
+    // context switches, and lower the IRQL between chunks to let the thread
+    // be preempted.
+    //
+    for (ULONG i = 0; i < k_CalibrationRounds; ++i)
+    {
+        cycles = 0;
+        for (ULONG j = 0; j < k_CalibrationIterations; ++j)
+        {
+            KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+            cycles += MeasureNptTransitions(vmcb, hookData, 1);
+            KeLowerIrql(oldIrql);
+        }
+        *Cycles = min(*Cycles, cycles);
+    }
+
+    *Cycles /= (static_cast<ULONG64>(k_CalibrationIterations) *
+                g_HookRegistrationEntryCount);
+
+Exit:
+    if (hookData != nullptr)
+    {
+        CleanupHookData(hookData);
+    }
+    if (vmcb != nullptr)
+    {
+        ExFreePoolWithTag(vmcb, k_PoolTag);
+    }
+    return status;
+}
+
+/*!
+    @brief Selects the backend used by all processors.
+
+    @details The fastest backend is selected unless the backend is configured.
+        The sweep backend is used when no backend can be measured.
+
+    @param[in] ConfiguredBackend - NPT_TRANSITION_BACKEND + 1 to use, or zero
+        to select the fastest one.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+SelectNptTransitionBackend (
+    ULONG ConfiguredBackend
+    )
+{
+    NTSTATUS status;
+    ULONG64 cycles;
+    ULONG64 fastestCycles;
+    ULONG64 flushPenalty;
+
+    PAGED_CODE();
+
+    g_NptTransitionBackend = NptTransitionBackendSweep;
+
+    if (ConfiguredBackend != 0)
+    {
+        NT_ASSERT(ConfiguredBackend <= NptTransitionBackendMax);
+
+        g_NptTransitionBackend = static_cast<NPT_TRANSITION_BACKEND>(
+                                                        ConfiguredBackend - 1);
+        LOGGING_LOG_INFO("NPT transition backend: %s (configured)",
+                         k_NptTransitionBackendNames[g_NptTransitionBackend]);
+        goto Exit;
+    }
+
+    if (g_HookRegistrationEntryCount == 0)
+    {
+        LOGGING_LOG_INFO("NPT transition backend: %s (no hooks)",
+                         k_NptTransitionBackendNames[g_NptTransitionBackend]);
+        goto Exit;
+    }
+
+    status = MeasureTlbFlushPenalty(&flushPenalty);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_WARN("Failed to measure the TLB flush penalty : %08x",
+                         status);
+        flushPenalty = 0;
+    }
+    LOGGING_LOG_INFO("TLB flush penalty: %llu cycles", flushPenalty);
+
+    fastestCycles = MAXULONG64;
+    for (ULONG i = 0; i < NptTransitionBackendMax; ++i)
+    {
+        status = MeasureNptTransitionBackend(
+                                    static_cast<NPT_TRANSITION_BACKEND>(i),
+                                    &cycles);
+        if (!NT_SUCCESS(status))
+        {
+            LOGGING_LOG_WARN("Failed to measure the %s backend : %08x",
+                             k_NptTransitionBackendNames[i],
+                             status);
+            continue;
+        }
+
+        cycles += flushPenalty * k_TlbFlushesPerTransitionPair[i];
+        LOGGING_LOG_INFO("NPT transition backend %s: %llu cycles per transition pair",
+                         k_NptTransitionBackendNames[i],
+                         cycles);
+        if (cycles < fastestCycles)
+        {
+            fastestCycles = cycles;
+            g_NptTransitionBackend = static_cast<NPT_TRANSITION_BACKEND>(i);
+        }
+    }
+
+    LOGGING_LOG_INFO("NPT transition backend: %s (calibrated)",
+                     k_NptTransitionBackendNames[g_NptTransitionBackend]);
+
+Exit:
+    return;
+}
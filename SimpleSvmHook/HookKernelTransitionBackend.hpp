@@ -0,0 +1,25 @@
+/*!
+    @file HookKernelTransitionBackend.hpp
+
+    @brief Kernel mode code to select the implementation of the NPT state
+        transitions.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "HookCommon.hpp"
+
+//
+// The backend used by all processors. Read-only once hooks are initialized.
+//
+extern NPT_TRANSITION_BACKEND g_NptTransitionBackend;
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+SelectNptTransitionBackend (
+    _In_ ULONG ConfiguredBackend
+    );
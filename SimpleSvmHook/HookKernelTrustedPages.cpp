@@ -0,0 +1,278 @@
+/*!
+    @file HookKernelTrustedPages.cpp
+
+    @brief Kernel mode code to collect pages kept executable in the state 2.
+
+    @details In the state 2, every page but the ones of the active hook is
+        non-executable. An interrupt arriving while a processor executes the
+        hooked page, or a hook handler being entered, therefore causes the
+        transition to the state 1 and another transition back to the state 2
+        when execution returns to the hooked page. The trusted pages stay
+        executable in the state 2 to avoid those transitions.
+
+        The categories of trusted pages are selected with the TrustedPages
+        value under the service key (see Configuration.hpp):
+        - k_TrustedPagesInterruptDispatch: the pages of the IDT handlers of all
+          processors.
+        - k_TrustedPagesHookHandlers: the non-paged, non-discardable code
+          sections of this driver, and the pages of original call stubs.
+
+        This is a trade-off. While a processor is in the state 2, it reads the
+        exec pages of the active hook, and the hooks are visible to code
+        executed there. Without the trusted pages, that is only code on the
+        hooked pages. With them, code on the trusted pages executed until
+        execution leaves them, such as the beginning of interrupt handlers,
+        can also read the hooks. The window is bounded to those pages, and
+        any page outside of them still causes the transition to the state 1.
+        Hooked pages are never trusted. Trusted pages are disabled by default.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelTrustedPages.hpp"
+#include "Common.hpp"
+#include "Configuration.hpp"
+#include "HookCommon.hpp"
+#include "Virtualization.hpp"
+#include "x86_64.hpp"
+
+EXTERN_C IMAGE_DOS_HEADER __ImageBase;
+
+/*!
+    @brief Adds the page containing the address to the trusted pages.
+
+    @details The page is ignored when it is not backed by physical memory,
+        contains hooks, or is already trusted. g_TrustedPages.PhyPageBases is
+        kept sorted.
+
+    @param[in] VirtualAddress - The address in the page to trust.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+AddTrustedPage (
+    _In_ PVOID VirtualAddress
+    )
+{
+    ULONG64 pa;
+    ULONG i;
+
+    PAGED_CODE();
+
+    pa = static_cast<ULONG64>(MmGetPhysicalAddress(
+                                        PAGE_ALIGN(VirtualAddress)).QuadPart);
+    if (pa == 0)
+    {
+        goto Exit;
+    }
+
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        if ((pa == registration.HookEntry.PhyPageBase) ||
+            (pa == registration.HookEntry.PhyLinkedPageBase))
+        {
+            goto Exit;
+        }
+    }
+
+    for (i = 0; i < g_TrustedPages.Count; ++i)
+    {
+        if (g_TrustedPages.PhyPageBases[i] >= pa)
+        {
+            break;
+        }
+    }
+    if ((i < g_TrustedPages.Count) && (g_TrustedPages.PhyPageBases[i] == pa))
+    {
+        goto Exit;
+    }
+
+    if (g_TrustedPages.Count == k_MaxTrustedPages)
+    {
+        LOGGING_LOG_WARN("Too many trusted pages. %p is not trusted.",
+                         VirtualAddress);
+        goto Exit;
+    }
+
+    RtlMoveMemory(&g_TrustedPages.PhyPageBases[i + 1],
+                  &g_TrustedPages.PhyPageBases[i],
+                  (g_TrustedPages.Count - i) * sizeof(ULONG64));
+    g_TrustedPages.PhyPageBases[i] = pa;
+    g_TrustedPages.Count++;
+
+Exit:
+    return;
+}
+
+/*!
+    @brief Adds the pages of the IDT handlers of the current processor to the
+        trusted pages.
+
+    @param[in] Context - Unused.
+
+    @return STATUS_SUCCESS.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+AddInterruptDispatchPages (
+    _In_opt_ PVOID Context
+    )
+{
+    DESCRIPTOR_TABLE_REGISTER idtr;
+    PINTERRUPT_GATE_DESCRIPTOR idt;
+    ULONG64 handler;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    PAGED_CODE();
+
+    __sidt(&idtr);
+    idt = reinterpret_cast<PINTERRUPT_GATE_DESCRIPTOR>(idtr.Base);
+    for (ULONG i = 0; i < (idtr.Limit + 1UL) / sizeof(*idt); ++i)
+    {
+        if (idt[i].Present == FALSE)
+        {
+            continue;
+        }
+
+        handler = (static_cast<ULONG64>(idt[i].OffsetHigh) << 32) |
+                  (static_cast<ULONG64>(idt[i].OffsetMiddle) << 16) |
+                  idt[i].OffsetLow;
+        AddTrustedPage(reinterpret_cast<PVOID>(handler));
+    }
+    return STATUS_SUCCESS;
+}
+
+/*!
+    @brief Adds the pages of hook handlers to the trusted pages.
+
+    @details The pages of the code sections of this driver that are neither
+        pageable nor discardable, and the pages of the original call stubs are
+        trusted.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+AddHookHandlerPages (
+    VOID
+    )
+{
+    PIMAGE_NT_HEADERS ntHeaders;
+    PIMAGE_SECTION_HEADER section;
+    PUCHAR sectionBase;
+
+    PAGED_CODE();
+
+    ntHeaders = reinterpret_cast<PIMAGE_NT_HEADERS>(
+                reinterpret_cast<PUCHAR>(&__ImageBase) + __ImageBase.e_lfanew);
+    section = IMAGE_FIRST_SECTION(ntHeaders);
+    for (ULONG i = 0; i < ntHeaders->FileHeader.NumberOfSections; ++i, ++section)
+    {
+        if ((!BooleanFlagOn(section->Characteristics, IMAGE_SCN_MEM_EXECUTE)) ||
+            BooleanFlagOn(section->Characteristics, IMAGE_SCN_MEM_DISCARDABLE) ||
+            (RtlCompareMemory(section->Name, "PAGE", 4) == 4))
+        {
+            continue;
+        }
+
+        sectionBase = reinterpret_cast<PUCHAR>(&__ImageBase) +
+                      section->VirtualAddress;
+        for (ULONG offset = 0;
+             offset < section->Misc.VirtualSize;
+             offset += PAGE_SIZE)
+        {
+            AddTrustedPage(sectionBase + offset);
+        }
+    }
+
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        if (registration.HookEntry.OriginalCallStub != nullptr)
+        {
+            AddTrustedPage(registration.HookEntry.OriginalCallStub);
+        }
+    }
+}
+
+/*!
+    @brief Collects the trusted pages.
+
+    @details This function must be called after hooks are installed, and
+        before processors are virtualized.
+
+    @param[in] Categories - The k_TrustedPages* flags specifying pages to
+        trust.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+InitializeTrustedPages (
+    ULONG Categories
+    )
+{
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    NT_ASSERT(g_TrustedPages.Count == 0);
+
+    if (BooleanFlagOn(Categories, k_TrustedPagesInterruptDispatch))
+    {
+        status = ExecuteOnEachProcessor(AddInterruptDispatchPages,
+                                        nullptr,
+                                        nullptr);
+        if (!NT_SUCCESS(status))
+        {
+            LOGGING_LOG_ERROR("ExecuteOnEachProcessor failed : %08x", status);
+            goto Exit;
+        }
+    }
+
+    if (BooleanFlagOn(Categories, k_TrustedPagesHookHandlers))
+    {
+        AddHookHandlerPages();
+    }
+
+    if (g_TrustedPages.Count != 0)
+    {
+        LOGGING_LOG_INFO("%lu pages are kept executable in the visible state",
+                         g_TrustedPages.Count);
+    }
+    status = STATUS_SUCCESS;
+
+Exit:
+    if (!NT_SUCCESS(status))
+    {
+        g_TrustedPages.Count = 0;
+    }
+    return status;
+}
+
+/*!
+    @brief Reports how many #VMEXITs the trusted pages avoided, and clears
+        them.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+CleanupTrustedPages (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    if (g_TrustedPages.Count != 0)
+    {
+        LOGGING_LOG_INFO("Trusted pages avoided up to %lld #VMEXITs",
+                         g_TrustedPages.AvoidedExitCount);
+    }
+    RtlZeroMemory(&g_TrustedPages, sizeof(g_TrustedPages));
+}
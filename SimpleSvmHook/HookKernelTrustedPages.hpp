@@ -0,0 +1,26 @@
+/*!
+    @file HookKernelTrustedPages.hpp
+
+    @brief Kernel mode code to collect pages kept executable in the state 2.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+InitializeTrustedPages (
+    _In_ ULONG Categories
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CleanupTrustedPages (
+    VOID
+    );
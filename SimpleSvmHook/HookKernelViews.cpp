@@ -0,0 +1,458 @@
+/*!
+    @file HookKernelViews.cpp
+
+    @brief Kernel mode code to precompute NPTs of the state 2 for each hooked
+        page.
+
+    @details A view is the NPT of the state 2 for a hooked page, used by
+        NptTransitionBackendHookViews. It is built from the NPT of the state 0
+        by copying the PML4 and the PDPT and making all PDPT entries
+        non-executable, then, copying the PDT and the PT on the path to each
+        page executable in the state 2 and making only that path executable.
+        The hooked page is backed by the exec page in the view, and so is the
+        linked page if it has hooks. All other tables are shared with the NPT
+        of the state 1 and never become executable through the view.
+
+        The size of a view is, therefore, bounded by the number of executable
+        pages, that is, 2 + k_MaxTrustedPages, regardless of the size of
+        physical memory.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookKernelViews.hpp"
+#include "Common.hpp"
+#include "HookCommon.hpp"
+
+/*!
+    @brief Allocates a table owned by the view as a copy of the table.
+
+    @param[in,out] View - The view to own the table.
+
+    @param[in] SourceTable - The table to copy.
+
+    @param[in] DisallowExecution - TRUE to make all entries of the copy
+        non-executable.
+
+    @return The address of the copy on success, or NULL.
+ */
+template<typename TableType>
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+TableType*
+CopyTableForView (
+    _Inout_ PHOOK_VIEW View,
+    _In_reads_(512) const TableType* SourceTable,
+    _In_ BOOLEAN DisallowExecution
+    )
+{
+    TableType* table;
+
+    table = nullptr;
+
+    if (View->TableCount >= RTL_NUMBER_OF(View->Tables))
+    {
+        NT_ASSERT(FALSE);
+        goto Exit;
+    }
+
+    table = static_cast<TableType*>(AllocateNptEntry(nullptr));
+    if (table == nullptr)
+    {
+        goto Exit;
+    }
+    View->Tables[View->TableCount++] = table;
+
+    RtlCopyMemory(table, SourceTable, PAGE_SIZE);
+    if (DisallowExecution != FALSE)
+    {
+        for (ULONG i = 0; i < 512; ++i)
+        {
+            table[i].Fields.NoExecute = TRUE;
+        }
+    }
+
+Exit:
+    return table;
+}
+
+/*!
+    @brief Makes the page executable in the view.
+
+    @details Entries on the path to the page that still refer to the tables
+        of the NPT of the state 1 are redirected to the copies owned by the
+        view first, so that making them executable does not make other pages
+        executable.
+
+    @param[in,out] HookData - The processor associated hook data.
+
+    @param[in,out] View - The view to make the page executable.
+
+    @param[in] PhysicalAddress - The physical address of the page to make
+        executable.
+
+    @param[in] BackingPhysicalAddress - The physical address of the page to
+        back PhysicalAddress in the view.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+NTSTATUS
+MakePageExecutableInView (
+    _In_ const HOOK_DATA* HookData,
+    _Inout_ PHOOK_VIEW View,
+    _In_ ULONG64 PhysicalAddress,
+    _In_ ULONG64 BackingPhysicalAddress
+    )
+{
+    NTSTATUS status;
+    PPDP_ENTRY_4KB viewPdpt, sharedPdpt;
+    PPD_ENTRY_4KB viewPdt, sharedPdt;
+    PPT_ENTRY_4KB viewPt, sharedPt;
+    ULONG64 ppeIndex, pdeIndex, pteIndex;
+
+    //
+    // Only the first PML4 entry is managed, as in the state 2 of the sweep
+    // backend. All physical memory ranges are within it.
+    //
+    if (GetPxeIndex(PhysicalAddress) != 0)
+    {
+        status = STATUS_NOT_SUPPORTED;
+        goto Exit;
+    }
+
+    viewPdpt = static_cast<PPDP_ENTRY_4KB>(GetVaFromPfn(
+                            View->Pml4Table[0].Fields.PageFrameNumber));
+    sharedPdpt = static_cast<PPDP_ENTRY_4KB>(GetVaFromPfn(
+                            HookData->Pml4Table[0].Fields.PageFrameNumber));
+
+    //
+    // PDPT (1 GB). The entry refers to the PDT owned by the view if its PFN
+    // differs from the one of the NPT of the state 1.
+    //
+    ppeIndex = GetPpeIndex(PhysicalAddress);
+    if (viewPdpt[ppeIndex].Fields.Valid == FALSE)
+    {
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+    if (viewPdpt[ppeIndex].Fields.PageFrameNumber ==
+        sharedPdpt[ppeIndex].Fields.PageFrameNumber)
+    {
+        viewPdt = CopyTableForView(View,
+                                   static_cast<PPD_ENTRY_4KB>(GetVaFromPfn(
+                                        sharedPdpt[ppeIndex].Fields.PageFrameNumber)),
+                                   TRUE);
+        if (viewPdt == nullptr)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        viewPdpt[ppeIndex].Fields.PageFrameNumber = GetPfnFromVa(viewPdt);
+    }
+    viewPdpt[ppeIndex].Fields.NoExecute = FALSE;
+    viewPdt = static_cast<PPD_ENTRY_4KB>(GetVaFromPfn(
+                            viewPdpt[ppeIndex].Fields.PageFrameNumber));
+    sharedPdt = static_cast<PPD_ENTRY_4KB>(GetVaFromPfn(
+                            sharedPdpt[ppeIndex].Fields.PageFrameNumber));
+
+    //
+    // PDT (2 MB)
+    //
+    pdeIndex = GetPdeIndex(PhysicalAddress);
+    if (viewPdt[pdeIndex].Fields.Valid == FALSE)
+    {
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+    if (viewPdt[pdeIndex].Fields.PageFrameNumber ==
+        sharedPdt[pdeIndex].Fields.PageFrameNumber)
+    {
+        viewPt = CopyTableForView(View,
+                                  static_cast<PPT_ENTRY_4KB>(GetVaFromPfn(
+                                        sharedPdt[pdeIndex].Fields.PageFrameNumber)),
+                                  TRUE);
+        if (viewPt == nullptr)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        viewPdt[pdeIndex].Fields.PageFrameNumber = GetPfnFromVa(viewPt);
+    }
+    viewPdt[pdeIndex].Fields.NoExecute = FALSE;
+    viewPt = static_cast<PPT_ENTRY_4KB>(GetVaFromPfn(
+                            viewPdt[pdeIndex].Fields.PageFrameNumber));
+    sharedPt = static_cast<PPT_ENTRY_4KB>(GetVaFromPfn(
+                            sharedPdt[pdeIndex].Fields.PageFrameNumber));
+
+    //
+    // PT (4 KB)
+    //
+    pteIndex = GetPteIndex(PhysicalAddress);
+    if (sharedPt[pteIndex].Fields.Valid == FALSE)
+    {
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+    viewPt[pteIndex].Fields.NoExecute = FALSE;
+    viewPt[pteIndex].Fields.PageFrameNumber = GetPfnFromPa(BackingPhysicalAddress);
+
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Frees all tables owned by the view.
+
+    @param[in,out] View - The view to free.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+CleanupHookView (
+    _Inout_ PHOOK_VIEW View
+    )
+{
+    for (ULONG i = 0; i < View->TableCount; ++i)
+    {
+        FreeContiguousMemory(View->Tables[i]);
+    }
+    View->TableCount = 0;
+}
+
+/*!
+    @brief Builds the view for the hooked page.
+
+    @param[in,out] HookData - The processor associated hook data. The NPT must
+        be in the state 0.
+
+    @param[out] View - The view to build.
+
+    @param[in] HookEntry - The hook on the page to build the view for.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+NTSTATUS
+BuildHookView (
+    _In_ const HOOK_DATA* HookData,
+    _Out_ PHOOK_VIEW View,
+    _In_ const HOOK_ENTRY* HookEntry
+    )
+{
+    NTSTATUS status;
+    PPDP_ENTRY_4KB pdpt;
+    ULONG64 linkedBackingPa;
+
+    RtlZeroMemory(View, sizeof(*View));
+    View->PhyPageBase = HookEntry->PhyPageBase;
+
+    //
+    // Copy the PML4 and the PDPT, and make everything non-executable.
+    //
+    View->Pml4Table = CopyTableForView(View, HookData->Pml4Table, FALSE);
+    if (View->Pml4Table == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    View->Pml4TablePa = GetPaFromVa(View->Pml4Table);
+
+    pdpt = CopyTableForView(View,
+                            static_cast<PPDP_ENTRY_4KB>(GetVaFromPfn(
+                                HookData->Pml4Table[0].Fields.PageFrameNumber)),
+                            TRUE);
+    if (pdpt == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    View->Pml4Table[0].Fields.PageFrameNumber = GetPfnFromVa(pdpt);
+
+    //
+    // Make the hooked page executable and backed by the exec page.
+    //
+    status = MakePageExecutableInView(HookData,
+                                      View,
+                                      HookEntry->PhyPageBase,
+                                      GetPhyPageBaseForExecution(HookEntry,
+                                                                 HookData));
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Do the same for the linked page. It is backed by the exec page only when
+    // it has hooks too.
+    //
+    if (HookEntry->PhyLinkedPageBase != 0)
+    {
+        linkedBackingPa = HookEntry->PhyLinkedPageBase;
+        for (const auto& registration : GetHookRegistrationEntries())
+        {
+            if (registration.HookEntry.PhyPageBase == HookEntry->PhyLinkedPageBase)
+            {
+                linkedBackingPa = GetPhyPageBaseForExecution(
+                                                &registration.HookEntry,
+                                                HookData);
+                break;
+            }
+        }
+
+        status = MakePageExecutableInView(HookData,
+                                          View,
+                                          HookEntry->PhyLinkedPageBase,
+                                          linkedBackingPa);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+    }
+
+    //
+    // Keep the trusted pages executable.
+    //
+    for (ULONG i = 0; i < g_TrustedPages.Count; ++i)
+    {
+        status = MakePageExecutableInView(HookData,
+                                          View,
+                                          g_TrustedPages.PhyPageBases[i],
+                                          g_TrustedPages.PhyPageBases[i]);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+    }
+
+Exit:
+    if (!NT_SUCCESS(status))
+    {
+        CleanupHookView(View);
+    }
+    return status;
+}
+
+/*!
+    @brief Builds the views for all hooked pages.
+
+    @param[in,out] HookData - The processor associated hook data to build the
+        views for. The NPT must be in the state 0.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_Use_decl_annotations_
+NTSTATUS
+BuildHookViews (
+    PHOOK_DATA HookData
+    )
+{
+    NTSTATUS status;
+    PHOOK_VIEWS views;
+    SIZE_T viewsSize;
+    BOOLEAN built;
+
+    NT_ASSERT(HookData->NptState == NptDefault);
+    NT_ASSERT(HookData->Views == nullptr);
+
+    //
+    // Allocate the views for up to as many hooked pages as hooks.
+    //
+    viewsSize = FIELD_OFFSET(HOOK_VIEWS, Views) +
+                sizeof(HOOK_VIEW) * g_HookRegistrationEntryCount;
+#pragma prefast(suppress : 28118, "DISPATCH_LEVEL is ok as this always allocates NonPagedPool")
+    views = static_cast<PHOOK_VIEWS>(ExAllocatePoolWithTag(NonPagedPool,
+                                                           viewsSize,
+                                                           k_PoolTag));
+    if (views == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(views, viewsSize);
+    views->DefaultPml4TablePa = GetPaFromVa(HookData->Pml4Table);
+
+    //
+    // Build a view for each hooked page.
+    //
+    status = STATUS_SUCCESS;
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        built = FALSE;
+        for (ULONG i = 0; i < views->Count; ++i)
+        {
+            if (views->Views[i].PhyPageBase == registration.HookEntry.PhyPageBase)
+            {
+                built = TRUE;
+                break;
+            }
+        }
+        if (built != FALSE)
+        {
+            continue;
+        }
+
+        status = BuildHookView(HookData,
+                               &views->Views[views->Count],
+                               &registration.HookEntry);
+        if (!NT_SUCCESS(status))
+        {
+            LOGGING_LOG_ERROR("BuildHookView failed : %08x", status);
+            goto Exit;
+        }
+        views->Count++;
+    }
+
+    HookData->Views = views;
+
+Exit:
+    if (!NT_SUCCESS(status))
+    {
+        if (views != nullptr)
+        {
+            for (ULONG i = 0; i < views->Count; ++i)
+            {
+                CleanupHookView(&views->Views[i]);
+            }
+            ExFreePoolWithTag(views, k_PoolTag);
+        }
+    }
+    return status;
+}
+
+/*!
+    @brief Frees the views built by the BuildHookViews function, if any.
+
+    @param[in,out] HookData - The processor associated hook data.
+ */
+_Use_decl_annotations_
+VOID
+DestroyHookViews (
+    PHOOK_DATA HookData
+    )
+{
+    NT_ASSERT(HookData->ActiveView == nullptr);
+
+    if (HookData->Views == nullptr)
+    {
+        goto Exit;
+    }
+
+    for (ULONG i = 0; i < HookData->Views->Count; ++i)
+    {
+        CleanupHookView(&HookData->Views->Views[i]);
+    }
+    ExFreePoolWithTag(HookData->Views, k_PoolTag);
+    HookData->Views = nullptr;
+
+Exit:
+    return;
+}
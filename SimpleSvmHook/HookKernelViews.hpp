@@ -0,0 +1,26 @@
+/*!
+    @file HookKernelViews.hpp
+
+    @brief Kernel mode code to precompute NPTs of the state 2 for each hooked
+        page.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "HookCommon.hpp"
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+NTSTATUS
+BuildHookViews (
+    _Inout_ PHOOK_DATA HookData
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+DestroyHookViews (
+    _Inout_ PHOOK_DATA HookData
+    );
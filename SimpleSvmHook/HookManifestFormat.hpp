@@ -0,0 +1,173 @@
+/*!
+    @file HookManifestFormat.hpp
+
+    @brief The binary format of the hook manifest.
+
+    @details The hook manifest is a REG_BINARY value named HookManifest under
+        the service key of the driver, and describes hooks to install instead
+        of the ones compiled in. It is generated by HookManifestCompiler from
+        a text file. This file is shared with HookManifestCompiler, and must
+        be buildable without the WDK.
+
+        The manifest consists of HOOK_MANIFEST_HEADER followed by EntryCount
+        of variable length HOOK_MANIFEST_ENTRY. Each entry is immediately
+        followed by the UTF-16LE name of the function without a terminating
+        null, and padding up to EntrySize. All integers are little-endian.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#if defined(_KERNEL_MODE)
+#include <fltKernel.h>
+#else
+#include <cstdint>
+typedef std::uint8_t UINT8;
+typedef std::uint16_t UINT16;
+typedef std::uint32_t UINT32;
+#endif
+
+//
+// "SSHM" in little-endian.
+//
+static constexpr UINT32 k_HookManifestSignature = 0x4d485353;
+static constexpr UINT16 k_HookManifestVersion = 1;
+
+//
+// The limits of the manifest. The maximum number of entries matches with
+// k_MaxHookRegistrationEntries.
+//
+static constexpr UINT32 k_HookManifestMaxSize = 64 * 1024;
+static constexpr UINT16 k_HookManifestMaxEntryCount = 32;
+static constexpr UINT16 k_HookManifestMaxNameLength = 128 * sizeof(UINT16);
+static constexpr UINT8 k_HookManifestMaxArgumentCount = 8;
+static constexpr UINT32 k_HookManifestEntryAlignment = 4;
+
+//
+// The handlers a hook can be bound to. Except for HookManifestHandlerProbe,
+// each handler is for a specific function and can be used only once.
+//
+typedef enum _HOOK_MANIFEST_HANDLER_ID
+{
+    HookManifestHandlerZwQuerySystemInformation,
+    HookManifestHandlerExAllocatePoolWithTag,
+    HookManifestHandlerExFreePoolWithTag,
+    HookManifestHandlerExFreePool,
+
+    //
+    // The generic hook point handler reporting the argument registers to
+    // subscribers. Can be used for any function and any number of times.
+    //
+    HookManifestHandlerProbe,
+    HookManifestHandlerMax,
+} HOOK_MANIFEST_HANDLER_ID, *PHOOK_MANIFEST_HANDLER_ID;
+
+//
+// How a hook is installed. HookManifestModeFunction hooks the entry of the
+// function with a function handler, and HookManifestModeHookPoint hooks the
+// instruction at Offset with HookManifestHandlerProbe.
+//
+typedef enum _HOOK_MANIFEST_MODE
+{
+    HookManifestModeFunction,
+    HookManifestModeHookPoint,
+    HookManifestModeMax,
+} HOOK_MANIFEST_MODE, *PHOOK_MANIFEST_MODE;
+
+//
+// The filters applied before subscribers are executed. The call is observed
+// only when all specified conditions are met.
+//
+static constexpr UINT32 k_HookManifestFilterCallerOutsideImage = 0x1;
+static constexpr UINT32 k_HookManifestFilterPassiveLevel = 0x2;
+static constexpr UINT32 k_HookManifestFilterAll = 0x3;
+
+typedef struct _HOOK_MANIFEST_HEADER
+{
+    UINT32 Signature;
+    UINT16 Version;
+    UINT16 EntryCount;
+
+    //
+    // The size of the manifest in bytes including this header.
+    //
+    UINT32 TotalSize;
+
+    //
+    // The FNV-1a hash of the bytes following this header.
+    //
+    UINT32 Checksum;
+} HOOK_MANIFEST_HEADER, *PHOOK_MANIFEST_HEADER;
+static_assert(sizeof(HOOK_MANIFEST_HEADER) == 16, "Size check");
+
+typedef struct _HOOK_MANIFEST_ENTRY
+{
+    //
+    // The size of this entry in bytes including the name and padding. A
+    // multiple of k_HookManifestEntryAlignment.
+    //
+    UINT16 EntrySize;
+
+    //
+    // The size of the name in bytes.
+    //
+    UINT16 NameLength;
+
+    //
+    // HOOK_MANIFEST_HANDLER_ID and HOOK_MANIFEST_MODE.
+    //
+    UINT16 Handler;
+    UINT8 Mode;
+
+    //
+    // The number of arguments the function takes. Must match with the handler
+    // for HookManifestModeFunction.
+    //
+    UINT8 ArgumentCount;
+
+    //
+    // The offset of the hook point from the start of the function. Zero for
+    // HookManifestModeFunction.
+    //
+    UINT32 Offset;
+
+    //
+    // k_HookManifestFilter* flags.
+    //
+    UINT32 Filters;
+
+    //
+    // Subscribers are executed for one of every SamplingInterval calls that
+    // passed the filters. Zero and one mean every call.
+    //
+    UINT32 SamplingInterval;
+} HOOK_MANIFEST_ENTRY, *PHOOK_MANIFEST_ENTRY;
+static_assert(sizeof(HOOK_MANIFEST_ENTRY) == 20, "Size check");
+
+/*!
+    @brief Computes the checksum of the manifest.
+
+    @param[in] Data - The address of the bytes following the header.
+
+    @param[in] Size - The size of Data in bytes.
+
+    @return The FNV-1a hash of Data.
+ */
+inline
+UINT32
+ComputeHookManifestChecksum (
+    const UINT8* Data,
+    UINT32 Size
+    )
+{
+    UINT32 hash;
+
+    hash = 0x811c9dc5;
+    for (UINT32 i = 0; i < Size; ++i)
+    {
+        hash ^= Data[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
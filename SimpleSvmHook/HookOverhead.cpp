@@ -0,0 +1,382 @@
+/*!
+    @file HookOverhead.cpp
+
+    @brief Kernel mode and VMM code to attribute overhead to hooks and guest
+        processes.
+
+    @details The cycles spent for NPT state transitions and #BP redirection by
+        the VMM, and for hook handlers in the guest, are charged to a pair of
+        the hook responsible for them and the guest CR3 at that time. Each
+        processor has its own open addressing table keyed by the pair, so that
+        charging never takes a lock and rarely contends. When a table is full,
+        cycles are counted as dropped instead of evicting existing entries.
+
+        The tables are aggregated and the top consumers are reported when hooks
+        are cleaned up. CR3 is reported as-is as the identifier of a process,
+        as resolving it into a process name is not safe from the VMM.
+
+        The cycles charged for the VMM are counted from the start of
+        HandleVmExit, and include the cost of the #VMEXIT and VMRUN round trip
+        outside it, which cannot be measured from the VMM. The round trip is
+        measured once per processor from the guest right after the processor
+        is virtualized (see HOOK_DATA::VmExitRoundTripCycles).
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "HookOverhead.hpp"
+#include "Common.hpp"
+#include "HookCommon.hpp"
+
+//
+// The maximum number of entries probed before giving up charging.
+//
+static constexpr ULONG k_HookOverheadMaxProbes = 16;
+
+//
+// The number of top consumers reported.
+//
+static constexpr ULONG k_HookOverheadReportCount = 10;
+
+//
+// The tables of all processors, indexed by the processor index.
+//
+static PHOOK_OVERHEAD_TABLE g_HookOverheadTables;
+static ULONG g_HookOverheadTableCount;
+
+/*!
+    @brief Allocates the tables of overhead for all processors.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+InitializeHookOverhead (
+    VOID
+    )
+{
+    NTSTATUS status;
+    ULONG numOfProcessors;
+    PHOOK_OVERHEAD_TABLE tables;
+
+    PAGED_CODE();
+
+    numOfProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    tables = static_cast<PHOOK_OVERHEAD_TABLE>(ExAllocatePoolWithTag(
+                                        NonPagedPool,
+                                        sizeof(*tables) * numOfProcessors,
+                                        k_PoolTag));
+    if (tables == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu",
+                          sizeof(*tables) * numOfProcessors);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(tables, sizeof(*tables) * numOfProcessors);
+
+    g_HookOverheadTableCount = numOfProcessors;
+    g_HookOverheadTables = tables;
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Compares two overhead entries by Key for qsort.
+ */
+static
+int
+__cdecl
+CompareHookOverheadEntriesByKey (
+    _In_ const void* Entry1,
+    _In_ const void* Entry2
+    )
+{
+    LONG64 key1, key2;
+
+    key1 = static_cast<const HOOK_OVERHEAD_ENTRY*>(Entry1)->Key;
+    key2 = static_cast<const HOOK_OVERHEAD_ENTRY*>(Entry2)->Key;
+    return (key1 < key2) ? -1 : (key1 > key2) ? 1 : 0;
+}
+
+/*!
+    @brief Returns the total cycles charged to the entry.
+ */
+static
+_Check_return_
+ULONG64
+GetTotalCycles (
+    _In_ const HOOK_OVERHEAD_ENTRY* Entry
+    )
+{
+    ULONG64 total;
+
+    total = 0;
+    for (ULONG type = 0; type < HookOverheadTypeMax; ++type)
+    {
+        total += static_cast<ULONG64>(Entry->Cycles[type]);
+    }
+    return total;
+}
+
+/*!
+    @brief Compares two overhead entries by the total cycles in the descending
+        order for qsort.
+ */
+static
+int
+__cdecl
+CompareHookOverheadEntriesByCycles (
+    _In_ const void* Entry1,
+    _In_ const void* Entry2
+    )
+{
+    ULONG64 total1, total2;
+
+    total1 = GetTotalCycles(static_cast<const HOOK_OVERHEAD_ENTRY*>(Entry1));
+    total2 = GetTotalCycles(static_cast<const HOOK_OVERHEAD_ENTRY*>(Entry2));
+    return (total1 > total2) ? -1 : (total1 < total2) ? 1 : 0;
+}
+
+/*!
+    @brief Aggregates the tables of all processors and reports the top
+        consumers.
+
+    @details This function must be called after hooks are disabled.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+ReportHookOverhead (
+    VOID
+    )
+{
+    PHOOK_OVERHEAD_ENTRY entries;
+    ULONG entryCount;
+    ULONG mergedCount;
+    ULONG64 droppedCycles;
+
+    PAGED_CODE();
+
+    entries = static_cast<PHOOK_OVERHEAD_ENTRY>(ExAllocatePoolWithTag(
+                    PagedPool,
+                    sizeof(*entries) * k_HookOverheadTableSize * g_HookOverheadTableCount,
+                    k_PoolTag));
+    if (entries == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu",
+                          sizeof(*entries) * k_HookOverheadTableSize *
+                                                    g_HookOverheadTableCount);
+        goto Exit;
+    }
+
+    //
+    // Collect used entries of all processors, and merge ones with the same
+    // key.
+    //
+    entryCount = 0;
+    droppedCycles = 0;
+    for (ULONG i = 0; i < g_HookOverheadTableCount; ++i)
+    {
+        const HOOK_OVERHEAD_TABLE* table;
+
+        table = &g_HookOverheadTables[i];
+        droppedCycles += static_cast<ULONG64>(table->DroppedCycles);
+        for (ULONG j = 0; j < k_HookOverheadTableSize; ++j)
+        {
+            if (table->Entries[j].Key != 0)
+            {
+                entries[entryCount++] = table->Entries[j];
+            }
+        }
+    }
+    qsort(entries, entryCount, sizeof(*entries), CompareHookOverheadEntriesByKey);
+
+    mergedCount = 0;
+    for (ULONG i = 0; i < entryCount; ++i)
+    {
+        if ((mergedCount != 0) &&
+            (entries[mergedCount - 1].Key == entries[i].Key))
+        {
+            for (ULONG type = 0; type < HookOverheadTypeMax; ++type)
+            {
+                entries[mergedCount - 1].Cycles[type] += entries[i].Cycles[type];
+                entries[mergedCount - 1].Counts[type] += entries[i].Counts[type];
+            }
+            continue;
+        }
+        entries[mergedCount++] = entries[i];
+    }
+    qsort(entries, mergedCount, sizeof(*entries), CompareHookOverheadEntriesByCycles);
+
+    LOGGING_LOG_INFO("Top overhead by hook and CR3 (%lu pairs, %llu cycles dropped)",
+                     mergedCount,
+                     droppedCycles);
+    for (ULONG i = 0; i < min(mergedCount, k_HookOverheadReportCount); ++i)
+    {
+        const HOOK_OVERHEAD_ENTRY* entry;
+        const HOOK_REGISTRATION_ENTRY* registration;
+
+        entry = &entries[i];
+        registration = &g_HookRegistrationEntries[(entry->Key & (PAGE_SIZE - 1)) - 1];
+        LOGGING_LOG_INFO("  %wZ CR3=%016llx: NPT %llu cycles / %llu, "
+                         "#BP %llu cycles / %llu, handler %llu cycles / %llu",
+                         &registration->FunctionName,
+                         static_cast<ULONG64>(entry->Key) & ~static_cast<ULONG64>(PAGE_SIZE - 1),
+                         static_cast<ULONG64>(entry->Cycles[HookOverheadNptTransition]),
+                         static_cast<ULONG64>(entry->Counts[HookOverheadNptTransition]),
+                         static_cast<ULONG64>(entry->Cycles[HookOverheadBreakPoint]),
+                         static_cast<ULONG64>(entry->Counts[HookOverheadBreakPoint]),
+                         static_cast<ULONG64>(entry->Cycles[HookOverheadHandler]),
+                         static_cast<ULONG64>(entry->Counts[HookOverheadHandler]));
+    }
+
+Exit:
+    if (entries != nullptr)
+    {
+        ExFreePoolWithTag(entries, k_PoolTag);
+    }
+}
+
+/*!
+    @brief Reports and frees the tables of overhead.
+
+    @details This function must be called after hooks are disabled.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+CleanupHookOverhead (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    if (g_HookOverheadTables == nullptr)
+    {
+        goto Exit;
+    }
+
+    ReportHookOverhead();
+
+    ExFreePoolWithTag(g_HookOverheadTables, k_PoolTag);
+    g_HookOverheadTables = nullptr;
+    g_HookOverheadTableCount = 0;
+
+Exit:
+    return;
+}
+
+/*!
+    @brief Returns the table of overhead of the current processor.
+
+    @return The table of overhead of the current processor, or NULL if the
+        tables are not initialized.
+ */
+_Use_decl_annotations_
+PHOOK_OVERHEAD_TABLE
+GetCurrentHookOverheadTable (
+    VOID
+    )
+{
+    PHOOK_OVERHEAD_TABLE table;
+
+    table = nullptr;
+    if (g_HookOverheadTables == nullptr)
+    {
+        goto Exit;
+    }
+
+    table = &g_HookOverheadTables[KeGetCurrentProcessorNumberEx(nullptr) %
+                                  g_HookOverheadTableCount];
+
+Exit:
+    return table;
+}
+
+/*!
+    @brief Charges cycles to the pair of the hook and the guest CR3.
+
+    @details The entry is found or claimed with linear probing. The caller may
+        be preempted and migrated to another processor at PASSIVE_LEVEL, hence
+        all updates are interlocked.
+
+    @param[in,out] Table - The table to charge cycles to. Nothing is done if
+        NULL.
+
+    @param[in] Registration - The registration entry of the hook responsible
+        for the cycles.
+
+    @param[in] Cr3 - The guest CR3 when the cycles were spent.
+
+    @param[in] Type - The kind of the overhead.
+
+    @param[in] Cycles - The cycles to charge.
+ */
+_Use_decl_annotations_
+VOID
+ChargeHookOverhead (
+    PHOOK_OVERHEAD_TABLE Table,
+    const HOOK_REGISTRATION_ENTRY* Registration,
+    ULONG64 Cr3,
+    HOOK_OVERHEAD_TYPE Type,
+    ULONG64 Cycles
+    )
+{
+    LONG64 key;
+    ULONG index;
+
+    if (Table == nullptr)
+    {
+        goto Exit;
+    }
+
+    NT_ASSERT(Type < HookOverheadTypeMax);
+
+    //
+    // The index of the registration entry fits in the page offset of CR3
+    // since k_MaxHookRegistrationEntries is less than PAGE_SIZE.
+    //
+    static_assert(k_MaxHookRegistrationEntries < PAGE_SIZE, "Size check");
+    key = static_cast<LONG64>((Cr3 & ~static_cast<ULONG64>(PAGE_SIZE - 1)) |
+                              ((Registration - &g_HookRegistrationEntries[0]) + 1));
+
+    //
+    // Fibonacci hashing of the key to the 8 bit index of the table.
+    //
+    static_assert(k_HookOverheadTableSize == 256, "Size check");
+    index = static_cast<ULONG>((static_cast<ULONG64>(key) * 0x9e3779b97f4a7c15) >> 56);
+
+    for (ULONG probe = 0; probe < k_HookOverheadMaxProbes; ++probe)
+    {
+        PHOOK_OVERHEAD_ENTRY entry;
+        LONG64 currentKey;
+
+        entry = &Table->Entries[(index + probe) & (k_HookOverheadTableSize - 1)];
+        currentKey = entry->Key;
+        if (currentKey == 0)
+        {
+            currentKey = InterlockedCompareExchange64(&entry->Key, key, 0);
+            if (currentKey == 0)
+            {
+                currentKey = key;
+            }
+        }
+        if (currentKey == key)
+        {
+            InterlockedAdd64(&entry->Cycles[Type], static_cast<LONG64>(Cycles));
+            InterlockedIncrement64(&entry->Counts[Type]);
+            goto Exit;
+        }
+    }
+
+    InterlockedAdd64(&Table->DroppedCycles, static_cast<LONG64>(Cycles));
+
+Exit:
+    return;
+}
@@ -0,0 +1,103 @@
+/*!
+    @file HookOverhead.hpp
+
+    @brief Kernel mode and VMM code to attribute overhead to hooks and guest
+        processes.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+
+typedef struct _HOOK_REGISTRATION_ENTRY HOOK_REGISTRATION_ENTRY;
+
+//
+// The kinds of overhead charged.
+//
+typedef enum _HOOK_OVERHEAD_TYPE
+{
+    //
+    // Transitions of the NPT state on NPT faults. Charged to the hook being
+    // entered or left.
+    //
+    HookOverheadNptTransition,
+
+    //
+    // Redirection of #BP to hook handlers.
+    //
+    HookOverheadBreakPoint,
+
+    //
+    // Execution of hook handlers except the original functions.
+    //
+    HookOverheadHandler,
+    HookOverheadTypeMax,
+} HOOK_OVERHEAD_TYPE, *PHOOK_OVERHEAD_TYPE;
+
+//
+// The number of entries in each table. The index is the top 8 bits of the
+// hash of the key.
+//
+static constexpr ULONG k_HookOverheadTableSize = 256;
+
+//
+// The cycles and counts charged to a pair of a hook and a guest CR3.
+//
+typedef struct _HOOK_OVERHEAD_ENTRY
+{
+    //
+    // The page frame of CR3 combined with the index of the registration entry
+    // plus one, or zero when the entry is unused.
+    //
+    volatile LONG64 Key;
+    volatile LONG64 Cycles[HookOverheadTypeMax];
+    volatile LONG64 Counts[HookOverheadTypeMax];
+} HOOK_OVERHEAD_ENTRY, *PHOOK_OVERHEAD_ENTRY;
+
+//
+// The per processor sparse table of overhead. Updated with interlocked
+// operations from both the guest and the VMM on the processor.
+//
+typedef struct _HOOK_OVERHEAD_TABLE
+{
+    HOOK_OVERHEAD_ENTRY Entries[k_HookOverheadTableSize];
+
+    //
+    // The cycles not charged to any entry because the table was full.
+    //
+    volatile LONG64 DroppedCycles;
+} HOOK_OVERHEAD_TABLE, *PHOOK_OVERHEAD_TABLE;
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+InitializeHookOverhead (
+    VOID
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CleanupHookOverhead (
+    VOID
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+PHOOK_OVERHEAD_TABLE
+GetCurrentHookOverheadTable (
+    VOID
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+ChargeHookOverhead (
+    _Inout_opt_ PHOOK_OVERHEAD_TABLE Table,
+    _In_ const HOOK_REGISTRATION_ENTRY* Registration,
+    _In_ ULONG64 Cr3,
+    _In_ HOOK_OVERHEAD_TYPE Type,
+    _In_ ULONG64 Cycles
+    );
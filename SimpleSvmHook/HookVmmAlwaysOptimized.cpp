@@ -20,13 +20,17 @@
         permission.
 
     @param[in] DisallowExecution - TRUE to make the page non-executable.
+
+    @param[in,out] NptHash - The hash of the NPT state checker to update, or
+        NULL.
  */
 _Use_decl_annotations_
 VOID
 ChangePermissionOfPage (
     PPML4_ENTRY_4KB Pml4Table,
     ULONG64 PhysicalAddress,
-    BOOLEAN DisallowExecution
+    BOOLEAN DisallowExecution,
+    PULONG64 NptHash
     )
 {
     PPML4_ENTRY_4KB pml4Entry;
@@ -96,7 +100,7 @@ ChangePermissionOfPage (
     if ((DisallowExecution == FALSE) &&
         (pdptEntry->Fields.NoExecute != FALSE))
     {
-        pdptEntry->Fields.NoExecute = FALSE;
+        SetNoExecute(pdptEntry, FALSE, NptHash);
 
         //
         // Change all entries of permission in the sub-table (PDT) to
@@ -107,7 +111,7 @@ ChangePermissionOfPage (
         for (pdeIndex = 0; pdeIndex < 512; ++pdeIndex)
         {
             pdtEntry = &pageDirectoryTable[pdeIndex];
-            pdtEntry->Fields.NoExecute = TRUE;
+            SetNoExecute(pdtEntry, TRUE, NptHash);
         }
     }
 
@@ -127,13 +131,13 @@ ChangePermissionOfPage (
         //
         // Do the same thing as we did for PDPT.
         //
-        pdtEntry->Fields.NoExecute = FALSE;
+        SetNoExecute(pdtEntry, FALSE, NptHash);
 
         PERFORMANCE_MEASURE_THIS_SCOPE();
         for (pteIndex = 0; pteIndex < 512; ++pteIndex)
         {
             ptEntry = &pageTable[pteIndex];
-            ptEntry->Fields.NoExecute = TRUE;
+            SetNoExecute(ptEntry, TRUE, NptHash);
         }
     }
 
@@ -144,7 +148,7 @@ ChangePermissionOfPage (
     pteIndex = GetPteIndex(PhysicalAddress);
     ptEntry = &pageTable[pteIndex];
     NT_ASSERT(pdtEntry->Fields.Valid != FALSE);
-    ptEntry->Fields.NoExecute = DisallowExecution;
+    SetNoExecute(ptEntry, DisallowExecution, NptHash);
 }
 
 /*!
@@ -157,12 +161,16 @@ ChangePermissionOfPage (
 
     @param[in] ActiveHookPa - The physical memory address of the active hook
         page.
+
+    @param[in,out] NptHash - The hash of the NPT state checker to update, or
+        NULL.
  */
 static
 VOID
 MakeAllSubTablesExecutable (
     _Inout_ PPDP_ENTRY_4KB PageDirectoryPointerTable,
-    _In_ ULONG64 ActiveHookPa
+    _In_ ULONG64 ActiveHookPa,
+    _Inout_opt_ PULONG64 NptHash
     )
 {
     ULONG64 ppeIndex, pdeIndex, pteIndex;
@@ -184,7 +192,7 @@ MakeAllSubTablesExecutable (
     for (pdeIndex = 0; pdeIndex < 512; ++pdeIndex)
     {
         pdtEntry = &pageDirectoryTable[pdeIndex];
-        pdtEntry->Fields.NoExecute = FALSE;
+        SetNoExecute(pdtEntry, FALSE, NptHash);
     }
 
     //
@@ -199,7 +207,7 @@ MakeAllSubTablesExecutable (
     for (pteIndex = 0; pteIndex < 512; ++pteIndex)
     {
         ptEntry = &pageTable[pteIndex];
-        ptEntry->Fields.NoExecute = FALSE;
+        SetNoExecute(ptEntry, FALSE, NptHash);
     }
 }
 
@@ -209,22 +217,30 @@ MakeAllSubTablesExecutable (
 
     @param[in,out] Pml4Table - The address of the NPT PML4 table.
 
-    @param[in] ActiveHookPa - The physical memory address of the active hook
-        page. Used when DisallowExecution is FALSE to make all necessary NTP
-        entries executable, that was changed to non-executable with the
-        ChangePermissionOfPage function.
+    @param[in] ExecutablePas - The physical memory addresses of the pages made
+        executable with the ChangePermissionOfPage function, such as the
+        active hook page. Used when DisallowExecution is FALSE to make all
+        necessary NTP entries executable, that was changed to non-executable
+        with that function. Zero entries are ignored.
+
+    @param[in] ExecutablePaCount - The number of entries in ExecutablePas.
 
     @param[in] DisallowExecution - TRUE to make the page non-executable.
 
     @param[in] MaxPpeIndex - The maximum index of PDPT to change the permission.
+
+    @param[in,out] NptHash - The hash of the NPT state checker to update, or
+        NULL.
  */
 _Use_decl_annotations_
 VOID
 ChangePermissionsOfAllPages (
     PPML4_ENTRY_4KB Pml4Table,
-    ULONG64 ActiveHookPa,
+    const ULONG64* ExecutablePas,
+    ULONG ExecutablePaCount,
     BOOLEAN DisallowExecution,
-    ULONG MaxPpeIndex
+    ULONG MaxPpeIndex,
+    PULONG64 NptHash
     )
 {
     PPML4_ENTRY_4KB pml4Entry;
@@ -261,7 +277,7 @@ ChangePermissionsOfAllPages (
     for (ULONG ppeIndex = 0; ppeIndex < MaxPpeIndex; ++ppeIndex)
     {
         pdptEntry = &pageDirectoryPointerTable[ppeIndex];
-        pdptEntry->Fields.NoExecute = DisallowExecution;
+        SetNoExecute(pdptEntry, DisallowExecution, NptHash);
     }
 
     //
@@ -272,6 +288,24 @@ ChangePermissionsOfAllPages (
     //
     if (DisallowExecution == FALSE)
     {
-        MakeAllSubTablesExecutable(pageDirectoryPointerTable, ActiveHookPa);
+        for (ULONG i = 0; i < ExecutablePaCount; ++i)
+        {
+            //
+            // Skip the page if it is managed by the same PT as the previous
+            // one. Its sub tables have already been made executable. Callers
+            // pass addresses in ascending order where possible to benefit
+            // from this.
+            //
+            if ((ExecutablePas[i] == 0) ||
+                ((i != 0) &&
+                 ((ExecutablePas[i] >> k_PdiShift) ==
+                  (ExecutablePas[i - 1] >> k_PdiShift))))
+            {
+                continue;
+            }
+            MakeAllSubTablesExecutable(pageDirectoryPointerTable,
+                                       ExecutablePas[i],
+                                       NptHash);
+        }
     }
 }
\ No newline at end of file
@@ -11,19 +11,95 @@
 #include <fltKernel.h>
 #include "x86_64.hpp"
 
+//
+// The fields of NPT entries tracked by the NPT state checker. See
+// HookVmmCommon.cpp.
+//
+static constexpr ULONG64 k_NptHashNoExecute = 1;
+static constexpr ULONG64 k_NptHashPageFrameNumber = 2;
+
+/*!
+    @brief Returns the hash of the value of the field of the NPT entry.
+
+    @param[in] Entry - The address of the NPT entry.
+
+    @param[in] Field - One of k_NptHash* values.
+
+    @param[in] Value - The value of the field.
+
+    @return The hash of the value of the field of the NPT entry.
+ */
+inline
+_Check_return_
+ULONG64
+HashNptEntryField (
+    _In_ const VOID* Entry,
+    _In_ ULONG64 Field,
+    _In_ ULONG64 Value
+    )
+{
+    ULONG64 hash;
+
+    //
+    // The finalizer of SplitMix64 over the address, the field and the value.
+    //
+    hash = reinterpret_cast<ULONG64>(Entry) ^
+           (Field << 56) ^
+           (Value * 0x9e3779b97f4a7c15ull);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+    return hash ^ (hash >> 31);
+}
+
+/*!
+    @brief Changes the NX bit of the NPT entry and updates the hash of the NPT
+        state checker.
+
+    @param[in,out] Entry - The NPT entry to change.
+
+    @param[in] DisallowExecution - TRUE to set the NX bit.
+
+    @param[in,out] NptHash - The hash of the NPT state checker to update, or
+        NULL.
+ */
+template<typename EntryType>
+FORCEINLINE
+VOID
+SetNoExecute (
+    _Inout_ EntryType* Entry,
+    _In_ BOOLEAN DisallowExecution,
+    _Inout_opt_ PULONG64 NptHash
+    )
+{
+    if ((NptHash != nullptr) &&
+        (static_cast<BOOLEAN>(Entry->Fields.NoExecute) != DisallowExecution))
+    {
+        *NptHash ^= HashNptEntryField(Entry,
+                                      k_NptHashNoExecute,
+                                      Entry->Fields.NoExecute) ^
+                    HashNptEntryField(Entry,
+                                      k_NptHashNoExecute,
+                                      DisallowExecution);
+    }
+    Entry->Fields.NoExecute = DisallowExecution;
+}
+
 VOID
 ChangePermissionOfPage (
     _Inout_ PPML4_ENTRY_4KB Pml4Table,
     _In_ ULONG64 PhysicalAddress,
-    _In_ BOOLEAN DisallowExecution
+    _In_ BOOLEAN DisallowExecution,
+    _Inout_opt_ PULONG64 NptHash
     );
 
 VOID
 ChangePermissionsOfAllPages (
     _Inout_ PPML4_ENTRY_4KB Pml4Table,
-    _When_(DisallowExecution == FALSE, _In_)
+    _When_(DisallowExecution == FALSE, _In_reads_(ExecutablePaCount))
     _When_(DisallowExecution != FALSE, _Unreferenced_parameter_)
-        ULONG64 ActiveHookPa,
+        const ULONG64* ExecutablePas,
+    _In_ ULONG ExecutablePaCount,
     _In_ BOOLEAN DisallowExecution,
-    _In_ ULONG MaxPpeIndex
+    _In_ ULONG MaxPpeIndex,
+    _Inout_opt_ PULONG64 NptHash
     );
@@ -13,6 +13,7 @@
             0)NptDefault              : RWX(O)  : RWX(O) : RWX(O)
             1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)
             2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
+            3)NptHookEnabledSuspended : RWX(O)  : RW-(O) : RW-(O)
 
                 Current= The page the processor is currently executing on.
                 Hooked = The pages hooks are installed into and not being
@@ -22,7 +23,12 @@
                 (O)= The page is backed by the original physical page where no
                      hook exists.
                 (E)= The page is backed by the exec physical page where hooks
-                     exist.
+                     exist. The copy of the exec page allocated on the NUMA
+                     node of the processor is used.
+
+            In the state 3, the hooked page the processor called out from is
+            backed by the original page again, as in the state 1, so that the
+            called code reading it sees no hooks.
         ----
 
         This also notes when those states change.
@@ -36,10 +42,73 @@
 
             2 -> 2 on any read or write access (no #VMEXIT)
               -> 2 on execution access against another hooked page
+              -> 3 on execution access against any of non hooked pages by
+                   a call from the hooked page
+              -> 1 on execution access against any of non hooked pages
+              -> 0 on disabling hooks (via CPUID)
+
+            3 -> 3 on any read or write access (no #VMEXIT)
+              -> 2 on execution access against the hooked page called out
+                   from (ie, return)
               -> 1 on execution access against any of non hooked pages
+              -> 2 on execution access against another hooked page
               -> 0 on disabling hooks (via CPUID)
         ---
 
+        The state 3 (suspended-visible) suppresses the ping-pong of the
+        transitions when code on the hooked page repeatedly calls a small
+        function outside it. A call is recognized when the return address at
+        the guest RSP points to the hooked page. Instead of the transition to
+        the state 1, only the hooked page is made non-executable and switched
+        to the original page, and only the called page is made executable, so
+        that the return to the hooked page and the next call only change a few
+        leaf NPT entries and flush TLB rather than sweeping all of them.
+        Execution reaching any other page leaves the state 3 as if it left the
+        state 2. This is used only with the sweep and shadows backends
+        described below, as the views backend never sweeps the NPT.
+
+        When a hooked instruction straddles a page boundary, the hooked page
+        and the next page (the linked page) are treated as a group: both are
+        made executable in the state 2, and the linked page is backed by the
+        exec page if it has hooks too. Execution can, therefore, flow from the
+        hooked page into the linked page without another transition.
+
+        The trusted pages (see HookKernelTrustedPages.cpp) are also executable
+        in the state 2, so that interrupts and hook handlers do not cause the
+        transition to the state 1 and back. Their Accessed bits are cleared on
+        the transition to the state 2 and examined on the transition out of it
+        to estimate the avoided transitions. This is an upper bound, as any
+        access to the trusted pages sets the bits, including data reads that
+        would not have caused the NPT faults.
+
+        The transitions between the state 1 and 2 are implemented by one of
+        the three backends selected at the driver load (see
+        HookKernelTransitionBackend.cpp). The sweep backend edits the single
+        NPT in place; it makes all PDPT entries non-executable and then the
+        executable pages executable again. The views backend leaves the NPT
+        of the state 1 untouched, and instead, switches NCr3 to the NPT of
+        the state 2 precomputed for the hooked page (see HookKernelViews.cpp)
+        and flushes TLB. MMIO entries built after the views are precomputed
+        are copied into the active view as non-executable on demand. The
+        shadows backend works as the sweep backend, except that the PDT of
+        the 1GB range of the hooked page is swapped with the one precomputed
+        for the hooked page (see HookKernelShadows.cpp) by changing the PFN of
+        the PDPT entry, instead of being edited. MMIO entries are copied into
+        the active shadow in the same way as views.
+
+        When configured, the NPT state checker validates the NPTs after each
+        transition without walking them. Every change to the NX bit or the PFN
+        of an NPT entry made by the transitions XORs the hashes of the old and
+        new values into the per processor hash, which hence equals to the XOR
+        of the hashes of the original and current values of the changed
+        fields, and is updated in O(changed entries). MMIO entries do not
+        affect it as they are built without changing those fields of existing
+        entries. The hash must be zero in the state 0, and the value computed
+        from the hooked pages in the state 1. In the state 2, it must equal to
+        the value seen on the first transition to the same hook, so that the
+        transitions are checked to be symmetric. The state 3 is checked on the
+        return to the state 2.
+
     @author Satoshi Tanda
 
     @copyright  Copyright (c) 2018, Satoshi Tanda. All rights reserved.
@@ -48,6 +117,7 @@
 #include "Common.hpp"
 #include "HookCommon.hpp"
 #include "HookVmmAlwaysOptimized.hpp"
+#include "HookOverhead.hpp"
 
 /*!
     @brief Finds HOOK_ENTRY associated with the physical memory page.
@@ -63,7 +133,7 @@ FindHookEntryByPhysicalPage (
     _In_ ULONG64 PhysicalAddress
     )
 {
-    for (const auto& registration : g_HookRegistrationEntries)
+    for (const auto& registration : GetHookRegistrationEntries())
     {
         if (PAGE_ALIGN(PhysicalAddress) ==
             PAGE_ALIGN(registration.HookEntry.PhyPageBase))
@@ -88,7 +158,7 @@ FindHookEntryByAddress (
     _In_ PVOID VirtualAddress
     )
 {
-    for (const auto& registration : g_HookRegistrationEntries)
+    for (const auto& registration : GetHookRegistrationEntries())
     {
         if (VirtualAddress == registration.HookEntry.HookAddress)
         {
@@ -99,10 +169,362 @@ FindHookEntryByAddress (
 }
 
 /*!
-    @brief Transition the NPT state 1 to 2.
+    @brief Returns the hash of the NPT state checker to update.
 
-    @details Hooks found on this page, which means the processor is attempt to
-        execute a page where hooks are installed. Move to the state 3.
+    @param[in] HookData - The processor associated hook data.
+
+    @return The address of the hash, or NULL if the checker is disabled.
+ */
+static
+_Check_return_
+PULONG64
+GetNptHash (
+    _In_ const HOOK_DATA* HookData
+    )
+{
+    return (HookData->StateChecker != nullptr) ?
+                &HookData->StateChecker->Hash : nullptr;
+}
+
+/*!
+    @brief Changes the PFN of the NPT entry and updates the hash of the NPT
+        state checker.
+
+    @param[in,out] Entry - The NPT entry to change.
+
+    @param[in] PageFrameNumber - The PFN to set.
+
+    @param[in,out] NptHash - The hash of the NPT state checker to update, or
+        NULL.
+ */
+template<typename EntryType>
+static
+VOID
+SetPageFrameNumber (
+    _Inout_ EntryType* Entry,
+    _In_ ULONG64 PageFrameNumber,
+    _Inout_opt_ PULONG64 NptHash
+    )
+{
+    if (NptHash != nullptr)
+    {
+        *NptHash ^= HashNptEntryField(Entry,
+                                      k_NptHashPageFrameNumber,
+                                      Entry->Fields.PageFrameNumber) ^
+                    HashNptEntryField(Entry,
+                                      k_NptHashPageFrameNumber,
+                                      PageFrameNumber);
+    }
+    Entry->Fields.PageFrameNumber = PageFrameNumber;
+}
+
+/*!
+    @brief Computes the hash of the NPT state checker expected in the state 1.
+
+    @details In the state 1, NPT entries differ from the ones in the state 0
+        only in the NX bits of the hooked pages.
+
+    @param[in] HookData - The processor associated hook data.
+
+    @return The hash expected in the state 1.
+ */
+static
+_Check_return_
+ULONG64
+ComputeInvisibleNptHash (
+    _In_ const HOOK_DATA* HookData
+    )
+{
+    ULONG64 hash;
+    PPT_ENTRY_4KB nptEntry;
+    BOOLEAN duplicated;
+
+    hash = 0;
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        //
+        // Count each hooked page only once.
+        //
+        duplicated = FALSE;
+        for (const auto& previous : GetHookRegistrationEntries())
+        {
+            if (&previous == &registration)
+            {
+                break;
+            }
+            if (previous.HookEntry.PhyPageBase ==
+                registration.HookEntry.PhyPageBase)
+            {
+                duplicated = TRUE;
+                break;
+            }
+        }
+        if (duplicated != FALSE)
+        {
+            continue;
+        }
+
+        nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
+                                           registration.HookEntry.PhyPageBase);
+        NT_ASSERT(nptEntry != nullptr);
+        hash ^= HashNptEntryField(nptEntry, k_NptHashNoExecute, FALSE) ^
+                HashNptEntryField(nptEntry, k_NptHashNoExecute, TRUE);
+    }
+    return hash;
+}
+
+/*!
+    @brief Validates the hash of the NPT state checker against the one
+        expected in the current state.
+
+    @details The hash of the state 2 is learned on the first transition for
+        each active hook on the processor. The state 3 is validated on the
+        return to the state 2. For the views backend, NCr3 is also validated.
+
+    @param[in] GuestVmcb - The processor associated VMCB, or NULL if NCr3 is
+        not to be validated.
+
+    @param[in,out] HookData - The processor associated hook data.
+ */
+static
+VOID
+CheckNptState (
+    _In_opt_ const VMCB* GuestVmcb,
+    _Inout_ PHOOK_DATA HookData
+    )
+{
+    PNPT_STATE_CHECKER checker;
+    ULONG index;
+    ULONG64 expectedHash;
+    BOOLEAN matched;
+
+    checker = HookData->StateChecker;
+    if (checker == nullptr)
+    {
+        goto Exit;
+    }
+
+    switch (HookData->NptState)
+    {
+    case NptDefault:
+        expectedHash = 0;
+        break;
+
+    case NptHookEnabledInvisible:
+        expectedHash = checker->InvisibleHash;
+        break;
+
+    case NptHookEnabledVisible:
+        index = static_cast<ULONG>(CONTAINING_RECORD(HookData->ActiveHookEntry,
+                                                     HOOK_REGISTRATION_ENTRY,
+                                                     HookEntry) -
+                                   g_HookRegistrationEntries);
+        if (!BooleanFlagOn(checker->VisibleHashValidMask, 1ul << index))
+        {
+            checker->VisibleHashes[index] = checker->Hash;
+            SetFlag(checker->VisibleHashValidMask, 1ul << index);
+        }
+        expectedHash = checker->VisibleHashes[index];
+        break;
+
+    default:
+        goto Exit;
+    }
+
+    matched = (checker->Hash == expectedHash);
+    if ((GuestVmcb != nullptr) && (HookData->Views != nullptr))
+    {
+        if (HookData->NptState == NptHookEnabledVisible)
+        {
+            matched &= ((HookData->ActiveView != nullptr) &&
+                        (GuestVmcb->ControlArea.NCr3 ==
+                            HookData->ActiveView->Pml4TablePa));
+        }
+        else
+        {
+            matched &= ((HookData->ActiveView == nullptr) &&
+                        (GuestVmcb->ControlArea.NCr3 ==
+                            HookData->Views->DefaultPml4TablePa));
+        }
+    }
+
+    checker->CheckCount++;
+    if (matched == FALSE)
+    {
+        checker->MismatchCount++;
+        checker->UnreportedMismatchCount++;
+    }
+    NT_ASSERT(matched != FALSE);
+
+Exit:
+    return;
+}
+
+/*!
+    @brief Returns the number of mismatches the NPT state checker found since
+        the last call.
+
+    @param[in,out] HookData - The processor associated hook data.
+
+    @return The number of mismatches since the last call.
+ */
+_Use_decl_annotations_
+ULONG
+TakeNptStateMismatches (
+    PHOOK_DATA HookData
+    )
+{
+    ULONG mismatchCount;
+
+    mismatchCount = 0;
+    if (HookData->StateChecker != nullptr)
+    {
+        mismatchCount = HookData->StateChecker->UnreportedMismatchCount;
+        HookData->StateChecker->UnreportedMismatchCount = 0;
+    }
+    return mismatchCount;
+}
+
+/*!
+    @brief Switches the active hooked page, and the linked page if it has
+        hooks too, to be backed by the exec page or the original page.
+
+    @details TLB must be flushed after this, as translations of the pages may
+        be cached for read and write accesses.
+
+    @param[in,out] HookData - The processor associated hook data.
+
+    @param[in] ForExecution - TRUE to back the pages by the exec page, or FALSE
+        to back them by the original page.
+ */
+static
+VOID
+SwitchActiveHookPages (
+    _Inout_ PHOOK_DATA HookData,
+    _In_ BOOLEAN ForExecution
+    )
+{
+    const HOOK_ENTRY* hookEntries[2];
+    PPT_ENTRY_4KB nptEntry;
+
+    hookEntries[0] = HookData->ActiveHookEntry;
+    hookEntries[1] = (HookData->ActiveHookEntry->PhyLinkedPageBase != 0) ?
+        FindHookEntryByPhysicalPage(HookData->ActiveHookEntry->PhyLinkedPageBase) :
+        nullptr;
+
+    for (const auto hookEntry : hookEntries)
+    {
+        if (hookEntry == nullptr)
+        {
+            continue;
+        }
+
+        nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
+                                           hookEntry->PhyPageBase);
+        NT_ASSERT(nptEntry != nullptr);
+        SetPageFrameNumber(nptEntry,
+                           GetPfnFromPa((ForExecution != FALSE) ?
+                                GetPhyPageBaseForExecution(hookEntry, HookData) :
+                                hookEntry->PhyPageBase),
+                           GetNptHash(HookData));
+    }
+}
+
+/*!
+    @brief Makes the trusted pages executable and clears their Accessed bits.
+
+    @param[in,out] HookData - The processor associated hook data.
+ */
+static
+VOID
+MakeTrustedPagesExecutable (
+    _Inout_ PHOOK_DATA HookData
+    )
+{
+    PPT_ENTRY_4KB nptEntry;
+
+    for (ULONG i = 0; i < g_TrustedPages.Count; ++i)
+    {
+        ChangePermissionOfPage(HookData->Pml4Table,
+                               g_TrustedPages.PhyPageBases[i],
+                               FALSE,
+                               GetNptHash(HookData));
+
+        nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
+                                           g_TrustedPages.PhyPageBases[i]);
+        NT_ASSERT(nptEntry != nullptr);
+        nptEntry->Fields.Accessed = FALSE;
+    }
+}
+
+/*!
+    @brief Counts #VMEXITs avoided by the trusted pages during the state 2.
+
+    @details If any of the trusted pages was accessed since the transition to
+        the state 2, execution may have left the hooked page and come back to
+        it without the NPT faults, avoiding two #VMEXITs. The Accessed bits do
+        not tell execution from data access, and the access may have been a
+        read of data on the page, so the count is an upper-bound estimate.
+
+    @param[in] Pml4Table - The NPT PML4 used in the state 2.
+ */
+static
+VOID
+CountAvoidedExits (
+    _In_ PPML4_ENTRY_4KB Pml4Table
+    )
+{
+    PPT_ENTRY_4KB nptEntry;
+
+    for (ULONG i = 0; i < g_TrustedPages.Count; ++i)
+    {
+        nptEntry = GetNestedPageTableEntry(Pml4Table,
+                                           g_TrustedPages.PhyPageBases[i]);
+        NT_ASSERT(nptEntry != nullptr);
+        if (nptEntry->Fields.Accessed != FALSE)
+        {
+            InterlockedAdd64(&g_TrustedPages.AvoidedExitCount, 2);
+            break;
+        }
+    }
+}
+
+/*!
+    @brief Makes all pages executable on the transition from the state 2.
+
+    @param[in,out] HookData - The processor associated hook data.
+ */
+static
+VOID
+MakeAllPagesExecutable (
+    _Inout_ PHOOK_DATA HookData
+    )
+{
+    ULONG64 executablePas[3 + k_MaxTrustedPages];
+
+    //
+    // All pages made executable with the ChangePermissionOfPage function in the
+    // state 2 and 3; the active hook page, the linked page, the called page and
+    // the trusted pages.
+    //
+    executablePas[0] = HookData->ActiveHookEntry->PhyPageBase;
+    executablePas[1] = HookData->ActiveHookEntry->PhyLinkedPageBase;
+    executablePas[2] = HookData->SuspendedCalleePhyPageBase;
+    RtlCopyMemory(&executablePas[3],
+                  g_TrustedPages.PhyPageBases,
+                  g_TrustedPages.Count * sizeof(ULONG64));
+    ChangePermissionsOfAllPages(HookData->Pml4Table,
+                                executablePas,
+                                3 + g_TrustedPages.Count,
+                                FALSE,
+                                HookData->MaxNptPdpEntriesUsed,
+                                GetNptHash(HookData));
+}
+
+/*!
+    @brief Makes the hooked page visible by changing permissions of all pages.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
 
     @param[in,out] HookData - The processor associated hook data.
 
@@ -111,17 +533,15 @@ FindHookEntryByAddress (
  */
 static
 VOID
-TransitionNptState1To2 (
+EnterVisibleStateBySweep (
+    _Inout_ PVMCB GuestVmcb,
     _Inout_ PHOOK_DATA HookData,
     _In_ const HOOK_ENTRY* CurrentHookEntry
     )
 {
     PPT_ENTRY_4KB nptEntry;
 
-    NT_ASSERT(HookData->NptState == NptHookEnabledInvisible);
-    NT_ASSERT(HookData->ActiveHookEntry == nullptr);
-
-    PERFORMANCE_MEASURE_THIS_SCOPE();
+    UNREFERENCED_PARAMETER(GuestVmcb);
 
     //
     // Make all pages non-executable.
@@ -135,153 +555,1046 @@ TransitionNptState1To2 (
     //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
     //
     ChangePermissionsOfAllPages(HookData->Pml4Table,
+                                nullptr,
                                 0,
                                 TRUE,
-                                HookData->MaxNptPdpEntriesUsed);
+                                HookData->MaxNptPdpEntriesUsed,
+                                GetNptHash(HookData));
+
+    //
+    // Switch the current page to the executable, exec page backed page.
+    //
+    //  State                     : Page Type
+    //                            : Current : Hooked : Other
+    //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)
+    //  v
+    //  *)Transitioning           : RW-(O)  : RW-(O) : RW-(O)
+    //  v
+    //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)    << transitioning to here
+
+    //
+    // Get a NPT entry associated with the page the processor has been
+    // executing on. The page should be backed by the original at this point.
+    //
+    nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
+                                       CurrentHookEntry->PhyPageBase);
+    NT_ASSERT(nptEntry != nullptr);
+    NT_ASSERT(nptEntry->Fields.NoExecute != FALSE);
+    NT_ASSERT(nptEntry->Fields.PageFrameNumber == GetPfnFromPa(
+                                                CurrentHookEntry->PhyPageBase));
+
+    //
+    // Switch to the exec physical page so hooks can be executed, and make the
+    // page executable.
+    //
+    SetPageFrameNumber(nptEntry,
+                       GetPfnFromPa(GetPhyPageBaseForExecution(CurrentHookEntry,
+                                                               HookData)),
+                       GetNptHash(HookData));
+    ChangePermissionOfPage(HookData->Pml4Table,
+                           CurrentHookEntry->PhyPageBase,
+                           FALSE,
+                           GetNptHash(HookData));
+
+    //
+    // Do the same for the linked page if exists. It is backed by the exec page
+    // only when it has hooks too.
+    //
+    if (CurrentHookEntry->PhyLinkedPageBase != 0)
+    {
+        const HOOK_ENTRY* linkedHookEntry;
+
+        linkedHookEntry = FindHookEntryByPhysicalPage(
+                                        CurrentHookEntry->PhyLinkedPageBase);
+        if (linkedHookEntry != nullptr)
+        {
+            nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
+                                               linkedHookEntry->PhyPageBase);
+            NT_ASSERT(nptEntry != nullptr);
+            SetPageFrameNumber(nptEntry,
+                               GetPfnFromPa(GetPhyPageBaseForExecution(
+                                                linkedHookEntry, HookData)),
+                               GetNptHash(HookData));
+        }
+        ChangePermissionOfPage(HookData->Pml4Table,
+                               CurrentHookEntry->PhyLinkedPageBase,
+                               FALSE,
+                               GetNptHash(HookData));
+    }
+
+    //
+    // Keep the trusted pages executable.
+    //
+    MakeTrustedPagesExecutable(HookData);
+}
+
+/*!
+    @brief Makes the hooked page invisible by changing permissions of all
+        pages.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] HookData - The processor associated hook data.
+ */
+static
+VOID
+LeaveVisibleStateBySweep (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData
+    )
+{
+    PPT_ENTRY_4KB nptEntry;
+
+    UNREFERENCED_PARAMETER(GuestVmcb);
+
+    //
+    // Make all pages executable.
+    //
+    //  State                     : Page Type
+    //                            : Current : Hooked : Other
+    //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
+    //  v
+    //  *)Transitioning           : RWX(E)  : RWX(O) : RWX(O)    << transitioning to here
+    //  v
+    //  *)Transitioning           : RWX(E)  : RW-(O) : RWX(O)
+    //  v
+    //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)
+    //
+    CountAvoidedExits(HookData->Pml4Table);
+    MakeAllPagesExecutable(HookData);
+
+    //
+    // Make all hooked pages non-executable.
+    //
+    //  State                     : Page Type
+    //                            : Current : Hooked : Other
+    //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
+    //  v
+    //  *)Transitioning           : RWX(E)  : RWX(O) : RWX(O)
+    //  v
+    //  *)Transitioning           : RWX(E)  : RW-(O) : RWX(O)    << transitioning to here
+    //  v
+    //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)
+    //
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        PERFORMANCE_MEASURE_THIS_SCOPE();
+        ChangePermissionOfPage(HookData->Pml4Table,
+                               registration.HookEntry.PhyPageBase,
+                               TRUE,
+                               GetNptHash(HookData));
+    }
+
+    //
+    // Switch the current page to be backed by the original physical page.
+    //
+    //  State                     : Page Type
+    //                            : Current : Hooked : Other
+    //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
+    //  v
+    //  *)Transitioning           : RWX(E)  : RWX(O) : RWX(O)
+    //  v
+    //  *)Transitioning           : RWX(E)  : RW-(O) : RWX(O)
+    //  v
+    //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)    << transitioning to here
+    //
+
+    //
+    // Get a NPT entry associated with the page the processor has been
+    // executing on. The page should be backed by the exec page at this point,
+    // or by the original page if leaving the state 3.
+    //
+    nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
+                                       HookData->ActiveHookEntry->PhyPageBase);
+    NT_ASSERT(nptEntry != nullptr);
+    NT_ASSERT(nptEntry->Fields.NoExecute != FALSE);
+    NT_ASSERT(nptEntry->Fields.PageFrameNumber == GetPfnFromPa(
+            (HookData->NptState == NptHookEnabledSuspended) ?
+                HookData->ActiveHookEntry->PhyPageBase :
+                GetPhyPageBaseForExecution(HookData->ActiveHookEntry, HookData)));
+
+    //
+    // Switch to the original physical page so it looks as if there were no
+    // hooks.
+    //
+    SetPageFrameNumber(nptEntry,
+                       GetPfnFromPa(HookData->ActiveHookEntry->PhyPageBase),
+                       GetNptHash(HookData));
+
+    //
+    // Do the same for the linked page if exists. It may or may not be backed by
+    // the exec page.
+    //
+    if (HookData->ActiveHookEntry->PhyLinkedPageBase != 0)
+    {
+        nptEntry = GetNestedPageTableEntry(
+                                HookData->Pml4Table,
+                                HookData->ActiveHookEntry->PhyLinkedPageBase);
+        NT_ASSERT(nptEntry != nullptr);
+        SetPageFrameNumber(nptEntry,
+                           GetPfnFromPa(HookData->ActiveHookEntry->PhyLinkedPageBase),
+                           GetNptHash(HookData));
+    }
+}
+
+/*!
+    @brief Finds the view precomputed for the hooked page.
+
+    @param[in] HookData - The processor associated hook data.
+
+    @param[in] PhyPageBase - The page aligned physical memory address of the
+        hooked page.
+
+    @return The address of the view.
+ */
+static
+_Check_return_
+const HOOK_VIEW*
+FindHookView (
+    _In_ const HOOK_DATA* HookData,
+    _In_ ULONG64 PhyPageBase
+    )
+{
+    const HOOK_VIEW* view;
+
+    view = nullptr;
+    for (ULONG i = 0; i < HookData->Views->Count; ++i)
+    {
+        if (HookData->Views->Views[i].PhyPageBase == PhyPageBase)
+        {
+            view = &HookData->Views->Views[i];
+            break;
+        }
+    }
+
+    //
+    // Every hooked page has its view.
+    //
+    NT_ASSERT(view != nullptr);
+    return view;
+}
+
+/*!
+    @brief Makes the hooked page visible by switching to its view.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] HookData - The processor associated hook data.
+
+    @param[in] CurrentHookEntry - Information associated with the page contains
+        hook(s) and  the processor has been executing on.
+ */
+static
+VOID
+EnterVisibleStateByView (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData,
+    _In_ const HOOK_ENTRY* CurrentHookEntry
+    )
+{
+    const HOOK_VIEW* view;
+    PPT_ENTRY_4KB nptEntry;
+
+    NT_ASSERT(HookData->ActiveView == nullptr);
+
+    view = FindHookView(HookData, CurrentHookEntry->PhyPageBase);
+
+    //
+    // The trusted pages are already executable in the view. Only clear their
+    // Accessed bits to count the avoided exits.
+    //
+    for (ULONG i = 0; i < g_TrustedPages.Count; ++i)
+    {
+        nptEntry = GetNestedPageTableEntry(view->Pml4Table,
+                                           g_TrustedPages.PhyPageBases[i]);
+        NT_ASSERT(nptEntry != nullptr);
+        nptEntry->Fields.Accessed = FALSE;
+    }
+
+    //
+    // Switch to the view. TLB entries are tagged with ASID and not with NCr3,
+    // hence those derived from the previous NPT must be flushed.
+    //
+    GuestVmcb->ControlArea.NCr3 = view->Pml4TablePa;
+    GuestVmcb->ControlArea.TlbControl = SVM_TLB_CONTROL_FLUSH_ALL;
+    HookData->ActiveView = view;
+}
+
+/*!
+    @brief Makes the hooked page invisible by switching back to the NPT of
+        the state 1.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] HookData - The processor associated hook data.
+ */
+static
+VOID
+LeaveVisibleStateByView (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData
+    )
+{
+    NT_ASSERT(HookData->ActiveView != nullptr);
+
+    CountAvoidedExits(HookData->ActiveView->Pml4Table);
+
+    GuestVmcb->ControlArea.NCr3 = HookData->Views->DefaultPml4TablePa;
+    GuestVmcb->ControlArea.TlbControl = SVM_TLB_CONTROL_FLUSH_ALL;
+    HookData->ActiveView = nullptr;
+}
+
+/*!
+    @brief Copies the NPT entries for the address from the NPT of the state 1
+        to the active view as non-executable.
+
+    @details Entries are copied at the highest level where the view does not
+        own the table, so that the view shares the rest with the NPT of the
+        state 1.
+
+    @param[in,out] HookData - The processor associated hook data.
+
+    @param[in] PhysicalAddress - The physical address to copy the entries for.
+ */
+static
+VOID
+SynchronizeActiveView (
+    _Inout_ PHOOK_DATA HookData,
+    _In_ ULONG64 PhysicalAddress
+    )
+{
+    PPML4_ENTRY_4KB viewPml4Table;
+    PPDP_ENTRY_4KB viewPdpt, sharedPdpt;
+    PPD_ENTRY_4KB viewPdt, sharedPdt;
+    PPT_ENTRY_4KB viewPt, sharedPt;
+    ULONG64 pxeIndex, ppeIndex, pdeIndex, pteIndex;
+
+    viewPml4Table = HookData->ActiveView->Pml4Table;
+
+    //
+    // Only the first PML4 entry refers to the PDPT owned by the view. Others
+    // are shared and only need to be copied.
+    //
+    pxeIndex = GetPxeIndex(PhysicalAddress);
+    if (pxeIndex != 0)
+    {
+        viewPml4Table[pxeIndex] = HookData->Pml4Table[pxeIndex];
+        goto Exit;
+    }
+
+    //
+    // An entry refers to the table owned by the view when the entry is valid
+    // and its PFN differs from the one of the NPT of the state 1.
+    //
+    viewPdpt = static_cast<PPDP_ENTRY_4KB>(GetVaFromPfn(
+                            viewPml4Table[0].Fields.PageFrameNumber));
+    sharedPdpt = static_cast<PPDP_ENTRY_4KB>(GetVaFromPfn(
+                            HookData->Pml4Table[0].Fields.PageFrameNumber));
+    ppeIndex = GetPpeIndex(PhysicalAddress);
+    if ((viewPdpt[ppeIndex].Fields.Valid == FALSE) ||
+        (viewPdpt[ppeIndex].Fields.PageFrameNumber ==
+            sharedPdpt[ppeIndex].Fields.PageFrameNumber))
+    {
+        viewPdpt[ppeIndex] = sharedPdpt[ppeIndex];
+        viewPdpt[ppeIndex].Fields.NoExecute = TRUE;
+        goto Exit;
+    }
+
+    viewPdt = static_cast<PPD_ENTRY_4KB>(GetVaFromPfn(
+                            viewPdpt[ppeIndex].Fields.PageFrameNumber));
+    sharedPdt = static_cast<PPD_ENTRY_4KB>(GetVaFromPfn(
+                            sharedPdpt[ppeIndex].Fields.PageFrameNumber));
+    pdeIndex = GetPdeIndex(PhysicalAddress);
+    if ((viewPdt[pdeIndex].Fields.Valid == FALSE) ||
+        (viewPdt[pdeIndex].Fields.PageFrameNumber ==
+            sharedPdt[pdeIndex].Fields.PageFrameNumber))
+    {
+        viewPdt[pdeIndex] = sharedPdt[pdeIndex];
+        viewPdt[pdeIndex].Fields.NoExecute = TRUE;
+        goto Exit;
+    }
+
+    viewPt = static_cast<PPT_ENTRY_4KB>(GetVaFromPfn(
+                            viewPdt[pdeIndex].Fields.PageFrameNumber));
+    sharedPt = static_cast<PPT_ENTRY_4KB>(GetVaFromPfn(
+                            sharedPdt[pdeIndex].Fields.PageFrameNumber));
+    pteIndex = GetPteIndex(PhysicalAddress);
+    viewPt[pteIndex] = sharedPt[pteIndex];
+    viewPt[pteIndex].Fields.NoExecute = TRUE;
+
+Exit:
+    return;
+}
+
+/*!
+    @brief Finds the shadow precomputed for the hooked page.
+
+    @param[in] HookData - The processor associated hook data.
+
+    @param[in] PhyPageBase - The page aligned physical memory address of the
+        hooked page.
+
+    @return The address of the shadow.
+ */
+static
+_Check_return_
+const HOOK_SHADOW*
+FindHookShadow (
+    _In_ const HOOK_DATA* HookData,
+    _In_ ULONG64 PhyPageBase
+    )
+{
+    const HOOK_SHADOW* shadow;
+
+    shadow = nullptr;
+    for (ULONG i = 0; i < HookData->Shadows->Count; ++i)
+    {
+        if (HookData->Shadows->Shadows[i].PhyPageBase == PhyPageBase)
+        {
+            shadow = &HookData->Shadows->Shadows[i];
+            break;
+        }
+    }
+
+    //
+    // Every hooked page has its shadow.
+    //
+    NT_ASSERT(shadow != nullptr);
+    return shadow;
+}
+
+/*!
+    @brief Returns the PDPT entry the shadow is swapped into.
+
+    @param[in] HookData - The processor associated hook data.
+
+    @param[in] Shadow - The shadow to get the PDPT entry for.
+
+    @return The address of the PDPT entry.
+ */
+static
+_Check_return_
+PPDP_ENTRY_4KB
+GetShadowedPdptEntry (
+    _In_ const HOOK_DATA* HookData,
+    _In_ const HOOK_SHADOW* Shadow
+    )
+{
+    PPDP_ENTRY_4KB pageDirectoryPointerTable;
+
+    pageDirectoryPointerTable = static_cast<PPDP_ENTRY_4KB>(GetVaFromPfn(
+                                HookData->Pml4Table[0].Fields.PageFrameNumber));
+    return &pageDirectoryPointerTable[Shadow->PpeIndex];
+}
+
+/*!
+    @brief Makes the hooked page visible by swapping in its shadow and
+        changing permissions of all other pages.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] HookData - The processor associated hook data.
+
+    @param[in] CurrentHookEntry - Information associated with the page contains
+        hook(s) and  the processor has been executing on.
+ */
+static
+VOID
+EnterVisibleStateByShadow (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData,
+    _In_ const HOOK_ENTRY* CurrentHookEntry
+    )
+{
+    const HOOK_SHADOW* shadow;
+    PPDP_ENTRY_4KB pdptEntry;
+    PPT_ENTRY_4KB nptEntry;
+    const HOOK_ENTRY* linkedHookEntry;
+
+    UNREFERENCED_PARAMETER(GuestVmcb);
+
+    NT_ASSERT(HookData->ActiveShadow == nullptr);
+
+    shadow = FindHookShadow(HookData, CurrentHookEntry->PhyPageBase);
+
+    //
+    // Make all pages non-executable, and then, swap in the shadow that makes
+    // the hooked page executable and backed by the exec page, as well as the
+    // linked page and the trusted pages within the range.
+    //
+    ChangePermissionsOfAllPages(HookData->Pml4Table,
+                                nullptr,
+                                0,
+                                TRUE,
+                                HookData->MaxNptPdpEntriesUsed,
+                                GetNptHash(HookData));
+
+    pdptEntry = GetShadowedPdptEntry(HookData, shadow);
+    NT_ASSERT(pdptEntry->Fields.PageFrameNumber == shadow->OriginalPdtPfn);
+    SetPageFrameNumber(pdptEntry, shadow->ShadowPdtPfn, GetNptHash(HookData));
+    SetNoExecute(pdptEntry, FALSE, GetNptHash(HookData));
+
+    //
+    // Make the linked page and the trusted pages outside of the range
+    // executable in place as the sweep backend does.
+    //
+    if (shadow->OutOfRangePas[0] != 0)
+    {
+        linkedHookEntry = FindHookEntryByPhysicalPage(shadow->OutOfRangePas[0]);
+        if (linkedHookEntry != nullptr)
+        {
+            nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
+                                               linkedHookEntry->PhyPageBase);
+            NT_ASSERT(nptEntry != nullptr);
+            SetPageFrameNumber(nptEntry,
+                               GetPfnFromPa(GetPhyPageBaseForExecution(
+                                                linkedHookEntry, HookData)),
+                               GetNptHash(HookData));
+        }
+    }
+    for (ULONG i = 0; i < 1 + g_TrustedPages.Count; ++i)
+    {
+        if (shadow->OutOfRangePas[i] != 0)
+        {
+            ChangePermissionOfPage(HookData->Pml4Table,
+                                   shadow->OutOfRangePas[i],
+                                   FALSE,
+                                   GetNptHash(HookData));
+        }
+    }
+
+    //
+    // Clear the Accessed bits of the trusted pages to count the avoided exits.
+    //
+    for (ULONG i = 0; i < g_TrustedPages.Count; ++i)
+    {
+        nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
+                                           g_TrustedPages.PhyPageBases[i]);
+        NT_ASSERT(nptEntry != nullptr);
+        nptEntry->Fields.Accessed = FALSE;
+    }
+
+    HookData->ActiveShadow = shadow;
+}
+
+/*!
+    @brief Makes the hooked page invisible by swapping out its shadow and
+        changing permissions of all other pages.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] HookData - The processor associated hook data.
+ */
+static
+VOID
+LeaveVisibleStateByShadow (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData
+    )
+{
+    const HOOK_SHADOW* shadow;
+    PPDP_ENTRY_4KB pdptEntry;
+    PPT_ENTRY_4KB nptEntry;
+
+    UNREFERENCED_PARAMETER(GuestVmcb);
+
+    shadow = HookData->ActiveShadow;
+    NT_ASSERT(shadow != nullptr);
+
+    CountAvoidedExits(HookData->Pml4Table);
+
+    //
+    // Undo the state 3 if that is the state, so that the shadow is left as
+    // precomputed for the next transition to the state 2.
+    //
+    if (HookData->SuspendedCalleePhyPageBase != 0)
+    {
+        SwitchActiveHookPages(HookData, TRUE);
+        ChangePermissionOfPage(HookData->Pml4Table,
+                               HookData->SuspendedCalleePhyPageBase,
+                               TRUE,
+                               GetNptHash(HookData));
+        ChangePermissionOfPage(HookData->Pml4Table,
+                               HookData->ActiveHookEntry->PhyPageBase,
+                               FALSE,
+                               GetNptHash(HookData));
+        if (HookData->ActiveHookEntry->PhyLinkedPageBase != 0)
+        {
+            ChangePermissionOfPage(HookData->Pml4Table,
+                                   HookData->ActiveHookEntry->PhyLinkedPageBase,
+                                   FALSE,
+                                   GetNptHash(HookData));
+        }
+    }
+
+    //
+    // Swap out the shadow, and make all pages executable. Only the tables
+    // for the pages outside of the range have to be made executable again.
+    //
+    pdptEntry = GetShadowedPdptEntry(HookData, shadow);
+    NT_ASSERT(pdptEntry->Fields.PageFrameNumber == shadow->ShadowPdtPfn);
+    SetPageFrameNumber(pdptEntry, shadow->OriginalPdtPfn, GetNptHash(HookData));
+    ChangePermissionsOfAllPages(HookData->Pml4Table,
+                                shadow->OutOfRangePas,
+                                1 + g_TrustedPages.Count,
+                                FALSE,
+                                HookData->MaxNptPdpEntriesUsed,
+                                GetNptHash(HookData));
+
+    //
+    // Make hooked pages made executable above non-executable again. Those
+    // within the range were never changed.
+    //
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        if (GetPpeIndex(registration.HookEntry.PhyPageBase) == shadow->PpeIndex)
+        {
+            continue;
+        }
+        ChangePermissionOfPage(HookData->Pml4Table,
+                               registration.HookEntry.PhyPageBase,
+                               TRUE,
+                               GetNptHash(HookData));
+    }
+
+    //
+    // Switch the linked page outside of the range to be backed by the original
+    // physical page.
+    //
+    if (shadow->OutOfRangePas[0] != 0)
+    {
+        nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
+                                           shadow->OutOfRangePas[0]);
+        NT_ASSERT(nptEntry != nullptr);
+        SetPageFrameNumber(nptEntry,
+                           GetPfnFromPa(shadow->OutOfRangePas[0]),
+                           GetNptHash(HookData));
+    }
+
+    HookData->ActiveShadow = nullptr;
+}
+
+/*!
+    @brief Copies the NPT entries for the address from the NPT of the state 1
+        to the active shadow as non-executable.
+
+    @details The PDPT entry must refer to the PDT of the NPT of the state 1
+        when this function is called. Entries are copied at the highest level
+        where the shadow does not own the table, as SynchronizeActiveView does.
+
+    @param[in,out] HookData - The processor associated hook data.
+
+    @param[in] PhysicalAddress - The physical address to copy the entries for.
+ */
+static
+VOID
+SynchronizeActiveShadow (
+    _Inout_ PHOOK_DATA HookData,
+    _In_ ULONG64 PhysicalAddress
+    )
+{
+    const HOOK_SHADOW* shadow;
+    PPD_ENTRY_4KB shadowPdt, sharedPdt;
+    PPT_ENTRY_4KB shadowPt, sharedPt;
+    ULONG64 pdeIndex, pteIndex;
+
+    shadow = HookData->ActiveShadow;
+
+    //
+    // Entries outside of the range are not shadowed.
+    //
+    if ((GetPxeIndex(PhysicalAddress) != 0) ||
+        (GetPpeIndex(PhysicalAddress) != shadow->PpeIndex))
+    {
+        goto Exit;
+    }
+
+    shadowPdt = static_cast<PPD_ENTRY_4KB>(GetVaFromPfn(shadow->ShadowPdtPfn));
+    sharedPdt = static_cast<PPD_ENTRY_4KB>(GetVaFromPfn(shadow->OriginalPdtPfn));
+    pdeIndex = GetPdeIndex(PhysicalAddress);
+    if ((shadowPdt[pdeIndex].Fields.Valid == FALSE) ||
+        (shadowPdt[pdeIndex].Fields.PageFrameNumber ==
+            sharedPdt[pdeIndex].Fields.PageFrameNumber))
+    {
+        shadowPdt[pdeIndex] = sharedPdt[pdeIndex];
+        shadowPdt[pdeIndex].Fields.NoExecute = TRUE;
+        goto Exit;
+    }
+
+    shadowPt = static_cast<PPT_ENTRY_4KB>(GetVaFromPfn(
+                            shadowPdt[pdeIndex].Fields.PageFrameNumber));
+    sharedPt = static_cast<PPT_ENTRY_4KB>(GetVaFromPfn(
+                            sharedPdt[pdeIndex].Fields.PageFrameNumber));
+    pteIndex = GetPteIndex(PhysicalAddress);
+    shadowPt[pteIndex] = sharedPt[pteIndex];
+    shadowPt[pteIndex].Fields.NoExecute = TRUE;
+
+Exit:
+    return;
+}
+
+/*!
+    @brief Returns the NPT PML4 NCr3 currently points to.
+
+    @param[in] HookData - The processor associated hook data.
+
+    @return The NPT PML4 NCr3 currently points to.
+ */
+static
+_Check_return_
+PPML4_ENTRY_4KB
+GetActivePml4Table (
+    _In_ const HOOK_DATA* HookData
+    )
+{
+    return (HookData->ActiveView != nullptr) ?
+                HookData->ActiveView->Pml4Table : HookData->Pml4Table;
+}
+
+//
+// The routines of a backend to make the hooked page visible (the state 1 to
+// 2), and invisible (the state 2 to 1).
+//
+typedef
+VOID
+NPT_ENTER_VISIBLE_STATE (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData,
+    _In_ const HOOK_ENTRY* CurrentHookEntry
+    );
+
+typedef
+VOID
+NPT_LEAVE_VISIBLE_STATE (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData
+    );
+
+typedef struct _NPT_TRANSITION_BACKEND_ROUTINES
+{
+    NPT_ENTER_VISIBLE_STATE* EnterVisibleState;
+    NPT_LEAVE_VISIBLE_STATE* LeaveVisibleState;
+} NPT_TRANSITION_BACKEND_ROUTINES, *PNPT_TRANSITION_BACKEND_ROUTINES;
+
+//
+// Indexed by NPT_TRANSITION_BACKEND.
+//
+static const NPT_TRANSITION_BACKEND_ROUTINES k_NptTransitionBackends[] =
+{
+    { EnterVisibleStateBySweep, LeaveVisibleStateBySweep },
+    { EnterVisibleStateByView, LeaveVisibleStateByView },
+    { EnterVisibleStateByShadow, LeaveVisibleStateByShadow },
+};
+static_assert(RTL_NUMBER_OF(k_NptTransitionBackends) == NptTransitionBackendMax,
+              "Size check");
+
+/*!
+    @brief Transition the NPT state 1 to 2.
+
+    @details Hooks found on this page, which means the processor is attempt to
+        execute a page where hooks are installed. Move to the state 2.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] HookData - The processor associated hook data.
+
+    @param[in] CurrentHookEntry - Information associated with the page contains
+        hook(s) and  the processor has been executing on.
+ */
+static
+VOID
+TransitionNptState1To2 (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData,
+    _In_ const HOOK_ENTRY* CurrentHookEntry
+    )
+{
+    NT_ASSERT(HookData->NptState == NptHookEnabledInvisible);
+    NT_ASSERT(HookData->ActiveHookEntry == nullptr);
+
+    PERFORMANCE_MEASURE_THIS_SCOPE();
+
+    k_NptTransitionBackends[HookData->TransitionBackend].EnterVisibleState(
+                                                            GuestVmcb,
+                                                            HookData,
+                                                            CurrentHookEntry);
+
+    //
+    // Transition completed.
+    //
+    HookData->ActiveHookEntry = CurrentHookEntry;
+    HookData->NptState = NptHookEnabledVisible;
+}
+
+/*!
+    @brief Transition the NPT state 2 to 1.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] HookData - The processor associated hook data.
+ */
+static
+VOID
+TransitionNtpState2To1 (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData
+    )
+{
+    NT_ASSERT((HookData->NptState == NptHookEnabledVisible) ||
+              (HookData->NptState == NptHookEnabledSuspended));
+    NT_ASSERT(HookData->ActiveHookEntry != nullptr);
+
+    //
+    // Move 2 (or 3) to 1. There is an active hook and no hooks on the page going to
+    // be executed. This must mean the processor is on the state 2, ie, running
+    // the page with hooks, and jumping out to outside of it.
+    //
+    PERFORMANCE_MEASURE_THIS_SCOPE();
+
+    k_NptTransitionBackends[HookData->TransitionBackend].LeaveVisibleState(
+                                                            GuestVmcb,
+                                                            HookData);
+
+    //
+    // Transition completed.
+    //
+    HookData->ActiveHookEntry = nullptr;
+    HookData->SuspendedCalleePhyPageBase = 0;
+    HookData->NptState = NptHookEnabledInvisible;
+}
+
+/*!
+    @brief Tests whether the processor left the hooked page by a call.
+
+    @details The return address at the guest RSP is compared with the hooked
+        page and the linked page. The guest stack is read only when it is a
+        kernel address valid in the host, which shares the kernel address
+        space with the guest. A jump out of the hooked page with a return
+        address pointing to the page may be mistaken as a call; the state 3
+        handles it correctly, only less efficiently.
+
+    @param[in] GuestVmcb - The processor associated VMCB.
+
+    @param[in] HookData - The processor associated hook data.
+
+    @return TRUE if the return address points to the hooked page or the linked
+        page; otherwise, FALSE.
+ */
+static
+_Check_return_
+BOOLEAN
+IsCallFromActiveHookPage (
+    _In_ const VMCB* GuestVmcb,
+    _In_ const HOOK_DATA* HookData
+    )
+{
+    BOOLEAN called;
+    PVOID stackPointer;
+    PVOID returnPage;
+    PVOID hookPage;
+
+    called = FALSE;
+
+    stackPointer = reinterpret_cast<PVOID>(GuestVmcb->StateSaveArea.Rsp);
+    if ((GuestVmcb->StateSaveArea.Cpl != 0) ||
+        (stackPointer < MmSystemRangeStart) ||
+        (MmIsAddressValid(stackPointer) == FALSE) ||
+        (MmIsAddressValid(Add2Ptr(stackPointer, sizeof(ULONG64) - 1)) == FALSE))
+    {
+        goto Exit;
+    }
+
+    returnPage = PAGE_ALIGN(*static_cast<PVOID*>(stackPointer));
+    hookPage = PAGE_ALIGN(HookData->ActiveHookEntry->HookAddress);
+    if ((returnPage == hookPage) ||
+        ((HookData->ActiveHookEntry->PhyLinkedPageBase != 0) &&
+         (returnPage == Add2Ptr(hookPage, PAGE_SIZE))))
+    {
+        called = TRUE;
+    }
+
+Exit:
+    return called;
+}
+
+/*!
+    @brief Tests whether the page can be made executable only by its PT entry.
+
+    @details This is the case when the parent PDPT and PDT entries of the page
+        are already executable in the state 2. Otherwise, making the page
+        executable pushes non-executable permission down to sub tables, which
+        is not reversed when the page is made non-executable again. The state
+        3 requires the former so that returning to the state 2 restores
+        exactly the same NPT.
+
+    @param[in] Pml4Table - The NPT PML4 to look up.
+
+    @param[in] PhysicalAddress - The physical address to test.
+
+    @return TRUE if only the PT entry of the page needs to be changed;
+        otherwise, FALSE.
+ */
+static
+_Check_return_
+BOOLEAN
+IsExecutableByLeafChange (
+    _In_ const PML4_ENTRY_4KB* Pml4Table,
+    _In_ ULONG64 PhysicalAddress
+    )
+{
+    BOOLEAN leafOnly;
+    const PML4_ENTRY_4KB* pml4Entry;
+    const PDP_ENTRY_4KB* pdptEntry;
+    const PD_ENTRY_4KB* pdtEntry;
+
+    leafOnly = FALSE;
+
+    pml4Entry = &Pml4Table[GetPxeIndex(PhysicalAddress)];
+    if (pml4Entry->Fields.Valid == FALSE)
+    {
+        goto Exit;
+    }
+
+    pdptEntry = &static_cast<const PDP_ENTRY_4KB*>(GetVaFromPfn(
+        pml4Entry->Fields.PageFrameNumber))[GetPpeIndex(PhysicalAddress)];
+    if ((pdptEntry->Fields.Valid == FALSE) ||
+        (pdptEntry->Fields.NoExecute != FALSE))
+    {
+        goto Exit;
+    }
+
+    pdtEntry = &static_cast<const PD_ENTRY_4KB*>(GetVaFromPfn(
+        pdptEntry->Fields.PageFrameNumber))[GetPdeIndex(PhysicalAddress)];
+    if ((pdtEntry->Fields.Valid == FALSE) ||
+        (pdtEntry->Fields.NoExecute != FALSE))
+    {
+        goto Exit;
+    }
+
+    leafOnly = TRUE;
+
+Exit:
+    return leafOnly;
+}
+
+/*!
+    @brief Transition the NPT state 2 to 3.
+
+    @details The processor called out of the hooked page. Make the hooked page
+        and the linked page non-executable and backed by the original pages,
+        and make only the called page executable.
+
+        State                     : Page Type
+                                  : Current : Hooked : Other
+        2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
+        v
+        3)NptHookEnabledSuspended : RWX(O)  : RW-(O) : RW-(O)   << transitioning to here
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
 
-    //
-    // Switch the current page to the executable, exec page backed page.
-    //
-    //  State                     : Page Type
-    //                            : Current : Hooked : Other
-    //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)
-    //  v
-    //  *)Transitioning           : RW-(O)  : RW-(O) : RW-(O)
-    //  v
-    //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)    << transitioning to here
+    @param[in,out] HookData - The processor associated hook data.
 
-    //
-    // Get a NPT entry associated with the page the processor has been
-    // executing on. The page should be backed by the original at this point.
-    //
-    nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
-                                       CurrentHookEntry->PhyPageBase);
-    NT_ASSERT(nptEntry != nullptr);
-    NT_ASSERT(nptEntry->Fields.NoExecute != FALSE);
-    NT_ASSERT(nptEntry->Fields.PageFrameNumber == GetPfnFromPa(
-                                                CurrentHookEntry->PhyPageBase));
+    @param[in] CalleePhysicalAddress - The physical address of the called
+        page.
+ */
+static
+VOID
+TransitionNptState2To3 (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData,
+    _In_ ULONG64 CalleePhysicalAddress
+    )
+{
+    NT_ASSERT(HookData->NptState == NptHookEnabledVisible);
+    NT_ASSERT(HookData->ActiveHookEntry != nullptr);
+    NT_ASSERT(HookData->TransitionBackend != NptTransitionBackendHookViews);
 
-    //
-    // Switch to the exec physical page so hooks can be executed, and make the
-    // page executable.
-    //
-    nptEntry->Fields.PageFrameNumber = GetPfnFromPa(
-                                CurrentHookEntry->PhyPageBaseForExecution);
+    PERFORMANCE_MEASURE_THIS_SCOPE();
+
+    SwitchActiveHookPages(HookData, FALSE);
     ChangePermissionOfPage(HookData->Pml4Table,
-                           CurrentHookEntry->PhyPageBase,
-                           FALSE);
+                           HookData->ActiveHookEntry->PhyPageBase,
+                           TRUE,
+                           GetNptHash(HookData));
+    if (HookData->ActiveHookEntry->PhyLinkedPageBase != 0)
+    {
+        ChangePermissionOfPage(HookData->Pml4Table,
+                               HookData->ActiveHookEntry->PhyLinkedPageBase,
+                               TRUE,
+                               GetNptHash(HookData));
+    }
+    HookData->SuspendedCalleePhyPageBase =
+                reinterpret_cast<ULONG64>(PAGE_ALIGN(CalleePhysicalAddress));
+    ChangePermissionOfPage(HookData->Pml4Table,
+                           HookData->SuspendedCalleePhyPageBase,
+                           FALSE,
+                           GetNptHash(HookData));
 
     //
-    // Transition completed.
+    // Translations to the exec page may be cached for reads by the called
+    // code.
     //
-    HookData->ActiveHookEntry = CurrentHookEntry;
-    HookData->NptState = NptHookEnabledVisible;
+    GuestVmcb->ControlArea.TlbControl = SVM_TLB_CONTROL_FLUSH_ALL;
+
+    HookData->NptState = NptHookEnabledSuspended;
+    InterlockedIncrement64(&g_SuspendedVisibleStatistics.SuspendCount);
 }
 
 /*!
-    @brief Transition the NPT state 2 to 1.
+    @brief Transition the NPT state 3 to 2.
+
+    @details The processor returned to the hooked page. Reverse what
+        TransitionNptState2To3 did.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
 
     @param[in,out] HookData - The processor associated hook data.
  */
 static
 VOID
-TransitionNtpState2To1 (
+TransitionNptState3To2 (
+    _Inout_ PVMCB GuestVmcb,
     _Inout_ PHOOK_DATA HookData
     )
 {
-    PPT_ENTRY_4KB nptEntry;
-
-    NT_ASSERT(HookData->NptState == NptHookEnabledVisible);
+    NT_ASSERT(HookData->NptState == NptHookEnabledSuspended);
     NT_ASSERT(HookData->ActiveHookEntry != nullptr);
 
-    //
-    // Move 2 to 1. There is an active hook and no hooks on the page going to
-    // be executed. This must mean the processor is on the state 2, ie, running
-    // the page with hooks, and jumping out to outside of it.
-    //
     PERFORMANCE_MEASURE_THIS_SCOPE();
 
-    //
-    // Make all pages executable.
-    //
-    //  State                     : Page Type
-    //                            : Current : Hooked : Other
-    //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
-    //  v
-    //  *)Transitioning           : RWX(E)  : RWX(O) : RWX(O)    << transitioning to here
-    //  v
-    //  *)Transitioning           : RWX(E)  : RW-(O) : RWX(O)
-    //  v
-    //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)
-    //
-    ChangePermissionsOfAllPages(HookData->Pml4Table,
-                                HookData->ActiveHookEntry->PhyPageBase,
-                                FALSE,
-                                HookData->MaxNptPdpEntriesUsed);
+    SwitchActiveHookPages(HookData, TRUE);
 
-    //
-    // Make all hooked pages non-executable.
-    //
-    //  State                     : Page Type
-    //                            : Current : Hooked : Other
-    //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
-    //  v
-    //  *)Transitioning           : RWX(E)  : RWX(O) : RWX(O)
-    //  v
-    //  *)Transitioning           : RWX(E)  : RW-(O) : RWX(O)    << transitioning to here
-    //  v
-    //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)
-    //
-    for (const auto& registration : g_HookRegistrationEntries)
+    ChangePermissionOfPage(HookData->Pml4Table,
+                           HookData->SuspendedCalleePhyPageBase,
+                           TRUE,
+                           GetNptHash(HookData));
+    ChangePermissionOfPage(HookData->Pml4Table,
+                           HookData->ActiveHookEntry->PhyPageBase,
+                           FALSE,
+                           GetNptHash(HookData));
+    if (HookData->ActiveHookEntry->PhyLinkedPageBase != 0)
     {
-        PERFORMANCE_MEASURE_THIS_SCOPE();
         ChangePermissionOfPage(HookData->Pml4Table,
-                               registration.HookEntry.PhyPageBase,
-                               TRUE);
+                               HookData->ActiveHookEntry->PhyLinkedPageBase,
+                               FALSE,
+                               GetNptHash(HookData));
     }
+    HookData->SuspendedCalleePhyPageBase = 0;
 
     //
-    // Switch the current page to be backed by the original physical page.
-    //
-    //  State                     : Page Type
-    //                            : Current : Hooked : Other
-    //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
-    //  v
-    //  *)Transitioning           : RWX(E)  : RWX(O) : RWX(O)
-    //  v
-    //  *)Transitioning           : RWX(E)  : RW-(O) : RWX(O)
-    //  v
-    //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)    << transitioning to here
-    //
-
-    //
-    // Get a NPT entry associated with the page the processor has been
-    // executing on. The page should be backed by the exec page at this point.
-    //
-    nptEntry = GetNestedPageTableEntry(HookData->Pml4Table,
-                                       HookData->ActiveHookEntry->PhyPageBase);
-    NT_ASSERT(nptEntry != nullptr);
-    NT_ASSERT(nptEntry->Fields.NoExecute != FALSE);
-    NT_ASSERT(nptEntry->Fields.PageFrameNumber == GetPfnFromPa(
-                            HookData->ActiveHookEntry->PhyPageBaseForExecution));
-
-    //
-    // Switch to the original physical page so it looks as if there were no
-    // hooks.
+    // Translations to the original pages may be cached for reads.
     //
-    nptEntry->Fields.PageFrameNumber = GetPfnFromPa(
-                                        HookData->ActiveHookEntry->PhyPageBase);
+    GuestVmcb->ControlArea.TlbControl = SVM_TLB_CONTROL_FLUSH_ALL;
 
-    //
-    // Transition completed.
-    //
-    HookData->ActiveHookEntry = nullptr;
-    HookData->NptState = NptHookEnabledInvisible;
+    HookData->NptState = NptHookEnabledVisible;
+    InterlockedIncrement64(&g_SuspendedVisibleStatistics.ResumeCount);
 }
 
 /*!
     @brief Transition the NPT state according with where the NPT fault occurred.
 
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
     @param[in,out] HookData - The processor associated hook data.
 
     @param[in] FaultPhysicalAddress - The physical address caused the NTP fault.
@@ -289,6 +1602,7 @@ TransitionNtpState2To1 (
 static
 VOID
 TransitionNptState (
+    _Inout_ PVMCB GuestVmcb,
     _Inout_ PHOOK_DATA HookData,
     _In_ ULONG64 FaultPhysicalAddress
     )
@@ -298,7 +1612,32 @@ TransitionNptState (
     NT_ASSERT(HookData->NptState != NptDefault);
 
     hookEntry = FindHookEntryByPhysicalPage(FaultPhysicalAddress);
-    if (hookEntry != nullptr)
+    if (HookData->NptState == NptHookEnabledSuspended)
+    {
+        //
+        // The processor is on the state 3. If it is returning to the hooked
+        // page or the linked page, move back to the state 2. Otherwise, it
+        // did not simply return from the called page. Move to the state 1,
+        // and to the state 2 if the page has hook(s).
+        //
+        if ((PAGE_ALIGN(FaultPhysicalAddress) ==
+                PAGE_ALIGN(HookData->ActiveHookEntry->PhyPageBase)) ||
+            ((HookData->ActiveHookEntry->PhyLinkedPageBase != 0) &&
+             (PAGE_ALIGN(FaultPhysicalAddress) ==
+                PAGE_ALIGN(HookData->ActiveHookEntry->PhyLinkedPageBase))))
+        {
+            TransitionNptState3To2(GuestVmcb, HookData);
+        }
+        else
+        {
+            TransitionNtpState2To1(GuestVmcb, HookData);
+            if (hookEntry != nullptr)
+            {
+                TransitionNptState1To2(GuestVmcb, HookData, hookEntry);
+            }
+        }
+    }
+    else if (hookEntry != nullptr)
     {
         //
         // Hook(s) found on this faulting page. This means the processor is
@@ -310,7 +1649,7 @@ TransitionNptState (
         //
         if (HookData->ActiveHookEntry == nullptr)
         {
-            TransitionNptState1To2(HookData, hookEntry);
+            TransitionNptState1To2(GuestVmcb, HookData, hookEntry);
         }
         else
         {
@@ -319,8 +1658,8 @@ TransitionNptState (
             // way to do this is to transit to 1 first and back to 2. This may
             // not be the most optimized way, but still run fast enough it seems.
             //
-            TransitionNtpState2To1(HookData);
-            TransitionNptState1To2(HookData, hookEntry);
+            TransitionNtpState2To1(GuestVmcb, HookData);
+            TransitionNptState1To2(GuestVmcb, HookData, hookEntry);
         }
     }
     else
@@ -328,10 +1667,24 @@ TransitionNptState (
         //
         // No hooks on this faulting page. This must mean the processor is
         // on the state 2, ie, running the page with hooks, and jumping out to
-        // outside of it. Move to the state 1.
+        // outside of it. Move to the state 3 if it is a call to a page that
+        // can be made executable by its PT entry alone, expecting the return
+        // to the page soon. Otherwise, move to the state 1.
         //
-        TransitionNtpState2To1(HookData);
+        if ((HookData->SuspendOnCall != FALSE) &&
+            (IsCallFromActiveHookPage(GuestVmcb, HookData) != FALSE) &&
+            (IsExecutableByLeafChange(HookData->Pml4Table,
+                                      FaultPhysicalAddress) != FALSE))
+        {
+            TransitionNptState2To3(GuestVmcb, HookData, FaultPhysicalAddress);
+        }
+        else
+        {
+            TransitionNtpState2To1(GuestVmcb, HookData);
+        }
     }
+
+    CheckNptState(GuestVmcb, HookData);
 }
 
 /*!
@@ -344,20 +1697,26 @@ TransitionNptState (
     @param[in,out] GuestVmcb - The processor associated VMCB.
 
     @param[in,out] HookData - The processor associated hook data.
+
+    @param[in] ExitTsc - The TSC at the start of HandleVmExit.
  */
 _Use_decl_annotations_
 VOID
 HandleNestedPageFault (
     PVMCB GuestVmcb,
-    PHOOK_DATA HookData
+    PHOOK_DATA HookData,
+    ULONG64 ExitTsc
     )
 {
     NPF_EXITINFO1 exitInfo;
     ULONG64 faultingPa;
     PPT_ENTRY_4KB nptEntry;
+    PPDP_ENTRY_4KB pdptEntry;
+    const HOOK_ENTRY* responsibleEntry;
 
     PERFORMANCE_MEASURE_THIS_SCOPE();
 
+    pdptEntry = nullptr;
     faultingPa = GuestVmcb->ControlArea.ExitInfo2;
     exitInfo.AsUInt64 = GuestVmcb->ControlArea.ExitInfo1;
     if (exitInfo.Fields.Valid == FALSE)
@@ -369,13 +1728,51 @@ HandleNestedPageFault (
         //
         PERFORMANCE_MEASURE_THIS_SCOPE();
 #if DBG
-        nptEntry = GetNestedPageTableEntry(HookData->Pml4Table, faultingPa);
+        nptEntry = GetNestedPageTableEntry(GetActivePml4Table(HookData),
+                                           faultingPa);
         NT_ASSERT((nptEntry == nullptr) || (nptEntry->Fields.Valid == FALSE));
 #endif
-        nptEntry = BuildSubTables(HookData->Pml4Table, faultingPa, HookData);
-        if (nptEntry == nullptr)
+        //
+        // When the fault is on a view or a shadow, the entry may already exist
+        // in the NPT of the state 1, as it may have been built in the state 1
+        // or on another view or shadow. The view or the shadow gets the copy
+        // of the entry. The shadow is swapped out while the NPT of the state 1
+        // is looked up and built. This does not update the hash of the NPT
+        // state checker as the PFN is restored below.
+        //
+        if (HookData->ActiveShadow != nullptr)
+        {
+            pdptEntry = GetShadowedPdptEntry(HookData, HookData->ActiveShadow);
+            pdptEntry->Fields.PageFrameNumber = HookData->ActiveShadow->OriginalPdtPfn;
+        }
+        nptEntry = GetNestedPageTableEntry(HookData->Pml4Table, faultingPa);
+        if ((nptEntry == nullptr) || (nptEntry->Fields.Valid == FALSE))
+        {
+            nptEntry = BuildSubTables(HookData->Pml4Table, faultingPa, HookData);
+            if (nptEntry == nullptr)
+            {
+                SIMPLESVMHOOK_BUG_CHECK();
+            }
+
+            //
+            // Record the page to map it when the NPT is built next time. See
+            // HookKernelMmioWorkingSet.cpp.
+            //
+            if (HookData->MmioFaultCount < RTL_NUMBER_OF(HookData->MmioPageNumbers))
+            {
+                HookData->MmioPageNumbers[HookData->MmioFaultCount] =
+                                                        faultingPa >> PAGE_SHIFT;
+            }
+            HookData->MmioFaultCount++;
+        }
+        if (HookData->ActiveView != nullptr)
+        {
+            SynchronizeActiveView(HookData, faultingPa);
+        }
+        if (HookData->ActiveShadow != nullptr)
         {
-            SIMPLESVMHOOK_BUG_CHECK();
+            SynchronizeActiveShadow(HookData, faultingPa);
+            pdptEntry->Fields.PageFrameNumber = HookData->ActiveShadow->ShadowPdtPfn;
         }
         goto Exit;
     }
@@ -386,7 +1783,28 @@ HandleNestedPageFault (
     // this request.
     //
     NT_ASSERT(exitInfo.Fields.Execute != FALSE);
-    TransitionNptState(HookData, faultingPa);
+    responsibleEntry = HookData->ActiveHookEntry;
+    TransitionNptState(GuestVmcb, HookData, faultingPa);
+
+    //
+    // Charge the transition to the hook being entered, or the hook being left
+    // when the transition is from the state 2 to 1, including the #VMEXIT and
+    // VMRUN round trip.
+    //
+    if (HookData->ActiveHookEntry != nullptr)
+    {
+        responsibleEntry = HookData->ActiveHookEntry;
+    }
+    if (responsibleEntry != nullptr)
+    {
+        ChargeHookOverhead(HookData->OverheadTable,
+                           CONTAINING_RECORD(responsibleEntry,
+                                             HOOK_REGISTRATION_ENTRY,
+                                             HookEntry),
+                           GuestVmcb->StateSaveArea.Cr3,
+                           HookOverheadNptTransition,
+                           __rdtsc() - ExitTsc + HookData->VmExitRoundTripCycles);
+    }
 
 Exit:
     return;
@@ -406,6 +1824,11 @@ EnableHooks (
     NT_ASSERT(HookData->NptState == NptDefault);
     NT_ASSERT(HookData->ActiveHookEntry == nullptr);
 
+    if (HookData->StateChecker != nullptr)
+    {
+        HookData->StateChecker->InvisibleHash = ComputeInvisibleNptHash(HookData);
+    }
+
     //
     // Move 0 to 1. Make all pages with hooks non-executable.
     //
@@ -415,112 +1838,219 @@ EnableHooks (
     //  v
     //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)   << transitioning to here
     //
-    for (const auto& registration : g_HookRegistrationEntries)
+    for (const auto& registration : GetHookRegistrationEntries())
     {
         PERFORMANCE_MEASURE_THIS_SCOPE();
         ChangePermissionOfPage(HookData->Pml4Table,
                                registration.HookEntry.PhyPageBase,
-                               TRUE);
+                               TRUE,
+                               GetNptHash(HookData));
     }
     HookData->NptState = NptHookEnabledInvisible;
+    CheckNptState(nullptr, HookData);
 }
 
 /*!
     @brief Disables all hooks (transition to the state 0).
 
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
     @param[in,out] HookData - The processor associated hook data.
  */
 _Use_decl_annotations_
 VOID
 DisableHooks (
+    PVMCB GuestVmcb,
     PHOOK_DATA HookData
     )
 {
-    PPT_ENTRY_4KB entry;
-
     NT_ASSERT(HookData->NptState != NptDefault);
 
-    if (HookData->NptState == NptHookEnabledInvisible)
+    if ((HookData->NptState == NptHookEnabledVisible) ||
+        (HookData->NptState == NptHookEnabledSuspended))
     {
-        NT_ASSERT(HookData->ActiveHookEntry == nullptr);
-
         //
-        // Move 1 to 0. The processor is not executing on the page where hooks
-        // are installed. This means we are at the state 1. Just make all
-        // hooked pages executable.
+        // Move 2 (or 3) to 1 first. The processor is executing on the page where
+        // hooks are installed. This should actually not happen unless we
+        // install hooks on the page where CPUID with CPUID_SUBLEAF_DISABLE_HOOKS
+        // exists (ie, our driver).
         //
-        //  State                     : Page Type
-        //                            : Current : Hooked : Other
-        //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)
-        //  v
-        //  0)NptDefault              : RWX(O)  : RWX(O) : RWX(O)   << transitioning to here
-        //
-        for (const auto& registration : g_HookRegistrationEntries)
-        {
-            PERFORMANCE_MEASURE_THIS_SCOPE();
-            ChangePermissionOfPage(HookData->Pml4Table,
-                                   registration.HookEntry.PhyPageBase,
-                                   FALSE);
-        }
+        NT_ASSERT(FALSE);
+        TransitionNtpState2To1(GuestVmcb, HookData);
     }
-    else
-    {
-        NT_ASSERT(HookData->ActiveHookEntry != nullptr);
 
-        //
-        // Move 2 to 0. The processor is executing on the page where hooks are
-        // installed. This means we are at the state 2. This should actually not
-        // happen unless we install hooks on the page where CPUID with
-        // CPUID_SUBLEAF_DISABLE_HOOKS exists (ie, our driver).
-        //
-        NT_ASSERT(FALSE);
+    NT_ASSERT(HookData->ActiveHookEntry == nullptr);
+
+    //
+    // Move 1 to 0. The processor is not executing on the page where hooks
+    // are installed. This means we are at the state 1. Just make all hooked
+    // pages executable.
+    //
+    //  State                     : Page Type
+    //                            : Current : Hooked : Other
+    //  1)NptHookEnabledInvisible : RWX(O)  : RW-(O) : RWX(O)
+    //  v
+    //  0)NptDefault              : RWX(O)  : RWX(O) : RWX(O)   << transitioning to here
+    //
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
         PERFORMANCE_MEASURE_THIS_SCOPE();
+        ChangePermissionOfPage(HookData->Pml4Table,
+                               registration.HookEntry.PhyPageBase,
+                               FALSE,
+                               GetNptHash(HookData));
+    }
 
-        //
-        // Make all pages executable.
-        //
-        //  State                     : Page Type
-        //                            : Current : Hooked : Other
-        //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
-        //  v
-        //  *)Transitioning           : RWX(E)  : RWX(O) : RWX(O)    << transitioning to here
-        //  v
-        //  0)NptDefault              : RWX(O)  : RWX(O) : RWX(O)
-        //
-        ChangePermissionsOfAllPages(HookData->Pml4Table,
-                                    HookData->ActiveHookEntry->PhyPageBase,
-                                    FALSE,
-                                    HookData->MaxNptPdpEntriesUsed);
+    HookData->NptState = NptDefault;
+    CheckNptState(GuestVmcb, HookData);
+}
 
-        //
-        // Change the backing physical page of the current page to the original
-        // physical page.
-        //
-        //
-        //  State                     : Page Type
-        //                            : Current : Hooked : Other
-        //  2)NptHookEnabledVisible   : RWX(E)  : RW-(O) : RW-(O)
-        //  v
-        //  *)Transitioning           : RWX(E)  : RWX(O) : RWX(O)
-        //  v
-        //  0)NptDefault              : RWX(O)  : RWX(O) : RWX(O)    << transitioning to here
-        //
-        entry = GetNestedPageTableEntry(HookData->Pml4Table,
-                                        HookData->ActiveHookEntry->PhyPageBase);
+/*!
+    @brief Reads the page through the active NPT, as the first guest access
+        to the page after the transition and the TLB flush would.
 
-        //
-        // The current page should be backed by the exec page,
-        //
-        NT_ASSERT(entry != nullptr);
-        NT_ASSERT(entry->Fields.PageFrameNumber == GetPfnFromPa(
-                        HookData->ActiveHookEntry->PhyPageBaseForExecution));
+    @details The walk of the NPT stands in for the walk the processor does on
+        the TLB miss, so that the cost of cache misses on the page tables the
+        transition switched to, such as those of views, is measured.
+
+    @param[in] HookData - The hook data.
+
+    @param[in] PhysicalAddress - The physical address to access.
+ */
+static
+VOID
+AccessPageThroughActiveNpt (
+    _In_ const HOOK_DATA* HookData,
+    _In_ ULONG64 PhysicalAddress
+    )
+{
+    const PT_ENTRY_4KB* nptEntry;
+
+    nptEntry = GetNestedPageTableEntry(GetActivePml4Table(HookData),
+                                       PhysicalAddress);
+    NT_ASSERT(nptEntry != nullptr);
+    (VOID)*static_cast<volatile UCHAR*>(
+                        GetVaFromPfn(nptEntry->Fields.PageFrameNumber));
+}
+
+/*!
+    @brief Measures the cycles spent for the transitions between the state 1
+        and 2.
+
+    @details This function transitions the NPT state 0 to 1, transitions to
+        the state 2 for each hook and back to 1 for the specified times, and
+        then transitions to the state 0. Each transition is made as on the NPT
+        fault, including the lookup of the hook, and followed by an access to
+        the faulting page through the active NPT. The page of the VMCB, which
+        never has hooks, stands in for the page execution leaves to. Only the
+        transitions between the state 1 and 2 and the accesses are measured.
+        This is used on the kernel-mode before virtualization with the hook
+        data and the VMCB not used by any processor, and the hook data must
+        not move to the state 3.
+
+    @param[in,out] GuestVmcb - The VMCB to be updated by the transitions.
+
+    @param[in,out] HookData - The hook data to transition.
+
+    @param[in] Iterations - The number of times to transition for each hook.
+
+    @return The number of cycles spent for the transitions.
+ */
+_Use_decl_annotations_
+ULONG64
+MeasureNptTransitions (
+    PVMCB GuestVmcb,
+    PHOOK_DATA HookData,
+    ULONG Iterations
+    )
+{
+    ULONG64 startCycles;
+    ULONG64 cycles;
+    ULONG64 unhookedPa;
+
+    NT_ASSERT(HookData->SuspendOnCall == FALSE);
+
+    unhookedPa = GetPaFromVa(GuestVmcb);
+    EnableHooks(HookData);
 
-        entry->Fields.PageFrameNumber = GetPfnFromPa(
-                                        HookData->ActiveHookEntry->PhyPageBase);
-        HookData->ActiveHookEntry = nullptr;
+    startCycles = __rdtsc();
+    for (ULONG i = 0; i < Iterations; ++i)
+    {
+        for (const auto& registration : GetHookRegistrationEntries())
+        {
+            TransitionNptState(GuestVmcb,
+                               HookData,
+                               registration.HookEntry.PhyPageBase);
+            AccessPageThroughActiveNpt(HookData,
+                                       registration.HookEntry.PhyPageBase);
+            TransitionNptState(GuestVmcb, HookData, unhookedPa);
+            AccessPageThroughActiveNpt(HookData, unhookedPa);
+        }
     }
+    cycles = __rdtsc() - startCycles;
 
-    HookData->NptState = NptDefault;
+    DisableHooks(GuestVmcb, HookData);
+    return cycles;
+}
+
+/*!
+    @brief Verifies the NPT entries of all hooked pages.
+
+    @details Each hooked page must be backed by the exec page and executable
+        when it is the active hook page, or the page linked to it, in the state
+        2. Otherwise, including in the state 3, it must be backed by the
+        original page, and be non-executable unless hooks are disabled. As
+        this runs on #VMEXIT, the NPT state cannot change while the entries
+        are examined. The entries are looked up from the NPT NCr3 points to.
+
+    @param[in] HookData - The processor associated hook data.
+
+    @return The number of NPT entries that do not hold the expected values.
+ */
+_Use_decl_annotations_
+ULONG
+VerifyNestedPageTableEntries (
+    const HOOK_DATA* HookData
+    )
+{
+    ULONG mismatchCount;
+    PPT_ENTRY_4KB nptEntry;
+    BOOLEAN visible;
+    ULONG64 expectedPa;
+    BOOLEAN expectedNoExecute;
+
+    mismatchCount = 0;
+    for (const auto& registration : GetHookRegistrationEntries())
+    {
+        const HOOK_ENTRY* hookEntry = &registration.HookEntry;
+
+        nptEntry = GetNestedPageTableEntry(GetActivePml4Table(HookData),
+                                           hookEntry->PhyPageBase);
+        if (nptEntry == nullptr)
+        {
+            mismatchCount++;
+            continue;
+        }
+
+        visible = ((HookData->NptState == NptHookEnabledVisible) &&
+                   ((hookEntry->PhyPageBase ==
+                        HookData->ActiveHookEntry->PhyPageBase) ||
+                    (hookEntry->PhyPageBase ==
+                        HookData->ActiveHookEntry->PhyLinkedPageBase)));
+        expectedPa = (visible != FALSE) ?
+                        GetPhyPageBaseForExecution(hookEntry, HookData) :
+                        hookEntry->PhyPageBase;
+        expectedNoExecute = ((HookData->NptState != NptDefault) &&
+                             (visible == FALSE));
+
+        if ((nptEntry->Fields.PageFrameNumber != GetPfnFromPa(expectedPa)) ||
+            (static_cast<BOOLEAN>(nptEntry->Fields.NoExecute) !=
+                expectedNoExecute))
+        {
+            mismatchCount++;
+        }
+    }
+    return mismatchCount;
 }
 
 /*!
@@ -563,27 +2093,35 @@ InjectBreakPointException (
     @param[in,out] GuestVmcb - The processor associated VMCB.
 
     @param[in,out] HookData - The processor associated hook data.
+
+    @param[in] ExitTsc - The TSC at the start of HandleVmExit.
  */
 _Use_decl_annotations_
 VOID
 HandleBreakPointException (
     PVMCB GuestVmcb,
-    PHOOK_DATA HookData
+    PHOOK_DATA HookData,
+    ULONG64 ExitTsc
     )
 {
     const HOOK_ENTRY* entry;
 
-    UNREFERENCED_PARAMETER(HookData);
-
     entry = FindHookEntryByAddress(reinterpret_cast<PVOID>(
                                                 GuestVmcb->StateSaveArea.Rip));
     if (entry != nullptr)
     {
         //
         // Transfer to the hook handler if the guest RIP is at where our hook
-        // is installed on.
+        // is installed on, and charge the hook for the #VMEXIT.
         //
         GuestVmcb->StateSaveArea.Rip = reinterpret_cast<ULONG64>(entry->Handler);
+        ChargeHookOverhead(HookData->OverheadTable,
+                           CONTAINING_RECORD(entry,
+                                             HOOK_REGISTRATION_ENTRY,
+                                             HookEntry),
+                           GuestVmcb->StateSaveArea.Cr3,
+                           HookOverheadBreakPoint,
+                           __rdtsc() - ExitTsc + HookData->VmExitRoundTripCycles);
     }
     else
     {
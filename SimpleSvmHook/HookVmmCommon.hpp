@@ -14,13 +14,15 @@
 VOID
 HandleNestedPageFault (
     _Inout_ PVMCB GuestVmcb,
-    _Inout_ PHOOK_DATA HookData
+    _Inout_ PHOOK_DATA HookData,
+    _In_ ULONG64 ExitTsc
     );
 
 VOID
 HandleBreakPointException (
     _Inout_ PVMCB GuestVmcb,
-    _Inout_ PHOOK_DATA HookData
+    _Inout_ PHOOK_DATA HookData,
+    _In_ ULONG64 ExitTsc
     );
 
 VOID
@@ -30,5 +32,26 @@ EnableHooks (
 
 VOID
 DisableHooks (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData
+    );
+
+_Check_return_
+ULONG64
+MeasureNptTransitions (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PHOOK_DATA HookData,
+    _In_ ULONG Iterations
+    );
+
+_Check_return_
+ULONG
+VerifyNestedPageTableEntries (
+    _In_ const HOOK_DATA* HookData
+    );
+
+_Check_return_
+ULONG
+TakeNptStateMismatches (
     _Inout_ PHOOK_DATA HookData
     );
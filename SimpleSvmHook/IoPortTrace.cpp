@@ -0,0 +1,891 @@
+/*!
+    @file IoPortTrace.cpp
+
+    @brief Kernel code to select I/O ports to intercept at runtime, and VMM
+        code to execute and record access to them.
+
+    @details Up to four ranges of I/O ports are selected with the
+        IoTrace*N*BasePort and IoTrace*N*PortCount values under the service
+        key. The values are read on start and whenever the key is changed
+        afterwards, so that ports can be selected without reloading the
+        driver. The bits of the selected ports are set in the shared I/O
+        permissions map (IOPM), and IOIO interception is enabled on all
+        processors only while any port is selected.
+
+        On #VMEXIT due to IOIO, the VMM executes the access natively on
+        behalf of the guest, counts it and the TSC ticks it took for the port,
+        and resumes the guest at the next instruction. INS and OUTS are
+        executed the same way when the buffer is a valid kernel address.
+        Otherwise, the bits of the port are cleared so that the guest
+        executes the instruction by itself, and the port is not traced until
+        the ranges are applied again.
+
+        When the ranges are changed, interception is disabled on all
+        processors first. After that, no processor refers to the IOPM and the
+        statistics, and those are updated without a lock. The statistics of
+        the previous ranges are logged at that time and on stop.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "IoPortTrace.hpp"
+#include "Common.hpp"
+#include "Configuration.hpp"
+#include "Virtualization.hpp"
+
+//
+// The maximum number of port ranges and the maximum total number of ports.
+//
+static constexpr ULONG k_MaxIoPortTraceRanges = 4;
+static constexpr ULONG k_MaxIoPortTracePorts = 1024;
+
+//
+// RFLAGS.DF and the encoding of FS in IOIO_EXITINFO1::Segment.
+//
+static constexpr ULONG64 k_RflagsDf = (1ull << 10);
+static constexpr ULONG k_SegmentFs = 4;
+
+//
+// The names of the values of each port range.
+//
+typedef struct _IO_PORT_TRACE_VALUE_NAMES
+{
+    PCWSTR BasePort;
+    PCWSTR PortCount;
+} IO_PORT_TRACE_VALUE_NAMES, *PIO_PORT_TRACE_VALUE_NAMES;
+
+static const IO_PORT_TRACE_VALUE_NAMES k_IoPortTraceValueNames[k_MaxIoPortTraceRanges] =
+{
+    { L"IoTrace0BasePort", L"IoTrace0PortCount", },
+    { L"IoTrace1BasePort", L"IoTrace1PortCount", },
+    { L"IoTrace2BasePort", L"IoTrace2PortCount", },
+    { L"IoTrace3BasePort", L"IoTrace3PortCount", },
+};
+
+typedef struct _IO_PORT_TRACE_RANGE
+{
+    ULONG BasePort;
+    ULONG PortCount;
+
+    //
+    // The index of the statistics of BasePort in IO_PORT_TRACE_BUFFER::Ports.
+    //
+    ULONG StatisticsIndex;
+} IO_PORT_TRACE_RANGE, *PIO_PORT_TRACE_RANGE;
+
+typedef struct _IO_PORT_STATISTICS
+{
+    UINT64 InCount;
+    UINT64 OutCount;
+    UINT64 ElapsedTsc;
+} IO_PORT_STATISTICS, *PIO_PORT_STATISTICS;
+
+//
+// The access traced on a processor. UnmatchedCount is the number of
+// intercepted access starting at an unselected port, which happens when a
+// multi-byte access overlaps a selected port.
+//
+typedef struct _IO_PORT_TRACE_BUFFER
+{
+    UINT64 UnmatchedCount;
+    UINT64 DroppedCount;
+    IO_PORT_STATISTICS Ports[k_MaxIoPortTracePorts];
+} IO_PORT_TRACE_BUFFER, *PIO_PORT_TRACE_BUFFER;
+
+typedef struct _IO_PORT_TRACE
+{
+    HANDLE ThreadHandle;
+    KEVENT StopEvent;
+    HANDLE KeyHandle;
+    HANDLE NotifyEventHandle;
+    PKEVENT NotifyEvent;
+
+    PVOID PermissionsMap;
+    ULONG64 PermissionsMapPa;
+
+    //
+    // TRUE while IOIO interception is enabled.
+    //
+    volatile BOOLEAN Enabled;
+
+    ULONG RangeCount;
+    IO_PORT_TRACE_RANGE Ranges[k_MaxIoPortTraceRanges];
+
+    //
+    // The buffers indexed by the processor index.
+    //
+    ULONG ProcessorCount;
+    PIO_PORT_TRACE_BUFFER* Buffers;
+} IO_PORT_TRACE, *PIO_PORT_TRACE;
+
+static IO_PORT_TRACE g_IoPortTrace;
+
+static KSTART_ROUTINE IoPortTraceThreadRoutine;
+
+/*!
+    @brief Asks the VMM to update IOIO interception of the current processor.
+
+    @param[in] Context - Unused.
+
+    @return Always STATUS_SUCCESS.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+UpdateIoInterceptionOnProcessor (
+    _In_opt_ PVOID Context
+    )
+{
+    int registers[4];
+
+    UNREFERENCED_PARAMETER(Context);
+
+    PAGED_CODE();
+
+    __cpuidex(registers, CPUID_LEAF_SIMPLE_SVM_CALL, CPUID_SUBLEAF_UPDATE_IO_INTERCEPTS);
+    return STATUS_SUCCESS;
+}
+
+/*!
+    @brief Updates IOIO interception of all processors according to
+        IO_PORT_TRACE::Enabled.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+UpdateIoInterception (
+    VOID
+    )
+{
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    status = ExecuteOnEachProcessor(UpdateIoInterceptionOnProcessor, nullptr, nullptr);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ExecuteOnEachProcessor failed : %08x", status);
+    }
+}
+
+/*!
+    @brief Logs the statistics of the current ranges summed over processors.
+
+    @param[in] Trace - The state of the trace.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+ReportIoPortStatistics (
+    _In_ const IO_PORT_TRACE* Trace
+    )
+{
+    UINT64 unmatchedCount, droppedCount;
+
+    PAGED_CODE();
+
+    for (ULONG i = 0; i < Trace->RangeCount; ++i)
+    {
+        const IO_PORT_TRACE_RANGE* range;
+
+        range = &Trace->Ranges[i];
+        for (ULONG j = 0; j < range->PortCount; ++j)
+        {
+            IO_PORT_STATISTICS total;
+
+            RtlZeroMemory(&total, sizeof(total));
+            for (ULONG k = 0; k < Trace->ProcessorCount; ++k)
+            {
+                const IO_PORT_STATISTICS* statistics;
+
+                statistics = &Trace->Buffers[k]->Ports[range->StatisticsIndex + j];
+                total.InCount += statistics->InCount;
+                total.OutCount += statistics->OutCount;
+                total.ElapsedTsc += statistics->ElapsedTsc;
+            }
+            if ((total.InCount + total.OutCount) == 0)
+            {
+                continue;
+            }
+            LOGGING_LOG_INFO("Port %04lx: %llu in, %llu out, %llu cycles on average",
+                             range->BasePort + j,
+                             total.InCount,
+                             total.OutCount,
+                             total.ElapsedTsc / (total.InCount + total.OutCount));
+        }
+    }
+
+    unmatchedCount = droppedCount = 0;
+    for (ULONG i = 0; i < Trace->ProcessorCount; ++i)
+    {
+        unmatchedCount += Trace->Buffers[i]->UnmatchedCount;
+        droppedCount += Trace->Buffers[i]->DroppedCount;
+    }
+    if ((unmatchedCount + droppedCount) != 0)
+    {
+        LOGGING_LOG_INFO("I/O access : %llu unmatched, %llu dropped",
+                         unmatchedCount,
+                         droppedCount);
+    }
+}
+
+/*!
+    @brief Reads the port ranges from the service key and applies them.
+
+    @param[in,out] Trace - The state of the trace.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+ApplyIoPortTraceRanges (
+    _Inout_ PIO_PORT_TRACE Trace
+    )
+{
+    IO_PORT_TRACE_RANGE ranges[k_MaxIoPortTraceRanges];
+    ULONG rangeCount;
+    ULONG portCount;
+    RTL_BITMAP bitmapHeader;
+
+    PAGED_CODE();
+
+    rangeCount = 0;
+    portCount = 0;
+    for (const auto& names : k_IoPortTraceValueNames)
+    {
+        ULONG basePort, count;
+
+        if (!NT_SUCCESS(ReadConfigurationValue(Trace->KeyHandle,
+                                               names.BasePort,
+                                               &basePort)) ||
+            !NT_SUCCESS(ReadConfigurationValue(Trace->KeyHandle,
+                                               names.PortCount,
+                                               &count)) ||
+            (count == 0))
+        {
+            continue;
+        }
+
+        if ((basePort > MAXUINT16) ||
+            (count > (MAXUINT16 + 1) - basePort) ||
+            (count > k_MaxIoPortTracePorts - portCount))
+        {
+            LOGGING_LOG_WARN("Ignoring the invalid %ws and %ws values : %lu, %lu",
+                             names.BasePort,
+                             names.PortCount,
+                             basePort,
+                             count);
+            continue;
+        }
+
+        ranges[rangeCount].BasePort = basePort;
+        ranges[rangeCount].PortCount = count;
+        ranges[rangeCount].StatisticsIndex = portCount;
+        rangeCount++;
+        portCount += count;
+    }
+
+    //
+    // Disable interception on all processors, so that no processor refers to
+    // the map and statistics being updated.
+    //
+    if (Trace->Enabled != FALSE)
+    {
+        Trace->Enabled = FALSE;
+        UpdateIoInterception();
+    }
+    ReportIoPortStatistics(Trace);
+
+    RtlInitializeBitMap(&bitmapHeader,
+                        static_cast<PULONG>(Trace->PermissionsMap),
+                        SVM_IO_PERMISSIONS_MAP_SIZE * CHAR_BIT);
+    RtlClearAllBits(&bitmapHeader);
+    for (ULONG i = 0; i < rangeCount; ++i)
+    {
+        RtlSetBits(&bitmapHeader, ranges[i].BasePort, ranges[i].PortCount);
+    }
+    for (ULONG i = 0; i < Trace->ProcessorCount; ++i)
+    {
+        RtlZeroMemory(Trace->Buffers[i], sizeof(IO_PORT_TRACE_BUFFER));
+    }
+    RtlCopyMemory(Trace->Ranges, ranges, sizeof(ranges[0]) * rangeCount);
+    Trace->RangeCount = rangeCount;
+
+    LOGGING_LOG_INFO("Intercepting %lu I/O ports in %lu ranges", portCount, rangeCount);
+
+    //
+    // Interception stays disabled if nothing is selected.
+    //
+    if (rangeCount != 0)
+    {
+        Trace->Enabled = TRUE;
+        UpdateIoInterception();
+    }
+}
+
+/*!
+    @brief The entry point of the thread applying the port ranges when the
+        service key is changed.
+
+    @param[in] StartContext - The state of the trace.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_Use_decl_annotations_
+VOID
+IoPortTraceThreadRoutine (
+    PVOID StartContext
+    )
+{
+    NTSTATUS status;
+    PIO_PORT_TRACE trace;
+    IO_STATUS_BLOCK ioStatusBlock;
+    PVOID waitObjects[2];
+
+    PAGED_CODE();
+
+    trace = static_cast<PIO_PORT_TRACE>(StartContext);
+    waitObjects[0] = &trace->StopEvent;
+    waitObjects[1] = trace->NotifyEvent;
+
+    for (;;)
+    {
+        //
+        // Request the notification before reading the values, so that a
+        // change while reading them is not missed.
+        //
+        status = ZwNotifyChangeKey(trace->KeyHandle,
+                                   trace->NotifyEventHandle,
+                                   nullptr,
+                                   nullptr,
+                                   &ioStatusBlock,
+                                   REG_NOTIFY_CHANGE_LAST_SET,
+                                   FALSE,
+                                   nullptr,
+                                   0,
+                                   TRUE);
+        if (!NT_SUCCESS(status))
+        {
+            LOGGING_LOG_ERROR("ZwNotifyChangeKey failed : %08x", status);
+            break;
+        }
+
+        ApplyIoPortTraceRanges(trace);
+
+        status = KeWaitForMultipleObjects(RTL_NUMBER_OF(waitObjects),
+                                          waitObjects,
+                                          WaitAny,
+                                          Executive,
+                                          KernelMode,
+                                          FALSE,
+                                          nullptr,
+                                          nullptr);
+        if (status != STATUS_WAIT_1)
+        {
+            break;
+        }
+    }
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/*!
+    @brief Frees resources of the trace.
+
+    @param[in,out] Trace - The state of the trace.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+FreeIoPortTrace (
+    _Inout_ PIO_PORT_TRACE Trace
+    )
+{
+    PAGED_CODE();
+
+    NT_ASSERT(Trace->Enabled == FALSE);
+
+    if (Trace->NotifyEvent != nullptr)
+    {
+        ObDereferenceObject(Trace->NotifyEvent);
+    }
+    if (Trace->NotifyEventHandle != nullptr)
+    {
+        NT_VERIFY(NT_SUCCESS(ZwClose(Trace->NotifyEventHandle)));
+    }
+    if (Trace->KeyHandle != nullptr)
+    {
+        NT_VERIFY(NT_SUCCESS(ZwClose(Trace->KeyHandle)));
+    }
+    if (Trace->Buffers != nullptr)
+    {
+        for (ULONG i = 0; i < Trace->ProcessorCount; ++i)
+        {
+            if (Trace->Buffers[i] != nullptr)
+            {
+                ExFreePoolWithTag(Trace->Buffers[i], k_PoolTag);
+            }
+        }
+        ExFreePoolWithTag(Trace->Buffers, k_PoolTag);
+    }
+    if (Trace->PermissionsMap != nullptr)
+    {
+        FreeContiguousMemory(Trace->PermissionsMap);
+    }
+    RtlZeroMemory(Trace, sizeof(*Trace));
+}
+
+/*!
+    @brief Starts the thread applying the port ranges.
+
+    @details This function must be called after all processors are
+        virtualized. The ranges are applied by the thread shortly after.
+
+    @param[in] RegistryPath - The path to the service key.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+StartIoPortTrace (
+    PCUNICODE_STRING RegistryPath
+    )
+{
+    NTSTATUS status;
+    OBJECT_ATTRIBUTES objectAttributes;
+    SIZE_T buffersSize;
+
+    PAGED_CODE();
+
+    NT_ASSERT(g_IoPortTrace.ThreadHandle == nullptr);
+
+    RtlZeroMemory(&g_IoPortTrace, sizeof(g_IoPortTrace));
+    KeInitializeEvent(&g_IoPortTrace.StopEvent, NotificationEvent, FALSE);
+
+    g_IoPortTrace.PermissionsMap = AllocateContiguousMemory(SVM_IO_PERMISSIONS_MAP_SIZE);
+    if (g_IoPortTrace.PermissionsMap == nullptr)
+    {
+        LOGGING_LOG_ERROR("AllocateContiguousMemory failed");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    g_IoPortTrace.PermissionsMapPa =
+        MmGetPhysicalAddress(g_IoPortTrace.PermissionsMap).QuadPart;
+
+    g_IoPortTrace.ProcessorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    buffersSize = sizeof(PIO_PORT_TRACE_BUFFER) * g_IoPortTrace.ProcessorCount;
+    g_IoPortTrace.Buffers = static_cast<PIO_PORT_TRACE_BUFFER*>(ExAllocatePoolWithTag(
+                                                                    NonPagedPool,
+                                                                    buffersSize,
+                                                                    k_PoolTag));
+    if (g_IoPortTrace.Buffers == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu", buffersSize);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(g_IoPortTrace.Buffers, buffersSize);
+
+    for (ULONG i = 0; i < g_IoPortTrace.ProcessorCount; ++i)
+    {
+        g_IoPortTrace.Buffers[i] = static_cast<PIO_PORT_TRACE_BUFFER>(ExAllocatePoolWithTag(
+                                                            NonPagedPool,
+                                                            sizeof(IO_PORT_TRACE_BUFFER),
+                                                            k_PoolTag));
+        if (g_IoPortTrace.Buffers[i] == nullptr)
+        {
+            LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu",
+                              sizeof(IO_PORT_TRACE_BUFFER));
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        RtlZeroMemory(g_IoPortTrace.Buffers[i], sizeof(IO_PORT_TRACE_BUFFER));
+    }
+
+    InitializeObjectAttributes(&objectAttributes,
+                               const_cast<PUNICODE_STRING>(RegistryPath),
+                               OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                               nullptr,
+                               nullptr);
+    status = ZwOpenKey(&g_IoPortTrace.KeyHandle,
+                       KEY_QUERY_VALUE | KEY_NOTIFY,
+                       &objectAttributes);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ZwOpenKey failed : %08x", status);
+        g_IoPortTrace.KeyHandle = nullptr;
+        goto Exit;
+    }
+
+    InitializeObjectAttributes(&objectAttributes,
+                               nullptr,
+                               OBJ_KERNEL_HANDLE,
+                               nullptr,
+                               nullptr);
+    status = ZwCreateEvent(&g_IoPortTrace.NotifyEventHandle,
+                           EVENT_ALL_ACCESS,
+                           &objectAttributes,
+                           SynchronizationEvent,
+                           FALSE);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ZwCreateEvent failed : %08x", status);
+        g_IoPortTrace.NotifyEventHandle = nullptr;
+        goto Exit;
+    }
+
+    status = ObReferenceObjectByHandle(g_IoPortTrace.NotifyEventHandle,
+                                       EVENT_ALL_ACCESS,
+                                       *ExEventObjectType,
+                                       KernelMode,
+                                       reinterpret_cast<PVOID*>(&g_IoPortTrace.NotifyEvent),
+                                       nullptr);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ObReferenceObjectByHandle failed : %08x", status);
+        g_IoPortTrace.NotifyEvent = nullptr;
+        goto Exit;
+    }
+
+    status = PsCreateSystemThread(&g_IoPortTrace.ThreadHandle,
+                                  THREAD_ALL_ACCESS,
+                                  nullptr,
+                                  nullptr,
+                                  nullptr,
+                                  IoPortTraceThreadRoutine,
+                                  &g_IoPortTrace);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("PsCreateSystemThread failed : %08x", status);
+        g_IoPortTrace.ThreadHandle = nullptr;
+        goto Exit;
+    }
+
+Exit:
+    if (!NT_SUCCESS(status))
+    {
+        FreeIoPortTrace(&g_IoPortTrace);
+    }
+    return status;
+}
+
+/*!
+    @brief Stops the thread, disables interception, and reports the
+        statistics.
+
+    @details This function must be called before processors are
+        de-virtualized.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+StopIoPortTrace (
+    VOID
+    )
+{
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    if (g_IoPortTrace.ThreadHandle == nullptr)
+    {
+        goto Exit;
+    }
+
+    (VOID)KeSetEvent(&g_IoPortTrace.StopEvent, IO_NO_INCREMENT, FALSE);
+    status = ZwWaitForSingleObject(g_IoPortTrace.ThreadHandle, FALSE, nullptr);
+    NT_ASSERT(NT_SUCCESS(status));
+    NT_VERIFY(NT_SUCCESS(ZwClose(g_IoPortTrace.ThreadHandle)));
+    g_IoPortTrace.ThreadHandle = nullptr;
+
+    if (g_IoPortTrace.Enabled != FALSE)
+    {
+        g_IoPortTrace.Enabled = FALSE;
+        UpdateIoInterception();
+    }
+    ReportIoPortStatistics(&g_IoPortTrace);
+    FreeIoPortTrace(&g_IoPortTrace);
+
+Exit:
+    return;
+}
+
+/*!
+    @brief Enables or disables IOIO interception according to the selected
+        ports.
+
+    @details This function is called when the processor is virtualized and on
+        request from UpdateIoInterception.
+
+    @param[in,out] GuestVmcb - The guest VMCB.
+ */
+_Use_decl_annotations_
+VOID
+ConfigureIoInterception (
+    PVMCB GuestVmcb
+    )
+{
+    if (g_IoPortTrace.Enabled != FALSE)
+    {
+        GuestVmcb->ControlArea.IopmBasePa = g_IoPortTrace.PermissionsMapPa;
+        SetFlag(GuestVmcb->ControlArea.InterceptMisc1, SVM_INTERCEPT_MISC1_IOIO_PROT);
+    }
+    else
+    {
+        ClearFlag(GuestVmcb->ControlArea.InterceptMisc1, SVM_INTERCEPT_MISC1_IOIO_PROT);
+    }
+}
+
+/*!
+    @brief Executes INS or OUTS on behalf of the guest.
+
+    @details Iterations are executed until the count reaches zero or the
+        next element is not a valid kernel address. Registers are updated
+        for the executed iterations.
+
+    @param[in] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] GuestRegisters - The guest general purpose registers.
+
+    @param[in] ExitInfo - The information of the access.
+
+    @param[in] Size - The size of each element in bytes.
+
+    @param[out] Completed - The address to receive TRUE if all iterations were
+        executed.
+
+    @return The number of iterations executed.
+ */
+static
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+UINT64
+ExecuteStringIo (
+    _In_ const VMCB* GuestVmcb,
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _In_ IOIO_EXITINFO1 ExitInfo,
+    _In_ ULONG Size,
+    _Out_ PBOOLEAN Completed
+    )
+{
+    UINT64 executed;
+    UINT64 count;
+    PUINT64 address;
+    USHORT port;
+
+    executed = 0;
+    *Completed = FALSE;
+    port = static_cast<USHORT>(ExitInfo.Fields.Port);
+    count = (ExitInfo.Fields.Repeat != FALSE) ? GuestRegisters->Rcx : 1;
+    address = (ExitInfo.Fields.Input != FALSE) ? &GuestRegisters->Rdi :
+                                                 &GuestRegisters->Rsi;
+
+    //
+    // Only 64-bit addressing by the kernel without a FS or GS override is
+    // supported, where the segment base is zero.
+    //
+    if ((ExitInfo.Fields.Address64 == FALSE) ||
+        (ExitInfo.Fields.Segment >= k_SegmentFs) ||
+        (GuestVmcb->StateSaveArea.Cpl != 0))
+    {
+        goto Exit;
+    }
+
+    for (/**/; count != 0; --count, ++executed)
+    {
+        PVOID element;
+
+        element = reinterpret_cast<PVOID>(*address);
+        if ((element < MmSystemRangeStart) ||
+            (MmIsAddressValid(element) == FALSE) ||
+            (MmIsAddressValid(Add2Ptr(element, Size - 1)) == FALSE))
+        {
+            break;
+        }
+
+        if (ExitInfo.Fields.Input != FALSE)
+        {
+            switch (Size)
+            {
+            case 1: *static_cast<volatile UINT8*>(element) = __inbyte(port); break;
+            case 2: *static_cast<volatile UINT16*>(element) = __inword(port); break;
+            default: *static_cast<volatile UINT32*>(element) = __indword(port); break;
+            }
+        }
+        else
+        {
+            switch (Size)
+            {
+            case 1: __outbyte(port, *static_cast<volatile UINT8*>(element)); break;
+            case 2: __outword(port, *static_cast<volatile UINT16*>(element)); break;
+            default: __outdword(port, *static_cast<volatile UINT32*>(element)); break;
+            }
+        }
+
+        if (BooleanFlagOn(GuestVmcb->StateSaveArea.Rflags, k_RflagsDf))
+        {
+            *address -= Size;
+        }
+        else
+        {
+            *address += Size;
+        }
+        if (ExitInfo.Fields.Repeat != FALSE)
+        {
+            GuestRegisters->Rcx--;
+        }
+    }
+    *Completed = (count == 0);
+
+Exit:
+    return executed;
+}
+
+/*!
+    @brief Handles #VMEXIT due to IOIO.
+
+    @details This function executes the access, records it for the port, and
+        advances the guest RIP.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] GuestRegisters - The guest general purpose registers.
+ */
+_Use_decl_annotations_
+VOID
+HandleIoPortAccess (
+    PVMCB GuestVmcb,
+    PGUEST_REGISTERS GuestRegisters
+    )
+{
+    IOIO_EXITINFO1 exitInfo;
+    USHORT port;
+    ULONG size;
+    UINT64 startTsc, elapsedTsc;
+    UINT64 count;
+    BOOLEAN completed;
+    ULONG processorIndex;
+    PIO_PORT_TRACE_BUFFER buffer;
+    PIO_PORT_STATISTICS statistics;
+
+    exitInfo.AsUInt64 = GuestVmcb->ControlArea.ExitInfo1;
+    port = static_cast<USHORT>(exitInfo.Fields.Port);
+    size = (exitInfo.Fields.Size8 != FALSE) ? 1 :
+           (exitInfo.Fields.Size16 != FALSE) ? 2 : 4;
+
+    buffer = nullptr;
+    processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+    if (processorIndex < g_IoPortTrace.ProcessorCount)
+    {
+        buffer = g_IoPortTrace.Buffers[processorIndex];
+    }
+
+    startTsc = __rdtsc();
+    if (exitInfo.Fields.String == FALSE)
+    {
+        if (exitInfo.Fields.Input != FALSE)
+        {
+            switch (size)
+            {
+            case 1:
+                GuestRegisters->Rax = (GuestRegisters->Rax & ~0xffull) | __inbyte(port);
+                break;
+            case 2:
+                GuestRegisters->Rax = (GuestRegisters->Rax & ~0xffffull) | __inword(port);
+                break;
+            default:
+                GuestRegisters->Rax = __indword(port);
+                break;
+            }
+        }
+        else
+        {
+            switch (size)
+            {
+            case 1: __outbyte(port, static_cast<UINT8>(GuestRegisters->Rax)); break;
+            case 2: __outword(port, static_cast<UINT16>(GuestRegisters->Rax)); break;
+            default: __outdword(port, static_cast<UINT32>(GuestRegisters->Rax)); break;
+            }
+        }
+        count = 1;
+        completed = TRUE;
+    }
+    else
+    {
+        count = ExecuteStringIo(GuestVmcb, GuestRegisters, exitInfo, size, &completed);
+    }
+    elapsedTsc = __rdtsc() - startTsc;
+
+    //
+    // Stop intercepting the port if the instruction cannot be executed at
+    // all, and let the guest execute it. The bits are cleared atomically as
+    // other processors may clear other bits concurrently.
+    //
+    if ((count == 0) && (completed == FALSE))
+    {
+        for (ULONG i = 0; i < size; ++i)
+        {
+            ULONG bit;
+
+            bit = port + i;
+            InterlockedAnd8(static_cast<volatile CHAR*>(Add2Ptr(g_IoPortTrace.PermissionsMap,
+                                                                bit / CHAR_BIT)),
+                            static_cast<CHAR>(~(1 << (bit % CHAR_BIT))));
+        }
+        if (buffer != nullptr)
+        {
+            buffer->DroppedCount++;
+        }
+        goto Exit;
+    }
+
+    //
+    // Advance RIP unless iterations remain to be executed by the guest.
+    //
+    if (completed != FALSE)
+    {
+        GuestVmcb->StateSaveArea.Rip = GuestVmcb->ControlArea.ExitInfo2;
+    }
+
+    if (buffer == nullptr)
+    {
+        goto Exit;
+    }
+
+    statistics = nullptr;
+    for (ULONG i = 0; i < g_IoPortTrace.RangeCount; ++i)
+    {
+        const IO_PORT_TRACE_RANGE* range;
+
+        range = &g_IoPortTrace.Ranges[i];
+        if ((port >= range->BasePort) && ((port - range->BasePort) < range->PortCount))
+        {
+            statistics = &buffer->Ports[range->StatisticsIndex + (port - range->BasePort)];
+            break;
+        }
+    }
+    if (statistics == nullptr)
+    {
+        buffer->UnmatchedCount++;
+        goto Exit;
+    }
+
+    if (exitInfo.Fields.Input != FALSE)
+    {
+        statistics->InCount += count;
+    }
+    else
+    {
+        statistics->OutCount += count;
+    }
+    statistics->ElapsedTsc += elapsedTsc;
+
+Exit:
+    return;
+}
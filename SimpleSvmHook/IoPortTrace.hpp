@@ -0,0 +1,42 @@
+/*!
+    @file IoPortTrace.hpp
+
+    @brief Kernel code to select I/O ports to intercept at runtime, and VMM
+        code to execute and record access to them.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "Svm.hpp"
+#include "VmmMain.hpp"
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+StartIoPortTrace (
+    _In_ PCUNICODE_STRING RegistryPath
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+StopIoPortTrace (
+    VOID
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+ConfigureIoInterception (
+    _Inout_ PVMCB GuestVmcb
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+HandleIoPortAccess (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PGUEST_REGISTERS GuestRegisters
+    );
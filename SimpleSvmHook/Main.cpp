@@ -11,6 +11,12 @@
 #include "Virtualization.hpp"
 #include "PowerCallback.hpp"
 #include "HookKernelCommon.hpp"
+#include "MsrTable.hpp"
+#include "SyscallTrace.hpp"
+#include "MmioTrace.hpp"
+#include "IoPortTrace.hpp"
+#include "Configuration.hpp"
+#include "HookKernelIntegrity.hpp"
 
 SIMPLESVMHOOK_INIT EXTERN_C DRIVER_INITIALIZE DriverEntry;
 static DRIVER_UNLOAD DriverUnload;
@@ -20,7 +26,7 @@ static DRIVER_UNLOAD DriverUnload;
 
     @param[in] DriverObject - A driver object.
 
-    @param[in] RegistryPath - Unused.
+    @param[in] RegistryPath - The path to the service key of the driver.
 
     @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
  */
@@ -35,15 +41,17 @@ DriverEntry (
 {
     NTSTATUS status;
     BOOLEAN needLogReinitialization;
-    BOOLEAN loggingInited, performanceInited, pcInited, hookInited;
-
-    UNREFERENCED_PARAMETER(RegistryPath);
+    BOOLEAN loggingInited, performanceInited, pcInited, msrTableInited;
+    BOOLEAN syscallTraceInited, mmioTraceInited, hookInited;
 
     SIMPLESVMHOOK_DEBUG_BREAK();
 
     loggingInited = FALSE;
     performanceInited = FALSE;
     pcInited = FALSE;
+    msrTableInited = FALSE;
+    syscallTraceInited = FALSE;
+    mmioTraceInited = FALSE;
     hookInited = FALSE;
 
     DriverObject->DriverUnload = DriverUnload;
@@ -81,6 +89,16 @@ DriverEntry (
     }
     performanceInited = TRUE;
 
+    //
+    // Read the driver configuration from the service key.
+    //
+    status = LoadConfiguration(RegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("LoadConfiguration failed : %08x", status);
+        goto Exit;
+    }
+
     //
     // Register the power callback.
     //
@@ -92,10 +110,43 @@ DriverEntry (
     }
     pcInited = TRUE;
 
+    //
+    // Probe MSRs the hypervisor cannot safely access on behalf of the guest.
+    //
+    status = InitializeMsrTable();
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("InitializeMsrTable failed : %08x", status);
+        goto Exit;
+    }
+    msrTableInited = TRUE;
+
+    //
+    // Build the stubs to trace syscall entries if configured.
+    //
+    status = InitializeSyscallTrace();
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("InitializeSyscallTrace failed : %08x", status);
+        goto Exit;
+    }
+    syscallTraceInited = TRUE;
+
+    //
+    // Map MMIO ranges to trace access to if configured.
+    //
+    status = InitializeMmioTrace();
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("InitializeMmioTrace failed : %08x", status);
+        goto Exit;
+    }
+    mmioTraceInited = TRUE;
+
     //
     // Initialize hook related general data structures.
     //
-    status = InitializeHook();
+    status = InitializeHook(RegistryPath);
     if (!NT_SUCCESS(status))
     {
         LOGGING_LOG_ERROR("InitializeHook failed : %08x", status);
@@ -115,6 +166,25 @@ DriverEntry (
 
     NT_ASSERT(AreAllHooksInvisible() != FALSE);
 
+    //
+    // Start verifying integrity of hooks in background. This is diagnostics
+    // and not required for hooks to work.
+    //
+    if (!NT_SUCCESS(StartHookIntegrityVerifier(
+                                    g_Configuration.IntegrityCheckInterval,
+                                    g_Configuration.IntegrityCheckBudget)))
+    {
+        LOGGING_LOG_WARN("Hook integrity is not verified in background");
+    }
+
+    //
+    // Start applying the I/O ports to intercept. This is diagnostics as well.
+    //
+    if (!NT_SUCCESS(StartIoPortTrace(RegistryPath)))
+    {
+        LOGGING_LOG_WARN("I/O ports are not intercepted");
+    }
+
     //
     // Register re-initialization for the log functions if needed.
     //
@@ -130,6 +200,18 @@ Exit:
         {
             CleanupHook();
         }
+        if (mmioTraceInited != FALSE)
+        {
+            CleanupMmioTrace();
+        }
+        if (syscallTraceInited != FALSE)
+        {
+            CleanupSyscallTrace();
+        }
+        if (msrTableInited != FALSE)
+        {
+            CleanupMsrTable();
+        }
         if (pcInited != FALSE)
         {
             CleanupPowerCallback();
@@ -172,8 +254,13 @@ DriverUnload (
     //
     // De-virtualize all processors on the system.
     //
+    StopHookIntegrityVerifier();
+    StopIoPortTrace();
     DevirtualizeAllProcessors();
     CleanupHook();
+    CleanupMmioTrace();
+    CleanupSyscallTrace();
+    CleanupMsrTable();
     CleanupPowerCallback();
     CleanupPerformance();
     CleanupLogging();
@@ -0,0 +1,1106 @@
+/*!
+    @file MemoryEmulator.cpp
+
+    @brief VMM code to emulate instructions accessing memory.
+
+    @details This emulator completes a guest access that caused #VMEXIT due to
+        NPF on a protected page without changing permissions of the page and
+        single-stepping the guest, which costs two more #VMEXITs. The
+        faulting instruction is applied against the page the caller chooses
+        as the backing of the access, and the guest RIP is advanced.
+
+        Only common forms of MOV, MOVZX, MOVSX(D), XCHG, CMPXCHG, STOS and
+        MOVS with a memory operand in 64-bit mode are supported. The
+        instruction bytes are taken from the VMCB when decode assists are
+        available, or read from the guest RIP if it is a kernel address
+        mapped in the host address space. For MOVS, the operand not on the
+        faulting page is also accessed through the host address space, and
+        only when it is a valid kernel address. Accesses straddling the page
+        boundary, instructions with 32-bit addressing in string forms, and
+        instructions executed with TF are not supported. The caller should
+        fall back to a permission change when this emulator returns FALSE.
+
+        The emulator does not inject exceptions. Since the faulting access
+        was already permitted by the guest page tables, the only exception it
+        could raise is #GP or #AC, which does not happen for kernel code
+        Windows executes.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "MemoryEmulator.hpp"
+#include "Common.hpp"
+#include "Disassembler.hpp"
+
+//
+// RFLAGS bits referenced or updated by emulated instructions.
+//
+static constexpr ULONG64 k_RflagsCf = (1ull << 0);
+static constexpr ULONG64 k_RflagsPf = (1ull << 2);
+static constexpr ULONG64 k_RflagsAf = (1ull << 4);
+static constexpr ULONG64 k_RflagsZf = (1ull << 6);
+static constexpr ULONG64 k_RflagsSf = (1ull << 7);
+static constexpr ULONG64 k_RflagsTf = (1ull << 8);
+static constexpr ULONG64 k_RflagsDf = (1ull << 10);
+static constexpr ULONG64 k_RflagsOf = (1ull << 11);
+
+//
+// The L (64-bit mode) bit of CS attributes in the VMCB format.
+//
+static constexpr UINT16 k_SegmentAttribLongMode = (1 << 9);
+
+//
+// The indexes of general purpose registers in the encoding order.
+//
+static constexpr ULONG k_RegisterRax = 0;
+static constexpr ULONG k_RegisterRcx = 1;
+static constexpr ULONG k_RegisterRsp = 4;
+static constexpr ULONG k_RegisterRsi = 6;
+static constexpr ULONG k_RegisterRdi = 7;
+
+//
+// The operations of the supported instructions.
+//
+typedef enum _EMULATED_OPERATION
+{
+    EmulatedOperationUnsupported,
+    EmulatedOperationStore,             // MOV m, r / MOV m, imm / MOV moffs, rAX
+    EmulatedOperationLoad,              // MOV r, m / MOV rAX, moffs
+    EmulatedOperationLoadZeroExtend,    // MOVZX r, m
+    EmulatedOperationLoadSignExtend,    // MOVSX r, m / MOVSXD r, m
+    EmulatedOperationExchange,          // XCHG m, r
+    EmulatedOperationCompareExchange,   // CMPXCHG m, r
+    EmulatedOperationStoreString,       // STOS
+    EmulatedOperationMoveString,        // MOVS
+} EMULATED_OPERATION;
+
+//
+// The decoded instruction and the guest state to emulate it.
+//
+typedef struct _EMULATION_CONTEXT
+{
+    PVMCB GuestVmcb;
+    PGUEST_REGISTERS GuestRegisters;
+
+    //
+    // The instruction bytes, and the number of valid bytes in them.
+    //
+    UCHAR Bytes[k_MaxInsturctionLength];
+    ULONG BytesFetched;
+    INSTRUCTION_INFO Instruction;
+
+    //
+    // The prefixes. SegmentBase is the base of FS or GS when overridden;
+    // otherwise, 0.
+    //
+    BOOLEAN OperandSizeOverride;
+    BOOLEAN AddressSizeOverride;
+    BOOLEAN Repeat;
+    UCHAR Rex;
+    ULONG64 SegmentBase;
+
+    //
+    // The operation, and the sizes of the memory operand and the other
+    // operand in bytes. Those differ only for MOVZX and MOVSX(D).
+    //
+    EMULATED_OPERATION Operation;
+    ULONG MemorySize;
+    ULONG OperandSize;
+} EMULATION_CONTEXT, *PEMULATION_CONTEXT;
+
+//
+// GUEST_REGISTERS holds registers in the reverse encoding order.
+//
+static_assert(FIELD_OFFSET(GUEST_REGISTERS, Rax) == (15 - k_RegisterRax) * sizeof(UINT64),
+              "Layout check");
+static_assert(FIELD_OFFSET(GUEST_REGISTERS, Rdi) == (15 - k_RegisterRdi) * sizeof(UINT64),
+              "Layout check");
+static_assert(FIELD_OFFSET(GUEST_REGISTERS, R15) == 0, "Layout check");
+
+/*!
+    @brief Returns the address of the guest register.
+
+    @param[in,out] Context - The emulation context.
+
+    @param[in] Index - The index of the register in the encoding order.
+
+    @return The address of the guest register.
+ */
+static
+_Check_return_
+PULONG64
+GetRegister (
+    _Inout_ PEMULATION_CONTEXT Context,
+    _In_ ULONG Index
+    )
+{
+    PULONG64 reg;
+
+    NT_ASSERT(Index < 16);
+
+    //
+    // RSP in GUEST_REGISTERS is not the guest value. The guest RSP is saved
+    // in the VMCB.
+    //
+    if (Index == k_RegisterRsp)
+    {
+        reg = &Context->GuestVmcb->StateSaveArea.Rsp;
+    }
+    else
+    {
+        reg = &reinterpret_cast<PULONG64>(Context->GuestRegisters)[15 - Index];
+    }
+    return reg;
+}
+
+/*!
+    @brief Returns the mask covering the operand size.
+ */
+static
+_Check_return_
+ULONG64
+GetSizeMask (
+    _In_ ULONG Size
+    )
+{
+    return (Size == sizeof(ULONG64)) ? MAXULONG64 : ((1ull << (Size * 8)) - 1);
+}
+
+/*!
+    @brief Sign-extends the value of the operand size to 64 bits.
+ */
+static
+_Check_return_
+ULONG64
+SignExtend (
+    _In_ ULONG64 Value,
+    _In_ ULONG Size
+    )
+{
+    ULONG shift;
+
+    shift = 64 - Size * 8;
+    return static_cast<ULONG64>(static_cast<LONG64>(Value << shift) >> shift);
+}
+
+/*!
+    @brief Reads the guest register with the operand size.
+
+    @details Without REX, byte registers 4 to 7 are AH, CH, DH and BH.
+ */
+static
+_Check_return_
+ULONG64
+ReadRegister (
+    _Inout_ PEMULATION_CONTEXT Context,
+    _In_ ULONG Index,
+    _In_ ULONG Size
+    )
+{
+    ULONG64 value;
+
+    if ((Size == 1) && (Context->Rex == 0) && (Index >= 4) && (Index <= 7))
+    {
+        value = (*GetRegister(Context, Index - 4) >> 8) & 0xff;
+    }
+    else
+    {
+        value = *GetRegister(Context, Index) & GetSizeMask(Size);
+    }
+    return value;
+}
+
+/*!
+    @brief Writes the guest register with the operand size.
+
+    @details Writing a 32-bit register zero-extends it, while writing 8 or
+        16-bit register preserves the other bits.
+ */
+static
+VOID
+WriteRegister (
+    _Inout_ PEMULATION_CONTEXT Context,
+    _In_ ULONG Index,
+    _In_ ULONG Size,
+    _In_ ULONG64 Value
+    )
+{
+    PULONG64 reg;
+
+    if ((Size == 1) && (Context->Rex == 0) && (Index >= 4) && (Index <= 7))
+    {
+        reg = GetRegister(Context, Index - 4);
+        *reg = (*reg & ~0xff00ull) | ((Value & 0xff) << 8);
+    }
+    else if (Size == 4)
+    {
+        *GetRegister(Context, Index) = Value & MAXUINT32;
+    }
+    else
+    {
+        reg = GetRegister(Context, Index);
+        *reg = (*reg & ~GetSizeMask(Size)) | (Value & GetSizeMask(Size));
+    }
+}
+
+/*!
+    @brief Reads memory with the operand size.
+ */
+static
+_Check_return_
+ULONG64
+ReadMemory (
+    _In_ PCVOID Address,
+    _In_ ULONG Size
+    )
+{
+    ULONG64 value;
+
+    switch (Size)
+    {
+    case 1:
+        value = *static_cast<const volatile UINT8*>(Address);
+        break;
+    case 2:
+        value = *static_cast<const volatile UINT16*>(Address);
+        break;
+    case 4:
+        value = *static_cast<const volatile UINT32*>(Address);
+        break;
+    default:
+        NT_ASSERT(Size == 8);
+        value = *static_cast<const volatile UINT64*>(Address);
+        break;
+    }
+    return value;
+}
+
+/*!
+    @brief Writes memory with the operand size.
+ */
+static
+VOID
+WriteMemory (
+    _Out_writes_bytes_(Size) PVOID Address,
+    _In_ ULONG Size,
+    _In_ ULONG64 Value
+    )
+{
+    switch (Size)
+    {
+    case 1:
+        *static_cast<volatile UINT8*>(Address) = static_cast<UINT8>(Value);
+        break;
+    case 2:
+        *static_cast<volatile UINT16*>(Address) = static_cast<UINT16>(Value);
+        break;
+    case 4:
+        *static_cast<volatile UINT32*>(Address) = static_cast<UINT32>(Value);
+        break;
+    default:
+        NT_ASSERT(Size == 8);
+        *static_cast<volatile UINT64*>(Address) = Value;
+        break;
+    }
+}
+
+/*!
+    @brief Atomically exchanges memory with the operand size.
+
+    @return The original value of the memory.
+ */
+static
+_Check_return_
+ULONG64
+ExchangeMemory (
+    _Inout_updates_bytes_(Size) PVOID Address,
+    _In_ ULONG Size,
+    _In_ ULONG64 Value
+    )
+{
+    ULONG64 original;
+
+    switch (Size)
+    {
+    case 1:
+        original = static_cast<UINT8>(_InterlockedExchange8(
+                                        static_cast<volatile CHAR*>(Address),
+                                        static_cast<CHAR>(Value)));
+        break;
+    case 2:
+        original = static_cast<UINT16>(_InterlockedExchange16(
+                                        static_cast<volatile SHORT*>(Address),
+                                        static_cast<SHORT>(Value)));
+        break;
+    case 4:
+        original = static_cast<UINT32>(InterlockedExchange(
+                                        static_cast<volatile LONG*>(Address),
+                                        static_cast<LONG>(Value)));
+        break;
+    default:
+        NT_ASSERT(Size == 8);
+        original = static_cast<ULONG64>(InterlockedExchange64(
+                                        static_cast<volatile LONG64*>(Address),
+                                        static_cast<LONG64>(Value)));
+        break;
+    }
+    return original;
+}
+
+/*!
+    @brief Atomically compares and exchanges memory with the operand size.
+
+    @return The original value of the memory.
+ */
+static
+_Check_return_
+ULONG64
+CompareExchangeMemory (
+    _Inout_updates_bytes_(Size) PVOID Address,
+    _In_ ULONG Size,
+    _In_ ULONG64 Exchange,
+    _In_ ULONG64 Comparand
+    )
+{
+    ULONG64 original;
+
+    switch (Size)
+    {
+    case 1:
+        original = static_cast<UINT8>(_InterlockedCompareExchange8(
+                                        static_cast<volatile CHAR*>(Address),
+                                        static_cast<CHAR>(Exchange),
+                                        static_cast<CHAR>(Comparand)));
+        break;
+    case 2:
+        original = static_cast<UINT16>(_InterlockedCompareExchange16(
+                                        static_cast<volatile SHORT*>(Address),
+                                        static_cast<SHORT>(Exchange),
+                                        static_cast<SHORT>(Comparand)));
+        break;
+    case 4:
+        original = static_cast<UINT32>(InterlockedCompareExchange(
+                                        static_cast<volatile LONG*>(Address),
+                                        static_cast<LONG>(Exchange),
+                                        static_cast<LONG>(Comparand)));
+        break;
+    default:
+        NT_ASSERT(Size == 8);
+        original = static_cast<ULONG64>(InterlockedCompareExchange64(
+                                        static_cast<volatile LONG64*>(Address),
+                                        static_cast<LONG64>(Exchange),
+                                        static_cast<LONG64>(Comparand)));
+        break;
+    }
+    return original;
+}
+
+/*!
+    @brief Updates the guest RFLAGS as CMP does.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in] Left - The first operand of CMP.
+
+    @param[in] Right - The second operand of CMP.
+
+    @param[in] Size - The operand size in bytes.
+ */
+static
+VOID
+UpdateFlagsForCompare (
+    _Inout_ PVMCB GuestVmcb,
+    _In_ ULONG64 Left,
+    _In_ ULONG64 Right,
+    _In_ ULONG Size
+    )
+{
+    ULONG64 result;
+    ULONG64 signBit;
+    ULONG64 flags;
+    UCHAR parity;
+
+    result = (Left - Right) & GetSizeMask(Size);
+    signBit = 1ull << (Size * 8 - 1);
+
+    flags = 0;
+    if (Left < Right)
+    {
+        flags |= k_RflagsCf;
+    }
+    if (result == 0)
+    {
+        flags |= k_RflagsZf;
+    }
+    if ((result & signBit) != 0)
+    {
+        flags |= k_RflagsSf;
+    }
+    if (((Left ^ Right) & (Left ^ result) & signBit) != 0)
+    {
+        flags |= k_RflagsOf;
+    }
+    if (((Left ^ Right ^ result) & 0x10) != 0)
+    {
+        flags |= k_RflagsAf;
+    }
+
+    //
+    // PF is set when the low byte has an even number of set bits.
+    //
+    parity = static_cast<UCHAR>(result);
+    parity ^= parity >> 4;
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+    if ((parity & 1) == 0)
+    {
+        flags |= k_RflagsPf;
+    }
+
+    GuestVmcb->StateSaveArea.Rflags &= ~(k_RflagsCf | k_RflagsPf | k_RflagsAf |
+                                         k_RflagsZf | k_RflagsSf | k_RflagsOf);
+    GuestVmcb->StateSaveArea.Rflags |= flags;
+}
+
+/*!
+    @brief Tests whether the guest linear address range is accessible from the
+        host.
+
+    @details The host shares the kernel address space with the guest, except
+        session space. MmIsAddressValid checks the host page tables, so the
+        range is safe to access when it returns TRUE for both ends.
+ */
+static
+_Check_return_
+BOOLEAN
+IsGuestKernelRangeAccessible (
+    _In_ const VMCB* GuestVmcb,
+    _In_ ULONG64 Address,
+    _In_ ULONG Size
+    )
+{
+    BOOLEAN accessible;
+
+    accessible = FALSE;
+    if ((GuestVmcb->StateSaveArea.Cpl != 0) ||
+        (reinterpret_cast<PVOID>(Address) < MmSystemRangeStart))
+    {
+        goto Exit;
+    }
+
+    if ((MmIsAddressValid(reinterpret_cast<PVOID>(Address)) == FALSE) ||
+        (MmIsAddressValid(reinterpret_cast<PVOID>(Address + Size - 1)) == FALSE))
+    {
+        goto Exit;
+    }
+
+    accessible = TRUE;
+
+Exit:
+    return accessible;
+}
+
+/*!
+    @brief Fetches and decodes the instruction at the guest RIP.
+
+    @param[in,out] Context - The emulation context to fill the instruction
+        bytes, the prefixes and the decoded result.
+
+    @return TRUE when the instruction is decoded; otherwise, FALSE.
+ */
+static
+_Success_(return)
+_Check_return_
+BOOLEAN
+FetchInstruction (
+    _Inout_ PEMULATION_CONTEXT Context
+    )
+{
+    BOOLEAN ok;
+    ULONG64 rip;
+    ULONG offset;
+
+    ok = FALSE;
+    rip = Context->GuestVmcb->StateSaveArea.Rip;
+
+    //
+    // Use the bytes fetched by the processor with decode assists. Otherwise,
+    // read them from the guest RIP.
+    //
+    Context->BytesFetched = min(Context->GuestVmcb->ControlArea.NumOfBytesFetched,
+                                k_MaxInsturctionLength);
+    if (Context->BytesFetched != 0)
+    {
+        RtlCopyMemory(Context->Bytes,
+                      Context->GuestVmcb->ControlArea.GuestInstructionBytes,
+                      Context->BytesFetched);
+    }
+    else
+    {
+        if (IsGuestKernelRangeAccessible(Context->GuestVmcb,
+                                         rip,
+                                         k_MaxInsturctionLength) == FALSE)
+        {
+            goto Exit;
+        }
+        RtlCopyMemory(Context->Bytes,
+                      reinterpret_cast<PCVOID>(rip),
+                      k_MaxInsturctionLength);
+        Context->BytesFetched = k_MaxInsturctionLength;
+    }
+
+    if ((DecodeInstruction(Context->Bytes, &Context->Instruction) == FALSE) ||
+        (Context->Instruction.Length > Context->BytesFetched))
+    {
+        goto Exit;
+    }
+
+    //
+    // Parse the prefixes DecodeInstruction skipped. CS, SS, DS and ES
+    // overrides are ignored in 64-bit mode. LOCK does not change the results
+    // as read-modify-write operations are always emulated atomically.
+    //
+    for (offset = 0; offset < Context->Instruction.Length; ++offset)
+    {
+        switch (Context->Bytes[offset])
+        {
+        case 0x66:
+            Context->OperandSizeOverride = TRUE;
+            continue;
+        case 0x67:
+            Context->AddressSizeOverride = TRUE;
+            continue;
+        case 0xf2:
+        case 0xf3:
+            Context->Repeat = TRUE;
+            continue;
+        case 0x64:
+            Context->SegmentBase = Context->GuestVmcb->StateSaveArea.FsBase;
+            continue;
+        case 0x65:
+            Context->SegmentBase = Context->GuestVmcb->StateSaveArea.GsBase;
+            continue;
+        case 0xf0:
+        case 0x2e:
+        case 0x36:
+        case 0x3e:
+        case 0x26:
+            continue;
+        default:
+            break;
+        }
+        break;
+    }
+    if ((Context->Bytes[offset] & 0xf0) == 0x40)
+    {
+        Context->Rex = Context->Bytes[offset];
+    }
+
+    ok = TRUE;
+
+Exit:
+    return ok;
+}
+
+/*!
+    @brief Determines the operation and operand sizes of the instruction.
+
+    @param[in,out] Context - The emulation context with the decoded
+        instruction.
+ */
+static
+VOID
+DetermineOperation (
+    _Inout_ PEMULATION_CONTEXT Context
+    )
+{
+    const INSTRUCTION_INFO* instruction;
+    ULONG operandSize;
+    ULONG regField;
+
+    instruction = &Context->Instruction;
+    operandSize = BooleanFlagOn(Context->Rex, 0x8) ? 8 :
+                  (Context->OperandSizeOverride != FALSE) ? 2 : 4;
+    regField = (instruction->ModRm >> 3) & 0x7;
+
+    Context->Operation = EmulatedOperationUnsupported;
+    Context->OperandSize = operandSize;
+    Context->MemorySize = operandSize;
+
+    if (instruction->OpcodeMap == OpcodeMapPrimary)
+    {
+        switch (instruction->Opcode)
+        {
+        case 0x88:  // MOV r/m8, r8
+        case 0xa2:  // MOV moffs8, AL
+            Context->OperandSize = Context->MemorySize = 1;
+            Context->Operation = EmulatedOperationStore;
+            break;
+        case 0x89:  // MOV r/m, r
+        case 0xa3:  // MOV moffs, rAX
+            Context->Operation = EmulatedOperationStore;
+            break;
+        case 0xc6:  // MOV r/m8, imm8
+            Context->OperandSize = Context->MemorySize = 1;
+            Context->Operation = (regField == 0) ? EmulatedOperationStore :
+                                                   EmulatedOperationUnsupported;
+            break;
+        case 0xc7:  // MOV r/m, imm
+            Context->Operation = (regField == 0) ? EmulatedOperationStore :
+                                                   EmulatedOperationUnsupported;
+            break;
+        case 0x8a:  // MOV r8, r/m8
+        case 0xa0:  // MOV AL, moffs8
+            Context->OperandSize = Context->MemorySize = 1;
+            Context->Operation = EmulatedOperationLoad;
+            break;
+        case 0x8b:  // MOV r, r/m
+        case 0xa1:  // MOV rAX, moffs
+            Context->Operation = EmulatedOperationLoad;
+            break;
+        case 0x63:  // MOVSXD r, r/m32
+            Context->MemorySize = min(operandSize, 4);
+            Context->Operation = EmulatedOperationLoadSignExtend;
+            break;
+        case 0x86:  // XCHG r/m8, r8
+            Context->OperandSize = Context->MemorySize = 1;
+            Context->Operation = EmulatedOperationExchange;
+            break;
+        case 0x87:  // XCHG r/m, r
+            Context->Operation = EmulatedOperationExchange;
+            break;
+        case 0xaa:  // STOS m8
+            Context->OperandSize = Context->MemorySize = 1;
+            Context->Operation = EmulatedOperationStoreString;
+            break;
+        case 0xab:  // STOS m
+            Context->Operation = EmulatedOperationStoreString;
+            break;
+        case 0xa4:  // MOVS m8, m8
+            Context->OperandSize = Context->MemorySize = 1;
+            Context->Operation = EmulatedOperationMoveString;
+            break;
+        case 0xa5:  // MOVS m, m
+            Context->Operation = EmulatedOperationMoveString;
+            break;
+        default:
+            break;
+        }
+    }
+    else if (instruction->OpcodeMap == OpcodeMap0F)
+    {
+        switch (instruction->Opcode)
+        {
+        case 0xb6:  // MOVZX r, r/m8
+            Context->MemorySize = 1;
+            Context->Operation = EmulatedOperationLoadZeroExtend;
+            break;
+        case 0xb7:  // MOVZX r, r/m16
+            Context->MemorySize = 2;
+            Context->Operation = EmulatedOperationLoadZeroExtend;
+            break;
+        case 0xbe:  // MOVSX r, r/m8
+            Context->MemorySize = 1;
+            Context->Operation = EmulatedOperationLoadSignExtend;
+            break;
+        case 0xbf:  // MOVSX r, r/m16
+            Context->MemorySize = 2;
+            Context->Operation = EmulatedOperationLoadSignExtend;
+            break;
+        case 0xb0:  // CMPXCHG r/m8, r8
+            Context->OperandSize = Context->MemorySize = 1;
+            Context->Operation = EmulatedOperationCompareExchange;
+            break;
+        case 0xb1:  // CMPXCHG r/m, r
+            Context->Operation = EmulatedOperationCompareExchange;
+            break;
+        default:
+            break;
+        }
+    }
+
+    //
+    // Forms with ModRM must reference memory, and VEX and EVEX encoded
+    // instructions share opcodes with them but are not supported.
+    //
+    if ((instruction->HasModRm != FALSE) && ((instruction->ModRm >> 6) == 3))
+    {
+        Context->Operation = EmulatedOperationUnsupported;
+    }
+    if ((Context->Bytes[0] == 0xc4) || (Context->Bytes[0] == 0xc5) ||
+        (Context->Bytes[0] == 0x62))
+    {
+        Context->Operation = EmulatedOperationUnsupported;
+    }
+}
+
+/*!
+    @brief Computes the guest linear address of the memory operand encoded
+        with ModRM or as moffs.
+
+    @param[in,out] Context - The emulation context with the decoded
+        instruction.
+
+    @return The guest linear address of the memory operand.
+ */
+static
+_Check_return_
+ULONG64
+ComputeEffectiveAddress (
+    _Inout_ PEMULATION_CONTEXT Context
+    )
+{
+    const INSTRUCTION_INFO* instruction;
+    ULONG64 address;
+    UCHAR mod, rm;
+
+    instruction = &Context->Instruction;
+
+    if (instruction->HasModRm == FALSE)
+    {
+        //
+        // MOV moffs. The immediate is the address.
+        //
+        address = ReadMemory(&Context->Bytes[instruction->ImmediateOffset],
+                             instruction->ImmediateSize);
+        goto Exit;
+    }
+
+    mod = (instruction->ModRm >> 6) & 0x3;
+    rm = instruction->ModRm & 0x7;
+    address = 0;
+
+    if (rm == 4)
+    {
+        UCHAR sib, scale, index, base;
+
+        //
+        // SIB immediately precedes the displacement. Index 100b without
+        // REX.X means no index, and base 101b with mod 00b means no base.
+        //
+        sib = Context->Bytes[instruction->DisplacementOffset - 1];
+        scale = (sib >> 6) & 0x3;
+        index = ((sib >> 3) & 0x7) | (BooleanFlagOn(Context->Rex, 0x2) ? 8 : 0);
+        base = (sib & 0x7) | (BooleanFlagOn(Context->Rex, 0x1) ? 8 : 0);
+
+        if (index != k_RegisterRsp)
+        {
+            address += *GetRegister(Context, index) << scale;
+        }
+        if ((mod != 0) || ((sib & 0x7) != 5))
+        {
+            address += *GetRegister(Context, base);
+        }
+    }
+    else if (instruction->IsRipRelative != FALSE)
+    {
+        address = Context->GuestVmcb->StateSaveArea.Rip + instruction->Length;
+    }
+    else
+    {
+        address = *GetRegister(Context,
+                               rm | (BooleanFlagOn(Context->Rex, 0x1) ? 8 : 0));
+    }
+
+    if (instruction->DisplacementSize != 0)
+    {
+        address += SignExtend(
+                    ReadMemory(&Context->Bytes[instruction->DisplacementOffset],
+                               instruction->DisplacementSize),
+                    instruction->DisplacementSize);
+    }
+
+Exit:
+    if (Context->AddressSizeOverride != FALSE)
+    {
+        address &= MAXUINT32;
+    }
+    return address + Context->SegmentBase;
+}
+
+/*!
+    @brief Advances RSI or RDI by the operand size according with DF.
+ */
+static
+VOID
+AdvanceStringRegister (
+    _Inout_ PEMULATION_CONTEXT Context,
+    _In_ ULONG Index
+    )
+{
+    if (BooleanFlagOn(Context->GuestVmcb->StateSaveArea.Rflags, k_RflagsDf))
+    {
+        *GetRegister(Context, Index) -= Context->MemorySize;
+    }
+    else
+    {
+        *GetRegister(Context, Index) += Context->MemorySize;
+    }
+}
+
+/*!
+    @brief Emulates the instruction that caused #VMEXIT due to NPF on a data
+        access.
+
+    @details On success, the access is applied against BackingPage at the page
+        offset of the faulting guest physical address, the guest registers and
+        RFLAGS are updated, and the guest RIP is advanced. For REP STOS and
+        REP MOVS, a single iteration is emulated and the guest RIP is advanced
+        only after the last iteration, so the remaining iterations are
+        executed by the guest. On failure, the guest state is not changed.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] GuestRegisters - The guest general purpose registers.
+
+    @param[in,out] BackingPage - The page aligned host virtual address of the
+        page to apply the access against.
+
+    @param[out] Access - The address to receive the access to the faulting
+        page on success.
+
+    @return TRUE when the instruction is emulated; otherwise, FALSE.
+ */
+_Use_decl_annotations_
+BOOLEAN
+EmulateMemoryAccess (
+    PVMCB GuestVmcb,
+    PGUEST_REGISTERS GuestRegisters,
+    PVOID BackingPage,
+    PEMULATED_MEMORY_ACCESS Access
+    )
+{
+    BOOLEAN emulated;
+    EMULATION_CONTEXT context;
+    NPF_EXITINFO1 exitInfo;
+    ULONG64 faultingPa;
+    ULONG64 address;
+    ULONG64 otherAddress;
+    ULONG regIndex;
+    PUCHAR memory;
+    PUCHAR otherMemory;
+    ULONG64 value;
+    ULONG64 accumulator;
+    BOOLEAN completed;
+    BOOLEAN write;
+
+    emulated = FALSE;
+    write = FALSE;
+    RtlZeroMemory(&context, sizeof(context));
+    context.GuestVmcb = GuestVmcb;
+    context.GuestRegisters = GuestRegisters;
+
+    faultingPa = GuestVmcb->ControlArea.ExitInfo2;
+    exitInfo.AsUInt64 = GuestVmcb->ControlArea.ExitInfo1;
+
+    //
+    // Only data accesses by 64-bit code are supported. Emulating with TF
+    // would require delivering #DB.
+    //
+    if ((exitInfo.Fields.Execute != FALSE) ||
+        (exitInfo.Fields.GuestPhysicalAddress == FALSE) ||
+        (BooleanFlagOn(GuestVmcb->StateSaveArea.CsAttrib, k_SegmentAttribLongMode) == FALSE) ||
+        BooleanFlagOn(GuestVmcb->StateSaveArea.Rflags, k_RflagsTf))
+    {
+        goto Exit;
+    }
+
+    if (FetchInstruction(&context) == FALSE)
+    {
+        goto Exit;
+    }
+
+    DetermineOperation(&context);
+    if (context.Operation == EmulatedOperationUnsupported)
+    {
+        goto Exit;
+    }
+
+    //
+    // Compute the address of the memory operand on the faulting page, and
+    // for MOVS, the other operand too. The write bit tells which operand of
+    // MOVS faulted.
+    //
+    otherAddress = 0;
+    if (context.Operation == EmulatedOperationStoreString)
+    {
+        address = *GetRegister(&context, k_RegisterRdi);
+    }
+    else if (context.Operation == EmulatedOperationMoveString)
+    {
+        address = *GetRegister(&context, k_RegisterRdi);
+        otherAddress = *GetRegister(&context, k_RegisterRsi) + context.SegmentBase;
+        if (exitInfo.Fields.Write == FALSE)
+        {
+            value = address;
+            address = otherAddress;
+            otherAddress = value;
+        }
+    }
+    else
+    {
+        address = ComputeEffectiveAddress(&context);
+    }
+
+    if (((context.Operation == EmulatedOperationStoreString) ||
+         (context.Operation == EmulatedOperationMoveString)) &&
+        (context.AddressSizeOverride != FALSE))
+    {
+        goto Exit;
+    }
+
+    //
+    // The linear and physical addresses share the page offset. A mismatch
+    // means the access straddles the page boundary or the decoding is wrong.
+    //
+    if (((address & (PAGE_SIZE - 1)) != (faultingPa & (PAGE_SIZE - 1))) ||
+        (((address & (PAGE_SIZE - 1)) + context.MemorySize) > PAGE_SIZE))
+    {
+        goto Exit;
+    }
+    memory = static_cast<PUCHAR>(BackingPage) + (address & (PAGE_SIZE - 1));
+
+    otherMemory = nullptr;
+    if (context.Operation == EmulatedOperationMoveString)
+    {
+        if (IsGuestKernelRangeAccessible(GuestVmcb,
+                                         otherAddress,
+                                         context.MemorySize) == FALSE)
+        {
+            goto Exit;
+        }
+        otherMemory = reinterpret_cast<PUCHAR>(otherAddress);
+    }
+
+    //
+    // REP with RCX of zero does not access memory, and so, never faults.
+    //
+    if ((context.Repeat != FALSE) &&
+        (*GetRegister(&context, k_RegisterRcx) == 0))
+    {
+        goto Exit;
+    }
+
+    regIndex = ((context.Instruction.ModRm >> 3) & 0x7) |
+               (BooleanFlagOn(context.Rex, 0x4) ? 8 : 0);
+    if (context.Instruction.HasModRm == FALSE)
+    {
+        regIndex = k_RegisterRax;
+    }
+
+    switch (context.Operation)
+    {
+    case EmulatedOperationStore:
+        if ((context.Instruction.Opcode == 0xc6) ||
+            (context.Instruction.Opcode == 0xc7))
+        {
+            value = SignExtend(
+                ReadMemory(&context.Bytes[context.Instruction.ImmediateOffset],
+                           context.Instruction.ImmediateSize),
+                context.Instruction.ImmediateSize);
+        }
+        else
+        {
+            value = ReadRegister(&context, regIndex, context.OperandSize);
+        }
+        WriteMemory(memory, context.MemorySize, value);
+        write = TRUE;
+        break;
+
+    case EmulatedOperationLoad:
+    case EmulatedOperationLoadZeroExtend:
+        value = ReadMemory(memory, context.MemorySize);
+        WriteRegister(&context, regIndex, context.OperandSize, value);
+        write = FALSE;
+        break;
+
+    case EmulatedOperationLoadSignExtend:
+        value = ReadMemory(memory, context.MemorySize);
+        WriteRegister(&context,
+                      regIndex,
+                      context.OperandSize,
+                      SignExtend(value, context.MemorySize));
+        write = FALSE;
+        break;
+
+    case EmulatedOperationExchange:
+        accumulator = ReadRegister(&context, regIndex, context.OperandSize);
+        WriteRegister(&context,
+                      regIndex,
+                      context.OperandSize,
+                      ExchangeMemory(memory, context.MemorySize, accumulator));
+        value = accumulator;
+        write = TRUE;
+        break;
+
+    case EmulatedOperationCompareExchange:
+        accumulator = ReadRegister(&context, k_RegisterRax, context.OperandSize);
+        value = CompareExchangeMemory(memory,
+                                      context.MemorySize,
+                                      ReadRegister(&context, regIndex, context.OperandSize),
+                                      accumulator);
+        UpdateFlagsForCompare(GuestVmcb, accumulator, value, context.OperandSize);
+        write = (value == accumulator);
+        if (write == FALSE)
+        {
+            WriteRegister(&context, k_RegisterRax, context.OperandSize, value);
+        }
+        else
+        {
+            value = ReadRegister(&context, regIndex, context.OperandSize);
+        }
+        break;
+
+    case EmulatedOperationStoreString:
+        value = ReadRegister(&context, k_RegisterRax, context.OperandSize);
+        WriteMemory(memory, context.MemorySize, value);
+        write = TRUE;
+        AdvanceStringRegister(&context, k_RegisterRdi);
+        break;
+
+    case EmulatedOperationMoveString:
+        write = (exitInfo.Fields.Write != FALSE);
+        if (write != FALSE)
+        {
+            value = ReadMemory(otherMemory, context.MemorySize);
+            WriteMemory(memory, context.MemorySize, value);
+        }
+        else
+        {
+            value = ReadMemory(memory, context.MemorySize);
+            WriteMemory(otherMemory, context.MemorySize, value);
+        }
+        AdvanceStringRegister(&context, k_RegisterRsi);
+        AdvanceStringRegister(&context, k_RegisterRdi);
+        break;
+
+    default:
+        NT_ASSERT(FALSE);
+        goto Exit;
+    }
+
+    //
+    // Complete the instruction unless more iterations remain.
+    //
+    completed = TRUE;
+    if (context.Repeat != FALSE)
+    {
+        completed = (--(*GetRegister(&context, k_RegisterRcx)) == 0);
+    }
+    if (completed != FALSE)
+    {
+        GuestVmcb->StateSaveArea.Rip += context.Instruction.Length;
+    }
+    if (ARGUMENT_PRESENT(Access))
+    {
+        Access->Offset = static_cast<ULONG>(address & (PAGE_SIZE - 1));
+        Access->Size = context.MemorySize;
+        Access->Write = write;
+        Access->Value = value;
+    }
+    emulated = TRUE;
+
+Exit:
+    return emulated;
+}
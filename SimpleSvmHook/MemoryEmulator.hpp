@@ -0,0 +1,36 @@
+/*!
+    @file MemoryEmulator.hpp
+
+    @brief VMM code to emulate instructions accessing memory.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "VmmMain.hpp"
+
+//
+// The access to the faulting page applied by EmulateMemoryAccess. Value is
+// the value written if Write is TRUE; otherwise, the value read. An exchange
+// is reported as a write.
+//
+typedef struct _EMULATED_MEMORY_ACCESS
+{
+    ULONG Offset;
+    ULONG Size;
+    BOOLEAN Write;
+    ULONG64 Value;
+} EMULATED_MEMORY_ACCESS, *PEMULATED_MEMORY_ACCESS;
+
+_IRQL_requires_max_(HIGH_LEVEL)
+_Success_(return)
+_Check_return_
+BOOLEAN
+EmulateMemoryAccess (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_updates_bytes_(PAGE_SIZE) PVOID BackingPage,
+    _Out_opt_ PEMULATED_MEMORY_ACCESS Access
+    );
@@ -0,0 +1,615 @@
+/*!
+    @file MmioTrace.cpp
+
+    @brief Kernel code to map traced MMIO ranges, and VMM code to emulate and
+        record access to them.
+
+    @details MMIO pages do not have NPT entries until the first access, on
+        which HandleNestedPageFault builds an entry, and the page is accessed
+        at full speed afterwards. Pages in the configured ranges never get the
+        entry. Instead, each access causes #VMEXIT, and the instruction is
+        emulated with EmulateMemoryAccess against a mapping of the page made
+        on load. The access is counted for the register, that is, the
+        physical address, and recorded with the value and TSC in a ring, both
+        per processor so that the VMM does not need a lock.
+
+        When the instruction cannot be emulated, the page is mapped on the
+        processor as other MMIO pages are, and further access to the page on
+        the processor is not traced. Such fallbacks are counted.
+
+        The ranges are mapped uncached, and so, should contain device
+        registers rather than frame buffers. Ranges overlapping RAM or the
+        APIC page are ignored since those always have NPT entries.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "MmioTrace.hpp"
+#include "Common.hpp"
+#include "Configuration.hpp"
+#include "MemoryEmulator.hpp"
+#include "PhysicalMemoryDescriptor.hpp"
+#include "x86_64.hpp"
+
+//
+// The number of registers counted and the number of records in the ring for
+// each processor. Access to registers beyond the count is only recorded in
+// the ring.
+//
+static constexpr ULONG k_MmioTraceRegisterCount = 256;
+static constexpr ULONG k_MmioTraceRingSize = 256;
+static_assert((k_MmioTraceRegisterCount & (k_MmioTraceRegisterCount - 1)) == 0,
+              "Power of two");
+static_assert((k_MmioTraceRingSize & (k_MmioTraceRingSize - 1)) == 0,
+              "Power of two");
+
+//
+// The counts of access to a register. PhysicalAddress is zero if unused.
+//
+typedef struct _MMIO_TRACE_REGISTER
+{
+    ULONG64 PhysicalAddress;
+    UINT64 ReadCount;
+    UINT64 WriteCount;
+    UINT64 LastValue;
+    UINT64 LastTimeStamp;
+} MMIO_TRACE_REGISTER, *PMMIO_TRACE_REGISTER;
+
+typedef struct _MMIO_TRACE_RECORD
+{
+    UINT64 TimeStamp;
+    ULONG64 PhysicalAddress;
+    UINT64 Value;
+    ULONG Size;
+    BOOLEAN Write;
+} MMIO_TRACE_RECORD, *PMMIO_TRACE_RECORD;
+
+//
+// The access traced on a processor.
+//
+typedef struct _MMIO_TRACE_BUFFER
+{
+    UINT64 ReadCount;
+    UINT64 WriteCount;
+    UINT64 UncountedCount;
+    UINT64 FallbackCount;
+    ULONG RingIndex;
+
+    //
+    // Open addressed by the physical address.
+    //
+    MMIO_TRACE_REGISTER Registers[k_MmioTraceRegisterCount];
+    MMIO_TRACE_RECORD Ring[k_MmioTraceRingSize];
+} MMIO_TRACE_BUFFER, *PMMIO_TRACE_BUFFER;
+
+typedef struct _MMIO_TRACE_RANGE
+{
+    ULONG64 BaseAddress;
+    ULONG64 Size;
+    PVOID MappedAddress;
+} MMIO_TRACE_RANGE, *PMMIO_TRACE_RANGE;
+
+typedef struct _MMIO_TRACE
+{
+    ULONG RangeCount;
+    MMIO_TRACE_RANGE Ranges[k_MaxMmioTraceRanges];
+
+    //
+    // The buffers indexed by the processor index. Buffers is NULL when
+    // tracing is not enabled.
+    //
+    ULONG ProcessorCount;
+    PMMIO_TRACE_BUFFER* Buffers;
+} MMIO_TRACE, *PMMIO_TRACE;
+
+static MMIO_TRACE g_MmioTrace;
+
+/*!
+    @brief Tests whether the range can be traced.
+
+    @param[in] Descriptor - The physical memory ranges.
+
+    @param[in] Range - The range to test.
+
+    @param[in] RangeCount - The number of ranges accepted so far.
+
+    @param[in] Ranges - The ranges accepted so far.
+
+    @return TRUE if the range overlaps neither RAM, the APIC page nor the
+        other ranges; otherwise, FALSE.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+BOOLEAN
+IsTraceableMmioRange (
+    _In_ const PHYSICAL_MEMORY_DESCRIPTOR* Descriptor,
+    _In_ const MMIO_TRACE_CONFIGURATION* Range,
+    _In_ ULONG RangeCount,
+    _In_reads_(RangeCount) const MMIO_TRACE_RANGE* Ranges
+    )
+{
+    BOOLEAN traceable;
+    ULONG64 basePage, endPage;
+    APIC_BASE apicBase;
+
+    PAGED_CODE();
+
+    traceable = FALSE;
+    basePage = Range->BasePage;
+    endPage = basePage + Range->PageCount;
+
+    for (ULONG i = 0; i < Descriptor->NumberOfRuns; ++i)
+    {
+        const PHYSICAL_MEMORY_RUN* run;
+
+        run = &Descriptor->Run[i];
+        if ((basePage < run->BasePage + run->PageCount) &&
+            (run->BasePage < endPage))
+        {
+            goto Exit;
+        }
+    }
+
+    apicBase.AsUInt64 = __readmsr(IA32_APIC_BASE);
+    if ((basePage <= apicBase.Fields.ApicBase) &&
+        (apicBase.Fields.ApicBase < endPage))
+    {
+        goto Exit;
+    }
+
+    for (ULONG i = 0; i < RangeCount; ++i)
+    {
+        if ((basePage * PAGE_SIZE < Ranges[i].BaseAddress + Ranges[i].Size) &&
+            (Ranges[i].BaseAddress < endPage * PAGE_SIZE))
+        {
+            goto Exit;
+        }
+    }
+
+    traceable = TRUE;
+
+Exit:
+    return traceable;
+}
+
+/*!
+    @brief Unmaps the ranges and frees the buffers.
+
+    @param[in,out] MmioTrace - The ranges and buffers to free.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+FreeMmioTrace (
+    _Inout_ PMMIO_TRACE MmioTrace
+    )
+{
+    PAGED_CODE();
+
+    for (ULONG i = 0; i < MmioTrace->RangeCount; ++i)
+    {
+        MmUnmapIoSpace(MmioTrace->Ranges[i].MappedAddress,
+                       MmioTrace->Ranges[i].Size);
+    }
+    if (MmioTrace->Buffers != nullptr)
+    {
+        for (ULONG i = 0; i < MmioTrace->ProcessorCount; ++i)
+        {
+            if (MmioTrace->Buffers[i] != nullptr)
+            {
+                ExFreePoolWithTag(MmioTrace->Buffers[i], k_PoolTag);
+            }
+        }
+        ExFreePoolWithTag(MmioTrace->Buffers, k_PoolTag);
+    }
+    RtlZeroMemory(MmioTrace, sizeof(*MmioTrace));
+}
+
+/*!
+    @brief Maps the configured MMIO ranges and allocates the buffers.
+
+    @details This function must be called before processors are virtualized.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+InitializeMmioTrace (
+    VOID
+    )
+{
+    NTSTATUS status;
+    PPHYSICAL_MEMORY_DESCRIPTOR descriptor;
+    MMIO_TRACE mmioTrace;
+    SIZE_T buffersSize;
+
+    PAGED_CODE();
+
+    NT_ASSERT(g_MmioTrace.Buffers == nullptr);
+
+    RtlZeroMemory(&mmioTrace, sizeof(mmioTrace));
+
+    descriptor = DuplicatePhysicalMemoryDescriptor();
+    if (descriptor == nullptr)
+    {
+        LOGGING_LOG_ERROR("DuplicatePhysicalMemoryDescriptor failed");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    for (const auto& range : g_Configuration.MmioTraceRanges)
+    {
+        PMMIO_TRACE_RANGE traced;
+        PHYSICAL_ADDRESS baseAddress;
+
+        if (range.PageCount == 0)
+        {
+            continue;
+        }
+
+        if (IsTraceableMmioRange(descriptor,
+                                 &range,
+                                 mmioTrace.RangeCount,
+                                 mmioTrace.Ranges) == FALSE)
+        {
+            LOGGING_LOG_WARN("MMIO pages %08lx-%08lx are not traced",
+                             range.BasePage,
+                             range.BasePage + range.PageCount - 1);
+            continue;
+        }
+
+        traced = &mmioTrace.Ranges[mmioTrace.RangeCount];
+        traced->BaseAddress = static_cast<ULONG64>(range.BasePage) * PAGE_SIZE;
+        traced->Size = static_cast<ULONG64>(range.PageCount) * PAGE_SIZE;
+        baseAddress.QuadPart = static_cast<LONGLONG>(traced->BaseAddress);
+        traced->MappedAddress = MmMapIoSpace(baseAddress,
+                                             static_cast<SIZE_T>(traced->Size),
+                                             MmNonCached);
+        if (traced->MappedAddress == nullptr)
+        {
+            LOGGING_LOG_ERROR("MmMapIoSpace failed : %016llx", traced->BaseAddress);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        mmioTrace.RangeCount++;
+    }
+
+    if (mmioTrace.RangeCount == 0)
+    {
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+
+    mmioTrace.ProcessorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    buffersSize = sizeof(PMMIO_TRACE_BUFFER) * mmioTrace.ProcessorCount;
+    mmioTrace.Buffers = static_cast<PMMIO_TRACE_BUFFER*>(ExAllocatePoolWithTag(
+                                                            NonPagedPool,
+                                                            buffersSize,
+                                                            k_PoolTag));
+    if (mmioTrace.Buffers == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu", buffersSize);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(mmioTrace.Buffers, buffersSize);
+
+    for (ULONG i = 0; i < mmioTrace.ProcessorCount; ++i)
+    {
+        mmioTrace.Buffers[i] = static_cast<PMMIO_TRACE_BUFFER>(ExAllocatePoolWithTag(
+                                                            NonPagedPool,
+                                                            sizeof(MMIO_TRACE_BUFFER),
+                                                            k_PoolTag));
+        if (mmioTrace.Buffers[i] == nullptr)
+        {
+            LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu",
+                              sizeof(MMIO_TRACE_BUFFER));
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        RtlZeroMemory(mmioTrace.Buffers[i], sizeof(MMIO_TRACE_BUFFER));
+    }
+
+    LOGGING_LOG_INFO("Tracing %lu MMIO ranges", mmioTrace.RangeCount);
+
+    g_MmioTrace = mmioTrace;
+    RtlZeroMemory(&mmioTrace, sizeof(mmioTrace));
+    status = STATUS_SUCCESS;
+
+Exit:
+    FreeMmioTrace(&mmioTrace);
+    if (descriptor != nullptr)
+    {
+        FreePhysicalMemoryDescriptor(descriptor);
+    }
+    return status;
+}
+
+/*!
+    @brief Reports the ring of the buffer from the oldest record at the debug
+        level.
+
+    @param[in] ProcessorIndex - The index of the processor of the buffer.
+
+    @param[in] Buffer - The buffer to report.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+ReportMmioTraceRing (
+    _In_ ULONG ProcessorIndex,
+    _In_ const MMIO_TRACE_BUFFER* Buffer
+    )
+{
+    const MMIO_TRACE_RECORD* record;
+
+    PAGED_CODE();
+
+    //
+    // RingIndex is the next record to be written, that is, the oldest one.
+    // Records not written yet have zero TimeStamp.
+    //
+    for (ULONG i = 0; i < k_MmioTraceRingSize; ++i)
+    {
+        record = &Buffer->Ring[(Buffer->RingIndex + i) & (k_MmioTraceRingSize - 1)];
+        if (record->TimeStamp == 0)
+        {
+            continue;
+        }
+        LOGGING_LOG_DEBUG("Processor %lu: %s %016llx (%lu bytes) %016llx at %llu",
+                          ProcessorIndex,
+                          (record->Write != FALSE) ? "write" : "read",
+                          record->PhysicalAddress,
+                          record->Size,
+                          record->Value,
+                          record->TimeStamp);
+    }
+}
+
+/*!
+    @brief Reports the traced access, unmaps the ranges and frees the buffers.
+
+    @details This function must be called after processors are de-virtualized.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+CleanupMmioTrace (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    if (g_MmioTrace.Buffers == nullptr)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < g_MmioTrace.ProcessorCount; ++i)
+    {
+        const MMIO_TRACE_BUFFER* buffer;
+
+        buffer = g_MmioTrace.Buffers[i];
+        LOGGING_LOG_INFO("Processor %lu: %llu MMIO reads, %llu writes, %llu uncounted, %llu not emulated",
+                         i,
+                         buffer->ReadCount,
+                         buffer->WriteCount,
+                         buffer->UncountedCount,
+                         buffer->FallbackCount);
+        for (const auto& reg : buffer->Registers)
+        {
+            if (reg.PhysicalAddress == 0)
+            {
+                continue;
+            }
+            LOGGING_LOG_DEBUG("%016llx: %llu reads, %llu writes, last %016llx",
+                              reg.PhysicalAddress,
+                              reg.ReadCount,
+                              reg.WriteCount,
+                              reg.LastValue);
+        }
+        ReportMmioTraceRing(i, buffer);
+    }
+
+    FreeMmioTrace(&g_MmioTrace);
+}
+
+/*!
+    @brief Returns the traced range containing the physical address.
+
+    @param[in] PhysicalAddress - The physical address to look up.
+
+    @return The traced range, or NULL if the address is not traced.
+ */
+static
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+const MMIO_TRACE_RANGE*
+FindMmioTraceRange (
+    _In_ ULONG64 PhysicalAddress
+    )
+{
+    const MMIO_TRACE_RANGE* range;
+
+    range = nullptr;
+    for (ULONG i = 0; i < g_MmioTrace.RangeCount; ++i)
+    {
+        if ((PhysicalAddress >= g_MmioTrace.Ranges[i].BaseAddress) &&
+            ((PhysicalAddress - g_MmioTrace.Ranges[i].BaseAddress) <
+                g_MmioTrace.Ranges[i].Size))
+        {
+            range = &g_MmioTrace.Ranges[i];
+            break;
+        }
+    }
+    return range;
+}
+
+/*!
+    @brief Records the emulated access.
+
+    @param[in,out] Buffer - The buffer of the current processor.
+
+    @param[in] PhysicalAddress - The physical address accessed.
+
+    @param[in] Access - The emulated access.
+ */
+static
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+RecordMmioAccess (
+    _Inout_ PMMIO_TRACE_BUFFER Buffer,
+    _In_ ULONG64 PhysicalAddress,
+    _In_ const EMULATED_MEMORY_ACCESS* Access
+    )
+{
+    UINT64 timeStamp;
+    PMMIO_TRACE_RECORD record;
+    PMMIO_TRACE_REGISTER reg;
+    ULONG index;
+
+    timeStamp = __rdtsc();
+
+    if (Access->Write != FALSE)
+    {
+        Buffer->WriteCount++;
+    }
+    else
+    {
+        Buffer->ReadCount++;
+    }
+
+    record = &Buffer->Ring[Buffer->RingIndex];
+    Buffer->RingIndex = (Buffer->RingIndex + 1) & (k_MmioTraceRingSize - 1);
+    record->TimeStamp = timeStamp;
+    record->PhysicalAddress = PhysicalAddress;
+    record->Value = Access->Value;
+    record->Size = Access->Size;
+    record->Write = Access->Write;
+
+    //
+    // Find or claim the slot of the register with linear probing. Registers
+    // are typically a few bytes apart, so the low bits spread them.
+    //
+    reg = nullptr;
+    index = static_cast<ULONG>(PhysicalAddress >> 2);
+    for (ULONG i = 0; i < k_MmioTraceRegisterCount; ++i, ++index)
+    {
+        PMMIO_TRACE_REGISTER candidate;
+
+        candidate = &Buffer->Registers[index & (k_MmioTraceRegisterCount - 1)];
+        if ((candidate->PhysicalAddress == PhysicalAddress) ||
+            (candidate->PhysicalAddress == 0))
+        {
+            candidate->PhysicalAddress = PhysicalAddress;
+            reg = candidate;
+            break;
+        }
+    }
+    if (reg == nullptr)
+    {
+        Buffer->UncountedCount++;
+        goto Exit;
+    }
+
+    if (Access->Write != FALSE)
+    {
+        reg->WriteCount++;
+    }
+    else
+    {
+        reg->ReadCount++;
+    }
+    reg->LastValue = Access->Value;
+    reg->LastTimeStamp = timeStamp;
+
+Exit:
+    return;
+}
+
+/*!
+    @brief Emulates and records access to a traced MMIO page.
+
+    @details This function is called on #VMEXIT due to NPF before
+        HandleNestedPageFault.
+
+    @param[in,out] GuestVmcb - The processor associated VMCB.
+
+    @param[in,out] GuestRegisters - The guest general purpose registers.
+
+    @return TRUE if the access was emulated; FALSE if the fault should be
+        handled by HandleNestedPageFault.
+ */
+_Use_decl_annotations_
+BOOLEAN
+HandleMmioTraceAccess (
+    PVMCB GuestVmcb,
+    PGUEST_REGISTERS GuestRegisters
+    )
+{
+    BOOLEAN handled;
+    NPF_EXITINFO1 exitInfo;
+    ULONG64 faultingPa;
+    const MMIO_TRACE_RANGE* range;
+    ULONG processorIndex;
+    PMMIO_TRACE_BUFFER buffer;
+    PVOID backingPage;
+    EMULATED_MEMORY_ACCESS access;
+
+    handled = FALSE;
+    if (g_MmioTrace.Buffers == nullptr)
+    {
+        goto Exit;
+    }
+
+    //
+    // Traced pages never have NPT entries.
+    //
+    exitInfo.AsUInt64 = GuestVmcb->ControlArea.ExitInfo1;
+    if (exitInfo.Fields.Valid != FALSE)
+    {
+        goto Exit;
+    }
+
+    faultingPa = GuestVmcb->ControlArea.ExitInfo2;
+    range = FindMmioTraceRange(faultingPa);
+    if (range == nullptr)
+    {
+        goto Exit;
+    }
+
+    //
+    // Not traced on a processor added after the buffers were allocated.
+    //
+    processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+    if (processorIndex >= g_MmioTrace.ProcessorCount)
+    {
+        goto Exit;
+    }
+    buffer = g_MmioTrace.Buffers[processorIndex];
+
+    backingPage = Add2Ptr(range->MappedAddress,
+                          (faultingPa - range->BaseAddress) & ~static_cast<ULONG64>(PAGE_SIZE - 1));
+    if (EmulateMemoryAccess(GuestVmcb,
+                            GuestRegisters,
+                            backingPage,
+                            &access) == FALSE)
+    {
+        buffer->FallbackCount++;
+        goto Exit;
+    }
+
+    RecordMmioAccess(buffer,
+                     (faultingPa & ~static_cast<ULONG64>(PAGE_SIZE - 1)) + access.Offset,
+                     &access);
+    handled = TRUE;
+
+Exit:
+    return handled;
+}
@@ -0,0 +1,37 @@
+/*!
+    @file MmioTrace.hpp
+
+    @brief Kernel code to map traced MMIO ranges, and VMM code to emulate and
+        record access to them.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "Svm.hpp"
+#include "VmmMain.hpp"
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+InitializeMmioTrace (
+    VOID
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CleanupMmioTrace (
+    VOID
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+BOOLEAN
+HandleMmioTraceAccess (
+    _Inout_ PVMCB GuestVmcb,
+    _Inout_ PGUEST_REGISTERS GuestRegisters
+    );
@@ -0,0 +1,501 @@
+/*!
+    @file MsrTable.cpp
+
+    @brief Kernel code to probe MSRs before virtualization, and VMM code to
+        emulate access to them.
+
+    @details MSRs outside the ranges covered by the MSR permissions map always
+        cause #VMEXIT, and the VMM cannot safely execute RDMSR or WRMSR for
+        them on behalf of the guest, because #GP raised in the host context is
+        fatal. To avoid this, MSRs in k_MsrProbeRanges are read with SEH on
+        each processor before virtualization, and the results are kept in a
+        sorted table of implemented MSRs. The VMM looks up the table and
+        injects #GP for unimplemented MSRs and for writes to read-only MSRs,
+        and returns read-only values from the table, without executing RDMSR
+        or WRMSR. Any MSR not in the table, including those outside
+        k_MsrProbeRanges, is handled as unimplemented, since the whole 32-bit
+        MSR space cannot be probed. Implemented MSRs outside the ranges of the
+        MSR permissions map are expected only in the probed ranges; a range
+        found to have more has to be added to k_MsrProbeRanges.
+
+        Only MSRs that are read-only by definition are answered from the
+        table. MSRs reporting state, such as MCA_STATUS, can change at any
+        time and are passed-through.
+
+        MSRs implemented only on some processors are handled as unimplemented
+        on all processors, so that the guest observes the same behaviour
+        regardless of the processor it runs on.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "MsrTable.hpp"
+#include "Common.hpp"
+#include "Virtualization.hpp"
+
+//
+// A range of MSRs to probe. MSRs in the range are grouped into blocks of
+// Stride MSRs, and ones whose offsets in the block are set in ReadOnlyOffsets
+// are read-only.
+//
+typedef struct _MSR_PROBE_RANGE
+{
+    UINT32 Base;
+    UINT32 Count;
+    UINT32 Stride;
+    UINT32 ReadOnlyOffsets;
+} MSR_PROBE_RANGE, *PMSR_PROBE_RANGE;
+
+//
+// The ranges of MSRs to probe, sorted by Base. Those must be outside the
+// ranges covered by the MSR permissions map.
+//
+static const MSR_PROBE_RANGE k_MsrProbeRanges[] =
+{
+    //
+    // The range reserved for hypervisors. Not implemented unless another
+    // hypervisor is present, and accessed by software detecting hypervisors.
+    //
+    { 0x40000000, 0x200, 1, 0, },
+
+    //
+    // The Scalable MCA registers, 16 for each of up to 64 banks. MCA_IPID at
+    // the offset 5 is read-only. See "Machine Check Architecture" in the PPR
+    // for the processor.
+    //
+    { 0xc0002000, 0x400, 16, 1UL << 5, },
+};
+
+//
+// The probe results of an MSR, accumulated across processors.
+//
+static constexpr UCHAR k_MsrProbeImplemented = 0x1;
+static constexpr UCHAR k_MsrProbeUnimplemented = 0x2;
+
+//
+// MSR_TABLE_ENTRY::ValueIndex of writable MSRs.
+//
+static constexpr UINT32 k_MsrTableNoValue = MAXUINT32;
+
+typedef struct _MSR_TABLE_ENTRY
+{
+    UINT32 Msr;
+
+    //
+    // The index of the values of the read-only MSR in MSR_TABLE::Values, or
+    // k_MsrTableNoValue if the MSR is writable.
+    //
+    UINT32 ValueIndex;
+} MSR_TABLE_ENTRY, *PMSR_TABLE_ENTRY;
+
+typedef struct _MSR_TABLE
+{
+    //
+    // Implemented MSRs in k_MsrProbeRanges sorted by Msr. MSRs not in this
+    // array are unimplemented.
+    //
+    ULONG EntryCount;
+    PMSR_TABLE_ENTRY Entries;
+
+    //
+    // The values of read-only MSRs for each processor, indexed by
+    // ValueIndex * ProcessorCount + the processor index, since some of them,
+    // such as MCA_IPID of per core banks, differ between processors.
+    //
+    ULONG ProcessorCount;
+    PULONG64 Values;
+} MSR_TABLE, *PMSR_TABLE;
+
+//
+// The table used by the VMM. Entries is NULL when the table is not built.
+//
+static MSR_TABLE g_MsrTable;
+
+/*!
+    @brief Executes RDMSR and handles #GP.
+
+    @param[in] Msr - The MSR to read.
+
+    @param[out] Value - The address to receive the value of the MSR.
+
+    @return TRUE if the MSR is implemented; otherwise, FALSE.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Success_(return)
+_Check_return_
+BOOLEAN
+ReadMsrSafely (
+    _In_ UINT32 Msr,
+    _Out_ PULONG64 Value
+    )
+{
+    BOOLEAN implemented;
+
+    PAGED_CODE();
+
+    __try
+    {
+        *Value = __readmsr(Msr);
+        implemented = TRUE;
+    }
+#pragma prefast(suppress : __WARNING_EXCEPTIONEXECUTEHANDLER, "Always want to handle exception")
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        implemented = FALSE;
+    }
+    return implemented;
+}
+
+/*!
+    @brief Records whether each MSR in k_MsrProbeRanges is implemented on the
+        current processor.
+
+    @param[in,out] Context - The array of probe results indexed by the position
+        of the MSR in k_MsrProbeRanges.
+
+    @return Always STATUS_SUCCESS.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+ProbeMsrs (
+    _Inout_ PVOID Context
+    )
+{
+    PUCHAR results;
+    ULONG position;
+    ULONG64 value;
+
+    PAGED_CODE();
+
+    results = static_cast<PUCHAR>(Context);
+    position = 0;
+    for (const auto& range : k_MsrProbeRanges)
+    {
+        for (UINT32 i = 0; i < range.Count; ++i, ++position)
+        {
+            SetFlag(results[position],
+                    (ReadMsrSafely(range.Base + i, &value) != FALSE) ?
+                        k_MsrProbeImplemented : k_MsrProbeUnimplemented);
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+/*!
+    @brief Reads the values of read-only MSRs on the current processor.
+
+    @param[in,out] Context - The table being built.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+ReadReadOnlyMsrs (
+    _Inout_ PVOID Context
+    )
+{
+    NTSTATUS status;
+    PMSR_TABLE table;
+    ULONG processorIndex;
+
+    PAGED_CODE();
+
+    table = static_cast<PMSR_TABLE>(Context);
+    processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+    NT_ASSERT(processorIndex < table->ProcessorCount);
+
+    for (ULONG i = 0; i < table->EntryCount; ++i)
+    {
+        const MSR_TABLE_ENTRY* entry;
+        PULONG64 value;
+
+        entry = &table->Entries[i];
+        if (entry->ValueIndex == k_MsrTableNoValue)
+        {
+            continue;
+        }
+
+        value = &table->Values[entry->ValueIndex * table->ProcessorCount +
+                               processorIndex];
+        if (ReadMsrSafely(entry->Msr, value) == FALSE)
+        {
+            LOGGING_LOG_ERROR("MSR %08x became unimplemented", entry->Msr);
+            status = STATUS_UNSUCCESSFUL;
+            goto Exit;
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Probes MSRs on all processors and builds the table used by the VMM.
+
+    @details This function must be called before processors are virtualized.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+InitializeMsrTable (
+    VOID
+    )
+{
+    NTSTATUS status;
+    PUCHAR results;
+    ULONG probeCount;
+    ULONG position;
+    ULONG readOnlyCount;
+    SIZE_T tableSize;
+    PVOID tableMemory;
+    MSR_TABLE table;
+
+    PAGED_CODE();
+
+    NT_ASSERT(g_MsrTable.Entries == nullptr);
+
+    tableMemory = nullptr;
+
+    probeCount = 0;
+    for (const auto& range : k_MsrProbeRanges)
+    {
+        probeCount += range.Count;
+    }
+
+    results = static_cast<PUCHAR>(ExAllocatePoolWithTag(PagedPool,
+                                                        probeCount,
+                                                        k_PoolTag));
+    if (results == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %lu", probeCount);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(results, probeCount);
+
+    status = ExecuteOnEachProcessor(ProbeMsrs, results, nullptr);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ExecuteOnEachProcessor failed : %08x", status);
+        goto Exit;
+    }
+
+    //
+    // Count implemented MSRs to size the table. An MSR implemented only on
+    // some processors is left out of the table and handled as unimplemented,
+    // since passing-through access to it would cause #GP only on some
+    // processors, and on those processors, in the host context.
+    //
+    table.EntryCount = 0;
+    readOnlyCount = 0;
+    position = 0;
+    for (const auto& range : k_MsrProbeRanges)
+    {
+        for (UINT32 i = 0; i < range.Count; ++i, ++position)
+        {
+            if (BooleanFlagOn(results[position], k_MsrProbeImplemented) == FALSE)
+            {
+                continue;
+            }
+
+            if (BooleanFlagOn(results[position], k_MsrProbeUnimplemented) != FALSE)
+            {
+                LOGGING_LOG_WARN("MSR %08x is implemented only on some processors",
+                                 range.Base + i);
+                continue;
+            }
+
+            table.EntryCount++;
+            if (BooleanFlagOn(range.ReadOnlyOffsets, 1UL << (i % range.Stride)) != FALSE)
+            {
+                readOnlyCount++;
+            }
+        }
+    }
+
+    table.ProcessorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    tableSize = sizeof(MSR_TABLE_ENTRY) * table.EntryCount +
+                sizeof(ULONG64) * readOnlyCount * table.ProcessorCount;
+    tableMemory = ExAllocatePoolWithTag(NonPagedPool,
+                                        max(tableSize, 1),
+                                        k_PoolTag);
+    if (tableMemory == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu", tableSize);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    table.Entries = static_cast<PMSR_TABLE_ENTRY>(tableMemory);
+    table.Values = static_cast<PULONG64>(Add2Ptr(
+                        tableMemory,
+                        sizeof(MSR_TABLE_ENTRY) * table.EntryCount));
+
+    //
+    // Fill the table. Entries are sorted as k_MsrProbeRanges is sorted.
+    //
+    table.EntryCount = 0;
+    readOnlyCount = 0;
+    position = 0;
+    for (const auto& range : k_MsrProbeRanges)
+    {
+        for (UINT32 i = 0; i < range.Count; ++i, ++position)
+        {
+            PMSR_TABLE_ENTRY entry;
+
+            if ((BooleanFlagOn(results[position], k_MsrProbeImplemented) == FALSE) ||
+                (BooleanFlagOn(results[position], k_MsrProbeUnimplemented) != FALSE))
+            {
+                continue;
+            }
+
+            entry = &table.Entries[table.EntryCount++];
+            entry->Msr = range.Base + i;
+            entry->ValueIndex = k_MsrTableNoValue;
+            if (BooleanFlagOn(range.ReadOnlyOffsets, 1UL << (i % range.Stride)) != FALSE)
+            {
+                entry->ValueIndex = readOnlyCount++;
+            }
+        }
+    }
+
+    status = ExecuteOnEachProcessor(ReadReadOnlyMsrs, &table, nullptr);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("ExecuteOnEachProcessor failed : %08x", status);
+        goto Exit;
+    }
+
+    LOGGING_LOG_INFO("Probed %lu MSRs : %lu implemented, %lu read-only",
+                     probeCount,
+                     table.EntryCount,
+                     readOnlyCount);
+
+    g_MsrTable = table;
+    tableMemory = nullptr;
+
+Exit:
+    if (tableMemory != nullptr)
+    {
+        ExFreePoolWithTag(tableMemory, k_PoolTag);
+    }
+    if (results != nullptr)
+    {
+        ExFreePoolWithTag(results, k_PoolTag);
+    }
+    return status;
+}
+
+/*!
+    @brief Frees the MSR table.
+
+    @details This function must be called after processors are de-virtualized.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+CleanupMsrTable (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    if (g_MsrTable.Entries == nullptr)
+    {
+        return;
+    }
+
+    ExFreePoolWithTag(g_MsrTable.Entries, k_PoolTag);
+    RtlZeroMemory(&g_MsrTable, sizeof(g_MsrTable));
+}
+
+/*!
+    @brief Looks up the MSR table for how access to the MSR should be handled.
+
+    @param[in] Msr - The MSR being accessed.
+
+    @param[out] Value - The address to receive the value of the MSR on the
+        current processor when MsrReadOnly is returned.
+
+    @return How access to the MSR should be handled.
+ */
+_Use_decl_annotations_
+MSR_TABLE_RESULT
+LookupMsrTable (
+    UINT32 Msr,
+    PULONG64 Value
+    )
+{
+    MSR_TABLE_RESULT result;
+    ULONG low, high;
+    ULONG processorIndex;
+
+    *Value = 0;
+
+    result = MsrNotProbed;
+    if (g_MsrTable.Entries == nullptr)
+    {
+        goto Exit;
+    }
+
+    result = MsrUnimplemented;
+
+    //
+    // Binary search the implemented MSRs.
+    //
+    low = 0;
+    high = g_MsrTable.EntryCount;
+    while (low < high)
+    {
+        const MSR_TABLE_ENTRY* entry;
+        ULONG middle;
+
+        middle = low + (high - low) / 2;
+        entry = &g_MsrTable.Entries[middle];
+        if (entry->Msr < Msr)
+        {
+            low = middle + 1;
+        }
+        else if (entry->Msr > Msr)
+        {
+            high = middle;
+        }
+        else
+        {
+            result = MsrImplemented;
+            if (entry->ValueIndex == k_MsrTableNoValue)
+            {
+                break;
+            }
+
+            //
+            // Pass-through on a processor added after the table was built.
+            //
+            processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+            if (processorIndex >= g_MsrTable.ProcessorCount)
+            {
+                break;
+            }
+
+            result = MsrReadOnly;
+            *Value = g_MsrTable.Values[entry->ValueIndex * g_MsrTable.ProcessorCount +
+                                       processorIndex];
+            break;
+        }
+    }
+
+Exit:
+    return result;
+}
@@ -0,0 +1,62 @@
+/*!
+    @file MsrTable.hpp
+
+    @brief Kernel code to probe MSRs before virtualization, and VMM code to
+        emulate access to them.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+
+//
+// How access to an MSR should be handled by the VMM.
+//
+typedef enum _MSR_TABLE_RESULT
+{
+    //
+    // The MSR table is not built. Access has to be passed-through.
+    //
+    MsrNotProbed,
+
+    //
+    // The MSR is not implemented. Both RDMSR and WRMSR cause #GP.
+    //
+    MsrUnimplemented,
+
+    //
+    // The MSR is implemented and writable. Access has to be passed-through.
+    //
+    MsrImplemented,
+
+    //
+    // The MSR is implemented and read-only. RDMSR returns the probed value, and
+    // WRMSR causes #GP.
+    //
+    MsrReadOnly,
+} MSR_TABLE_RESULT, *PMSR_TABLE_RESULT;
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+InitializeMsrTable (
+    VOID
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CleanupMsrTable (
+    VOID
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+MSR_TABLE_RESULT
+LookupMsrTable (
+    _In_ UINT32 Msr,
+    _Out_ PULONG64 Value
+    );
@@ -15,6 +15,11 @@
 //
 #define SVM_MSR_PERMISSIONS_MAP_SIZE    (PAGE_SIZE * 2)
 
+//
+// A size of the I/O permissions map.
+//
+#define SVM_IO_PERMISSIONS_MAP_SIZE     (PAGE_SIZE * 3)
+
 //
 // See "SVM Related MSRs"
 //
@@ -27,9 +32,12 @@
 // See "VMCB Layout, Control Area"
 //
 #define SVM_INTERCEPT_MISC1_CPUID       (1UL << 18)
+#define SVM_INTERCEPT_MISC1_IOIO_PROT   (1UL << 27)
 #define SVM_INTERCEPT_MISC1_MSR_PROT    (1UL << 28)
 #define SVM_INTERCEPT_MISC2_VMRUN       (1UL << 0)
 #define SVM_NP_ENABLE_NP_ENABLE         (1UL << 0)
+#define SVM_TLB_CONTROL_DO_NOTHING      0
+#define SVM_TLB_CONTROL_FLUSH_ALL       1
 
 typedef struct _VMCB_CONTROL_AREA
 {
@@ -214,6 +222,35 @@ typedef struct _NPF_EXITINFO1
 static_assert(sizeof(NPF_EXITINFO1) == 8,
               "NPF_EXITINFO1 size mismatch");
 
+//
+// See "IOIO Intercepts"
+//
+typedef struct _IOIO_EXITINFO1
+{
+    union
+    {
+        UINT64 AsUInt64;
+        struct
+        {
+            UINT64 Input : 1;                   // [0]
+            UINT64 Reserved1 : 1;               // [1]
+            UINT64 String : 1;                  // [2]
+            UINT64 Repeat : 1;                  // [3]
+            UINT64 Size8 : 1;                   // [4]
+            UINT64 Size16 : 1;                  // [5]
+            UINT64 Size32 : 1;                  // [6]
+            UINT64 Address16 : 1;               // [7]
+            UINT64 Address32 : 1;               // [8]
+            UINT64 Address64 : 1;               // [9]
+            UINT64 Segment : 3;                 // [10:12]
+            UINT64 Reserved2 : 3;               // [13:15]
+            UINT64 Port : 16;                   // [16:31]
+        } Fields;
+    };
+} IOIO_EXITINFO1, *PIOIO_EXITINFO1;
+static_assert(sizeof(IOIO_EXITINFO1) == 8,
+              "IOIO_EXITINFO1 size mismatch");
+
 //
 // See "SVM Intercept Codes"
 //
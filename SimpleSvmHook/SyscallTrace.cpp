@@ -0,0 +1,622 @@
+/*!
+    @file SyscallTrace.cpp
+
+    @brief Kernel code to build syscall entry tracing stubs, and VMM code to
+        redirect LSTAR to them.
+
+    @details When enabled, the guest's LSTAR on each processor points to a
+        copy of k_SyscallTraceCode instead of the system call handler of the
+        kernel. The stub counts the system call number in a histogram and
+        records it with the TSC in a ring, then jumps to the original LSTAR.
+        No #VMEXIT occurs on this path, and it costs a few tens of cycles
+        mostly for RDTSC.
+
+        The stub runs right after SYSCALL, where RSP and GS still belong to
+        the user mode, so it saves registers to its own data with RIP-relative
+        addressing instead of to the stack. This is safe without a lock
+        because each processor has its own stub and SYSCALL clears IF through
+        SFMASK. Data is placed on the page following the code to avoid stores
+        near the instructions being executed. RCX and R11 set by SYSCALL are
+        not modified.
+
+        Read and write access to LSTAR is intercepted so that the guest keeps
+        seeing the original value. Tracing is not enabled when KVA shadow is
+        enabled since the stub is not mapped with the user mode CR3, which is
+        still in use at the system call entry.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#include "SyscallTrace.hpp"
+#include "Common.hpp"
+#include "Configuration.hpp"
+
+EXTERN_C
+NTSYSAPI
+NTSTATUS
+NTAPI
+ZwQuerySystemInformation (
+    _In_ ULONG SystemInformationClass,
+    _Out_writes_bytes_opt_(SystemInformationLength) PVOID SystemInformation,
+    _In_ ULONG SystemInformationLength,
+    _Out_opt_ PULONG ReturnLength
+    );
+
+//
+// SystemKernelVaShadowInformation and its KvaShadowEnabled flag.
+//
+static constexpr ULONG k_SystemKernelVaShadowInformation = 196;
+static constexpr ULONG k_KvaShadowEnabled = 0x1;
+
+//
+// The number of histogram buckets for each system call number, and the number
+// of records in the ring. Numbers larger than or equal to the bucket count are
+// counted in the extra bucket at the end. Numbers of both the kernel and
+// win32k services are below 0x2000.
+//
+static constexpr ULONG k_SyscallTraceBucketCount = 0x2000;
+static constexpr ULONG k_SyscallTraceRingSize = 0x400;
+static_assert((k_SyscallTraceRingSize & (k_SyscallTraceRingSize - 1)) == 0,
+              "Power of two");
+
+typedef struct _SYSCALL_TRACE_RECORD
+{
+    UINT64 TimeStamp;
+    UINT64 Number;
+} SYSCALL_TRACE_RECORD, *PSYSCALL_TRACE_RECORD;
+static_assert(sizeof(SYSCALL_TRACE_RECORD) == 16, "Size check");
+
+//
+// The stub and data for a processor. Must be page aligned.
+//
+typedef struct _SYSCALL_TRACE_STUB
+{
+    UCHAR Code[PAGE_SIZE];
+
+    //
+    // Written only by the stub, except OriginalLstar also written by the VMM.
+    //
+    UINT64 SavedRax;
+    UINT64 SavedRdx;
+    UINT64 SavedRbx;
+    UINT64 OriginalLstar;
+    ULONG RingIndex;
+    ULONG Reserved1;
+    UINT64 Histogram[k_SyscallTraceBucketCount + 1];
+    SYSCALL_TRACE_RECORD Ring[k_SyscallTraceRingSize];
+} SYSCALL_TRACE_STUB, *PSYSCALL_TRACE_STUB;
+
+//
+// A byte array that represents the below x64 code. disp32 values are zero and
+// fixed up with k_SyscallTraceFixups.
+//  48890500000000   mov     [SavedRax], rax
+//  48891500000000   mov     [SavedRdx], rdx
+//  48891d00000000   mov     [SavedRbx], rbx
+//  0f31             rdtsc
+//  48c1e220         shl     rdx, 20h
+//  480bd0           or      rdx, rax
+//  8b1d00000000     mov     ebx, [RingIndex]
+//  8d4301           lea     eax, [rbx+1]
+//  25ff030000       and     eax, k_SyscallTraceRingSize - 1
+//  890500000000     mov     [RingIndex], eax
+//  48c1e304         shl     rbx, 4
+//  488d0500000000   lea     rax, [Ring]
+//  48891403         mov     [rbx+rax], rdx                 ; TimeStamp
+//  488b1500000000   mov     rdx, [SavedRax]
+//  4889540308       mov     [rbx+rax+8], rdx               ; Number
+//  89d3             mov     ebx, edx
+//  81fb00200000     cmp     ebx, k_SyscallTraceBucketCount
+//  7205             jb      count
+//  bb00200000       mov     ebx, k_SyscallTraceBucketCount
+// count:
+//  488d0500000000   lea     rax, [Histogram]
+//  48ff04d8         inc     qword ptr [rax+rbx*8]
+//  488b0500000000   mov     rax, [SavedRax]
+//  488b1500000000   mov     rdx, [SavedRdx]
+//  488b1d00000000   mov     rbx, [SavedRbx]
+//  ff2500000000     jmp     qword ptr [OriginalLstar]
+//
+static const UCHAR k_SyscallTraceCode[] =
+{
+    0x48, 0x89, 0x05, 0x00, 0x00, 0x00, 0x00,
+    0x48, 0x89, 0x15, 0x00, 0x00, 0x00, 0x00,
+    0x48, 0x89, 0x1d, 0x00, 0x00, 0x00, 0x00,
+    0x0f, 0x31,
+    0x48, 0xc1, 0xe2, 0x20,
+    0x48, 0x0b, 0xd0,
+    0x8b, 0x1d, 0x00, 0x00, 0x00, 0x00,
+    0x8d, 0x43, 0x01,
+    0x25, 0xff, 0x03, 0x00, 0x00,
+    0x89, 0x05, 0x00, 0x00, 0x00, 0x00,
+    0x48, 0xc1, 0xe3, 0x04,
+    0x48, 0x8d, 0x05, 0x00, 0x00, 0x00, 0x00,
+    0x48, 0x89, 0x14, 0x03,
+    0x48, 0x8b, 0x15, 0x00, 0x00, 0x00, 0x00,
+    0x48, 0x89, 0x54, 0x03, 0x08,
+    0x89, 0xd3,
+    0x81, 0xfb, 0x00, 0x20, 0x00, 0x00,
+    0x72, 0x05,
+    0xbb, 0x00, 0x20, 0x00, 0x00,
+    0x48, 0x8d, 0x05, 0x00, 0x00, 0x00, 0x00,
+    0x48, 0xff, 0x04, 0xd8,
+    0x48, 0x8b, 0x05, 0x00, 0x00, 0x00, 0x00,
+    0x48, 0x8b, 0x15, 0x00, 0x00, 0x00, 0x00,
+    0x48, 0x8b, 0x1d, 0x00, 0x00, 0x00, 0x00,
+    0xff, 0x25, 0x00, 0x00, 0x00, 0x00,
+};
+static_assert(sizeof(k_SyscallTraceCode) == 130, "Size check");
+static_assert((k_SyscallTraceRingSize == 0x400) &&
+              (k_SyscallTraceBucketCount == 0x2000),
+              "Update the immediate values in k_SyscallTraceCode");
+
+//
+// A RIP-relative operand of k_SyscallTraceCode. InstructionEnd is the offset
+// of the next instruction, where the disp32 ends.
+//
+typedef struct _SYSCALL_TRACE_FIXUP
+{
+    ULONG InstructionEnd;
+    ULONG FieldOffset;
+} SYSCALL_TRACE_FIXUP, *PSYSCALL_TRACE_FIXUP;
+
+static const SYSCALL_TRACE_FIXUP k_SyscallTraceFixups[] =
+{
+    { 7, FIELD_OFFSET(SYSCALL_TRACE_STUB, SavedRax), },
+    { 14, FIELD_OFFSET(SYSCALL_TRACE_STUB, SavedRdx), },
+    { 21, FIELD_OFFSET(SYSCALL_TRACE_STUB, SavedRbx), },
+    { 36, FIELD_OFFSET(SYSCALL_TRACE_STUB, RingIndex), },
+    { 50, FIELD_OFFSET(SYSCALL_TRACE_STUB, RingIndex), },
+    { 61, FIELD_OFFSET(SYSCALL_TRACE_STUB, Ring), },
+    { 72, FIELD_OFFSET(SYSCALL_TRACE_STUB, SavedRax), },
+    { 99, FIELD_OFFSET(SYSCALL_TRACE_STUB, Histogram), },
+    { 110, FIELD_OFFSET(SYSCALL_TRACE_STUB, SavedRax), },
+    { 117, FIELD_OFFSET(SYSCALL_TRACE_STUB, SavedRdx), },
+    { 124, FIELD_OFFSET(SYSCALL_TRACE_STUB, SavedRbx), },
+    { 130, FIELD_OFFSET(SYSCALL_TRACE_STUB, OriginalLstar), },
+};
+
+typedef struct _SYSCALL_TRACE
+{
+    //
+    // The stubs indexed by the processor index. Stubs is NULL when tracing is
+    // not enabled.
+    //
+    ULONG ProcessorCount;
+    PSYSCALL_TRACE_STUB* Stubs;
+} SYSCALL_TRACE, *PSYSCALL_TRACE;
+
+static SYSCALL_TRACE g_SyscallTrace;
+
+/*!
+    @brief Tests whether KVA shadow is enabled.
+
+    @return TRUE if KVA shadow is enabled; otherwise, FALSE.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+BOOLEAN
+IsKvaShadowEnabled (
+    VOID
+    )
+{
+    NTSTATUS status;
+    ULONG flags;
+
+    PAGED_CODE();
+
+    //
+    // The information class is not implemented without KVA shadow support.
+    //
+    flags = 0;
+    status = ZwQuerySystemInformation(k_SystemKernelVaShadowInformation,
+                                      &flags,
+                                      sizeof(flags),
+                                      nullptr);
+    return (NT_SUCCESS(status) &&
+            (BooleanFlagOn(flags, k_KvaShadowEnabled) != FALSE));
+}
+
+/*!
+    @brief Frees the stubs.
+
+    @param[in,out] SyscallTrace - The stubs to free.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+FreeSyscallTraceStubs (
+    _Inout_ PSYSCALL_TRACE SyscallTrace
+    )
+{
+    PAGED_CODE();
+
+    for (ULONG i = 0; i < SyscallTrace->ProcessorCount; ++i)
+    {
+        if (SyscallTrace->Stubs[i] != nullptr)
+        {
+            ExFreePoolWithTag(SyscallTrace->Stubs[i], k_PoolTag);
+        }
+    }
+    ExFreePoolWithTag(SyscallTrace->Stubs, k_PoolTag);
+    RtlZeroMemory(SyscallTrace, sizeof(*SyscallTrace));
+}
+
+/*!
+    @brief Builds the stubs for each processor if tracing is configured.
+
+    @details This function must be called before processors are virtualized.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+NTSTATUS
+InitializeSyscallTrace (
+    VOID
+    )
+{
+    NTSTATUS status;
+    SYSCALL_TRACE syscallTrace;
+    SIZE_T stubsSize;
+
+    PAGED_CODE();
+
+    NT_ASSERT(g_SyscallTrace.Stubs == nullptr);
+
+    syscallTrace.Stubs = nullptr;
+
+    if (g_Configuration.SyscallTrace == 0)
+    {
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+
+    if (IsKvaShadowEnabled() != FALSE)
+    {
+        LOGGING_LOG_WARN("Syscall entries are not traced with KVA shadow");
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+
+    syscallTrace.ProcessorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    stubsSize = sizeof(PSYSCALL_TRACE_STUB) * syscallTrace.ProcessorCount;
+    syscallTrace.Stubs = static_cast<PSYSCALL_TRACE_STUB*>(ExAllocatePoolWithTag(
+                                                                NonPagedPool,
+                                                                stubsSize,
+                                                                k_PoolTag));
+    if (syscallTrace.Stubs == nullptr)
+    {
+        LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu", stubsSize);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(syscallTrace.Stubs, stubsSize);
+
+    for (ULONG i = 0; i < syscallTrace.ProcessorCount; ++i)
+    {
+        PSYSCALL_TRACE_STUB stub;
+
+        //
+        // Allocations of a page or larger are page aligned.
+        //
+#pragma prefast(suppress : 30030, "Intentionally executable")
+        stub = static_cast<PSYSCALL_TRACE_STUB>(ExAllocatePoolWithTag(
+                                                    NonPagedPoolExecute,
+                                                    sizeof(*stub),
+                                                    k_PoolTag));
+        if (stub == nullptr)
+        {
+            LOGGING_LOG_ERROR("ExAllocatePoolWithTag failed : %Iu", sizeof(*stub));
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        NT_ASSERT(PAGE_ALIGN(stub) == stub);
+        syscallTrace.Stubs[i] = stub;
+
+        RtlZeroMemory(stub, sizeof(*stub));
+        RtlCopyMemory(stub->Code, k_SyscallTraceCode, sizeof(k_SyscallTraceCode));
+        for (const auto& fixup : k_SyscallTraceFixups)
+        {
+            *reinterpret_cast<PLONG>(&stub->Code[fixup.InstructionEnd - sizeof(LONG)]) =
+                static_cast<LONG>(fixup.FieldOffset - fixup.InstructionEnd);
+        }
+    }
+
+    LOGGING_LOG_INFO("Tracing syscall entries on %lu processors",
+                     syscallTrace.ProcessorCount);
+
+    g_SyscallTrace = syscallTrace;
+    syscallTrace.Stubs = nullptr;
+    status = STATUS_SUCCESS;
+
+Exit:
+    if (syscallTrace.Stubs != nullptr)
+    {
+        FreeSyscallTraceStubs(&syscallTrace);
+    }
+    return status;
+}
+
+/*!
+    @brief Reports the ring of the stub from the oldest record.
+
+    @details The number of records and the TSC ticks they span are logged,
+        and each record is logged at the debug level with the ticks since the
+        previous record.
+
+    @param[in] ProcessorIndex - The index of the processor of the stub.
+
+    @param[in] Stub - The stub to report.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+ReportSyscallTraceRing (
+    _In_ ULONG ProcessorIndex,
+    _In_ const SYSCALL_TRACE_STUB* Stub
+    )
+{
+    const SYSCALL_TRACE_RECORD* record;
+    const SYSCALL_TRACE_RECORD* oldest;
+    const SYSCALL_TRACE_RECORD* previous;
+    ULONG recordCount;
+
+    PAGED_CODE();
+
+    //
+    // RingIndex is the next record to be written, that is, the oldest one.
+    // Records not written yet have zero TimeStamp.
+    //
+    oldest = previous = nullptr;
+    recordCount = 0;
+    for (ULONG i = 0; i < k_SyscallTraceRingSize; ++i)
+    {
+        record = &Stub->Ring[(Stub->RingIndex + i) & (k_SyscallTraceRingSize - 1)];
+        if (record->TimeStamp == 0)
+        {
+            continue;
+        }
+
+        LOGGING_LOG_DEBUG("Processor %lu: syscall %04llx at %llu (+%llu)",
+                          ProcessorIndex,
+                          record->Number,
+                          record->TimeStamp,
+                          (previous != nullptr) ?
+                            record->TimeStamp - previous->TimeStamp : 0);
+        if (oldest == nullptr)
+        {
+            oldest = record;
+        }
+        previous = record;
+        recordCount++;
+    }
+
+    if (recordCount != 0)
+    {
+        LOGGING_LOG_INFO("Processor %lu: last %lu syscalls in %llu TSC ticks",
+                         ProcessorIndex,
+                         recordCount,
+                         previous->TimeStamp - oldest->TimeStamp);
+    }
+}
+
+/*!
+    @brief Reports the traced syscall entries and frees the stubs.
+
+    @details This function must be called after processors are de-virtualized.
+ */
+SIMPLESVMHOOK_PAGED
+_Use_decl_annotations_
+VOID
+CleanupSyscallTrace (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    if (g_SyscallTrace.Stubs == nullptr)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < g_SyscallTrace.ProcessorCount; ++i)
+    {
+        const SYSCALL_TRACE_STUB* stub;
+        UINT64 total;
+        ULONG mostFrequent;
+
+        stub = g_SyscallTrace.Stubs[i];
+        total = 0;
+        mostFrequent = 0;
+        for (ULONG number = 0; number < RTL_NUMBER_OF(stub->Histogram); ++number)
+        {
+            total += stub->Histogram[number];
+            if (stub->Histogram[number] > stub->Histogram[mostFrequent])
+            {
+                mostFrequent = number;
+            }
+        }
+        LOGGING_LOG_INFO("Processor %lu: %llu syscalls, most frequently %04lx (%llu)",
+                         i,
+                         total,
+                         mostFrequent,
+                         stub->Histogram[mostFrequent]);
+        ReportSyscallTraceRing(i, stub);
+    }
+
+    FreeSyscallTraceStubs(&g_SyscallTrace);
+}
+
+/*!
+    @brief Tests whether syscall entries are traced.
+
+    @return TRUE if syscall entries are traced; otherwise, FALSE.
+ */
+_Use_decl_annotations_
+BOOLEAN
+IsSyscallTraceEnabled (
+    VOID
+    )
+{
+    return (g_SyscallTrace.Stubs != nullptr);
+}
+
+/*!
+    @brief Returns the stub for the current processor.
+
+    @return The stub for the current processor, or NULL if syscall entries are
+        not traced on the processor.
+ */
+static
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+PSYSCALL_TRACE_STUB
+GetCurrentSyscallTraceStub (
+    VOID
+    )
+{
+    PSYSCALL_TRACE_STUB stub;
+    ULONG processorIndex;
+
+    stub = nullptr;
+    if (g_SyscallTrace.Stubs == nullptr)
+    {
+        goto Exit;
+    }
+
+    //
+    // Not traced on a processor added after the stubs were built.
+    //
+    processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+    if (processorIndex >= g_SyscallTrace.ProcessorCount)
+    {
+        goto Exit;
+    }
+    stub = g_SyscallTrace.Stubs[processorIndex];
+
+Exit:
+    return stub;
+}
+
+/*!
+    @brief Points the guest's LSTAR to the stub for the current processor.
+
+    @details This function is called with VMCB that has just been saved with
+        the current LSTAR, before the processor is virtualized.
+
+    @param[in,out] GuestVmcb - The guest VMCB.
+ */
+_Use_decl_annotations_
+VOID
+RedirectSyscallEntry (
+    PVMCB GuestVmcb
+    )
+{
+    PSYSCALL_TRACE_STUB stub;
+
+    stub = GetCurrentSyscallTraceStub();
+    if (stub == nullptr)
+    {
+        goto Exit;
+    }
+
+    stub->OriginalLstar = GuestVmcb->StateSaveArea.LStar;
+    GuestVmcb->StateSaveArea.LStar = reinterpret_cast<UINT64>(stub->Code);
+
+Exit:
+    return;
+}
+
+/*!
+    @brief Restores the original value of the guest's LSTAR.
+
+    @details This function is called before the guest state is loaded to
+        de-virtualize the processor.
+
+    @param[in,out] GuestVmcb - The guest VMCB.
+ */
+_Use_decl_annotations_
+VOID
+RestoreSyscallEntry (
+    PVMCB GuestVmcb
+    )
+{
+    GuestVmcb->StateSaveArea.LStar = EmulateLstarRead(GuestVmcb);
+}
+
+/*!
+    @brief Returns the value of LSTAR the guest should read.
+
+    @param[in] GuestVmcb - The guest VMCB.
+
+    @return The original value if LSTAR points to the stub; otherwise, the
+        value of LSTAR.
+ */
+_Use_decl_annotations_
+UINT64
+EmulateLstarRead (
+    const VMCB* GuestVmcb
+    )
+{
+    const SYSCALL_TRACE_STUB* stub;
+    UINT64 value;
+
+    value = GuestVmcb->StateSaveArea.LStar;
+    stub = GetCurrentSyscallTraceStub();
+    if ((stub != nullptr) &&
+        (value == reinterpret_cast<UINT64>(stub->Code)))
+    {
+        value = stub->OriginalLstar;
+    }
+    return value;
+}
+
+/*!
+    @brief Updates the original value of LSTAR on write by the guest.
+
+    @details LSTAR keeps pointing to the stub, which jumps to the new value
+        from the next system call.
+
+    @param[in,out] GuestVmcb - The guest VMCB.
+
+    @param[in] Value - The value the guest writes.
+
+    @return TRUE if the value is written; FALSE if the value is not canonical
+        and #GP should be injected.
+ */
+_Use_decl_annotations_
+BOOLEAN
+EmulateLstarWrite (
+    PVMCB GuestVmcb,
+    UINT64 Value
+    )
+{
+    BOOLEAN written;
+    PSYSCALL_TRACE_STUB stub;
+
+    written = FALSE;
+    if (static_cast<UINT64>((static_cast<LONG64>(Value) << 16) >> 16) != Value)
+    {
+        goto Exit;
+    }
+
+    stub = GetCurrentSyscallTraceStub();
+    if (stub == nullptr)
+    {
+        GuestVmcb->StateSaveArea.LStar = Value;
+    }
+    else
+    {
+        stub->OriginalLstar = Value;
+        GuestVmcb->StateSaveArea.LStar = reinterpret_cast<UINT64>(stub->Code);
+    }
+    written = TRUE;
+
+Exit:
+    return written;
+}
@@ -0,0 +1,62 @@
+/*!
+    @file SyscallTrace.hpp
+
+    @brief Kernel code to build syscall entry tracing stubs, and VMM code to
+        redirect LSTAR to them.
+
+    @author Satoshi Tanda
+
+    @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+#include "Common.hpp"
+#include "Svm.hpp"
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+InitializeSyscallTrace (
+    VOID
+    );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CleanupSyscallTrace (
+    VOID
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+BOOLEAN
+IsSyscallTraceEnabled (
+    VOID
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+RedirectSyscallEntry (
+    _Inout_ PVMCB GuestVmcb
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+RestoreSyscallEntry (
+    _Inout_ PVMCB GuestVmcb
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+UINT64
+EmulateLstarRead (
+    _In_ const VMCB* GuestVmcb
+    );
+
+_IRQL_requires_max_(HIGH_LEVEL)
+_Check_return_
+BOOLEAN
+EmulateLstarWrite (
+    _Inout_ PVMCB GuestVmcb,
+    _In_ UINT64 Value
+    );
@@ -3,6 +3,16 @@
 
     @brief Kernel code to virtualize and de-virtualize processors.
 
+    @details The per processor data, VIRTUAL_PROCESSOR_DATA followed by
+        HOOK_DATA, of all processors on a NUMA node are carved from a single
+        region allocated on the node. The region is physically contiguous,
+        and its size is a power of two no smaller than 2MB and the physical
+        address is aligned to the size, so that it can be mapped with large
+        pages, letting #VMEXIT handling touch the host
+        stack, the VMCBs and the hook data through a single TLB entry. When the
+        region cannot be allocated, processors on the node allocate their data
+        individually as before.
+
     @author Satoshi Tanda
 
     @copyright Copyright (c) 2018-2021, Satoshi Tanda. All rights reserved.
@@ -12,7 +22,11 @@
 #include "x86_64.hpp"
 #include "Svm.hpp"
 #include "HookKernelProcessorData.hpp"
+#include "HookCommon.hpp"
 #include "VmmMain.hpp"
+#include "SyscallTrace.hpp"
+#include "IoPortTrace.hpp"
+#include "HookKernelMmioWorkingSet.hpp"
 
 EXTERN_C
 VOID
@@ -88,6 +102,254 @@ FreePageAlingedPhysicalMemory (
     ExFreePoolWithTag(BaseAddress, k_PoolTag);
 }
 
+//
+// The size and alignment of the large page.
+//
+static constexpr SIZE_T k_LargePageSize = 0x200000;
+
+//
+// The size of the per processor data in the region; VIRTUAL_PROCESSOR_DATA
+// followed by HOOK_DATA.
+//
+static constexpr SIZE_T k_ProcessorDataSlotSize =
+            sizeof(VIRTUAL_PROCESSOR_DATA) + ROUND_TO_PAGES(sizeof(HOOK_DATA));
+
+//
+// The region of the per processor data of a NUMA node.
+//
+typedef struct _PROCESSOR_DATA_REGION
+{
+    //
+    // The region, or NULL if processors on the node allocate their data
+    // individually.
+    //
+    PVOID Base;
+    SIZE_T Size;
+
+    //
+    // The number of slots, that is, the maximum number of processors on the
+    // node across all processor groups, and the number of slots taken.
+    // Processors take slots in the order they are virtualized.
+    //
+    ULONG SlotCount;
+    volatile LONG TakenSlotCount;
+} PROCESSOR_DATA_REGION, *PPROCESSOR_DATA_REGION;
+
+//
+// The regions of all NUMA nodes, indexed by the node number.
+//
+typedef struct _PROCESSOR_DATA_REGIONS
+{
+    ULONG Count;
+    PROCESSOR_DATA_REGION Regions[ANYSIZE_ARRAY];
+} PROCESSOR_DATA_REGIONS, *PPROCESSOR_DATA_REGIONS;
+
+/*!
+    @brief Allocates the per processor data region for each NUMA node.
+
+    @details Failure to allocate a region is not fatal. Processors on the node
+        allocate their data individually.
+
+    @param[out] Regions - The address to receive the regions.
+
+    @return STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+NTSTATUS
+AllocateProcessorDataRegions (
+    _Outptr_result_nullonfailure_ PPROCESSOR_DATA_REGIONS* Regions
+    )
+{
+    NTSTATUS status;
+    PPROCESSOR_DATA_REGIONS regions;
+    SIZE_T regionsSize;
+    ULONG nodeCount;
+    PPROCESSOR_DATA_REGION region;
+    PHYSICAL_ADDRESS lowest, highest, boundary;
+
+    PAGED_CODE();
+
+    *Regions = nullptr;
+
+    nodeCount = static_cast<ULONG>(KeQueryHighestNodeNumber()) + 1;
+    regionsSize = FIELD_OFFSET(PROCESSOR_DATA_REGIONS, Regions) +
+                  sizeof(PROCESSOR_DATA_REGION) * nodeCount;
+    regions = static_cast<PPROCESSOR_DATA_REGIONS>(ExAllocatePoolWithTag(
+                                                            NonPagedPool,
+                                                            regionsSize,
+                                                            k_PoolTag));
+    if (regions == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(regions, regionsSize);
+    regions->Count = nodeCount;
+
+    lowest.QuadPart = 0;
+    highest.QuadPart = MAXULONG64;
+    for (ULONG node = 0; node < nodeCount; ++node)
+    {
+        region = &regions->Regions[node];
+
+        //
+        // KeQueryNodeActiveAffinity only reports the processors in the primary
+        // group of the node, hence the maximum count across groups is used.
+        //
+        region->SlotCount = KeQueryNodeMaximumProcessorCount(
+                                                    static_cast<USHORT>(node));
+        if (region->SlotCount == 0)
+        {
+            continue;
+        }
+
+        //
+        // Round up the size to the power of two no smaller than the large
+        // page, and allocate it with the same boundary. As the region cannot
+        // cross the boundary, it is aligned to the size, and so, to the large
+        // page.
+        //
+        boundary.QuadPart = k_LargePageSize;
+        while (static_cast<SIZE_T>(boundary.QuadPart) <
+               k_ProcessorDataSlotSize * region->SlotCount)
+        {
+            boundary.QuadPart <<= 1;
+        }
+        region->Size = static_cast<SIZE_T>(boundary.QuadPart);
+
+        region->Base = MmAllocateContiguousNodeMemory(region->Size,
+                                                      lowest,
+                                                      highest,
+                                                      boundary,
+                                                      PAGE_READWRITE,
+                                                      node);
+        if (region->Base == nullptr)
+        {
+            LOGGING_LOG_WARN("MmAllocateContiguousNodeMemory failed : %lu", node);
+            continue;
+        }
+        RtlZeroMemory(region->Base, region->Size);
+        LOGGING_LOG_INFO("Per processor data region for node %lu: %p (%Iu bytes for %lu processors)",
+                         node,
+                         region->Base,
+                         region->Size,
+                         region->SlotCount);
+    }
+
+    *Regions = regions;
+    status = STATUS_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/*!
+    @brief Frees the regions allocated by AllocateProcessorDataRegions.
+
+    @param[in] Regions - The regions to free.
+ */
+SIMPLESVMHOOK_PAGED
+static
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+FreeProcessorDataRegions (
+    _In_ _Frees_ptr_ PPROCESSOR_DATA_REGIONS Regions
+    )
+{
+    PAGED_CODE();
+
+    for (ULONG i = 0; i < Regions->Count; ++i)
+    {
+        if (Regions->Regions[i].Base != nullptr)
+        {
+            MmFreeContiguousMemory(Regions->Regions[i].Base);
+        }
+    }
+    ExFreePoolWithTag(Regions, k_PoolTag);
+}
+
+/*!
+    @brief Takes a slot for the per processor data of the current processor
+        from the region of its node.
+
+    @param[in,out] Regions - The regions to take a slot from.
+
+    @return The address of the zero filled per processor data of the current
+        processor, or NULL if the region of the node is not allocated or has
+        no free slot.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+PVOID
+GetProcessorDataSlot (
+    _Inout_ PPROCESSOR_DATA_REGIONS Regions
+    )
+{
+    PVOID slot;
+    PPROCESSOR_DATA_REGION region;
+    ULONG slotIndex;
+
+    slot = nullptr;
+
+    region = &Regions->Regions[KeGetCurrentNodeNumber()];
+    if (region->Base == nullptr)
+    {
+        goto Exit;
+    }
+
+    slotIndex = static_cast<ULONG>(InterlockedIncrement(&region->TakenSlotCount)) - 1;
+    if (slotIndex >= region->SlotCount)
+    {
+        goto Exit;
+    }
+    NT_ASSERT((slotIndex + 1) * k_ProcessorDataSlotSize <= region->Size);
+
+    slot = Add2Ptr(region->Base, slotIndex * k_ProcessorDataSlotSize);
+
+Exit:
+    return slot;
+}
+
+/*!
+    @brief Tests whether the address is in any of the regions.
+
+    @param[in] Regions - The regions to test.
+
+    @param[in] Address - The address to test.
+
+    @return TRUE if the address is in any of the regions; otherwise, FALSE.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Check_return_
+BOOLEAN
+IsInProcessorDataRegions (
+    _In_ const PROCESSOR_DATA_REGIONS* Regions,
+    _In_ const VOID* Address
+    )
+{
+    BOOLEAN inRegion;
+    const PROCESSOR_DATA_REGION* region;
+
+    inRegion = FALSE;
+    for (ULONG i = 0; i < Regions->Count; ++i)
+    {
+        region = &Regions->Regions[i];
+        if ((region->Base != nullptr) &&
+            (Address >= region->Base) &&
+            (Address < Add2Ptr(region->Base, region->Size)))
+        {
+            inRegion = TRUE;
+            break;
+        }
+    }
+    return inRegion;
+}
+
 /*!
     @brief Executes a callback on all processors one-by-one.
 
@@ -110,14 +372,12 @@ FreePageAlingedPhysicalMemory (
         on all processors; otherwise, an appropriate error code.
  */
 SIMPLESVMHOOK_PAGED
-static
-_IRQL_requires_max_(APC_LEVEL)
-_Check_return_
+_Use_decl_annotations_
 NTSTATUS
 ExecuteOnEachProcessor (
-    _In_ NTSTATUS (*Callback)(PVOID),
-    _In_opt_ PVOID Context,
-    _Out_opt_ PULONG NumOfProcessorCompleted
+    NTSTATUS (*Callback)(PVOID),
+    PVOID Context,
+    PULONG NumOfProcessorCompleted
     )
 {
     NTSTATUS status;
@@ -248,8 +508,15 @@ DevirtualizeProcessor (
     //
     sharedVpDataPtr = static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA*>(Context);
     *sharedVpDataPtr = vpData->HostStackLayout.SharedVpData;
+    LOGGING_LOG_INFO("Time in the VMM: %llu cycles for %llu #VMEXITs.",
+                     vpData->VmmTime.ElapsedTsc,
+                     vpData->VmmTime.ExitCount);
     CleanupHookData(vpData->HookData);
-    FreePageAlingedPhysicalMemory(vpData);
+    if (IsInProcessorDataRegions((*sharedVpDataPtr)->ProcessorDataRegions,
+                                 vpData) == FALSE)
+    {
+        FreePageAlingedPhysicalMemory(vpData);
+    }
 
     return STATUS_SUCCESS;
 }
@@ -284,10 +551,17 @@ DevirtualizeAllProcessors (
                                                 nullptr)));
     if (sharedVpData != nullptr)
     {
+        FreeProcessorDataRegions(sharedVpData->ProcessorDataRegions);
         FreeContiguousMemory(sharedVpData->MsrPermissionsMap);
         FreePageAlingedPhysicalMemory(sharedVpData);
     }
 
+    //
+    // Save the MMIO pages recorded by all processors to map them when the NPT
+    // is built on the next load.
+    //
+    SaveMmioWorkingSet();
+
     LOGGING_LOG_INFO("The all processors have been de-virtualized.");
 }
 
@@ -443,11 +717,18 @@ PrepareForVirtualization (
 
     //
     // Also, configure to trigger #VMEXIT on MSR access as configured by the
-    // MSRPM. In our case, write to IA32_MSR_EFER is intercepted.
+    // MSRPM. In our case, write to IA32_MSR_EFER is intercepted, and so is
+    // access to IA32_MSR_LSTAR when syscall entries are traced.
     //
     VpData->GuestVmcb.ControlArea.InterceptMisc1 |= SVM_INTERCEPT_MISC1_MSR_PROT;
     VpData->GuestVmcb.ControlArea.MsrpmBasePa = msrpmPa.QuadPart;
 
+    //
+    // Intercept I/O access to the selected ports if any. This is relevant when
+    // processors are virtualized again after resume.
+    //
+    ConfigureIoInterception(&VpData->GuestVmcb);
+
     //
     // Specify guest's address space ID (ASID). TLB is maintained by the ID for
     // guests. Use the same value for all processors since all of them run a
@@ -521,6 +802,12 @@ PrepareForVirtualization (
     //
     __svm_vmsave(guestVmcbPa.QuadPart);
 
+    //
+    // Point the saved LSTAR to the tracing stub if syscall entries are traced.
+    // The host VMCB saved below keeps the original value.
+    //
+    RedirectSyscallEntry(&VpData->GuestVmcb);
+
     //
     // Store data to stack so that the host (hypervisor) can use those values.
     //
@@ -544,6 +831,74 @@ PrepareForVirtualization (
     __svm_vmsave(hostVmcbPa.QuadPart);
 }
 
+/*!
+    @brief Returns the TSC ticks spent in the VMM on the current processor.
+
+    @return The TSC ticks spent in the VMM.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG64
+QueryVmmElapsedTsc (
+    VOID
+    )
+{
+    int registers[4];
+
+    __cpuid(registers, CPUID_HV_VMM_TIME);
+    return ((static_cast<ULONG64>(static_cast<ULONG>(registers[3])) << 32) |
+            static_cast<ULONG>(registers[0]));
+}
+
+/*!
+    @brief Measures the #VMEXIT and VMRUN round trip on the current processor.
+
+    @details The round trip is the TSC ticks a CPUID takes in the guest minus
+        the ticks the VMM reports for it. The smallest value over some rounds
+        is taken to exclude interrupts.
+
+    @param[out] HookData - The processor associated hook data.
+ */
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+MeasureVmExitRoundTrip (
+    _Out_ PHOOK_DATA HookData
+    )
+{
+    static const ULONG k_MeasurementCount = 16;
+    ULONG64 roundTrip;
+
+    roundTrip = MAXULONG64;
+    for (ULONG i = 0; i < k_MeasurementCount; ++i)
+    {
+        ULONG64 vmmTscBefore;
+        ULONG64 vmmTscAfter;
+        ULONG64 guestTscBefore;
+        ULONG64 guestTscAfter;
+
+        //
+        // The VMM reports the ticks excluding the current #VMEXIT, so the ticks
+        // of the timed CPUID are the difference from the following CPUID.
+        //
+        guestTscBefore = __rdtsc();
+        vmmTscBefore = QueryVmmElapsedTsc();
+        guestTscAfter = __rdtsc();
+        vmmTscAfter = QueryVmmElapsedTsc();
+
+        if ((guestTscAfter - guestTscBefore) > (vmmTscAfter - vmmTscBefore))
+        {
+            roundTrip = min(roundTrip,
+                            (guestTscAfter - guestTscBefore) -
+                            (vmmTscAfter - vmmTscBefore));
+        }
+    }
+
+    HookData->VmExitRoundTripCycles = (roundTrip == MAXULONG64) ? 0 : roundTrip;
+    LOGGING_LOG_INFO("#VMEXIT round trip: %llu cycles",
+                     HookData->VmExitRoundTripCycles);
+}
+
 /*!
     @brief Virtualizes the current processor.
 
@@ -567,12 +922,15 @@ VirtualizeProcessor (
     PVIRTUAL_PROCESSOR_DATA vpData;
     PCONTEXT contextRecord;
     int registers[4];   // EAX, EBX, ECX, and EDX
+    PVOID slot;
 
     vpData = nullptr;
 
     NT_ASSERT(ARGUMENT_PRESENT(Context));
     _Analysis_assume_(ARGUMENT_PRESENT(Context));
 
+    sharedVpData = static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(Context);
+
 #pragma prefast(suppress : 28118, "DISPATCH_LEVEL is ok as this always allocates NonPagedPool")
     contextRecord = static_cast<PCONTEXT>(ExAllocatePoolWithTag(
                                                         NonPagedPool,
@@ -587,20 +945,32 @@ VirtualizeProcessor (
     }
 
     //
-    // Allocate per processor data.
+    // Take per processor data from the region of the node, or allocate it if
+    // the region is not available.
     //
-#pragma prefast(suppress : __WARNING_MEMORY_LEAK, "Ownership is taken on success.")
-    vpData = static_cast<PVIRTUAL_PROCESSOR_DATA>(AllocatePageAlingedPhysicalMemory(
-                                                sizeof(VIRTUAL_PROCESSOR_DATA)));
-    if (vpData == nullptr)
+    slot = GetProcessorDataSlot(sharedVpData->ProcessorDataRegions);
+    if (slot != nullptr)
     {
-        LOGGING_LOG_ERROR("AllocatePageAlingedPhysicalMemory failed : %Iu",
-                          sizeof(VIRTUAL_PROCESSOR_DATA));
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        goto Exit;
+        vpData = static_cast<PVIRTUAL_PROCESSOR_DATA>(slot);
+    }
+    else
+    {
+#pragma prefast(suppress : __WARNING_MEMORY_LEAK, "Ownership is taken on success.")
+        vpData = static_cast<PVIRTUAL_PROCESSOR_DATA>(AllocatePageAlingedPhysicalMemory(
+                                                    sizeof(VIRTUAL_PROCESSOR_DATA)));
+        if (vpData == nullptr)
+        {
+            LOGGING_LOG_ERROR("AllocatePageAlingedPhysicalMemory failed : %Iu",
+                              sizeof(VIRTUAL_PROCESSOR_DATA));
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
     }
 
-    status = InitializeHookData(&vpData->HookData);
+    status = InitializeHookData(&vpData->HookData,
+                                (slot != nullptr) ?
+                                    Add2Ptr(slot, sizeof(VIRTUAL_PROCESSOR_DATA)) :
+                                    nullptr);
     if (!NT_SUCCESS(status))
     {
         LOGGING_LOG_ERROR("InitializeHookData failed : %08x", status);
@@ -626,8 +996,6 @@ VirtualizeProcessor (
     if (IsOurHypervisorInstalled() == FALSE)
     {
         LOGGING_LOG_INFO("Attempting to virtualize the processor.");
-        sharedVpData = static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(Context);
-
         //
         // Enable SVM by setting EFER.SVME. It has already been verified that this
         // bit was writable with IsSvmSupported.
@@ -653,6 +1021,8 @@ VirtualizeProcessor (
 
     LOGGING_LOG_INFO("The processor has been virtualized.");
 
+    MeasureVmExitRoundTrip(vpData->HookData);
+
     //
     // Ask our hypervisor to activate all hooks.
     //
@@ -676,7 +1046,10 @@ Exit:
             {
                 CleanupHookData(vpData->HookData);
             }
-            FreePageAlingedPhysicalMemory(vpData);
+            if (slot == nullptr)
+            {
+                FreePageAlingedPhysicalMemory(vpData);
+            }
         }
     }
     return status;
@@ -735,6 +1108,17 @@ BuildMsrPermissionsMap (
     // Set the MSB bit indicating write accesses to the MSR should be intercepted.
     //
     RtlSetBits(&bitmapHeader, offset + 1, 1);
+
+    //
+    // Intercept both read and write accesses to IA32_MSR_LSTAR to hide the
+    // redirection when syscall entries are traced. See SyscallTrace.cpp.
+    //
+    if (IsSyscallTraceEnabled() != FALSE)
+    {
+        offsetFrom2ndBase = (IA32_MSR_LSTAR - secondMsrRangeBase) * bitsPerMsr;
+        offset = secondMsrpmOffset + offsetFrom2ndBase;
+        RtlSetBits(&bitmapHeader, offset, 2);
+    }
 }
 
 /*!
@@ -865,6 +1249,7 @@ VirtualizeAllProcessors (
         status = STATUS_INSUFFICIENT_RESOURCES;
         goto Exit;
     }
+    RtlZeroMemory(sharedVpData, sizeof(SHARED_VIRTUAL_PROCESSOR_DATA));
 
     //
     // Allocate MSR permissions map (MSRPM) onto contiguous physical memory.
@@ -884,6 +1269,16 @@ VirtualizeAllProcessors (
     //
     BuildMsrPermissionsMap(sharedVpData->MsrPermissionsMap);
 
+    //
+    // Allocate the regions to place per processor data in.
+    //
+    status = AllocateProcessorDataRegions(&sharedVpData->ProcessorDataRegions);
+    if (!NT_SUCCESS(status))
+    {
+        LOGGING_LOG_ERROR("AllocateProcessorDataRegions failed : %08x", status);
+        goto Exit;
+    }
+
     //
     // Execute VirtualizeProcessor on and virtualize each processor one-by-one.
     // How many processors were successfully virtualized is stored in the third
@@ -930,6 +1325,10 @@ Exit:
             //
             if (sharedVpData != nullptr)
             {
+                if (sharedVpData->ProcessorDataRegions != nullptr)
+                {
+                    FreeProcessorDataRegions(sharedVpData->ProcessorDataRegions);
+                }
                 if (sharedVpData->MsrPermissionsMap != nullptr)
                 {
                     FreeContiguousMemory(sharedVpData->MsrPermissionsMap);
@@ -24,3 +24,13 @@ VOID
 DevirtualizeAllProcessors (
     VOID
     );
+
+SIMPLESVMHOOK_PAGED
+_IRQL_requires_max_(APC_LEVEL)
+_Check_return_
+NTSTATUS
+ExecuteOnEachProcessor (
+    _In_ NTSTATUS (*Callback)(PVOID),
+    _In_opt_ PVOID Context,
+    _Out_opt_ PULONG NumOfProcessorCompleted
+    );
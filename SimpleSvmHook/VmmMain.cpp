@@ -12,6 +12,10 @@
 #include "x86_64.hpp"
 #include "Svm.hpp"
 #include "HookVmmCommon.hpp"
+#include "MsrTable.hpp"
+#include "SyscallTrace.hpp"
+#include "MmioTrace.hpp"
+#include "IoPortTrace.hpp"
 
 /*!
     @brief Injects #GP with 0 of error code into the guest.
@@ -50,7 +54,8 @@ InjectGeneralProtectionException (
         to the hypervisor interface to some extent. See "Requirements for
         implementing the Microsoft Hypervisor interface"
         https://msdn.microsoft.com/en-us/library/windows/hardware/Dn613994(v=vs.85).aspx
-        for details of the interface.
+        for details of the interface. CPUID leaf 0x40000002 returns the time
+        spent in the VMM on the processor.
 
     @param[in,out] VpData - The address of per processor data.
 
@@ -105,6 +110,18 @@ HandleCpuid (
         registers[1] = registers[2] = registers[3] = 0;
         break;
 
+    case CPUID_HV_VMM_TIME:
+        //
+        // Return the TSC ticks spent in the VMM in EDX:EAX, and the number of
+        // #VMEXITs in ECX:EBX. This is not restricted to the kernel-mode so
+        // that a user-mode performance counter provider can sample it.
+        //
+        registers[0] = static_cast<int>(VpData->VmmTime.ElapsedTsc);
+        registers[3] = static_cast<int>(VpData->VmmTime.ElapsedTsc >> 32);
+        registers[1] = static_cast<int>(VpData->VmmTime.ExitCount);
+        registers[2] = static_cast<int>(VpData->VmmTime.ExitCount >> 32);
+        break;
+
     case CPUID_LEAF_SIMPLE_SVM_CALL:
         //
         // Only accept VMCALLs from the kernel-mode.
@@ -124,7 +141,23 @@ HandleCpuid (
             EnableHooks(VpData->HookData);
             break;
         case CPUID_SUBLEAF_DISABLE_HOOKS:
-            DisableHooks(VpData->HookData);
+            DisableHooks(&VpData->GuestVmcb, VpData->HookData);
+            break;
+        case CPUID_SUBLEAF_VERIFY_HOOKS:
+            //
+            // Return the number of unexpected NPT entries in EAX, the number
+            // of mismatches the NPT state checker found since the last request
+            // in EBX, and 'MVSS' in ECX to indicate that the request was
+            // handled.
+            //
+            registers[0] = static_cast<int>(VerifyNestedPageTableEntries(
+                                                        VpData->HookData));
+            registers[1] = static_cast<int>(TakeNptStateMismatches(
+                                                        VpData->HookData));
+            registers[2] = k_PoolTag;
+            break;
+        case CPUID_SUBLEAF_UPDATE_IO_INTERCEPTS:
+            ConfigureIoInterception(&VpData->GuestVmcb);
             break;
         default:
             NT_ASSERT(FALSE);
@@ -154,7 +187,8 @@ HandleCpuid (
 
     @details This protects EFER.SVME from being cleared by the guest by
         injecting #GP when it is about to be cleared. For other MSR access, it
-        passes-through.
+        emulates access based on the MSR table if the MSR was probed, and
+        otherwise, passes-through.
 
     @param[in,out] VpData - The address of per processor data.
 
@@ -170,6 +204,7 @@ HandleMsrAccess (
     ULARGE_INTEGER value;
     UINT32 msr;
     BOOLEAN writeAccess;
+    MSR_TABLE_RESULT result;
 
     msr = GuestContext->VpRegs->Rcx & MAXUINT32;
     writeAccess = (VpData->GuestVmcb.ControlArea.ExitInfo1 != 0);
@@ -209,37 +244,73 @@ HandleMsrAccess (
         //
         VpData->GuestVmcb.StateSaveArea.Efer = value.QuadPart;
     }
+    else if (msr == IA32_MSR_LSTAR)
+    {
+        //
+        // #VMEXIT on IA32_MSR_LSTAR access only occurs when syscall entries are
+        // traced. Return and update the original value, while the guest's
+        // LSTAR keeps pointing to the tracing stub.
+        //
+        NT_ASSERT(IsSyscallTraceEnabled() != FALSE);
+
+        if (writeAccess != FALSE)
+        {
+            value.LowPart = GuestContext->VpRegs->Rax & MAXUINT32;
+            value.HighPart = GuestContext->VpRegs->Rdx & MAXUINT32;
+            if (EmulateLstarWrite(&VpData->GuestVmcb, value.QuadPart) == FALSE)
+            {
+                InjectGeneralProtectionException(VpData);
+                goto Exit;
+            }
+        }
+        else
+        {
+            value.QuadPart = EmulateLstarRead(&VpData->GuestVmcb);
+            GuestContext->VpRegs->Rax = value.LowPart;
+            GuestContext->VpRegs->Rdx = value.HighPart;
+        }
+    }
     else
     {
         //
-        // If the MSR being accessed is not IA32_MSR_EFER, assert that #VMEXIT
-        // can only occur on access to MSR outside the ranges controlled with
-        // the MSR permissions map. This is true because the map is configured
-        // not to intercept any MSR access but IA32_MSR_EFER. See
-        // "MSR Ranges Covered by MSRPM" in "MSR Intercepts" for the MSR ranges
-        // controlled by the map.
+        // If the MSR being accessed is neither IA32_MSR_EFER nor
+        // IA32_MSR_LSTAR, #VMEXIT occurs on access to MSR outside the ranges
+        // controlled with the MSR permissions map, since the map is configured
+        // not to intercept any other MSR access. See "MSR Ranges Covered by
+        // MSRPM" in "MSR Intercepts" for the MSR ranges controlled by the map.
         //
         // Note that VMware Workstation has a bug that access to unimplemented
         // MSRs unconditionally causes #VMEXIT ignoring bits in the MSR
         // permissions map. This can be tested by reading MSR zero, for example.
+        // Such MSRs are not in the MSR table and handled as unimplemented.
         //
-        NT_ASSERT(((msr > 0x00001fff) && (msr < 0xc0000000)) ||
-                  ((msr > 0xc0001fff) && (msr < 0xc0010000)) ||
-                   (msr > 0xc0011fff));
 
         //
-        // Execute WRMSR or RDMSR on behalf of the guest. Important that this
-        // can cause bug check when the guest tries to access unimplemented MSR
-        // *even within the SEH block* because the below WRMSR or RDMSR raises
-        // #GP and are not protected by the SEH block (or cannot be protected
-        // either as this code run outside the thread stack region Windows
-        // requires to proceed SEH). Hypervisors typically handle this by noop-ing
-        // WRMSR and returning zero for RDMSR with non-architecturally defined
-        // MSRs. Alternatively, one can probe which MSRs should cause #GP prior
-        // to installation of a hypervisor and the hypervisor can emulate the
-        // results.
+        // Emulate the MSRs probed prior to installation of the hypervisor
+        // without executing WRMSR or RDMSR. Inject #GP, as the processor would
+        // raise, for unimplemented MSRs, that is, any MSR not found in the
+        // table, and writes to read-only MSRs. Do not advance RIP since the
+        // instruction is not completed.
         //
-        if (writeAccess != FALSE)
+        result = LookupMsrTable(msr, &value.QuadPart);
+        if ((result == MsrUnimplemented) ||
+            ((result == MsrReadOnly) && (writeAccess != FALSE)))
+        {
+            InjectGeneralProtectionException(VpData);
+            goto Exit;
+        }
+
+        //
+        // Otherwise, return the probed value of the read-only MSR, or execute
+        // WRMSR or RDMSR on behalf of the guest for the MSR found implemented
+        // on all processors. See MsrTable.cpp for the probed MSRs.
+        //
+        if (result == MsrReadOnly)
+        {
+            GuestContext->VpRegs->Rax = value.LowPart;
+            GuestContext->VpRegs->Rdx = value.HighPart;
+        }
+        else if (writeAccess != FALSE)
         {
             value.LowPart = GuestContext->VpRegs->Rax & MAXUINT32;
             value.HighPart = GuestContext->VpRegs->Rdx & MAXUINT32;
@@ -257,6 +328,9 @@ HandleMsrAccess (
     // Then, advance RIP to "complete" the instruction.
     //
     VpData->GuestVmcb.StateSaveArea.Rip = VpData->GuestVmcb.ControlArea.NRip;
+
+Exit:
+    return;
 }
 
 /*!
@@ -295,6 +369,10 @@ HandleVmrun (
         this function loads guest state, disables SVM and returns to execution
         flow where the #VMEXIT triggered.
 
+        The TSC ticks spent in this function are accumulated for each
+        processor. This excludes the register save and restore in SvLaunchVm,
+        which is constant and small compared with the handlers.
+
     @param[in,out] VpData - The address of per processor data.
 
     @param[in,out] GuestRegisters - The address of the guest GPRs.
@@ -311,6 +389,9 @@ HandleVmExit (
 {
     GUEST_CONTEXT guestContext;
     KIRQL oldIrql;
+    UINT64 exitTsc;
+
+    exitTsc = __rdtsc();
 
     //
     // Load some host state that are not loaded on #VMEXIT.
@@ -346,6 +427,12 @@ HandleVmExit (
     guestContext.VpRegs = GuestRegisters;
     guestContext.ExitVm = FALSE;
 
+    //
+    // Stop flushing TLB requested on the previous #VMEXIT, if any. Handlers
+    // request it again when switching NCr3.
+    //
+    VpData->GuestVmcb.ControlArea.TlbControl = SVM_TLB_CONTROL_DO_NOTHING;
+
     //
     // Handle #VMEXIT according with its reason.
     //
@@ -364,11 +451,22 @@ HandleVmExit (
         break;
 
     case VMEXIT_EXCEPTION_BP:
-        HandleBreakPointException(&VpData->GuestVmcb, VpData->HookData);
+        HandleBreakPointException(&VpData->GuestVmcb, VpData->HookData, exitTsc);
         break;
 
     case VMEXIT_NPF:
-        HandleNestedPageFault(&VpData->GuestVmcb, VpData->HookData);
+        //
+        // Access to traced MMIO pages is emulated without building the NPT
+        // entry. Otherwise, build the entry or transition the NPT state.
+        //
+        if (HandleMmioTraceAccess(&VpData->GuestVmcb, guestContext.VpRegs) == FALSE)
+        {
+            HandleNestedPageFault(&VpData->GuestVmcb, VpData->HookData, exitTsc);
+        }
+        break;
+
+    case VMEXIT_IOIO:
+        HandleIoPortAccess(&VpData->GuestVmcb, guestContext.VpRegs);
         break;
 
     default:
@@ -404,8 +502,10 @@ HandleVmExit (
         guestContext.VpRegs->Rdx = reinterpret_cast<UINT64>(VpData) >> 32;
 
         //
-        // Load guest state (currently host state is loaded).
+        // Load guest state (currently host state is loaded) with the original
+        // LSTAR.
         //
+        RestoreSyscallEntry(&VpData->GuestVmcb);
         __svm_vmload(MmGetPhysicalAddress(&VpData->GuestVmcb).QuadPart);
 
         //
@@ -434,5 +534,7 @@ HandleVmExit (
 
 Exit:
     NT_ASSERT(VpData->HostStackLayout.Reserved1 == MAXUINT64);
+    VpData->VmmTime.ExitCount++;
+    VpData->VmmTime.ElapsedTsc += __rdtsc() - exitTsc;
     return guestContext.ExitVm;
 }
\ No newline at end of file
@@ -17,8 +17,26 @@
 typedef struct _SHARED_VIRTUAL_PROCESSOR_DATA
 {
     PVOID MsrPermissionsMap;
+    struct _PROCESSOR_DATA_REGIONS* ProcessorDataRegions;
 } SHARED_VIRTUAL_PROCESSOR_DATA, *PSHARED_VIRTUAL_PROCESSOR_DATA;
 
+//
+// Time spent in the VMM on a processor, counted from when the processor is
+// virtualized.
+//
+typedef struct _VMM_TIME_STATISTICS
+{
+    //
+    // The number of #VMEXITs handled.
+    //
+    UINT64 ExitCount;
+
+    //
+    // The TSC ticks spent in HandleVmExit.
+    //
+    UINT64 ElapsedTsc;
+} VMM_TIME_STATISTICS, *PVMM_TIME_STATISTICS;
+
 //
 // Data allocated for each processor and used when VMM code is executed.
 //
@@ -49,6 +67,7 @@ typedef struct _VIRTUAL_PROCESSOR_DATA
     DECLSPEC_ALIGN(PAGE_SIZE) VMCB HostVmcb;
     DECLSPEC_ALIGN(PAGE_SIZE) UINT8 HostStateArea[PAGE_SIZE];
     struct _HOOK_DATA* HookData;
+    VMM_TIME_STATISTICS VmmTime;
 } VIRTUAL_PROCESSOR_DATA, *PVIRTUAL_PROCESSOR_DATA;
 static_assert(sizeof(VIRTUAL_PROCESSOR_DATA) == KERNEL_STACK_SIZE + PAGE_SIZE * 4,
               "VIRTUAL_PROCESSOR_DATA size mismatch");
@@ -91,3 +110,11 @@ typedef struct _GUEST_CONTEXT
 //
 #define CPUID_HV_VENDOR_AND_MAX_FUNCTIONS   0x40000000
 #define CPUID_HV_INTERFACE                  0x40000001
+
+//
+// SimpleSvmHook specific hypervisor CPUID leaf. Returns the TSC ticks spent in
+// the VMM on the current processor in EDX:EAX, and the number of #VMEXITs on
+// it in ECX:EBX. Both are counted from when the processor is virtualized, and
+// readable from any CPL.
+//
+#define CPUID_HV_VMM_TIME                   0x40000002
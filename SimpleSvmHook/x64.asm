@@ -10,6 +10,7 @@
 .code
 
 extern HandleVmExit : proc
+extern HandleHookPoint : proc
 
 ;
 ;   @brief Saves all general purpose registers to the stack.
@@ -222,4 +223,116 @@ SvLV20: ;
         jmp rbx
 SvLaunchVm endp
 
+;
+;   @brief Saves registers, calls the handler of a hook point, restores
+;       registers and continues execution with the original call stub.
+;
+;   @details This function is jumped into from the entry stub of a hook point
+;       with the address of HOOK_REGISTRATION_ENTRY pushed onto the stack. See
+;       HookKernelHookPoint.cpp.
+;
+SvHookPointDispatcher proc frame
+        ;
+        ; Save RFLAGS and GPRs to build HOOK_POINT_FRAME. Below is the stack
+        ; layout after this.
+        ; ----
+        ; Rsp          => R15                        ; HOOK_REGISTER_CONTEXT
+        ;                 R14                        ;
+        ;                 ...                        ;
+        ;                 RAX                        ;
+        ; Rsp + 8 * 16 => RFLAGS                     ;
+        ; Rsp + 8 * 17 => Registration/Continuation  ;
+        ; Rsp + 8 * 18 => Stack at the hook point
+        ; ----
+        ;
+        ; This is the same as PUSHAQ, but each push is described in the unwind
+        ; information, so that exceptions and stack walks in the handler can
+        ; unwind through this function.
+        ;
+        pushfq
+        .allocstack 8
+        push    rax
+        .pushreg rax
+        push    rcx
+        .pushreg rcx
+        push    rdx
+        .pushreg rdx
+        push    rbx
+        .pushreg rbx
+        push    -1      ; Dummy for rsp.
+        .allocstack 8
+        push    rbp
+        .pushreg rbp
+        push    rsi
+        .pushreg rsi
+        push    rdi
+        .pushreg rdi
+        push    r8
+        .pushreg r8
+        push    r9
+        .pushreg r9
+        push    r10
+        .pushreg r10
+        push    r11
+        .pushreg r11
+        push    r12
+        .pushreg r12
+        push    r13
+        .pushreg r13
+        push    r14
+        .pushreg r14
+        push    r15
+        .pushreg r15
+
+        ;
+        ; Keep the address of the frame in RBX, which is preserved by the
+        ; callee, and use it as the frame pointer since RSP is realigned below.
+        ;
+        mov rbx, rsp
+        .setframe rbx, 0
+        .endprolog
+
+        ;
+        ; The direction flag must be clear on function call.
+        ;
+        cld
+
+        ;
+        ; Set a parameter for HandleHookPoint.
+        ;
+        mov rcx, rbx                    ; Rcx <= Frame
+
+        ;
+        ; The stack pointer at the hook point can be any 8 byte aligned
+        ; address. Align it to 16 bytes, and allocate stack for homing space
+        ; (0x20) and volatile XMM registers (0x60) as SvLaunchVm does.
+        ;
+        and rsp, -10h
+        sub rsp, 80h
+        movaps xmmword ptr [rsp + 20h], xmm0
+        movaps xmmword ptr [rsp + 30h], xmm1
+        movaps xmmword ptr [rsp + 40h], xmm2
+        movaps xmmword ptr [rsp + 50h], xmm3
+        movaps xmmword ptr [rsp + 60h], xmm4
+        movaps xmmword ptr [rsp + 70h], xmm5
+
+        call HandleHookPoint
+
+        movaps xmm5, xmmword ptr [rsp + 70h]
+        movaps xmm4, xmmword ptr [rsp + 60h]
+        movaps xmm3, xmmword ptr [rsp + 50h]
+        movaps xmm2, xmmword ptr [rsp + 40h]
+        movaps xmm1, xmmword ptr [rsp + 30h]
+        movaps xmm0, xmmword ptr [rsp + 20h]
+        mov rsp, rbx
+
+        ;
+        ; Load registers possibly modified by the handler, and return to the
+        ; continuation address HandleHookPoint stored.
+        ;
+        POPAQ
+        popfq
+        ret
+SvHookPointDispatcher endp
+
         end
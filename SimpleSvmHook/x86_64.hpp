@@ -15,6 +15,7 @@ static constexpr ULONG k_MaxInsturctionLength = 15;
 #define IA32_APIC_BASE  0x0000001b
 #define IA32_MSR_PAT    0x00000277
 #define IA32_MSR_EFER   0xc0000080
+#define IA32_MSR_LSTAR  0xc0000082
 
 #define EFER_SVME       (1UL << 12)
 
@@ -28,6 +29,7 @@ static constexpr ULONG k_MaxInsturctionLength = 15;
 #define CPUID_MAX_STANDARD_FN_NUMBER_AND_VENDOR_STRING          0x00000000
 #define CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS       0x00000001
 #define CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS_EX    0x80000001
+#define CPUID_ADDRESS_SIZE_IDENTIFIERS                          0x80000008
 #define CPUID_SVM_FEATURES                                      0x8000000a
 
 //
@@ -230,3 +232,23 @@ typedef struct _SEGMENT_ATTRIBUTE
 } SEGMENT_ATTRIBUTE, *PSEGMENT_ATTRIBUTE;
 static_assert(sizeof(SEGMENT_ATTRIBUTE) == 2,
               "SEGMENT_ATTRIBUTE size mismatch");
+
+//
+// See "Interrupt-Gate and Trap-Gate Descriptors-Long Mode"
+//
+typedef struct _INTERRUPT_GATE_DESCRIPTOR
+{
+    UINT16 OffsetLow;               // [0:15]
+    UINT16 Selector;                // [16:31]
+    UINT16 Ist : 3;                 // [32:34]
+    UINT16 Reserved1 : 5;           // [35:39]
+    UINT16 Type : 4;                // [40:43]
+    UINT16 Reserved2 : 1;           // [44]
+    UINT16 Dpl : 2;                 // [45:46]
+    UINT16 Present : 1;             // [47]
+    UINT16 OffsetMiddle;            // [48:63]
+    UINT32 OffsetHigh;              // [64:95]
+    UINT32 Reserved3;               // [96:127]
+} INTERRUPT_GATE_DESCRIPTOR, *PINTERRUPT_GATE_DESCRIPTOR;
+static_assert(sizeof(INTERRUPT_GATE_DESCRIPTOR) == 16,
+              "INTERRUPT_GATE_DESCRIPTOR size mismatch");